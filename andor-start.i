@@ -1,5 +1,20 @@
+autoload, "andor.i", andor_add_step;
+autoload, "andor.i", andor_arm;
+autoload, "andor.i", andor_attach;
+autoload, "andor.i", andor_auto_exposure;
+autoload, "andor.i", andor_broker;
+autoload, "andor.i", andor_capture;
+autoload, "andor.i", andor_centroider;
+autoload, "andor.i", andor_change_detector;
 autoload, "andor.i", andor_command;
+autoload, "andor.i", andor_connect;
 autoload, "andor.i", andor_count_devices;
+autoload, "andor.i", andor_decode;
+autoload, "andor.i", andor_detach;
+autoload, "andor.i", andor_encode;
+autoload, "andor.i", andor_event_extractor;
+autoload, "andor.i", andor_frame_client;
+autoload, "andor.i", andor_frame_server;
 autoload, "andor.i", andor_get_bool;
 autoload, "andor.i", andor_get_enum_count;
 autoload, "andor.i", andor_get_enum_index;
@@ -27,14 +42,34 @@ autoload, "andor.i", andor_list_devices;
 autoload, "andor.i", andor_list_enum_available;
 autoload, "andor.i", andor_list_enum_implemented;
 autoload, "andor.i", andor_list_enum_string;
+autoload, "andor.i", andor_lucky_selector;
 autoload, "andor.i", andor_open;
+autoload, "andor.i", andor_open_container;
+autoload, "andor.i", andor_open_metadata;
+autoload, "andor.i", andor_open_ring_file;
+autoload, "andor.i", andor_preview;
+autoload, "andor.i", andor_process;
+autoload, "andor.i", andor_ramp;
+autoload, "andor.i", andor_recorder;
+autoload, "andor.i", andor_reset;
+autoload, "andor.i", andor_ring_file;
+autoload, "andor.i", andor_run_sequence;
+autoload, "andor.i", andor_sequencer;
+autoload, "andor.i", andor_set_bad_pixels;
 autoload, "andor.i", andor_set_bool;
+autoload, "andor.i", andor_set_color_mode;
 autoload, "andor.i", andor_set_enum_index;
 autoload, "andor.i", andor_set_enum_string;
 autoload, "andor.i", andor_set_float;
 autoload, "andor.i", andor_set_int;
+autoload, "andor.i", andor_set_orientation;
+autoload, "andor.i", andor_set_output_type;
 autoload, "andor.i", andor_set_queue_length;
 autoload, "andor.i", andor_set_string;
+autoload, "andor.i", andor_shift_and_add;
+autoload, "andor.i", andor_speckle;
+autoload, "andor.i", andor_stacker;
 autoload, "andor.i", andor_start_acquisition;
 autoload, "andor.i", andor_stop_acquisition;
+autoload, "andor.i", andor_trigger;
 autoload, "andor.i", andor_wait_image;
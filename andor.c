@@ -11,13 +11,25 @@
  * Copyright (C) 2014 Éric Thiébaut <https://github.com/emmt/YAndor>
  */
 
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <wchar.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
 #include "atcore.h"
 #include "yapi.h"
 #include "pstdlib.h"
@@ -298,6 +310,38 @@ static int get_pixel_encoding(camera_t* cam);
 static void start_acquisition(camera_t* cam);
 static void stop_acquisition(camera_t* cam, int final);
 
+/* Processing stages attached to a camera (see "PROCESSING STAGES" below). */
+typedef struct _stage stage_t;
+#define MAX_STAGES 16
+static void setup_stages(camera_t* cam);
+static int process_frame(camera_t* cam, const unsigned char* frame);
+static void detach_stages(camera_t* cam);
+
+/* Correction of bad pixels (see "BAD PIXEL CORRECTION" below). */
+static void setup_bad_pixels(camera_t* cam);
+static void correct_bad_pixels(const camera_t* cam);
+static void correct_image(const camera_t* cam, void* img, long ntot,
+                          const long dims[], int type);
+
+/* Monotonic clock in seconds (see "LIVE PREVIEW" below). */
+static double monotonic_time(void);
+
+/* Sharing of the frame buffers and remote cameras (see "CAMERA BROKER"
+   below). */
+#define BR_MAX_HOLD 32
+static void alloc_frame_buffers(camera_t* cam, long size);
+static void free_frame_buffers(camera_t* cam);
+static void setup_shared_frames(camera_t* cam);
+static void publish_frame(camera_t* cam, const unsigned char* frame);
+static int requeue_buffer(camera_t* cam, AT_U8* frame_ptr, int frame_size);
+static int is_remote_camera(int iarg);
+static AT_H get_remote_handle(int iarg);
+static void wait_remote_image(int iarg, int timeout);
+
+/* Frame metadata and cached feature values (see "FRAME METADATA" below). */
+static void setup_metadata(camera_t* cam);
+static void refresh_cached_features(int iarg);
+
 /* Functions to extract frame data as a Yorick array. */
 static void extract_Raw(const camera_t* cam, const unsigned char* src);
 static void extract_Mono8(const camera_t* cam, const unsigned char* src);
@@ -334,11 +378,50 @@ static struct {
 static const int number_of_pixel_encodings =
   sizeof(pixel_encoding_table)/sizeof(pixel_encoding_table[0]) - 1;
 
+/* Indices of the pixel encodings in the above table (must be kept in the
+   same order). */
+enum {
+  ENCODING_Raw = 0,
+  ENCODING_Mono8,
+  ENCODING_Mono12Packed,
+  ENCODING_Mono12,
+  ENCODING_Mono16,
+  ENCODING_Mono32,
+  ENCODING_RGB8Packed,
+  ENCODING_Mono12Coded,
+  ENCODING_Mono12codedPacked,
+  ENCODING_Mono12parallel,
+  ENCODING_Mono12PackedParallel
+};
+
+/* Extraction of color (RGB8Packed) frames. */
+#define COLOR_PLANAR    0 /* Width-by-height-by-3 array of planes. */
+#define COLOR_LUMINANCE 1 /* Width-by-height array of luminance. */
+#define COLOR_RAW       2 /* Interleaved bytes as delivered. */
+static const char* color_modes[] = {"planar", "luminance", "raw", NULL};
+
+/* Names of the types of the extracted frames (indexed by Y_CHAR, ...,
+   Y_DOUBLE). */
+static const char* output_types[] = {"char", "short", "int", "long",
+                                     "float", "double", NULL};
+
+/* Orientations of the extracted frames, a combination of bits: ORIENT_FLIPX
+   and ORIENT_FLIPY reverse the first and second axis of the result,
+   ORIENT_TRANSPOSE exchanges the axes of the frame (before the flips). */
+#define ORIENT_FLIPX     1
+#define ORIENT_FLIPY     2
+#define ORIENT_TRANSPOSE 4
+static const char* orientations[] = {"none", "flipx", "flipy", "rotate180",
+                                     "transpose", "rotate90", "rotate270",
+                                     "antitranspose", NULL};
+
 struct _camera {
   AT_H handle;
   int device;
   int initialized;
   int acquiring;      /* Camera is acquiring? */
+  int trigger_mode;   /* Index of the trigger mode to restore when an armed
+                         acquisition stops (-1 if none). */
   AT_U8* buffer;      /* Current queue buffer. */
   long buffer_size;   /* Current queue buffer size. */
   long queue_length;  /* Number of frames in the queue. */
@@ -349,10 +432,56 @@ struct _camera {
                          started. */
   long row_stride;    /* The size of one row in the image in bytes when
                          acquisition started. */
+  int encoding;       /* Index of the pixel encoding when acquisition
+                         started (-1 if unknown). */
+
+  /* Processing stages fed with the raw frames. */
+  int nstages;
+  stage_t* stage[MAX_STAGES];
+  void* stage_use[MAX_STAGES];
+
+  /* Map of bad pixels. */
+  long nbad;          /* Number of bad pixels. */
+  long* bad_xy;       /* Coordinates of bad pixels (0-based, 2-by-NBAD). */
+  int bad_median;     /* Use median of neighbors (otherwise mean)? */
+  long nfix;          /* Number of bad pixels in the current frames. */
+  long* fix;          /* Index, number of neighbors and offsets of the
+                         neighbors of each bad pixel in the current
+                         frames (see setup_bad_pixels). */
+
+  /* Frame metadata and cached feature values. */
+  int timestamps;     /* Frames have a timestamp metadata block? */
+  double frequency;   /* Frequency of the timestamp clock (Hz), 0 if
+                         unknown. */
+  double exposure;    /* Exposure time (s), NaN if unknown. */
 
   /* Method to extract the frame data into a Yorick array which is pushed on
      top of the stack. */
   void (*extract)(const camera_t* cam, const unsigned char* src);
+  int color;          /* Extraction of color frames (COLOR_...). */
+  void* target;       /* Where to store the next extracted frame (see
+                         capture_frames), NULL to push a new array. */
+  long target_count;  /* Number of elements at TARGET. */
+  int target_type;    /* Type of the elements at TARGET. */
+  int output_type;    /* Type of extracted frames (Y_CHAR, ..., Y_DOUBLE),
+                         -1 for the native type of the pixel encoding. */
+  int orientation;    /* Orientation of extracted frames (ORIENT_...). */
+
+  /* Sharing of the frame buffers with remote cameras. */
+  struct _frame_server* broker; /* Broker sharing the frame buffers of the
+                         camera in shared memory, NULL if none. */
+  int shared_fd;      /* Shared memory of the frame buffers, -1 if none. */
+  unsigned char* shared; /* Address of the shared memory, NULL if the frame
+                         buffers are not shared. */
+  long shared_size;   /* Size of the shared memory. */
+  uint64_t sequence;  /* Number of frames published in the shared memory. */
+  unsigned int writes;/* Number of features written by the brokers when
+                         the cached values were last refreshed. */
+  long hold;          /* Number of delivered buffers held back from the
+                         queue (so that remote cameras can read them). */
+  long nheld;         /* Number of buffers currently held. */
+  long first_held;    /* Index of the oldest held buffer in HELD. */
+  AT_U8* held[BR_MAX_HOLD];
 
 };
 
@@ -383,8 +512,13 @@ free_camera(void* ptr)
     if (cam->acquiring) {
       stop_acquisition(cam, TRUE);
     }
-    if (cam->buffer != NULL) {
-      p_free(cam->buffer);
+    detach_stages(cam);
+    free_frame_buffers(cam);
+    if (cam->bad_xy != NULL) {
+      p_free(cam->bad_xy);
+    }
+    if (cam->fix != NULL) {
+      p_free(cam->fix);
     }
     (void)AT_Close(cam->handle);
   }
@@ -422,8 +556,29 @@ extract_camera(void* ptr, char* name)
     } else {
       goto illegal;
     }
+  } else if (name[0] == 'b' && strcmp(name + 1, "ad_pixels") == 0) {
+    if (cam->nbad > 0) {
+      long dims[3], k;
+      long* dst;
+      dims[0] = 2;
+      dims[1] = 2;
+      dims[2] = cam->nbad;
+      dst = ypush_l(dims);
+      for (k = 0; k < 2*cam->nbad; ++k) {
+        dst[k] = cam->bad_xy[k] + 1;
+      }
+    } else {
+      push_nil();
+    }
+  } else if (name[0] == 'c' && strcmp(name + 1, "olor_mode") == 0) {
+    push_string(color_modes[cam->color]);
   } else if (name[0] == 'd' && strcmp(name + 1, "evice") == 0) {
     push_long(cam->device);
+  } else if (name[0] == 'o' && strcmp(name + 1, "rientation") == 0) {
+    push_string(orientations[cam->orientation]);
+  } else if (name[0] == 'o' && strcmp(name + 1, "utput_type") == 0) {
+    push_string(cam->output_type >= 0 ? output_types[cam->output_type]
+                : "native");
   } else if (name[0] == 'q' && strcmp(name + 1, "ueue_length") == 0) {
     push_long(cam->queue_length);
   } else if (name[0] == 'r' && strcmp(name + 1, "ow_stride") == 0) {
@@ -455,6 +610,8 @@ get_camera_handle(int iarg)
 {
   if (yarg_nil(iarg)) {
     return AT_HANDLE_SYSTEM;
+  } else if (is_remote_camera(iarg)) {
+    return get_remote_handle(iarg);
   } else {
     return get_camera(iarg)->handle;
   }
@@ -569,22 +726,33 @@ get_pixel_encoding(camera_t* cam)
   return -1;
 }
 
-/* Start the acquisition. */
+/* Restore the trigger mode saved by arm_acquisition (if any). */
 static void
-start_acquisition(camera_t* cam)
+restore_trigger_mode(camera_t* cam, int final)
 {
-  unsigned char* frame_ptr;
-  long buffer_size, frame_stride, k;
-  int enc, code;
+  int code;
 
-  /* Check argument. */
-  if (cam->acquiring) {
-    warning("Camera already acquiring.");
+  if (cam->trigger_mode < 0) {
     return;
   }
-  if (cam->queue_length <= 0) {
-    y_error("set queue length first");
+  code = AT_SetEnumIndex(cam->handle, L"TriggerMode", cam->trigger_mode);
+  cam->trigger_mode = -1;
+  if (code != AT_SUCCESS && ! final) {
+    warning("Failure of AT_SetEnumIndex \"TriggerMode\" (%s).",
+            get_reason(code));
   }
+}
+
+/* Prepare the acquisition: select the method to extract the frames, query
+   the frame format and let the attached processing stages check it (no
+   buffers are queued yet). */
+static void
+prepare_acquisition(camera_t* cam)
+{
+  int enc;
+
+  /* Restore the trigger mode if arming the camera has failed. */
+  restore_trigger_mode(cam, FALSE);
 
   /* Determine pixel format. */
   enc = get_pixel_encoding(cam);
@@ -594,6 +762,8 @@ start_acquisition(camera_t* cam)
   } else {
     cam->extract = pixel_encoding_table[enc].extract;
   }
+  cam->encoding = enc;
+  cam->target = NULL;
 
   /* Make sure no buffers are currently in use. */
   (void)AT_Flush(cam->handle);
@@ -603,25 +773,49 @@ start_acquisition(camera_t* cam)
   cam->frame_width = get_frame_width(cam);
   cam->frame_height = get_frame_height(cam);
   cam->row_stride = get_row_stride(cam);
+
+  /* Let the attached processing stages check the frame format and allocate
+     their resources before any buffers get queued. */
+  setup_metadata(cam);
+  setup_stages(cam);
+  setup_bad_pixels(cam);
+}
+
+/* Allocate (if needed) and queue the frame buffers of the camera.  If
+   PREFAULT is true, every page of the buffers is touched before queuing
+   them so that no page faults occur when the first frames are delivered. */
+static void
+queue_buffers(camera_t* cam, int prefault)
+{
+  unsigned char* frame_ptr;
+  long buffer_size, frame_stride, k;
+  int code;
+
+  if (cam->queue_length <= 0) {
+    y_error("set queue length first");
+  }
   frame_stride = ROUND_UP(cam->frame_size, FRAME_ALIGN);
   buffer_size = (FRAME_ALIGN - 1) + frame_stride*cam->queue_length;
-  if (cam->buffer != NULL && cam->buffer_size > 0) {
-    if (buffer_size != cam->buffer_size) {
-      /* Free existing buffer if not of the correct size. */
-      void* ptr = cam->buffer;
-      cam->buffer = NULL;
-      cam->buffer_size = 0;
-      p_free(ptr); /* free *after* updating members (in case of interrupts) */
-    }
-  } else {
-    cam->buffer = NULL;
-    cam->buffer_size = 0;
+  if (cam->buffer != NULL && (buffer_size != cam->buffer_size ||
+                              (cam->broker != NULL) !=
+                              (cam->shared != NULL))) {
+    /* Free existing buffer if not of the correct size or if it must be
+       (or must no longer be) shared. */
+    free_frame_buffers(cam);
   }
-  if (buffer_size != cam->buffer_size) {
+  if (cam->buffer == NULL) {
     /* Allocate a new buffer. */
-    cam->buffer = p_malloc(buffer_size);
-    cam->buffer_size = buffer_size;
+    alloc_frame_buffers(cam, buffer_size);
+  }
+  if (prefault) {
+    volatile unsigned char* ptr = (volatile unsigned char*)cam->buffer;
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0) page = 4096;
+    for (k = 0; k < cam->buffer_size; k += page) {
+      ptr[k] = 0;
+    }
   }
+  setup_shared_frames(cam);
 
   /* Queue the buffers. */
   frame_ptr = FIRST_FRAME(cam);
@@ -634,13 +828,37 @@ start_acquisition(camera_t* cam)
     }
     frame_ptr += frame_stride;
   }
+}
 
-  /* Set the camera to continuously acquires frames. */
-  code = AT_SetEnumString(cam->handle, L"CycleMode", L"Continuous");
-  if (code != AT_SUCCESS) {
-    /* Cancel the queued buffers and report error. */
-    (void)AT_Flush(cam->handle);
-    throw("AT_SetEnumString \"CycleMode\" \"Continuous\"", code);
+/* Start the acquisition of the queued buffers, continuously if COUNT is
+   zero, of exactly COUNT frames otherwise. */
+static void
+launch_acquisition(camera_t* cam, long count)
+{
+  int code;
+
+  if (count > 0) {
+    /* Set the camera to acquire a fixed number of frames. */
+    code = AT_SetEnumString(cam->handle, L"CycleMode", L"Fixed");
+    if (code != AT_SUCCESS) {
+      /* Cancel the queued buffers and report error. */
+      (void)AT_Flush(cam->handle);
+      throw("AT_SetEnumString \"CycleMode\" \"Fixed\"", code);
+    }
+    code = AT_SetInt(cam->handle, L"FrameCount", count);
+    if (code != AT_SUCCESS) {
+      /* Cancel the queued buffers and report error. */
+      (void)AT_Flush(cam->handle);
+      throw("AT_SetInt \"FrameCount\"", code);
+    }
+  } else {
+    /* Set the camera to continuously acquires frames. */
+    code = AT_SetEnumString(cam->handle, L"CycleMode", L"Continuous");
+    if (code != AT_SUCCESS) {
+      /* Cancel the queued buffers and report error. */
+      (void)AT_Flush(cam->handle);
+      throw("AT_SetEnumString \"CycleMode\" \"Continuous\"", code);
+    }
   }
 
   /* Start the acquisition. */
@@ -653,6 +871,55 @@ start_acquisition(camera_t* cam)
   cam->acquiring = TRUE;
 }
 
+/* Start the acquisition. */
+static void
+start_acquisition(camera_t* cam)
+{
+  /* Check argument. */
+  if (cam->acquiring) {
+    warning("Camera already acquiring.");
+    return;
+  }
+  if (cam->queue_length <= 0) {
+    y_error("set queue length first");
+  }
+  prepare_acquisition(cam);
+  queue_buffers(cam, FALSE);
+  launch_acquisition(cam, 0);
+}
+
+/* Prepare everything for a software triggered acquisition, so that
+   starting the first exposure only requires the "SoftwareTrigger"
+   command.  The current trigger mode is restored by stop_acquisition. */
+static void
+arm_acquisition(camera_t* cam)
+{
+  int code, index;
+
+  if (cam->acquiring) {
+    y_error("camera is acquiring");
+  }
+  if (cam->queue_length <= 0) {
+    y_error("set queue length first");
+  }
+  prepare_acquisition(cam);
+  queue_buffers(cam, TRUE);
+  code = AT_GetEnumIndex(cam->handle, L"TriggerMode", &index);
+  if (code != AT_SUCCESS) {
+    /* Cancel the queued buffers and report error. */
+    (void)AT_Flush(cam->handle);
+    throw("AT_GetEnumIndex \"TriggerMode\"", code);
+  }
+  code = AT_SetEnumString(cam->handle, L"TriggerMode", L"Software");
+  if (code != AT_SUCCESS) {
+    /* Cancel the queued buffers and report error. */
+    (void)AT_Flush(cam->handle);
+    throw("AT_SetEnumString \"TriggerMode\" \"Software\"", code);
+  }
+  cam->trigger_mode = index;
+  launch_acquisition(cam, 0);
+}
+
 static void
 stop_acquisition(camera_t* cam, int final)
 {
@@ -675,9 +942,164 @@ stop_acquisition(camera_t* cam, int final)
        just issue a warning. */
     warning("Failure of AT_Flush (%s).", get_reason(code));
   }
+  restore_trigger_mode(cam, final);
+  cam->nheld = 0;
   cam->acquiring = FALSE;
 }
 
+/* Remote cameras (see "CAMERA BROKER" below) have pseudo-handles for which
+   the calls to the SDK are forwarded to their broker.  FORWARD(CFUNC) is the
+   function to call in place of the SDK function CFUNC when the handle may be
+   that of a remote camera. */
+#define FORWARD(CFUNC) forward_##CFUNC
+
+#define BR_MAX_REMOTE   16
+#define BR_FIRST_HANDLE (-1000)
+#define IS_REMOTE_HANDLE(handle) ((handle) <= BR_FIRST_HANDLE && \
+                                  (handle) > BR_FIRST_HANDLE - BR_MAX_REMOTE)
+
+/* Identifiers of the forwarded functions, sorted by type of result. */
+enum {
+  /* Functions yielding an integer (or a boolean). */
+  BR_AT_GetBool = 0,
+  BR_AT_IsImplemented,
+  BR_AT_IsReadOnly,
+  BR_AT_IsReadable,
+  BR_AT_IsWritable,
+  BR_AT_IsEnumIndexAvailable,
+  BR_AT_IsEnumIndexImplemented,
+  BR_AT_GetEnumIndex,
+  BR_AT_GetEnumCount,
+  BR_AT_GetStringMaxLength,
+  /* Functions yielding a 64-bit integer. */
+  BR_AT_GetInt,
+  BR_AT_GetIntMin,
+  BR_AT_GetIntMax,
+  /* Functions yielding a floating-point value. */
+  BR_AT_GetFloat,
+  BR_AT_GetFloatMin,
+  BR_AT_GetFloatMax,
+  /* Functions yielding a string. */
+  BR_AT_GetString,
+  BR_AT_GetEnumStringByIndex,
+  /* Functions yielding nothing. */
+  BR_AT_SetInt,
+  BR_AT_SetFloat,
+  BR_AT_SetBool,
+  BR_AT_SetEnumIndex,
+  BR_AT_SetString,
+  BR_AT_SetEnumString,
+  BR_AT_Command,
+  BR_NFUNCS
+};
+
+static int remote_call(AT_H handle, int func, const AT_WC* feature,
+                       int ival, AT_64 lval, double dval, const AT_WC* sval,
+                       void* result, int length);
+
+#define GETTER(CFUNC, TYPE)                                             \
+static int                                                              \
+forward_##CFUNC(AT_H handle, const AT_WC* feature, TYPE* value)        \
+{                                                                       \
+  if (IS_REMOTE_HANDLE(handle)) {                                       \
+    return remote_call(handle, BR_##CFUNC, feature, 0, 0, 0.0, NULL,    \
+                       value, 0);                                       \
+  }                                                                     \
+  return CFUNC(handle, feature, value);                                 \
+}
+GETTER(AT_GetBool,            AT_BOOL)
+GETTER(AT_IsImplemented,      AT_BOOL)
+GETTER(AT_IsReadOnly,         AT_BOOL)
+GETTER(AT_IsReadable,         AT_BOOL)
+GETTER(AT_IsWritable,         AT_BOOL)
+GETTER(AT_GetEnumIndex,       int)
+GETTER(AT_GetEnumCount,       int)
+GETTER(AT_GetStringMaxLength, int)
+GETTER(AT_GetInt,             AT_64)
+GETTER(AT_GetIntMin,          AT_64)
+GETTER(AT_GetIntMax,          AT_64)
+GETTER(AT_GetFloat,           double)
+GETTER(AT_GetFloatMin,        double)
+GETTER(AT_GetFloatMax,        double)
+#undef GETTER
+
+#define SETTER(CFUNC, TYPE, IVAL, LVAL, DVAL)                           \
+static int                                                              \
+forward_##CFUNC(AT_H handle, const AT_WC* feature, TYPE value)         \
+{                                                                       \
+  if (IS_REMOTE_HANDLE(handle)) {                                       \
+    return remote_call(handle, BR_##CFUNC, feature, IVAL, LVAL, DVAL,   \
+                       NULL, NULL, 0);                                  \
+  }                                                                     \
+  return CFUNC(handle, feature, value);                                 \
+}
+SETTER(AT_SetInt,       AT_64,         0,     value, 0.0)
+SETTER(AT_SetFloat,     double,        0,     0,     value)
+SETTER(AT_SetBool,      AT_BOOL,       value, 0,     0.0)
+SETTER(AT_SetEnumIndex, int,           value, 0,     0.0)
+#undef SETTER
+
+#define SETTER(CFUNC)                                                   \
+static int                                                              \
+forward_##CFUNC(AT_H handle, const AT_WC* feature, const AT_WC* value) \
+{                                                                       \
+  if (IS_REMOTE_HANDLE(handle)) {                                       \
+    return remote_call(handle, BR_##CFUNC, feature, 0, 0, 0.0, value,   \
+                       NULL, 0);                                        \
+  }                                                                     \
+  return CFUNC(handle, feature, value);                                 \
+}
+SETTER(AT_SetString)
+SETTER(AT_SetEnumString)
+#undef SETTER
+
+#define GETTER(CFUNC)                                                   \
+static int                                                              \
+forward_##CFUNC(AT_H handle, const AT_WC* feature, int index,          \
+                AT_BOOL* value)                                         \
+{                                                                       \
+  if (IS_REMOTE_HANDLE(handle)) {                                       \
+    return remote_call(handle, BR_##CFUNC, feature, index, 0, 0.0,      \
+                       NULL, value, 0);                                 \
+  }                                                                     \
+  return CFUNC(handle, feature, index, value);                          \
+}
+GETTER(AT_IsEnumIndexAvailable)
+GETTER(AT_IsEnumIndexImplemented)
+#undef GETTER
+
+static int
+forward_AT_GetString(AT_H handle, const AT_WC* feature, AT_WC* value,
+                     int length)
+{
+  if (IS_REMOTE_HANDLE(handle)) {
+    return remote_call(handle, BR_AT_GetString, feature, 0, 0, 0.0, NULL,
+                       value, length);
+  }
+  return AT_GetString(handle, feature, value, length);
+}
+
+static int
+forward_AT_GetEnumStringByIndex(AT_H handle, const AT_WC* feature,
+                                int index, AT_WC* value, int length)
+{
+  if (IS_REMOTE_HANDLE(handle)) {
+    return remote_call(handle, BR_AT_GetEnumStringByIndex, feature, index,
+                       0, 0.0, NULL, value, length);
+  }
+  return AT_GetEnumStringByIndex(handle, feature, index, value, length);
+}
+
+static int
+forward_AT_Command(AT_H handle, const AT_WC* feature)
+{
+  if (IS_REMOTE_HANDLE(handle)) {
+    return remote_call(handle, BR_AT_Command, feature, 0, 0, 0.0, NULL,
+                       NULL, 0);
+  }
+  return AT_Command(handle, feature);
+}
+
 /*---------------------------------------------------------------------------*/
 /* BUILT-IN FUNCTIONS */
 
@@ -768,6 +1190,10 @@ Y_andor_open(int argc)
   cam->device = device;
   cam->initialized = TRUE;
   cam->extract = extract_Raw;
+  cam->encoding = -1;
+  cam->output_type = -1;
+  cam->shared_fd = -1;
+  cam->trigger_mode = -1;
 }
 
 /* Functions which retrieve a boolean value. */
@@ -778,8 +1204,8 @@ Y_##YFUNC(int argc)                                             \
   AT_BOOL value;                                                \
   int code;                                                     \
   if (argc != 2) y_error("expecting exactly 2 arguments");      \
-  code = CFUNC(get_camera_handle(1),                            \
-               get_wide_string(0, FALSE), &value);              \
+  code = FORWARD(CFUNC)(get_camera_handle(1),                   \
+                        get_wide_string(0, FALSE), &value);     \
   if (code != AT_SUCCESS) throw(#CFUNC, code);                  \
   push_int((value ? TRUE : FALSE));                             \
 }
@@ -798,8 +1224,8 @@ Y_##YFUNC(int argc)                                             \
   AT_64 value;                                                  \
   int code;                                                     \
   if (argc != 2) y_error("expecting exactly 2 arguments");      \
-  code = CFUNC(get_camera_handle(1),                            \
-               get_wide_string(0, FALSE), &value);              \
+  code = FORWARD(CFUNC)(get_camera_handle(1),                   \
+                        get_wide_string(0, FALSE), &value);     \
   if (code != AT_SUCCESS) throw(#CFUNC, code);                  \
   push_int64(value);                                            \
 }
@@ -815,8 +1241,8 @@ Y_##YFUNC(int argc)                                             \
 {                                                               \
   int value, code;                                              \
   if (argc != 2) y_error("expecting exactly 2 arguments");      \
-  code = CFUNC(get_camera_handle(1),                            \
-               get_wide_string(0, FALSE), &value);              \
+  code = FORWARD(CFUNC)(get_camera_handle(1),                   \
+                        get_wide_string(0, FALSE), &value);     \
   if (code != AT_SUCCESS) throw(#CFUNC, code);                  \
   push_long(value);                                             \
 }
@@ -828,8 +1254,8 @@ Y_andor_get_enum_count(int argc)
 {
   int value, code;
   if (argc != 2) y_error("expecting exactly 2 arguments");
-  code = AT_GetEnumCount(get_camera_handle(1),
-                         get_wide_string(0, FALSE), &value);
+  code = FORWARD(AT_GetEnumCount)(get_camera_handle(1),
+                                  get_wide_string(0, FALSE), &value);
   if (code != AT_SUCCESS) {
     if (code != AT_ERR_NOTIMPLEMENTED) {
       throw("AT_GetEnumCount", code);
@@ -847,8 +1273,8 @@ Y_##YFUNC(int argc)                                             \
   double value;                                                 \
   int code;                                                     \
   if (argc != 2) y_error("expecting exactly 2 arguments");      \
-  code = CFUNC(get_camera_handle(1),                            \
-               get_wide_string(0, FALSE), &value);              \
+  code = FORWARD(CFUNC)(get_camera_handle(1),                   \
+                        get_wide_string(0, FALSE), &value);     \
   if (code != AT_SUCCESS) throw(#CFUNC, code);                  \
   push_double(value);                                           \
 }
@@ -864,9 +1290,10 @@ Y_##YFUNC(int argc)                                             \
 {                                                               \
   int code;                                                     \
   if (argc != 3) y_error("expecting exactly 3 arguments");      \
-  code = CFUNC(get_camera_handle(2),                            \
-               get_wide_string(1, FALSE), GETTER(0));           \
+  code = FORWARD(CFUNC)(get_camera_handle(2),                   \
+                        get_wide_string(1, FALSE), GETTER(0));  \
   if (code != AT_SUCCESS) throw(#CFUNC, code);                  \
+  refresh_cached_features(2);                                   \
   push_nil();                                                   \
 }
 FUNCTION(andor_set_int,        AT_SetInt,       get_long)
@@ -888,14 +1315,14 @@ Y_andor_get_string(int argc)
   handle = get_camera_handle(1);
   feature = get_wide_string(0, FALSE);
   if (feature == NULL) y_error("invalid NULL string");
-  code = AT_GetStringMaxLength(handle, feature, &length);
+  code = FORWARD(AT_GetStringMaxLength)(handle, feature, &length);
   if (code != AT_SUCCESS) throw("AT_GetStringMaxLength", code);
 
   /* We cannot use the global workspace (already used to store FEATURE), so we
      create a new one large enough to store the wide-character value. */
   size = (length + 1)*sizeof(wchar_t);
   value = ypush_scratch(size, NULL);
-  code = AT_GetString(handle, feature, value, length);
+  code = FORWARD(AT_GetString)(handle, feature, value, length);
   if (code != AT_SUCCESS) throw("AT_GetString", code);
   value[length] = 0;
 
@@ -919,8 +1346,9 @@ Y_##YFUNC(int argc)                                                     \
   feature = get_wide_string(1, FALSE); /* use global workspace */       \
   value = get_wide_string(0, TRUE); /* use scratch */                   \
   if (feature == NULL || value == NULL) y_error("invalid NULL string"); \
-  code = CFUNC(handle, feature, value);                                 \
+  code = FORWARD(CFUNC)(handle, feature, value);                        \
   if (code != AT_SUCCESS) throw(#CFUNC, code);                          \
+  refresh_cached_features(2);                                           \
   push_nil();                                                           \
 }
 FUNCTION(andor_set_string,      AT_SetString)
@@ -935,10 +1363,10 @@ Y_##YFUNC(int argc)                                           \
   AT_BOOL value;                                              \
   int code;                                                   \
   if (argc != 3) y_error("expecting exactly 2 arguments");    \
-  code = CFUNC(get_camera_handle(2),                          \
-               get_wide_string(1, FALSE),                     \
-               get_int(0),                                    \
-               &value);                                       \
+  code = FORWARD(CFUNC)(get_camera_handle(2),                 \
+                        get_wide_string(1, FALSE),            \
+                        get_int(0),                           \
+                        &value);                              \
   if (code != AT_SUCCESS) {                                   \
     if (code != AT_SUCCESS) throw(#CFUNC, code);              \
     value = FALSE;                                            \
@@ -961,8 +1389,8 @@ Y_andor_get_enum_string_by_index(int argc)
   handle = get_camera_handle(2);
   feature = get_wide_string(1, FALSE);
   index = get_int(0);
-  code = AT_GetEnumStringByIndex(handle, feature, index,
-                                 value, ENUM_STRING_MAXLEN+1);
+  code = FORWARD(AT_GetEnumStringByIndex)(handle, feature, index,
+                                          value, ENUM_STRING_MAXLEN+1);
   if (code != AT_SUCCESS) {
     throw("AT_GetEnumStringByIndex", code);
   }
@@ -981,7 +1409,7 @@ Y_andor_get_enum_string(int argc)
   if (argc != 2) y_error("expecting exactly 2 arguments");
   handle = get_camera_handle(1);
   feature = get_wide_string(0, FALSE);
-  code = AT_GetEnumIndex(handle, feature, &index);
+  code = FORWARD(AT_GetEnumIndex)(handle, feature, &index);
   if (code != AT_SUCCESS) {
     /* FIXME: generalize this type of behavior to other "getters". */
     if (code == AT_ERR_NOTIMPLEMENTED) {
@@ -990,8 +1418,8 @@ Y_andor_get_enum_string(int argc)
     }
     throw("AT_GetEnumIndex", code);
   }
-  code = AT_GetEnumStringByIndex(handle, feature, index,
-                                 value, ENUM_STRING_MAXLEN+1);
+  code = FORWARD(AT_GetEnumStringByIndex)(handle, feature, index,
+                                          value, ENUM_STRING_MAXLEN+1);
   if (code != AT_SUCCESS) {
     throw("AT_GetEnumStringByIndex", code);
   }
@@ -1008,9 +1436,9 @@ Y_andor_command(int argc)
   int code, done;
 
   if (argc != 2) y_error("expecting exactly 2 arguments");
-  if (yarg_nil(1)) {
+  if (yarg_nil(1) || is_remote_camera(1)) {
     cam = NULL;
-    handle = AT_HANDLE_SYSTEM;
+    handle = get_camera_handle(1);
   } else {
     cam = get_camera(1);
     handle = cam->handle;
@@ -1032,7 +1460,7 @@ Y_andor_command(int argc)
     }
   }
   if (! done) {
-    code = AT_Command(handle, to_wide(command, FALSE));
+    code = FORWARD(AT_Command)(handle, to_wide(command, FALSE));
     if (code != AT_SUCCESS) throw("AT_Command", code);
   }
   push_nil();
@@ -1058,6 +1486,72 @@ Y_andor_set_queue_length(int argc)
   push_nil();
 }
 
+void
+Y_andor_set_color_mode(int argc)
+{
+  camera_t* cam;
+  const char* mode;
+  int k;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  cam = get_camera(1);
+  mode = ygets_q(0);
+  for (k = 0; color_modes[k] != NULL; ++k) {
+    if (mode != NULL && strcmp(mode, color_modes[k]) == 0) {
+      cam->color = k;
+      push_nil();
+      return;
+    }
+  }
+  y_error("color mode must be \"planar\", \"luminance\" or \"raw\"");
+}
+
+void
+Y__andor_set_output_type(int argc)
+{
+  camera_t* cam;
+  const char* name;
+  int k;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  cam = get_camera(1);
+  name = (yarg_nil(0) ? NULL : ygets_q(0));
+  if (name == NULL || strcmp(name, "native") == 0) {
+    cam->output_type = -1;
+    push_nil();
+    return;
+  }
+  for (k = 0; output_types[k] != NULL; ++k) {
+    if (strcmp(name, output_types[k]) == 0) {
+      cam->output_type = k;
+      push_nil();
+      return;
+    }
+  }
+  y_error("unsupported output type");
+}
+
+void
+Y_andor_set_orientation(int argc)
+{
+  camera_t* cam;
+  const char* name;
+  int k;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  cam = get_camera(1);
+  name = (yarg_nil(0) ? "none" : ygets_q(0));
+  for (k = 0; orientations[k] != NULL; ++k) {
+    if (name != NULL && strcmp(name, orientations[k]) == 0) {
+      cam->orientation = k;
+      setup_bad_pixels(cam);
+      push_nil();
+      return;
+    }
+  }
+  y_error("unknown orientation");
+}
+
 void
 Y_andor_start_acquisition(int argc)
 {
@@ -1072,6 +1566,26 @@ Y_andor_stop_acquisition(int argc)
   stop_acquisition(get_camera(0), FALSE);
 }
 
+void
+Y_andor_arm(int argc)
+{
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  arm_acquisition(get_camera(0));
+}
+
+void
+Y_andor_trigger(int argc)
+{
+  camera_t* cam;
+  int code;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  cam = get_camera(0);
+  if (! cam->acquiring) y_error("camera is not armed");
+  code = AT_Command(cam->handle, L"SoftwareTrigger");
+  if (code != AT_SUCCESS) throw("AT_Command \"SoftwareTrigger\"", code);
+}
+
 /* This function just check the consistency of my assumption about the way
    frame buffers are used by the SDK. */
 static void
@@ -1103,137 +1617,458 @@ check_frame(const camera_t* cam, AT_U8* frame_ptr,
 void
 Y_andor_wait_image(int argc)
 {
-  int code, frame_size, timeout;
+  int code, frame_size, timeout, forever;
   camera_t* cam;
   AT_U8* frame_ptr;
+  double deadline, remaining;
 
   /* Get and check arguments. */
   if (argc != 2) y_error("expecting exactly 2 arguments");
+  if (is_remote_camera(1)) {
+    wait_remote_image(1, get_int(0));
+    return;
+  }
   cam = get_camera(1);
   timeout = get_int(0);
   if (! cam->acquiring) y_error("camera is not acquiring");
-  if (timeout < 0) timeout = AT_INFINITE;
+  forever = (timeout < 0);
+  if (forever) timeout = AT_INFINITE;
+  deadline = (forever ? 0.0 : monotonic_time() + 1E-3*timeout);
 
-  /* Sleep in this thread until data is ready. */
-  code = AT_WaitBuffer(cam->handle, &frame_ptr, &frame_size, timeout);
-  if (code != AT_SUCCESS) {
-    throw("AT_WaitBuffer", code);
-    /*push_nil();*/
-    return;
+  for (;;) {
+    /* Sleep in this thread until data is ready. */
+    code = AT_WaitBuffer(cam->handle, &frame_ptr, &frame_size, timeout);
+    if (code != AT_SUCCESS) {
+      throw("AT_WaitBuffer", code);
+      /*push_nil();*/
+      return;
+    }
+    check_frame(cam, frame_ptr, frame_size, FALSE);
+
+    /* Feed the attached processing stages. */
+    if (process_frame(cam, (const unsigned char*)frame_ptr)) {
+      break;
+    }
+
+    /* The frame has been suppressed by a stage, re-queue the buffer and wait
+       for the next frame in the remaining time. */
+    code = requeue_buffer(cam, frame_ptr, frame_size);
+    if (code != AT_SUCCESS) {
+      throw("AT_QueueBuffer", code);
+    }
+    if (! forever) {
+      remaining = deadline - monotonic_time();
+      timeout = (remaining > 0.0 ? (int)(1E3*remaining) : 0);
+    }
   }
-  check_frame(cam, frame_ptr, frame_size, FALSE);
 
   /* Extract frame data as a Yorick array. */
   if (cam->extract != NULL) {
     cam->extract(cam, (const unsigned char*)frame_ptr);
+    correct_bad_pixels(cam);
   } else {
     push_nil();
   }
 
   /* Re-queue the buffer. */
-  code = AT_QueueBuffer(cam->handle, frame_ptr, frame_size);
+  code = requeue_buffer(cam, frame_ptr, frame_size);
   if (code != AT_SUCCESS) {
     throw("AT_QueueBuffer", code);
   }
 }
 
+static void* push_frame_output(const camera_t* cam, int type, long dims[]);
+
 static void
 extract_Raw(const camera_t* cam, const unsigned char* src)
 {
   long dims[2];
   dims[0] = 1;
   dims[1] = cam->frame_size;
-  memcpy(ypush_c(dims), src, cam->frame_size);
+  memcpy(push_frame_output(cam, Y_CHAR, dims), src, cam->frame_size);
 }
 
-#define FUNCTION(NAME, DST_TYPE, PUSH, SRC_TYPE)                \
-static void                                                     \
-NAME(const camera_t* cam, const unsigned char* src)             \
-{                                                               \
-  DST_TYPE* dst;                                                \
-  long dims[3];                                                 \
-  long x, y;                                                    \
-                                                                \
-  /* Create Yorick array. */                                    \
-  if (sizeof(DST_TYPE) < sizeof(SRC_TYPE)) {                    \
-    y_error("sizeof("#DST_TYPE") < sizeof("#SRC_TYPE")");       \
-  }                                                             \
-  dims[0] = 2;                                                  \
-  dims[1] = cam->frame_width;                                   \
-  dims[2] = cam->frame_height;                                  \
-  dst = (DST_TYPE*)PUSH(dims);                                  \
-                                                                \
-  if (sizeof(SRC_TYPE) == sizeof(DST_TYPE)) {                   \
-    /* Source and destination pixels have same size. */         \
-    size_t row_size = sizeof(DST_TYPE)*cam->frame_width;        \
-    if (cam->row_stride == row_size) {                          \
-      /* A single copy will do the job. */                      \
-      memcpy(dst, src, cam->frame_height*row_size);             \
-    } else {                                                    \
-      /* Copy row by row. */                                    \
-      for (y = 0; y < cam->frame_height; ++y) {                 \
-        memcpy(dst + y*cam->frame_width,                        \
-               src + y*cam->row_stride,                         \
-               row_size);                                       \
-      }                                                         \
-    }                                                           \
-  } else {                                                      \
-    /* A conversion is needed, copy pixel by pixel. */          \
-    for (y = 0; y < cam->frame_height; ++y) {                   \
-      DST_TYPE* dst_row = dst + y*cam->frame_width;             \
-      const SRC_TYPE* src_row =                                 \
-        (const SRC_TYPE*)(src + y*cam->row_stride);             \
-      for (x = 0; x < cam->frame_width; ++x) {                  \
-        dst_row[x] = src_row[x];                                \
-      }                                                         \
-    }                                                           \
-  }                                                             \
+/* The extracted frames are Yorick arrays of the type chosen for the camera
+   (see andor_set_output_type) or, by default, of the smallest type able to
+   store the pixel values.  The conversion is fused with the extraction of
+   the pixels: CONVERT_ROW stores the N values VALUE(SRC,x), for x = 0, ...,
+   N-1, at index OFFSET of the array DST of type TYPE.  The type is
+   dispatched for each row, so the inner loops are specialized. */
+#define CONVERT_ROW(TYPE, DST, OFFSET, SRC, N, VALUE)                   \
+  switch (TYPE) {                                                       \
+    CONVERT_CASE(Y_CHAR,   unsigned char,  DST, OFFSET, SRC, N, VALUE); \
+    CONVERT_CASE(Y_SHORT,  unsigned short, DST, OFFSET, SRC, N, VALUE); \
+    CONVERT_CASE(Y_INT,    unsigned int,   DST, OFFSET, SRC, N, VALUE); \
+    CONVERT_CASE(Y_LONG,   long,           DST, OFFSET, SRC, N, VALUE); \
+    CONVERT_CASE(Y_FLOAT,  float,          DST, OFFSET, SRC, N, VALUE); \
+    CONVERT_CASE(Y_DOUBLE, double,         DST, OFFSET, SRC, N, VALUE); \
+  }
+#define CONVERT_CASE(TYPE, CTYPE, DST, OFFSET, SRC, N, VALUE)           \
+  case TYPE:                                                            \
+    {                                                                   \
+      CTYPE* d_ = (CTYPE*)(DST) + (OFFSET);                             \
+      long x_, n_ = (N);                                                \
+      for (x_ = 0; x_ < n_; ++x_) {                                     \
+        d_[x_] = (CTYPE)VALUE(SRC, x_);                                 \
+      }                                                                 \
+    }                                                                   \
+    break
+
+/* Get the type of the frames extracted for camera CAM, NATIVE being the
+   default type for the pixel encoding. */
+#define OUTPUT_TYPE(cam, native) \
+  ((cam)->output_type >= 0 ? (cam)->output_type : (native))
+
+/* Push a Yorick array of type TYPE (Y_CHAR, ..., Y_DOUBLE) and dimensions
+   DIMS. */
+static void*
+push_array(int type, long dims[])
+{
+  switch (type) {
+  case Y_CHAR:   return ypush_c(dims);
+  case Y_SHORT:  return ypush_s(dims);
+  case Y_INT:    return ypush_i(dims);
+  case Y_LONG:   return ypush_l(dims);
+  case Y_FLOAT:  return ypush_f(dims);
+  default:       return ypush_d(dims);
+  }
 }
-FUNCTION(extract_Mono8,  unsigned char,  ypush_c, uint8_t)
-FUNCTION(extract_Mono12, unsigned short, ypush_s, uint16_t)
-FUNCTION(extract_Mono16, unsigned short, ypush_s, uint16_t)
-FUNCTION(extract_Mono32, unsigned int,   ypush_i, uint32_t)
-#undef FUNCTION
 
-#define FUNCTION(FORMAT)                                                \
-static void                                                             \
-extract_##FORMAT(const camera_t* cam, const unsigned char* src)         \
-{                                                                       \
-  static int warn = TRUE;                                               \
-  if (warn) {                                                           \
-    warning(#FORMAT " pixels will be extracted as raw data.");          \
-    warn = FALSE;                                                       \
-  }                                                                     \
-  extract_Raw(cam, src);                                                \
+/* Get the size of the elements of type TYPE (Y_CHAR, ..., Y_DOUBLE). */
+static size_t
+element_size(int type)
+{
+  switch (type) {
+  case Y_CHAR:   return sizeof(char);
+  case Y_SHORT:  return sizeof(short);
+  case Y_INT:    return sizeof(int);
+  case Y_LONG:   return sizeof(long);
+  case Y_FLOAT:  return sizeof(float);
+  default:       return sizeof(double);
+  }
 }
-FUNCTION(RGB8Packed)
-FUNCTION(Mono12Coded)
-FUNCTION(Mono12codedPacked)
-FUNCTION(Mono12parallel)
-FUNCTION(Mono12PackedParallel)
-#undef FUNCTION
 
-#define EXTRACTLOWPACKED(ptr)  ((ptr[0] << 4) | (ptr[1] & 0xF))
-#define EXTRACTHIGHPACKED(ptr) ((ptr[2] << 4) | (ptr[1] >> 4))
+/* Push a Yorick array of type TYPE and dimensions DIMS for a frame
+   extracted by camera CAM and return its data.  If the frame is to be
+   stored elsewhere (see capture_frames), nothing is pushed and the address
+   where to store the frame is returned. */
+static void*
+push_frame_output(const camera_t* cam, int type, long dims[])
+{
+  long k, count;
 
+  if (cam->target == NULL) {
+    return push_array(type, dims);
+  }
+  for (count = 1, k = 1; k <= dims[0]; ++k) {
+    count *= dims[k];
+  }
+  if (type != cam->target_type || count != cam->target_count) {
+    ((camera_t*)cam)->target = NULL;
+    y_error("unexpected format of extracted frame");
+  }
+  return cam->target;
+}
+
+/* Get the dimensions of the frames of camera CAM, with DEPTH planes, once
+   extracted. */
 static void
-extract_Mono12Packed(const camera_t* cam, const unsigned char* src)
+get_frame_dims(const camera_t* cam, long depth, long dims[])
 {
-  unsigned short* dst;
-  long dims[3];
+  dims[0] = (depth > 1 ? 3 : 2);
+  if ((cam->orientation & ORIENT_TRANSPOSE) != 0) {
+    dims[1] = cam->frame_height;
+    dims[2] = cam->frame_width;
+  } else {
+    dims[1] = cam->frame_width;
+    dims[2] = cam->frame_height;
+  }
+  dims[3] = depth;
+}
+
+/* Push a Yorick array of type TYPE for a frame of camera CAM with DEPTH
+   planes. */
+static void*
+push_frame_array(const camera_t* cam, int type, long depth)
+{
+  long dims[4];
+  get_frame_dims(cam, depth, dims);
+  return push_frame_output(cam, type, dims);
+}
+
+/* Get the type and the dimensions of the arrays extracted from the frames
+   of camera CAM (see the extract_... functions below). */
+static int
+get_extracted_format(const camera_t* cam, long dims[])
+{
+  int native;
+  long depth = 1;
+
+  switch (cam->encoding) {
+  case ENCODING_Mono8:
+    native = Y_CHAR;
+    break;
+  case ENCODING_Mono12Packed:
+  case ENCODING_Mono12:
+  case ENCODING_Mono16:
+    native = Y_SHORT;
+    break;
+  case ENCODING_Mono32:
+    native = Y_INT;
+    break;
+  case ENCODING_RGB8Packed:
+    if (cam->color != COLOR_RAW) {
+      native = Y_CHAR;
+      depth = (cam->color == COLOR_LUMINANCE ? 1 : 3);
+      break;
+    }
+    /* Fall through (raw data). */
+  default:
+    dims[0] = 1;
+    dims[1] = cam->frame_size;
+    return Y_CHAR;
+  }
+  get_frame_dims(cam, depth, dims);
+  return OUTPUT_TYPE(cam, native);
+}
+
+/* With the orientation of camera CAM, pixel (X,Y) of a frame (0-based) is
+   stored at index ORIGIN + X*XSTEP + Y*YSTEP of the extracted array. */
+static void
+frame_orientation(const camera_t* cam, long* origin, long* xstep,
+                  long* ystep)
+{
+  long width = cam->frame_width;
+  long height = cam->frame_height;
+  long o = 0, sx, sy;
+
+  if ((cam->orientation & ORIENT_TRANSPOSE) == 0) {
+    sx = 1;
+    sy = width;
+    if ((cam->orientation & ORIENT_FLIPX) != 0) {
+      o += width - 1;
+      sx = -1;
+    }
+    if ((cam->orientation & ORIENT_FLIPY) != 0) {
+      o += (height - 1)*width;
+      sy = -width;
+    }
+  } else {
+    sx = height;
+    sy = 1;
+    if ((cam->orientation & ORIENT_FLIPX) != 0) {
+      o += height - 1;
+      sy = -1;
+    }
+    if ((cam->orientation & ORIENT_FLIPY) != 0) {
+      o += (width - 1)*height;
+      sx = -height;
+    }
+  }
+  *origin = o;
+  *xstep = sx;
+  *ystep = sy;
+}
+
+/* ORIENT_FRAME stores the pixels VALUE(ROW,x) of the frame SRC of camera CAM
+   into the array DST of type TYPE (starting at index OFFSET) with the
+   orientation of the camera.  ROW is the address of the row of the pixel as
+   a pointer to SRC_TYPE.  The frame is processed by small square tiles, so
+   that the reads and the (strided) writes stay in the cache whatever the
+   orientation.  The type is dispatched for each tile. */
+#define ORIENT_TILE 32
+#define ORIENT_FRAME(CAM, TYPE, DST, OFFSET, SRC, SRC_TYPE, VALUE)      \
+  do {                                                                  \
+    const unsigned char* src_ = (SRC);                                  \
+    void* dst_ = (DST);                                                 \
+    long stride_ = (CAM)->row_stride;                                   \
+    long o_, sx_, sy_, x0_, x1_, y0_, y1_;                              \
+    frame_orientation(CAM, &o_, &sx_, &sy_);                            \
+    o_ += (OFFSET);                                                     \
+    for (y0_ = 0; y0_ < (CAM)->frame_height; y0_ = y1_) {               \
+      y1_ = y0_ + ORIENT_TILE;                                          \
+      if (y1_ > (CAM)->frame_height) y1_ = (CAM)->frame_height;         \
+      for (x0_ = 0; x0_ < (CAM)->frame_width; x0_ = x1_) {              \
+        x1_ = x0_ + ORIENT_TILE;                                        \
+        if (x1_ > (CAM)->frame_width) x1_ = (CAM)->frame_width;         \
+        switch (TYPE) {                                                 \
+          ORIENT_CASE(Y_CHAR,   unsigned char,  SRC_TYPE, VALUE);       \
+          ORIENT_CASE(Y_SHORT,  unsigned short, SRC_TYPE, VALUE);       \
+          ORIENT_CASE(Y_INT,    unsigned int,   SRC_TYPE, VALUE);       \
+          ORIENT_CASE(Y_LONG,   long,           SRC_TYPE, VALUE);       \
+          ORIENT_CASE(Y_FLOAT,  float,          SRC_TYPE, VALUE);       \
+          ORIENT_CASE(Y_DOUBLE, double,         SRC_TYPE, VALUE);       \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+#define ORIENT_CASE(TYPE, CTYPE, SRC_TYPE, VALUE)                       \
+  case TYPE:                                                            \
+    {                                                                   \
+      long x_, y_;                                                      \
+      for (y_ = y0_; y_ < y1_; ++y_) {                                  \
+        const SRC_TYPE* s_ = (const SRC_TYPE*)(src_ + y_*stride_);      \
+        CTYPE* d_ = (CTYPE*)dst_ + o_ + y_*sy_;                         \
+        for (x_ = x0_; x_ < x1_; ++x_) {                                \
+          d_[x_*sx_] = (CTYPE)VALUE(s_, x_);                            \
+        }                                                               \
+      }                                                                 \
+    }                                                                   \
+    break
+
+#define PLAIN_VALUE(src, x) ((src)[x])
+
+#define FUNCTION(NAME, NATIVE, SRC_TYPE)                                \
+static void                                                             \
+NAME(const camera_t* cam, const unsigned char* src)                     \
+{                                                                       \
+  void* dst;                                                            \
+  long y;                                                               \
+  int type = OUTPUT_TYPE(cam, NATIVE);                                  \
+                                                                        \
+  /* Create Yorick array. */                                            \
+  dst = push_frame_array(cam, type, 1);                                 \
+                                                                        \
+  if (cam->orientation != 0) {                                          \
+    /* Transform the frame by tiles. */                                 \
+    ORIENT_FRAME(cam, type, dst, 0, src, SRC_TYPE, PLAIN_VALUE);        \
+  } else if (type == NATIVE) {                                          \
+    /* Source and destination pixels have same size. */                 \
+    size_t row_size = sizeof(SRC_TYPE)*cam->frame_width;                \
+    if (cam->row_stride == row_size) {                                  \
+      /* A single copy will do the job. */                              \
+      memcpy(dst, src, cam->frame_height*row_size);                     \
+    } else {                                                            \
+      /* Copy row by row. */                                            \
+      for (y = 0; y < cam->frame_height; ++y) {                         \
+        memcpy((unsigned char*)dst + y*row_size,                        \
+               src + y*cam->row_stride,                                 \
+               row_size);                                               \
+      }                                                                 \
+    }                                                                   \
+  } else {                                                              \
+    /* A conversion is needed, convert row by row. */                   \
+    for (y = 0; y < cam->frame_height; ++y) {                           \
+      const SRC_TYPE* src_row =                                         \
+        (const SRC_TYPE*)(src + y*cam->row_stride);                     \
+      CONVERT_ROW(type, dst, y*cam->frame_width, src_row,               \
+                  cam->frame_width, PLAIN_VALUE);                       \
+    }                                                                   \
+  }                                                                     \
+}
+FUNCTION(extract_Mono8,  Y_CHAR,  uint8_t)
+FUNCTION(extract_Mono12, Y_SHORT, uint16_t)
+FUNCTION(extract_Mono16, Y_SHORT, uint16_t)
+FUNCTION(extract_Mono32, Y_INT,   uint32_t)
+#undef FUNCTION
+
+#define FUNCTION(FORMAT)                                                \
+static void                                                             \
+extract_##FORMAT(const camera_t* cam, const unsigned char* src)         \
+{                                                                       \
+  static int warn = TRUE;                                               \
+  if (warn) {                                                           \
+    warning(#FORMAT " pixels will be extracted as raw data.");          \
+    warn = FALSE;                                                       \
+  }                                                                     \
+  extract_Raw(cam, src);                                                \
+}
+FUNCTION(Mono12Coded)
+FUNCTION(Mono12codedPacked)
+FUNCTION(Mono12parallel)
+FUNCTION(Mono12PackedParallel)
+#undef FUNCTION
+
+/* Color frames are deinterleaved into planes or converted into luminance
+   (with the weights of ITU-R BT.601 in 8-bit fixed point) according to the
+   color mode of the camera.  The inner loops are simple enough to be
+   vectorized by the compiler. */
+#define RED_VALUE(src, x)       ((src)[3*(x)])
+#define GREEN_VALUE(src, x)     ((src)[3*(x)+1])
+#define BLUE_VALUE(src, x)      ((src)[3*(x)+2])
+#define LUMINANCE_VALUE(src, x) ((77*(src)[3*(x)] + 150*(src)[3*(x)+1] + \
+                                  29*(src)[3*(x)+2] + 128) >> 8)
+
+static void
+extract_RGB8Packed(const camera_t* cam, const unsigned char* src)
+{
+  const unsigned char* s;
+  void* dst;
+  long width, height, npix, y;
+  int type;
+
+  if (cam->color == COLOR_RAW) {
+    extract_Raw(cam, src);
+    return;
+  }
+  width = cam->frame_width;
+  height = cam->frame_height;
+  npix = width*height;
+  type = OUTPUT_TYPE(cam, Y_CHAR);
+  dst = push_frame_array(cam, type,
+                         (cam->color == COLOR_LUMINANCE ? 1 : 3));
+  if (cam->orientation != 0) {
+    if (cam->color == COLOR_LUMINANCE) {
+      ORIENT_FRAME(cam, type, dst, 0, src, unsigned char, LUMINANCE_VALUE);
+    } else {
+      ORIENT_FRAME(cam, type, dst, 0, src, unsigned char, RED_VALUE);
+      ORIENT_FRAME(cam, type, dst, npix, src, unsigned char, GREEN_VALUE);
+      ORIENT_FRAME(cam, type, dst, 2*npix, src, unsigned char, BLUE_VALUE);
+    }
+    return;
+  }
+  for (y = 0; y < height; ++y) {
+    s = src + y*cam->row_stride;
+    if (cam->color == COLOR_LUMINANCE) {
+      CONVERT_ROW(type, dst, y*width, s, width, LUMINANCE_VALUE);
+    } else {
+      CONVERT_ROW(type, dst, y*width, s, width, RED_VALUE);
+      CONVERT_ROW(type, dst, y*width + npix, s, width, GREEN_VALUE);
+      CONVERT_ROW(type, dst, y*width + 2*npix, s, width, BLUE_VALUE);
+    }
+  }
+}
+
+#define EXTRACTLOWPACKED(ptr)  ((ptr[0] << 4) | (ptr[1] & 0xF))
+#define EXTRACTHIGHPACKED(ptr) ((ptr[2] << 4) | (ptr[1] >> 4))
+
+/* Value of the X-th pixel (0-based) of a row of packed 12-bit pixels. */
+#define PACKED12_VALUE(src, x)                                  \
+  (((x) & 1) == 0 ? EXTRACTLOWPACKED(((src) + ((x)/2)*3))        \
+   : EXTRACTHIGHPACKED(((src) + ((x)/2)*3)))
+
+static void
+extract_Mono12Packed(const camera_t* cam, const unsigned char* src)
+{
+  unsigned short* dst;
   long y, even_width;
   int odd; /* number of colmuns is odd? */
+  int type;
 
   fprintf(stderr, "extract_Mono12Packed\n");
 
+  type = OUTPUT_TYPE(cam, Y_SHORT);
+  if (cam->orientation != 0) {
+    /* Unpack, convert and transform in a single pass. */
+    void* buf = push_frame_array(cam, type, 1);
+    ORIENT_FRAME(cam, type, buf, 0, src, unsigned char, PACKED12_VALUE);
+    return;
+  }
+  if (type != Y_SHORT) {
+    /* Unpack and convert in a single pass. */
+    void* buf = push_frame_array(cam, type, 1);
+    for (y = 0; y < cam->frame_height; ++y) {
+      CONVERT_ROW(type, buf, y*cam->frame_width, src + y*cam->row_stride,
+                  cam->frame_width, PACKED12_VALUE);
+    }
+    return;
+  }
+
   /* Create Yorick array. */
   if (sizeof(short) < 2) {
     y_error("sizeof(short) < 2");
   }
-  dims[0] = 2;
-  dims[1] = cam->frame_width;
-  dims[2] = cam->frame_height;
-  dst = (unsigned short*)ypush_s(dims);
+  dst = (unsigned short*)push_frame_array(cam, Y_SHORT, 1);
 
   odd = ((cam->frame_width & 1L) != 0L);
   even_width = (cam->frame_width & ~1L);
@@ -1255,5 +2090,8263 @@ extract_Mono12Packed(const camera_t* cam, const unsigned char* src)
   }
 }
 
-#undef EXTRACTLOWPACKED
-#undef EXTRACTHIGHPACKED
+/* Get the type of the elements if the frames of camera CAM are stored as
+   delivered in the extracted arrays, -1 otherwise. */
+static int
+get_in_place_type(const camera_t* cam)
+{
+  long size;
+  int type;
+
+  switch (cam->encoding) {
+  case ENCODING_Mono8:
+    type = Y_CHAR;
+    size = 1;
+    break;
+  case ENCODING_Mono12:
+  case ENCODING_Mono16:
+    type = Y_SHORT;
+    size = 2;
+    break;
+  case ENCODING_Mono32:
+    type = Y_INT;
+    size = 4;
+    break;
+  default:
+    return -1;
+  }
+  if (OUTPUT_TYPE(cam, type) != type || cam->orientation != 0 ||
+      cam->nfix > 0 || cam->broker != NULL ||
+      cam->row_stride != size*cam->frame_width ||
+      cam->frame_size != cam->row_stride*cam->frame_height ||
+      cam->frame_size % FRAME_ALIGN != 0) {
+    return -1;
+  }
+  return type;
+}
+
+/* Exact-count acquisition.  The camera acquires exactly COUNT frames in
+   the "Fixed" cycle mode.  If KEEP is true, the frames are left on top of
+   the stack as a single array allocated before starting the acquisition:
+   when the frames can be stored as delivered (see get_in_place_type), one
+   buffer per frame is queued directly in the result, so the frames are
+   never copied; otherwise the queue of the camera is used and each frame
+   is extracted directly in its slice of the result.  If KEEP is false, the
+   frames are only fed to the processing stages.  All frames are stored,
+   including those suppressed by a processing stage. */
+static void
+capture_frames(camera_t* cam, long count, int timeout, int keep)
+{
+  AT_U8* frame_ptr;
+  unsigned char* dst;
+  long dims[Y_DIMSIZE], frame_dims[Y_DIMSIZE], ntot, n, k;
+  size_t size;
+  int code, frame_size, type, in_place;
+
+  if (count < 1) y_error("invalid number of frames");
+  if (cam->acquiring) y_error("camera is acquiring");
+  if (timeout < 0) timeout = AT_INFINITE;
+
+  prepare_acquisition(cam);
+  type = (keep ? get_in_place_type(cam) : -1);
+  dst = NULL;
+  size = 0;
+  ntot = 0;
+  in_place = FALSE;
+  if (type != -1) {
+    /* Queue the buffers in the result if it is suitably aligned. */
+    dims[0] = 3;
+    dims[1] = cam->frame_width;
+    dims[2] = cam->frame_height;
+    dims[3] = count;
+    dst = (unsigned char*)push_array(type, dims);
+    size = cam->frame_size;
+    in_place = (((size_t)dst) % FRAME_ALIGN == 0);
+    if (! in_place) {
+      yarg_drop(1);
+    }
+  }
+  if (keep && ! in_place) {
+    /* Allocate the result for the extracted frames. */
+    type = get_extracted_format(cam, frame_dims);
+    for (ntot = 1, k = 0; k <= frame_dims[0]; ++k) {
+      dims[k] = frame_dims[k];
+      if (k > 0) ntot *= frame_dims[k];
+    }
+    dims[++dims[0]] = count;
+    dst = (unsigned char*)push_array(type, dims);
+    size = ntot*element_size(type);
+  }
+  if (in_place) {
+    for (n = 0; n < count; ++n) {
+      code = AT_QueueBuffer(cam->handle, (AT_U8*)(dst + n*size),
+                            cam->frame_size);
+      if (code != AT_SUCCESS) {
+        (void)AT_Flush(cam->handle);
+        throw("AT_QueueBuffer", code);
+      }
+    }
+  } else {
+    queue_buffers(cam, FALSE);
+  }
+  launch_acquisition(cam, count);
+
+  for (n = 0; n < count; ++n) {
+    code = AT_WaitBuffer(cam->handle, &frame_ptr, &frame_size, timeout);
+    if (code != AT_SUCCESS) {
+      /* Make sure the SDK no longer uses the buffers. */
+      stop_acquisition(cam, FALSE);
+      throw("AT_WaitBuffer", code);
+    }
+
+    /* The stages cannot suppress frames here: the result has room for
+       exactly COUNT frames and no more frames are acquired. */
+    (void)process_frame(cam, (const unsigned char*)frame_ptr);
+    if (in_place) {
+      continue;
+    }
+    if (keep) {
+      check_frame(cam, frame_ptr, frame_size, FALSE);
+      cam->target = dst + n*size;
+      cam->target_count = ntot;
+      cam->target_type = type;
+      cam->extract(cam, (const unsigned char*)frame_ptr);
+      cam->target = NULL;
+      correct_image(cam, dst + n*size, ntot, frame_dims, type);
+    }
+    code = requeue_buffer(cam, frame_ptr, frame_size);
+    if (code != AT_SUCCESS) {
+      stop_acquisition(cam, FALSE);
+      throw("AT_QueueBuffer", code);
+    }
+  }
+  stop_acquisition(cam, FALSE);
+}
+
+void
+Y_andor_capture(int argc)
+{
+  if (argc != 3) y_error("expecting exactly 3 arguments");
+  capture_frames(get_camera(2), get_long(1), get_int(0), TRUE);
+}
+
+/*---------------------------------------------------------------------------*/
+/* DECODING OF RAW PIXELS */
+
+/* Processing stages work directly on the raw frames, decoding only the parts
+   they need into small single precision buffers.  The following function
+   decodes N pixels of a row starting at column X0 (0-based).  Only
+   monochrome pixel encodings are supported (see is_monochrome). */
+
+static int
+is_monochrome(int encoding)
+{
+  return (encoding == ENCODING_Mono8 ||
+          encoding == ENCODING_Mono12 ||
+          encoding == ENCODING_Mono12Packed ||
+          encoding == ENCODING_Mono16 ||
+          encoding == ENCODING_Mono32);
+}
+
+static void
+decode_span(int encoding, const unsigned char* row, long x0, long n,
+            float* dst)
+{
+  long i;
+
+  switch (encoding) {
+  case ENCODING_Mono8:
+    {
+      const uint8_t* src = (const uint8_t*)row + x0;
+      for (i = 0; i < n; ++i) {
+        dst[i] = src[i];
+      }
+    }
+    break;
+  case ENCODING_Mono12:
+  case ENCODING_Mono16:
+    {
+      const uint16_t* src = (const uint16_t*)row + x0;
+      for (i = 0; i < n; ++i) {
+        dst[i] = src[i];
+      }
+    }
+    break;
+  case ENCODING_Mono32:
+    {
+      const uint32_t* src = (const uint32_t*)row + x0;
+      for (i = 0; i < n; ++i) {
+        dst[i] = src[i];
+      }
+    }
+    break;
+  case ENCODING_Mono12Packed:
+    {
+      const unsigned char* src = row + (x0/2)*3;
+      i = 0;
+      if ((x0 & 1L) != 0L && n > 0) {
+        dst[i++] = EXTRACTHIGHPACKED(src);
+        src += 3;
+      }
+      for (; i + 1 < n; i += 2) {
+        dst[i] = EXTRACTLOWPACKED(src);
+        dst[i+1] = EXTRACTHIGHPACKED(src);
+        src += 3;
+      }
+      if (i < n) {
+        dst[i] = EXTRACTLOWPACKED(src);
+      }
+    }
+    break;
+  default:
+    for (i = 0; i < n; ++i) {
+      dst[i] = 0.0f;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* WORKER THREADS */
+
+/* A team of workers is used to split the processing of a frame into
+   independent tasks.  The calling thread takes its part of the work, so a
+   team of N workers only runs N-1 additional threads which are created once
+   and sleep between jobs.  Tasks must not call any function of the Yorick
+   API. */
+
+typedef void task_t(void* ctx, long task, int thread);
+
+typedef struct _workers workers_t;
+struct _workers {
+  pthread_mutex_t mutex;
+  pthread_cond_t start;   /* Signaled when a new job is available. */
+  pthread_cond_t done;    /* Signaled when all helpers are done. */
+  pthread_t* threads;     /* Helper threads. */
+  int nthreads;           /* Number of workers (including the caller). */
+  int started;            /* Number of started helpers. */
+  int busy;               /* Number of helpers still working on the job. */
+  int quit;               /* Helpers must exit? */
+  unsigned long job;      /* Job counter. */
+  task_t* task;           /* Task function of the current job. */
+  void* ctx;              /* Context of the current job. */
+  long ntasks;            /* Number of tasks of the current job. */
+  long next;              /* Index of next task to perform. */
+};
+
+/* Perform tasks of current job until none remain, must be called with the
+   mutex locked. */
+static void
+run_tasks(workers_t* w, int thread)
+{
+  long task;
+  while (w->next < w->ntasks) {
+    task = w->next++;
+    pthread_mutex_unlock(&w->mutex);
+    w->task(w->ctx, task, thread);
+    pthread_mutex_lock(&w->mutex);
+  }
+}
+
+static void*
+run_helper(void* arg)
+{
+  workers_t* w = (workers_t*)arg;
+  unsigned long job;
+  int thread;
+
+  pthread_mutex_lock(&w->mutex);
+  thread = ++w->started;
+  job = 0; /* helpers are started before any job */
+  while (TRUE) {
+    while (! w->quit && w->job == job) {
+      pthread_cond_wait(&w->start, &w->mutex);
+    }
+    if (w->quit) {
+      break;
+    }
+    job = w->job;
+    run_tasks(w, thread);
+    if (--w->busy == 0) {
+      pthread_cond_signal(&w->done);
+    }
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+/* Get the number of processors, used as the default number of workers. */
+static int
+get_number_of_processors(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n >= 1 && n <= INT_MAX ? (int)n : 1);
+}
+
+/* Create a team of NTHREADS workers (NTHREADS <= 0 to use as many workers as
+   processors).  The team may be smaller than requested if some threads
+   cannot be created.  NULL is returned if memory cannot be allocated. */
+static workers_t*
+new_workers(int nthreads)
+{
+  workers_t* w;
+  int k;
+
+  if (nthreads <= 0) {
+    nthreads = get_number_of_processors();
+  }
+  w = (workers_t*)malloc(sizeof(workers_t));
+  if (w == NULL) {
+    return NULL;
+  }
+  memset(w, 0, sizeof(workers_t));
+  w->threads = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+  if (w->threads == NULL) {
+    free(w);
+    return NULL;
+  }
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->start, NULL);
+  pthread_cond_init(&w->done, NULL);
+  w->nthreads = 1;
+  for (k = 1; k < nthreads; ++k) {
+    if (pthread_create(&w->threads[k], NULL, run_helper, w) != 0) {
+      warning("Only %d worker threads could be created.", k);
+      break;
+    }
+    w->nthreads = k + 1;
+  }
+  return w;
+}
+
+static void
+free_workers(workers_t* w)
+{
+  int k;
+
+  if (w != NULL) {
+    pthread_mutex_lock(&w->mutex);
+    w->quit = TRUE;
+    pthread_cond_broadcast(&w->start);
+    pthread_mutex_unlock(&w->mutex);
+    for (k = 1; k < w->nthreads; ++k) {
+      pthread_join(w->threads[k], NULL);
+    }
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->start);
+    pthread_mutex_destroy(&w->mutex);
+    free(w->threads);
+    free(w);
+  }
+}
+
+/* Run NTASKS tasks by calling TASK(CTX, I, THREAD) for I = 0, ..., NTASKS-1
+   and wait for their completion.  THREAD is the index of the worker in the
+   team (0 for the caller). */
+static void
+run_workers(workers_t* w, long ntasks, task_t* task, void* ctx)
+{
+  long i;
+
+  if (w == NULL || w->nthreads <= 1 || ntasks <= 1) {
+    for (i = 0; i < ntasks; ++i) {
+      task(ctx, i, 0);
+    }
+    return;
+  }
+  pthread_mutex_lock(&w->mutex);
+  w->task = task;
+  w->ctx = ctx;
+  w->ntasks = ntasks;
+  w->next = 0;
+  w->busy = w->nthreads - 1;
+  ++w->job;
+  pthread_cond_broadcast(&w->start);
+  run_tasks(w, 0);
+  while (w->busy > 0) {
+    pthread_cond_wait(&w->done, &w->mutex);
+  }
+  pthread_mutex_unlock(&w->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+/* PROCESSING STAGES */
+
+/* A processing stage is a Yorick object which can be attached to a camera to
+   process the raw frames as they are delivered by andor_wait_image or
+   andor_process, before the frame buffers are re-queued.  All stages share
+   the same Yorick class, their specific behavior is implemented by the
+   methods of their "stage class". */
+
+typedef struct _stage_class stage_class_t;
+struct _stage_class {
+  const char* name;
+
+  /* Check the frame format and (re)allocate resources.  Called when
+     acquisition is started or when the stage is attached to an acquiring
+     camera.  This method may raise errors. */
+  void (*setup)(stage_t* stage, const camera_t* cam);
+
+  /* Process a raw frame.  This method is called before the frame buffer is
+     re-queued and must not raise errors.  It returns FALSE to suppress the
+     delivery of the frame: the frame is then neither passed to the next
+     stages nor extracted by andor_wait_image. */
+  int (*process)(stage_t* stage, const camera_t* cam,
+                 const unsigned char* frame);
+
+  /* Reset the results accumulated so far (optional). */
+  void (*reset)(stage_t* stage);
+
+  /* Push the current result of the stage on top of the stack (called when
+     the stage object is used as a function). */
+  void (*eval)(stage_t* stage, int argc);
+
+  /* Push the value of member NAME on top of the stack, returning FALSE if
+     there is no such member (optional). */
+  int (*extract)(stage_t* stage, const char* name);
+
+  /* Release resources (optional). */
+  void (*free)(stage_t* stage);
+};
+
+struct _stage {
+  const stage_class_t* cls;
+  const camera_t* camera;  /* Camera the stage is attached to. */
+  long frames;             /* Number of processed frames. */
+};
+
+static void free_stage(void*);
+static void print_stage(void*);
+static void eval_stage(void*, int);
+static void extract_stage(void*, char*);
+
+y_userobj_t stage_type = {
+  "Andor processing stage",
+  free_stage, print_stage, eval_stage, extract_stage, NULL
+};
+
+/* Create a new stage instance of SIZE bytes and push it on top of the
+   stack.  All members but the class are zero-filled. */
+static stage_t*
+push_stage(const stage_class_t* cls, size_t size)
+{
+  stage_t* stage = (stage_t*)ypush_obj(&stage_type, size);
+  stage->cls = cls;
+  return stage;
+}
+
+static stage_t*
+get_stage(int iarg)
+{
+  return (stage_t*)yget_obj(iarg, &stage_type);
+}
+
+static void
+free_stage(void* ptr)
+{
+  stage_t* stage = (stage_t*)ptr;
+  if (stage->cls != NULL && stage->cls->free != NULL) {
+    stage->cls->free(stage);
+  }
+}
+
+static void
+print_stage(void* ptr)
+{
+  char buffer[128];
+  stage_t* stage = (stage_t*)ptr;
+  sprintf(buffer, " (frames = %ld, attached = %s)", stage->frames,
+          (stage->camera != NULL ? "TRUE" : "FALSE"));
+  y_print(stage->cls->name, 0);
+  y_print(buffer, 1);
+}
+
+static void
+eval_stage(void* ptr, int argc)
+{
+  stage_t* stage = (stage_t*)ptr;
+  stage->cls->eval(stage, argc);
+}
+
+static void
+extract_stage(void* ptr, char* name)
+{
+  stage_t* stage = (stage_t*)ptr;
+  if (name[0] == 'f' && strcmp(name + 1, "rames") == 0) {
+    push_long(stage->frames);
+  } else if (stage->cls->extract == NULL || ! stage->cls->extract(stage, name)) {
+    y_error("illegal member");
+  }
+}
+
+static void
+setup_stages(camera_t* cam)
+{
+  int k;
+  for (k = 0; k < cam->nstages; ++k) {
+    cam->stage[k]->cls->setup(cam->stage[k], cam);
+  }
+}
+
+/* Feed the attached stages with a frame, return FALSE if the frame has been
+   suppressed by one of them.  Shared frames are published for the remote
+   cameras first. */
+static int
+process_frame(camera_t* cam, const unsigned char* frame)
+{
+  stage_t* stage;
+  int k, deliver;
+  if (cam->broker != NULL) {
+    publish_frame(cam, frame);
+  }
+  for (k = 0; k < cam->nstages; ++k) {
+    stage = cam->stage[k];
+    deliver = stage->cls->process(stage, cam, frame);
+    ++stage->frames;
+    if (! deliver) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void
+detach_stages(camera_t* cam)
+{
+  void* use;
+  while (cam->nstages > 0) {
+    --cam->nstages;
+    cam->stage[cam->nstages]->camera = NULL;
+    use = cam->stage_use[cam->nstages];
+    cam->stage[cam->nstages] = NULL;
+    cam->stage_use[cam->nstages] = NULL;
+    ydrop_use(use); /* drop *after* updating members */
+  }
+}
+
+void
+Y_andor_attach(int argc)
+{
+  camera_t* cam;
+  stage_t* stage;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  cam = get_camera(1);
+  stage = get_stage(0);
+  if (stage->camera != NULL) y_error("stage is already attached");
+  if (cam->nstages >= MAX_STAGES) y_error("too many attached stages");
+  if (cam->acquiring) {
+    stage->cls->setup(stage, cam);
+  }
+  stage->camera = cam;
+  cam->stage[cam->nstages] = stage;
+  cam->stage_use[cam->nstages] = yget_use(0);
+  ++cam->nstages;
+  push_nil();
+}
+
+void
+Y_andor_detach(int argc)
+{
+  camera_t* cam;
+  stage_t* stage;
+  void* use;
+  int j, k;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  cam = get_camera(1);
+  if (yarg_nil(0)) {
+    detach_stages(cam);
+  } else {
+    stage = get_stage(0);
+    for (k = 0; k < cam->nstages; ++k) {
+      if (cam->stage[k] == stage) {
+        use = cam->stage_use[k];
+        for (j = k + 1; j < cam->nstages; ++j) {
+          cam->stage[j-1] = cam->stage[j];
+          cam->stage_use[j-1] = cam->stage_use[j];
+        }
+        --cam->nstages;
+        stage->camera = NULL;
+        ydrop_use(use);
+        break;
+      }
+    }
+  }
+  push_nil();
+}
+
+void
+Y_andor_reset(int argc)
+{
+  stage_t* stage;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  stage = get_stage(0);
+  if (stage->cls->reset != NULL) {
+    stage->cls->reset(stage);
+  }
+  stage->frames = 0;
+  push_nil();
+}
+
+void
+Y_andor_process(int argc)
+{
+  int code, frame_size, timeout;
+  long count, n;
+  camera_t* cam;
+  AT_U8* frame_ptr;
+
+  if (argc != 3) y_error("expecting exactly 3 arguments");
+  cam = get_camera(2);
+  timeout = get_int(1);
+  count = get_long(0);
+  if (! cam->acquiring) y_error("camera is not acquiring");
+  if (timeout < 0) timeout = AT_INFINITE;
+
+  for (n = 0; n < count; ++n) {
+    code = AT_WaitBuffer(cam->handle, &frame_ptr, &frame_size, timeout);
+    if (code == AT_ERR_TIMEDOUT) {
+      break;
+    }
+    if (code != AT_SUCCESS) {
+      throw("AT_WaitBuffer", code);
+    }
+    check_frame(cam, frame_ptr, frame_size, FALSE);
+    process_frame(cam, (const unsigned char*)frame_ptr);
+    code = requeue_buffer(cam, frame_ptr, frame_size);
+    if (code != AT_SUCCESS) {
+      throw("AT_QueueBuffer", code);
+    }
+  }
+  push_long(n);
+}
+
+/*---------------------------------------------------------------------------*/
+/* WAVEFRONT SENSOR CENTROIDING */
+
+/* The centroider computes the center of gravity of the sub-images of a
+   Shack-Hartmann wavefront sensor.  Each sub-aperture is processed
+   independently, so sub-apertures are split in chunks distributed among the
+   worker threads.  Each worker decodes the rows of its sub-apertures in its
+   own small buffer. */
+
+#define CENTROID_COG     0 /* Center of gravity. */
+#define CENTROID_TCOG    1 /* Thresholded center of gravity. */
+#define CENTROID_WCOG    2 /* Weighted center of gravity. */
+#define CENTROID_CHUNK  16 /* Number of sub-apertures per task. */
+
+typedef struct _centroider centroider_t;
+struct _centroider {
+  stage_t base;
+  long nsubs;           /* Number of sub-apertures. */
+  long* x0;             /* Leftmost column of sub-apertures (0-based). */
+  long* y0;             /* Bottom row of sub-apertures (0-based). */
+  long* w;              /* Width of sub-apertures. */
+  long* h;              /* Height of sub-apertures. */
+  long wmax;            /* Maximum width of sub-apertures. */
+  int method;           /* Centroiding method. */
+  float threshold;      /* Threshold for the thresholded method. */
+  float* weights;       /* Weights for the weighted method (all
+                           sub-apertures have the same size). */
+  double* slopes;       /* Result: 2-by-NSUBS array. */
+  double* flux;         /* Result: total flux in each sub-aperture. */
+  float* work;          /* Workspace: NTHREADS rows of WMAX pixels. */
+  workers_t* workers;   /* Team of worker threads. */
+
+  /* Frame being processed. */
+  const unsigned char* frame;
+  long stride;
+  int encoding;
+};
+
+static void
+centroider_setup(stage_t* stage, const camera_t* cam)
+{
+  centroider_t* ctr = (centroider_t*)stage;
+  long k;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for centroiding");
+  }
+  for (k = 0; k < ctr->nsubs; ++k) {
+    if (ctr->x0[k] + ctr->w[k] > cam->frame_width ||
+        ctr->y0[k] + ctr->h[k] > cam->frame_height) {
+      y_error("sub-aperture outside the frame");
+    }
+  }
+}
+
+static void
+centroider_task(void* ctx, long task, int thread)
+{
+  centroider_t* ctr = (centroider_t*)ctx;
+  float* buf = ctr->work + thread*ctr->wmax;
+  const float* wgt;
+  double s, sx, sy, rs, rsx;
+  float t, v;
+  long k, kmax, x, y, w, h;
+
+  k = task*CENTROID_CHUNK;
+  kmax = k + CENTROID_CHUNK;
+  if (kmax > ctr->nsubs) kmax = ctr->nsubs;
+  t = ctr->threshold;
+  for (; k < kmax; ++k) {
+    w = ctr->w[k];
+    h = ctr->h[k];
+    wgt = ctr->weights;
+    s = sx = sy = 0.0;
+    for (y = 0; y < h; ++y) {
+      decode_span(ctr->encoding,
+                  ctr->frame + (ctr->y0[k] + y)*ctr->stride,
+                  ctr->x0[k], w, buf);
+      if (ctr->method == CENTROID_TCOG) {
+        for (x = 0; x < w; ++x) {
+          v = buf[x] - t;
+          buf[x] = (v > 0.0f ? v : 0.0f);
+        }
+      } else if (ctr->method == CENTROID_WCOG) {
+        for (x = 0; x < w; ++x) {
+          buf[x] *= wgt[x];
+        }
+        wgt += w;
+      }
+      rs = rsx = 0.0;
+      for (x = 0; x < w; ++x) {
+        rs += buf[x];
+        rsx += x*buf[x];
+      }
+      s += rs;
+      sx += rsx;
+      sy += y*rs;
+    }
+    ctr->flux[k] = s;
+    if (s > 0.0) {
+      /* Slopes are relative to the center of the sub-aperture. */
+      ctr->slopes[2*k] = sx/s - 0.5*(w - 1);
+      ctr->slopes[2*k+1] = sy/s - 0.5*(h - 1);
+    } else {
+      ctr->slopes[2*k] = 0.0;
+      ctr->slopes[2*k+1] = 0.0;
+    }
+  }
+}
+
+static int
+centroider_process(stage_t* stage, const camera_t* cam,
+                   const unsigned char* frame)
+{
+  centroider_t* ctr = (centroider_t*)stage;
+  ctr->frame = frame;
+  ctr->stride = cam->row_stride;
+  ctr->encoding = cam->encoding;
+  run_workers(ctr->workers, (ctr->nsubs + CENTROID_CHUNK - 1)/CENTROID_CHUNK,
+              centroider_task, ctr);
+  ctr->frame = NULL;
+  return TRUE;
+}
+
+static void
+centroider_reset(stage_t* stage)
+{
+  centroider_t* ctr = (centroider_t*)stage;
+  memset(ctr->slopes, 0, 2*ctr->nsubs*sizeof(double));
+  memset(ctr->flux, 0, ctr->nsubs*sizeof(double));
+}
+
+static void
+centroider_eval(stage_t* stage, int argc)
+{
+  centroider_t* ctr = (centroider_t*)stage;
+  long dims[3];
+  dims[0] = 2;
+  dims[1] = 2;
+  dims[2] = ctr->nsubs;
+  memcpy(ypush_d(dims), ctr->slopes, 2*ctr->nsubs*sizeof(double));
+}
+
+static int
+centroider_extract(stage_t* stage, const char* name)
+{
+  centroider_t* ctr = (centroider_t*)stage;
+  long dims[3];
+  if (strcmp(name, "slopes") == 0) {
+    centroider_eval(stage, 0);
+  } else if (strcmp(name, "flux") == 0) {
+    dims[0] = 1;
+    dims[1] = ctr->nsubs;
+    memcpy(ypush_d(dims), ctr->flux, ctr->nsubs*sizeof(double));
+  } else if (strcmp(name, "nsubs") == 0) {
+    push_long(ctr->nsubs);
+  } else if (strcmp(name, "nthreads") == 0) {
+    push_long(ctr->workers != NULL ? ctr->workers->nthreads : 1);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+centroider_free(stage_t* stage)
+{
+  centroider_t* ctr = (centroider_t*)stage;
+  free_workers(ctr->workers);
+  if (ctr->x0 != NULL) p_free(ctr->x0);
+  if (ctr->weights != NULL) p_free(ctr->weights);
+  if (ctr->slopes != NULL) p_free(ctr->slopes);
+  if (ctr->work != NULL) p_free(ctr->work);
+}
+
+static stage_class_t centroider_class = {
+  "Andor wavefront sensor centroider",
+  centroider_setup,
+  centroider_process,
+  centroider_reset,
+  centroider_eval,
+  centroider_extract,
+  centroider_free
+};
+
+void
+Y__andor_centroider(int argc)
+{
+  centroider_t* ctr;
+  const long* xpos;
+  const long* ypos;
+  const long* wptr;
+  const long* hptr;
+  const double* wgt;
+  const char* method;
+  long k, nsubs, nw, nh, nwgt, dims[Y_DIMSIZE];
+  double threshold;
+  int nthreads, code;
+
+  /* Parse arguments. */
+  if (argc != 8) y_error("expecting exactly 8 arguments");
+  xpos = ygeta_l(7, &nsubs, NULL);
+  ypos = ygeta_l(6, &k, NULL);
+  if (nsubs < 1 || k != nsubs) {
+    y_error("X and Y must have the same number of elements");
+  }
+  wptr = ygeta_l(5, &nw, NULL);
+  hptr = ygeta_l(4, &nh, NULL);
+  if ((nw != 1 && nw != nsubs) || (nh != 1 && nh != nsubs)) {
+    y_error("bad number of sub-aperture sizes");
+  }
+  method = get_string(3);
+  if (method == NULL || strcmp(method, "cog") == 0) {
+    code = CENTROID_COG;
+  } else if (strcmp(method, "tcog") == 0) {
+    code = CENTROID_TCOG;
+  } else if (strcmp(method, "wcog") == 0) {
+    code = CENTROID_WCOG;
+  } else {
+    y_error("unknown centroiding method");
+    return;
+  }
+  threshold = get_double(2);
+  wgt = NULL;
+  nwgt = 0;
+  if (code == CENTROID_WCOG) {
+    if (yarg_nil(1)) y_error("weights must be specified for \"wcog\"");
+    if (nw != 1 || nh != 1) {
+      y_error("sub-apertures must have the same size for \"wcog\"");
+    }
+    wgt = ygeta_d(1, &nwgt, dims);
+    if (dims[0] != 2 || dims[1] != wptr[0] || dims[2] != hptr[0]) {
+      y_error("weights must be a WIDTH-by-HEIGHT array");
+    }
+  }
+  nthreads = get_int(0);
+
+  /* Push the object (so that it is released in case of errors) and
+     initialize it. */
+  ctr = (centroider_t*)push_stage(&centroider_class, sizeof(centroider_t));
+  ctr->nsubs = nsubs;
+  ctr->method = code;
+  ctr->threshold = (float)threshold;
+  ctr->x0 = (long*)p_malloc(4*nsubs*sizeof(long));
+  ctr->y0 = ctr->x0 + nsubs;
+  ctr->w = ctr->y0 + nsubs;
+  ctr->h = ctr->w + nsubs;
+  ctr->wmax = 0;
+  for (k = 0; k < nsubs; ++k) {
+    ctr->x0[k] = xpos[k] - 1;
+    ctr->y0[k] = ypos[k] - 1;
+    ctr->w[k] = wptr[nw > 1 ? k : 0];
+    ctr->h[k] = hptr[nh > 1 ? k : 0];
+    if (ctr->x0[k] < 0 || ctr->y0[k] < 0 || ctr->w[k] < 1 || ctr->h[k] < 1) {
+      y_error("invalid sub-aperture position or size");
+    }
+    if (ctr->w[k] > ctr->wmax) ctr->wmax = ctr->w[k];
+  }
+  if (wgt != NULL) {
+    ctr->weights = (float*)p_malloc(nwgt*sizeof(float));
+    for (k = 0; k < nwgt; ++k) {
+      ctr->weights[k] = (float)wgt[k];
+    }
+  }
+  ctr->slopes = (double*)p_malloc(3*nsubs*sizeof(double));
+  ctr->flux = ctr->slopes + 2*nsubs;
+  centroider_reset(&ctr->base);
+  ctr->workers = new_workers(nthreads);
+  if (ctr->workers == NULL) y_error("insufficient memory");
+  ctr->work = (float*)p_malloc(ctr->workers->nthreads*ctr->wmax*sizeof(float));
+}
+
+/*---------------------------------------------------------------------------*/
+/* SPARSE EVENT EXTRACTION */
+
+/* For photon counting, only the pixels above a given threshold are of
+   interest.  Each row is decoded and compared to the thresholds, the indices
+   of the selected pixels are collected in a branchless loop (so that the
+   comparison can be vectorized) and the few selected pixels are then appended
+   to the list of events.  Events are stored as (x, y, value, frame)
+   quadruplets. */
+
+typedef struct _event_extractor event_extractor_t;
+struct _event_extractor {
+  stage_t base;
+  long width, height;   /* Dimensions of the threshold map (0 if scalar). */
+  float threshold;      /* Threshold if scalar. */
+  float* map;           /* Threshold map or workspace for a scalar
+                           threshold (one row). */
+  float* row;           /* Workspace for a decoded row. */
+  int* index;           /* Workspace for the indices of selected pixels. */
+  long rowlen;          /* Length of workspaces. */
+  long* events;         /* List of events (malloc'ed). */
+  long count;           /* Number of events. */
+  long capacity;        /* Maximum number of events in the list. */
+  long maxcount;        /* Maximum number of events to store. */
+  long lost;            /* Number of events not stored. */
+};
+
+static void
+event_extractor_setup(stage_t* stage, const camera_t* cam)
+{
+  event_extractor_t* ext = (event_extractor_t*)stage;
+  long x;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for event extraction");
+  }
+  if (ext->width > 0 && (ext->width != cam->frame_width ||
+                         ext->height != cam->frame_height)) {
+    y_error("threshold map and frames have different dimensions");
+  }
+  if (ext->rowlen < cam->frame_width) {
+    /* (Re)allocate workspaces, taking care of interrupts. */
+    void* ptr = ext->row;
+    ext->row = NULL;
+    ext->index = NULL;
+    ext->rowlen = 0;
+    if (ptr != NULL) p_free(ptr);
+    ptr = p_malloc(cam->frame_width*(sizeof(float) + sizeof(int)));
+    ext->row = (float*)ptr;
+    ext->index = (int*)(ext->row + cam->frame_width);
+    ext->rowlen = cam->frame_width;
+  }
+  if (ext->width == 0) {
+    /* Expand the scalar threshold to a full row. */
+    void* ptr = ext->map;
+    ext->map = NULL;
+    if (ptr != NULL) p_free(ptr);
+    ext->map = (float*)p_malloc(cam->frame_width*sizeof(float));
+    for (x = 0; x < cam->frame_width; ++x) {
+      ext->map[x] = ext->threshold;
+    }
+  }
+}
+
+/* Make room for at least N more events, returning the number of events which
+   can be stored. */
+static long
+event_extractor_reserve(event_extractor_t* ext, long n)
+{
+  long capacity;
+  void* ptr;
+
+  if (ext->count + n > ext->maxcount) {
+    n = ext->maxcount - ext->count;
+  }
+  if (ext->count + n > ext->capacity) {
+    capacity = 2*ext->capacity;
+    if (capacity < ext->count + n) capacity = ext->count + n;
+    if (capacity < 1024) capacity = 1024;
+    if (capacity > ext->maxcount) capacity = ext->maxcount;
+    ptr = realloc(ext->events, 4*capacity*sizeof(long));
+    if (ptr == NULL) {
+      n = ext->capacity - ext->count;
+    } else {
+      ext->events = (long*)ptr;
+      ext->capacity = capacity;
+    }
+  }
+  return n;
+}
+
+static int
+event_extractor_process(stage_t* stage, const camera_t* cam,
+                        const unsigned char* frame)
+{
+  event_extractor_t* ext = (event_extractor_t*)stage;
+  const float* thr;
+  const float* row = ext->row;
+  const uint32_t* raw;
+  int* index = ext->index;
+  long* ev;
+  long x, y, k, n, m, width, height, number;
+
+  width = cam->frame_width;
+  height = cam->frame_height;
+  number = stage->frames + 1;
+  for (y = 0; y < height; ++y) {
+    decode_span(cam->encoding, frame + y*cam->row_stride, 0, width,
+                ext->row);
+    /* Values above 2^24 are not exact as floats, take them from the raw
+       Mono32 row. */
+    raw = (cam->encoding == ENCODING_Mono32 ?
+           (const uint32_t*)(frame + y*cam->row_stride) : NULL);
+    thr = ext->map + (ext->width > 0 ? y*width : 0);
+    n = 0;
+    for (x = 0; x < width; ++x) {
+      index[n] = x;
+      n += (row[x] > thr[x]);
+    }
+    if (n > 0) {
+      m = event_extractor_reserve(ext, n);
+      ev = ext->events + 4*ext->count;
+      for (k = 0; k < m; ++k) {
+        ev[0] = index[k] + 1;
+        ev[1] = y + 1;
+        ev[2] = (raw != NULL ? (long)raw[index[k]] : (long)row[index[k]]);
+        ev[3] = number;
+        ev += 4;
+      }
+      ext->count += m;
+      ext->lost += n - m;
+    }
+  }
+  return TRUE;
+}
+
+static void
+event_extractor_reset(stage_t* stage)
+{
+  event_extractor_t* ext = (event_extractor_t*)stage;
+  ext->count = 0;
+  ext->lost = 0;
+}
+
+static void
+event_extractor_eval(stage_t* stage, int argc)
+{
+  event_extractor_t* ext = (event_extractor_t*)stage;
+  long dims[3];
+  if (ext->count > 0) {
+    dims[0] = 2;
+    dims[1] = 4;
+    dims[2] = ext->count;
+    memcpy(ypush_l(dims), ext->events, 4*ext->count*sizeof(long));
+  } else {
+    push_nil();
+  }
+}
+
+static int
+event_extractor_extract(stage_t* stage, const char* name)
+{
+  event_extractor_t* ext = (event_extractor_t*)stage;
+  if (strcmp(name, "count") == 0) {
+    push_long(ext->count);
+  } else if (strcmp(name, "lost") == 0) {
+    push_long(ext->lost);
+  } else if (strcmp(name, "maxcount") == 0) {
+    push_long(ext->maxcount);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+event_extractor_free(stage_t* stage)
+{
+  event_extractor_t* ext = (event_extractor_t*)stage;
+  if (ext->map != NULL) p_free(ext->map);
+  if (ext->row != NULL) p_free(ext->row);
+  if (ext->events != NULL) free(ext->events);
+}
+
+static stage_class_t event_extractor_class = {
+  "Andor event extractor",
+  event_extractor_setup,
+  event_extractor_process,
+  event_extractor_reset,
+  event_extractor_eval,
+  event_extractor_extract,
+  event_extractor_free
+};
+
+void
+Y__andor_event_extractor(int argc)
+{
+  event_extractor_t* ext;
+  const double* thr;
+  long k, ntot, maxcount, dims[Y_DIMSIZE];
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  thr = ygeta_d(1, &ntot, dims);
+  if (dims[0] != 0 && dims[0] != 2) {
+    y_error("threshold must be a scalar or a WIDTH-by-HEIGHT array");
+  }
+  maxcount = get_long(0);
+  if (maxcount <= 0 || maxcount > LONG_MAX/(4*sizeof(long))) {
+    maxcount = LONG_MAX/(4*sizeof(long));
+  }
+  ext = (event_extractor_t*)push_stage(&event_extractor_class,
+                                       sizeof(event_extractor_t));
+  ext->maxcount = maxcount;
+  if (dims[0] == 2) {
+    ext->width = dims[1];
+    ext->height = dims[2];
+    ext->map = (float*)p_malloc(ntot*sizeof(float));
+    for (k = 0; k < ntot; ++k) {
+      ext->map[k] = (float)thr[k];
+    }
+  } else {
+    ext->threshold = (float)thr[0];
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* LUCKY IMAGING */
+
+/* The lucky imaging selector keeps the K best frames according to a
+   sharpness metric computed on the fly.  The retained frames are stored in
+   their raw form and managed as a min-heap (the root is the worst retained
+   frame), so each new frame is compared to the root and, if better, replaces
+   it.  Memory is thus bounded by K raw frames. */
+
+#define LUCKY_PEAK     0 /* Peak intensity over total intensity. */
+#define LUCKY_GRADIENT 1 /* Gradient energy over squared total intensity. */
+
+typedef struct _lucky_entry lucky_entry_t;
+struct _lucky_entry {
+  double metric;        /* Sharpness of the frame. */
+  long number;          /* 1-based number of the frame. */
+  long slot;            /* Index of the raw frame in the storage. */
+};
+
+typedef struct _lucky_selector lucky_selector_t;
+struct _lucky_selector {
+  stage_t base;
+  long k;               /* Maximum number of retained frames. */
+  long count;           /* Number of retained frames. */
+  int metric;           /* Sharpness metric. */
+  lucky_entry_t* heap;  /* Min-heap of retained frames. */
+  unsigned char* data;  /* Storage for the raw frames. */
+  float* work;          /* Workspace for 2 decoded rows. */
+  int encoding;         /* Format of the stored frames. */
+  long width, height, stride, size;
+};
+
+static void
+lucky_selector_reset(stage_t* stage)
+{
+  ((lucky_selector_t*)stage)->count = 0;
+}
+
+static void
+lucky_selector_setup(stage_t* stage, const camera_t* cam)
+{
+  lucky_selector_t* sel = (lucky_selector_t*)stage;
+  void* ptr;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for lucky imaging");
+  }
+  if (sel->data != NULL && sel->size == cam->frame_size &&
+      sel->encoding == cam->encoding && sel->width == cam->frame_width &&
+      sel->height == cam->frame_height && sel->stride == cam->row_stride) {
+    /* Same format, keep the retained frames. */
+    return;
+  }
+  lucky_selector_reset(stage);
+  ptr = sel->data;
+  sel->data = NULL;
+  sel->size = 0;
+  if (ptr != NULL) p_free(ptr);
+  ptr = sel->work;
+  sel->work = NULL;
+  if (ptr != NULL) p_free(ptr);
+  sel->data = (unsigned char*)p_malloc(sel->k*cam->frame_size);
+  sel->work = (float*)p_malloc(2*cam->frame_width*sizeof(float));
+  sel->encoding = cam->encoding;
+  sel->width = cam->frame_width;
+  sel->height = cam->frame_height;
+  sel->stride = cam->row_stride;
+  sel->size = cam->frame_size;
+}
+
+static double
+lucky_selector_metric(lucky_selector_t* sel, const unsigned char* frame)
+{
+  float* row = sel->work;
+  float* prev = sel->work + sel->width;
+  float* tmp;
+  double sum, peak, energy, rs, re, d;
+  long x, y, width = sel->width;
+  float rp;
+
+  sum = peak = energy = 0.0;
+  for (y = 0; y < sel->height; ++y) {
+    decode_span(sel->encoding, frame + y*sel->stride, 0, width, row);
+    rs = 0.0;
+    for (x = 0; x < width; ++x) {
+      rs += row[x];
+    }
+    sum += rs;
+    if (sel->metric == LUCKY_PEAK) {
+      rp = row[0];
+      for (x = 1; x < width; ++x) {
+        rp = (row[x] > rp ? row[x] : rp);
+      }
+      if (rp > peak) peak = rp;
+    } else {
+      re = 0.0;
+      for (x = 1; x < width; ++x) {
+        d = row[x] - row[x-1];
+        re += d*d;
+      }
+      if (y > 0) {
+        for (x = 0; x < width; ++x) {
+          d = row[x] - prev[x];
+          re += d*d;
+        }
+      }
+      energy += re;
+      tmp = prev;
+      prev = row;
+      row = tmp;
+    }
+  }
+  if (sum <= 0.0) {
+    return 0.0;
+  }
+  return (sel->metric == LUCKY_PEAK ? peak/sum : energy/(sum*sum));
+}
+
+static int
+lucky_selector_process(stage_t* stage, const camera_t* cam,
+                       const unsigned char* frame)
+{
+  lucky_selector_t* sel = (lucky_selector_t*)stage;
+  lucky_entry_t* heap = sel->heap;
+  lucky_entry_t entry;
+  double metric;
+  long i, j, n;
+
+  metric = lucky_selector_metric(sel, frame);
+  if (sel->count < sel->k) {
+    /* Heap not yet full: store the frame in the next free slot and sift it
+       up. */
+    entry.slot = sel->count;
+    i = sel->count++;
+    while (i > 0 && heap[(i - 1)/2].metric > metric) {
+      heap[i] = heap[(i - 1)/2];
+      i = (i - 1)/2;
+    }
+  } else if (metric > heap[0].metric) {
+    /* Replace the worst retained frame and sift it down. */
+    entry.slot = heap[0].slot;
+    n = sel->count;
+    i = 0;
+    while ((j = 2*i + 1) < n) {
+      if (j + 1 < n && heap[j+1].metric < heap[j].metric) ++j;
+      if (heap[j].metric >= metric) break;
+      heap[i] = heap[j];
+      i = j;
+    }
+  } else {
+    return TRUE;
+  }
+  entry.metric = metric;
+  entry.number = stage->frames + 1;
+  heap[i] = entry;
+  memcpy(sel->data + entry.slot*sel->size, frame, sel->size);
+  return TRUE;
+}
+
+/* Get the indices of the retained frames sorted by decreasing sharpness,
+   the result is stored in a scratch buffer. */
+static long*
+lucky_selector_order(lucky_selector_t* sel)
+{
+  long* order;
+  long i, j, t;
+
+  order = (long*)ypush_scratch(sel->k*sizeof(long), NULL);
+  for (i = 0; i < sel->count; ++i) {
+    t = i;
+    for (j = i; j > 0 && sel->heap[order[j-1]].metric < sel->heap[t].metric;
+         --j) {
+      order[j] = order[j-1];
+    }
+    order[j] = t;
+  }
+  return order;
+}
+
+static void
+lucky_selector_eval(stage_t* stage, int argc)
+{
+  lucky_selector_t* sel = (lucky_selector_t*)stage;
+  const unsigned char* frame;
+  const long* order;
+  float* dst;
+  long dims[4], k, y;
+
+  if (sel->count < 1) {
+    push_nil();
+    return;
+  }
+  order = lucky_selector_order(sel);
+  dims[0] = 3;
+  dims[1] = sel->width;
+  dims[2] = sel->height;
+  dims[3] = sel->count;
+  dst = ypush_f(dims);
+  for (k = 0; k < sel->count; ++k) {
+    frame = sel->data + sel->heap[order[k]].slot*sel->size;
+    for (y = 0; y < sel->height; ++y) {
+      decode_span(sel->encoding, frame + y*sel->stride, 0, sel->width, dst);
+      dst += sel->width;
+    }
+  }
+}
+
+static int
+lucky_selector_extract(stage_t* stage, const char* name)
+{
+  lucky_selector_t* sel = (lucky_selector_t*)stage;
+  const long* order;
+  long dims[2], k;
+  int metrics;
+
+  if ((metrics = (strcmp(name, "metrics") == 0)) ||
+      strcmp(name, "numbers") == 0) {
+    if (sel->count < 1) {
+      push_nil();
+      return TRUE;
+    }
+    order = lucky_selector_order(sel);
+    dims[0] = 1;
+    dims[1] = sel->count;
+    if (metrics) {
+      double* dst = ypush_d(dims);
+      for (k = 0; k < sel->count; ++k) {
+        dst[k] = sel->heap[order[k]].metric;
+      }
+    } else {
+      long* dst = ypush_l(dims);
+      for (k = 0; k < sel->count; ++k) {
+        dst[k] = sel->heap[order[k]].number;
+      }
+    }
+  } else if (strcmp(name, "count") == 0) {
+    push_long(sel->count);
+  } else if (strcmp(name, "k") == 0) {
+    push_long(sel->k);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+lucky_selector_free(stage_t* stage)
+{
+  lucky_selector_t* sel = (lucky_selector_t*)stage;
+  if (sel->heap != NULL) p_free(sel->heap);
+  if (sel->data != NULL) p_free(sel->data);
+  if (sel->work != NULL) p_free(sel->work);
+}
+
+static stage_class_t lucky_selector_class = {
+  "Andor lucky imaging selector",
+  lucky_selector_setup,
+  lucky_selector_process,
+  lucky_selector_reset,
+  lucky_selector_eval,
+  lucky_selector_extract,
+  lucky_selector_free
+};
+
+void
+Y__andor_lucky_selector(int argc)
+{
+  lucky_selector_t* sel;
+  const char* metric;
+  long k;
+  int code;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  k = get_long(1);
+  if (k < 1) y_error("number of frames to retain must be >= 1");
+  metric = get_string(0);
+  if (metric == NULL || strcmp(metric, "peak") == 0) {
+    code = LUCKY_PEAK;
+  } else if (strcmp(metric, "gradient") == 0) {
+    code = LUCKY_GRADIENT;
+  } else {
+    y_error("unknown sharpness metric");
+    return;
+  }
+  sel = (lucky_selector_t*)push_stage(&lucky_selector_class,
+                                      sizeof(lucky_selector_t));
+  sel->k = k;
+  sel->metric = code;
+  sel->encoding = -1;
+  sel->heap = (lucky_entry_t*)p_malloc(k*sizeof(lucky_entry_t));
+}
+
+/*---------------------------------------------------------------------------*/
+/* SHIFT-AND-ADD */
+
+/* The shift-and-add stage estimates the position of the brightest feature
+   (peak or centroid) in a reference window of each frame and adds the frame,
+   shifted so that this feature stays at the position it had in the first
+   frame, into an oversampled accumulator.  A shift of the oversampled grid
+   is an integer (nearest) shift or a bilinear shift which is split in 4
+   weighted integer shifts.  Each integer shift is applied row by row with a
+   precomputed column map. */
+
+#define SHIFT_AND_ADD_PEAK      0
+#define SHIFT_AND_ADD_CENTROID  1
+
+typedef struct _shift_and_add shift_and_add_t;
+struct _shift_and_add {
+  stage_t base;
+  int method;           /* Position estimator. */
+  int bilinear;         /* Bilinear or integer shifts? */
+  long ovs;             /* Oversampling factor. */
+  long window[4];       /* Reference window (0-based, inclusive), all -1 for
+                           the full frame. */
+  long xmin, xmax, ymin, ymax; /* Window clipped to the frame. */
+  long width, height;   /* Dimensions of the frames. */
+  long acc_width;       /* Width of the accumulator (WIDTH*OVS). */
+  long acc_height;      /* Height of the accumulator (HEIGHT*OVS). */
+  double xref, yref;    /* Reference position. */
+  double xoff, yoff;    /* Last applied shift (in frame pixels). */
+  float* image;         /* Decoded frame. */
+  long* xmap;           /* Column map. */
+  double* sum;          /* Accumulated sum. */
+  double* wgt;          /* Accumulated weights. */
+};
+
+static void
+shift_and_add_reset(stage_t* stage)
+{
+  shift_and_add_t* saa = (shift_and_add_t*)stage;
+  long n = saa->acc_width*saa->acc_height;
+  if (saa->sum != NULL) memset(saa->sum, 0, n*sizeof(double));
+  if (saa->wgt != NULL) memset(saa->wgt, 0, n*sizeof(double));
+}
+
+static void
+shift_and_add_setup(stage_t* stage, const camera_t* cam)
+{
+  shift_and_add_t* saa = (shift_and_add_t*)stage;
+  long n;
+  void* ptr;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for shift-and-add");
+  }
+  saa->xmin = (saa->window[0] >= 0 ? saa->window[0] : 0);
+  saa->xmax = (saa->window[1] >= 0 ? saa->window[1] : cam->frame_width - 1);
+  saa->ymin = (saa->window[2] >= 0 ? saa->window[2] : 0);
+  saa->ymax = (saa->window[3] >= 0 ? saa->window[3] : cam->frame_height - 1);
+  if (saa->xmax >= cam->frame_width || saa->ymax >= cam->frame_height ||
+      saa->xmin > saa->xmax || saa->ymin > saa->ymax) {
+    y_error("reference window outside the frame");
+  }
+  if (saa->sum != NULL && saa->width == cam->frame_width &&
+      saa->height == cam->frame_height) {
+    /* Same dimensions, keep the accumulated data. */
+    return;
+  }
+  ptr = saa->sum;
+  saa->image = NULL;
+  saa->xmap = NULL;
+  saa->sum = NULL;
+  saa->wgt = NULL;
+  saa->width = saa->height = 0;
+  saa->acc_width = saa->acc_height = 0;
+  if (ptr != NULL) p_free(ptr);
+  saa->acc_width = cam->frame_width*saa->ovs;
+  saa->acc_height = cam->frame_height*saa->ovs;
+  n = saa->acc_width*saa->acc_height;
+  ptr = p_malloc(2*n*sizeof(double) + saa->acc_width*sizeof(long) +
+                 cam->frame_width*cam->frame_height*sizeof(float));
+  saa->sum = (double*)ptr;
+  saa->wgt = saa->sum + n;
+  saa->xmap = (long*)(saa->wgt + n);
+  saa->image = (float*)(saa->xmap + saa->acc_width);
+  saa->width = cam->frame_width;
+  saa->height = cam->frame_height;
+  stage->frames = 0;
+  shift_and_add_reset(stage);
+}
+
+/* Floor of A/B for B > 0. */
+static long
+floor_div(long a, long b)
+{
+  return (a >= 0 ? a/b : -((b - 1 - a)/b));
+}
+
+/* Add the decoded frame with weight W, the frame being shifted by (SX,SY)
+   pixels of the oversampled grid. */
+static void
+shift_and_add_deposit(shift_and_add_t* saa, long sx, long sy, double w)
+{
+  long* xmap = saa->xmap;
+  const float* src;
+  double* sum;
+  double* wgt;
+  long x, y, xlo, xhi, ylo, yhi, ovs = saa->ovs;
+
+  /* Range of columns and rows of the accumulator covered by the shifted
+     frame. */
+  xlo = (sx > 0 ? sx : 0);
+  xhi = saa->width*ovs + sx;
+  if (xhi > saa->acc_width) xhi = saa->acc_width;
+  ylo = (sy > 0 ? sy : 0);
+  yhi = saa->height*ovs + sy;
+  if (yhi > saa->acc_height) yhi = saa->acc_height;
+  for (x = xlo; x < xhi; ++x) {
+    xmap[x] = floor_div(x - sx, ovs);
+  }
+  for (y = ylo; y < yhi; ++y) {
+    src = saa->image + floor_div(y - sy, ovs)*saa->width;
+    sum = saa->sum + y*saa->acc_width;
+    wgt = saa->wgt + y*saa->acc_width;
+    for (x = xlo; x < xhi; ++x) {
+      sum[x] += w*src[xmap[x]];
+      wgt[x] += w;
+    }
+  }
+}
+
+static int
+shift_and_add_process(stage_t* stage, const camera_t* cam,
+                      const unsigned char* frame)
+{
+  shift_and_add_t* saa = (shift_and_add_t*)stage;
+  const float* row;
+  double s, sx, sy, xpos, ypos, dx, dy, fx, fy;
+  float peak;
+  long x, y, ix, iy;
+
+  for (y = 0; y < saa->height; ++y) {
+    decode_span(cam->encoding, frame + y*cam->row_stride, 0, saa->width,
+                saa->image + y*saa->width);
+  }
+
+  /* Estimate the position of the feature in the reference window. */
+  xpos = saa->xmin;
+  ypos = saa->ymin;
+  if (saa->method == SHIFT_AND_ADD_PEAK) {
+    peak = saa->image[saa->ymin*saa->width + saa->xmin];
+    for (y = saa->ymin; y <= saa->ymax; ++y) {
+      row = saa->image + y*saa->width;
+      for (x = saa->xmin; x <= saa->xmax; ++x) {
+        if (row[x] > peak) {
+          peak = row[x];
+          xpos = x;
+          ypos = y;
+        }
+      }
+    }
+  } else {
+    s = sx = sy = 0.0;
+    for (y = saa->ymin; y <= saa->ymax; ++y) {
+      row = saa->image + y*saa->width;
+      for (x = saa->xmin; x <= saa->xmax; ++x) {
+        s += row[x];
+        sx += x*row[x];
+        sy += y*row[x];
+      }
+    }
+    if (s > 0.0) {
+      xpos = sx/s;
+      ypos = sy/s;
+    } else {
+      xpos = 0.5*(saa->xmin + saa->xmax);
+      ypos = 0.5*(saa->ymin + saa->ymax);
+    }
+  }
+  if (stage->frames == 0) {
+    saa->xref = xpos;
+    saa->yref = ypos;
+  }
+
+  /* Shift in pixels of the oversampled grid. */
+  saa->xoff = saa->xref - xpos;
+  saa->yoff = saa->yref - ypos;
+  dx = saa->xoff*saa->ovs;
+  dy = saa->yoff*saa->ovs;
+  if (saa->bilinear) {
+    ix = (long)floor(dx);
+    iy = (long)floor(dy);
+    fx = dx - ix;
+    fy = dy - iy;
+    shift_and_add_deposit(saa, ix,     iy,     (1.0 - fx)*(1.0 - fy));
+    if (fx > 0.0) {
+      shift_and_add_deposit(saa, ix + 1, iy,     fx*(1.0 - fy));
+    }
+    if (fy > 0.0) {
+      shift_and_add_deposit(saa, ix,     iy + 1, (1.0 - fx)*fy);
+    }
+    if (fx > 0.0 && fy > 0.0) {
+      shift_and_add_deposit(saa, ix + 1, iy + 1, fx*fy);
+    }
+  } else {
+    shift_and_add_deposit(saa, (long)floor(dx + 0.5), (long)floor(dy + 0.5),
+                          1.0);
+  }
+  return TRUE;
+}
+
+static void
+shift_and_add_eval(stage_t* stage, int argc)
+{
+  shift_and_add_t* saa = (shift_and_add_t*)stage;
+  double* dst;
+  long dims[3], k, n;
+
+  if (saa->sum == NULL) {
+    push_nil();
+    return;
+  }
+  dims[0] = 2;
+  dims[1] = saa->acc_width;
+  dims[2] = saa->acc_height;
+  dst = ypush_d(dims);
+  n = saa->acc_width*saa->acc_height;
+  for (k = 0; k < n; ++k) {
+    dst[k] = (saa->wgt[k] > 0.0 ? saa->sum[k]/saa->wgt[k] : 0.0);
+  }
+}
+
+static int
+shift_and_add_extract(stage_t* stage, const char* name)
+{
+  shift_and_add_t* saa = (shift_and_add_t*)stage;
+  double* src;
+  long dims[3];
+
+  if ((src = (strcmp(name, "sum") == 0 ? saa->sum :
+              strcmp(name, "weights") == 0 ? saa->wgt : NULL)) != NULL) {
+    dims[0] = 2;
+    dims[1] = saa->acc_width;
+    dims[2] = saa->acc_height;
+    memcpy(ypush_d(dims), src, dims[1]*dims[2]*sizeof(double));
+  } else if (strcmp(name, "shift") == 0) {
+    dims[0] = 1;
+    dims[1] = 2;
+    src = ypush_d(dims);
+    src[0] = saa->xoff;
+    src[1] = saa->yoff;
+  } else if (strcmp(name, "oversampling") == 0) {
+    push_long(saa->ovs);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+shift_and_add_free(stage_t* stage)
+{
+  shift_and_add_t* saa = (shift_and_add_t*)stage;
+  if (saa->sum != NULL) p_free(saa->sum);
+}
+
+static stage_class_t shift_and_add_class = {
+  "Andor shift-and-add accumulator",
+  shift_and_add_setup,
+  shift_and_add_process,
+  shift_and_add_reset,
+  shift_and_add_eval,
+  shift_and_add_extract,
+  shift_and_add_free
+};
+
+void
+Y__andor_shift_and_add(int argc)
+{
+  shift_and_add_t* saa;
+  const char* method;
+  const char* shift;
+  const long* win;
+  long ntot, ovs, k;
+  int code, bilinear;
+
+  if (argc != 4) y_error("expecting exactly 4 arguments");
+  method = get_string(3);
+  if (method == NULL || strcmp(method, "peak") == 0) {
+    code = SHIFT_AND_ADD_PEAK;
+  } else if (strcmp(method, "centroid") == 0) {
+    code = SHIFT_AND_ADD_CENTROID;
+  } else {
+    y_error("unknown position estimator");
+    return;
+  }
+  shift = get_string(2);
+  if (shift == NULL || strcmp(shift, "integer") == 0) {
+    bilinear = FALSE;
+  } else if (strcmp(shift, "bilinear") == 0) {
+    bilinear = TRUE;
+  } else {
+    y_error("unknown type of shift");
+    return;
+  }
+  ovs = get_long(1);
+  if (ovs < 1) y_error("oversampling factor must be >= 1");
+  win = NULL;
+  if (! yarg_nil(0)) {
+    win = ygeta_l(0, &ntot, NULL);
+    if (ntot != 4) y_error("window must be [XMIN,XMAX,YMIN,YMAX]");
+    if (win[0] < 1 || win[2] < 1) y_error("invalid window");
+  }
+  saa = (shift_and_add_t*)push_stage(&shift_and_add_class,
+                                     sizeof(shift_and_add_t));
+  saa->method = code;
+  saa->bilinear = bilinear;
+  saa->ovs = ovs;
+  for (k = 0; k < 4; ++k) {
+    saa->window[k] = (win != NULL ? win[k] - 1 : -1);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* ROBUST STACKING */
+
+/* The stacker keeps the last N raw frames in a ring and combines them on
+   demand with a per-pixel median or sigma-clipped mean.  The combination is
+   done row by row: the row is decoded from every frame of the window and all
+   pixels of the row are processed at the same time, the N values of a pixel
+   being spread along the rows of the workspace.  For the median, the values
+   are sorted by applying Batcher's odd-even merge sorting network, each
+   compare-exchange being a min/max over whole rows (which vectorizes well).
+   For the sigma-clipped mean, the clipping starts from the median and the
+   median absolute deviation and the iterations are expressed as masked sums
+   over the rows. */
+
+#define STACK_MEDIAN  0
+#define STACK_SIGMA   1
+
+typedef struct _stacker stacker_t;
+struct _stacker {
+  stage_t base;
+  long n;               /* Length of the sliding window. */
+  long count;           /* Number of frames in the window. */
+  long next;            /* Index of the next slot to use. */
+  int method;           /* Combination method. */
+  int niter;            /* Number of clipping iterations. */
+  double nsigma;        /* Clipping threshold in units of sigma. */
+  unsigned char* data;  /* Storage for the raw frames. */
+  int encoding;         /* Format of the stored frames. */
+  long width, height, stride, size;
+};
+
+static void
+stacker_reset(stage_t* stage)
+{
+  stacker_t* stk = (stacker_t*)stage;
+  stk->count = 0;
+  stk->next = 0;
+}
+
+static void
+stacker_setup(stage_t* stage, const camera_t* cam)
+{
+  stacker_t* stk = (stacker_t*)stage;
+  void* ptr;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for stacking");
+  }
+  if (stk->data != NULL && stk->size == cam->frame_size &&
+      stk->encoding == cam->encoding && stk->width == cam->frame_width &&
+      stk->height == cam->frame_height && stk->stride == cam->row_stride) {
+    return;
+  }
+  stacker_reset(stage);
+  ptr = stk->data;
+  stk->data = NULL;
+  stk->size = 0;
+  if (ptr != NULL) p_free(ptr);
+  stk->data = (unsigned char*)p_malloc(stk->n*cam->frame_size);
+  stk->encoding = cam->encoding;
+  stk->width = cam->frame_width;
+  stk->height = cam->frame_height;
+  stk->stride = cam->row_stride;
+  stk->size = cam->frame_size;
+}
+
+static int
+stacker_process(stage_t* stage, const camera_t* cam,
+                const unsigned char* frame)
+{
+  stacker_t* stk = (stacker_t*)stage;
+  memcpy(stk->data + stk->next*stk->size, frame, stk->size);
+  stk->next = (stk->next + 1) % stk->n;
+  if (stk->count < stk->n) ++stk->count;
+  return TRUE;
+}
+
+/* Sort, pixel-wise, the N rows of length WIDTH stored in V. */
+static void
+sort_rows(float* v, long n, long width)
+{
+  float* a;
+  float* b;
+  float t;
+  long p, k, j, i, imax, x;
+
+  for (p = 1; p < n; p += p) {
+    for (k = p; k >= 1; k /= 2) {
+      for (j = k % p; j + k < n; j += k + k) {
+        imax = (k < n - j - k ? k : n - j - k);
+        for (i = 0; i < imax; ++i) {
+          if ((i + j)/(p + p) == (i + j + k)/(p + p)) {
+            a = v + (i + j)*width;
+            b = v + (i + j + k)*width;
+            for (x = 0; x < width; ++x) {
+              t = a[x];
+              a[x] = (b[x] < t ? b[x] : t);
+              b[x] = (b[x] < t ? t : b[x]);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+static void
+stacker_eval(stage_t* stage, int argc)
+{
+  stacker_t* stk = (stacker_t*)stage;
+  float* dst;
+  float* v;
+  float* d;
+  double* s;
+  double* c;
+  double* ss;
+  double* mean;
+  double* sdev;
+  double lo, hi, var, w;
+  long dims[3], n, k, x, y, width, slot;
+  int iter;
+
+  if (stk->count < 1) {
+    push_nil();
+    return;
+  }
+  n = stk->count;
+  width = stk->width;
+  v = (float*)ypush_scratch(2*n*width*sizeof(float) + 5*width*sizeof(double),
+                            NULL);
+  d = v + n*width;
+  s = (double*)(d + n*width);
+  c = s + width;
+  ss = c + width;
+  mean = ss + width;
+  sdev = mean + width;
+  dims[0] = 2;
+  dims[1] = stk->width;
+  dims[2] = stk->height;
+  dst = ypush_f(dims);
+  for (y = 0; y < stk->height; ++y) {
+    /* Decode the row of all frames in the window. */
+    for (k = 0; k < n; ++k) {
+      slot = (stk->next - n + k + stk->n) % stk->n;
+      decode_span(stk->encoding,
+                  stk->data + slot*stk->size + y*stk->stride, 0, width,
+                  v + k*width);
+    }
+    if (stk->method == STACK_MEDIAN) {
+      sort_rows(v, n, width);
+      if ((n & 1L) != 0L) {
+        memcpy(dst, v + (n/2)*width, width*sizeof(float));
+      } else {
+        for (x = 0; x < width; ++x) {
+          dst[x] = 0.5f*(v[(n/2 - 1)*width + x] + v[(n/2)*width + x]);
+        }
+      }
+    } else {
+      /* Start with the median and the median absolute deviation (scaled to
+         be the standard deviation for Gaussian noise) which are robust
+         against outliers, then iterate with the mean and standard deviation
+         of the values within bounds. */
+      sort_rows(v, n, width);
+      for (x = 0; x < width; ++x) {
+        mean[x] = 0.5*(v[((n - 1)/2)*width + x] + v[(n/2)*width + x]);
+      }
+      for (k = 0; k < n; ++k) {
+        for (x = 0; x < width; ++x) {
+          d[k*width + x] = fabs(v[k*width + x] - mean[x]);
+        }
+      }
+      sort_rows(d, n, width);
+      for (x = 0; x < width; ++x) {
+        sdev[x] = 1.4826*0.5*(d[((n - 1)/2)*width + x] + d[(n/2)*width + x]);
+      }
+      for (iter = 0; iter < stk->niter; ++iter) {
+        for (x = 0; x < width; ++x) {
+          s[x] = c[x] = ss[x] = 0.0;
+        }
+        for (k = 0; k < n; ++k) {
+          for (x = 0; x < width; ++x) {
+            lo = mean[x] - stk->nsigma*sdev[x];
+            hi = mean[x] + stk->nsigma*sdev[x];
+            w = (v[k*width + x] >= lo && v[k*width + x] <= hi ? 1.0 : 0.0);
+            s[x] += w*v[k*width + x];
+            ss[x] += w*v[k*width + x]*v[k*width + x];
+            c[x] += w;
+          }
+        }
+        for (x = 0; x < width; ++x) {
+          if (c[x] > 0.0) {
+            mean[x] = s[x]/c[x];
+            var = ss[x]/c[x] - mean[x]*mean[x];
+            sdev[x] = (var > 0.0 ? sqrt(var) : 0.0);
+          }
+        }
+      }
+      for (x = 0; x < width; ++x) {
+        dst[x] = (float)mean[x];
+      }
+    }
+    dst += width;
+  }
+}
+
+static int
+stacker_extract(stage_t* stage, const char* name)
+{
+  stacker_t* stk = (stacker_t*)stage;
+  if (strcmp(name, "count") == 0) {
+    push_long(stk->count);
+  } else if (strcmp(name, "n") == 0) {
+    push_long(stk->n);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+stacker_free(stage_t* stage)
+{
+  stacker_t* stk = (stacker_t*)stage;
+  if (stk->data != NULL) p_free(stk->data);
+}
+
+static stage_class_t stacker_class = {
+  "Andor robust stacker",
+  stacker_setup,
+  stacker_process,
+  stacker_reset,
+  stacker_eval,
+  stacker_extract,
+  stacker_free
+};
+
+void
+Y__andor_stacker(int argc)
+{
+  stacker_t* stk;
+  const char* method;
+  double nsigma;
+  long n;
+  int code, niter;
+
+  if (argc != 4) y_error("expecting exactly 4 arguments");
+  n = get_long(3);
+  if (n < 1) y_error("length of sliding window must be >= 1");
+  method = get_string(2);
+  if (method == NULL || strcmp(method, "median") == 0) {
+    code = STACK_MEDIAN;
+  } else if (strcmp(method, "sigma") == 0) {
+    code = STACK_SIGMA;
+  } else {
+    y_error("unknown stacking method");
+    return;
+  }
+  nsigma = get_double(1);
+  if (nsigma <= 0.0) y_error("clipping threshold must be > 0");
+  niter = get_int(0);
+  if (niter < 0) y_error("number of iterations must be >= 0");
+  stk = (stacker_t*)push_stage(&stacker_class, sizeof(stacker_t));
+  stk->n = n;
+  stk->method = code;
+  stk->nsigma = nsigma;
+  stk->niter = niter;
+  stk->encoding = -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* FAST FOURIER TRANSFORM */
+
+/* A simple radix-2 complex FFT is enough for the needs of the processing
+   stages.  Complex values are stored as pairs of doubles.  Twiddle factors
+   (N/2 complex values) and the bit-reversal permutation (N indices) are
+   precomputed by fft_setup for a given length N which must be a power of
+   2. */
+
+static int
+is_power_of_two(long n)
+{
+  return (n >= 1 && (n & (n - 1)) == 0);
+}
+
+static void
+fft_setup(long n, double* tw, long* rev)
+{
+  long i, j, k;
+  double a;
+
+  for (k = 0; k < n/2; ++k) {
+    a = -2.0*M_PI*k/n;
+    tw[2*k] = cos(a);
+    tw[2*k+1] = sin(a);
+  }
+  for (i = 0, j = 0; i < n; ++i) {
+    rev[i] = j;
+    for (k = n/2; k >= 1 && (j & k) != 0; k /= 2) {
+      j ^= k;
+    }
+    j |= k;
+  }
+}
+
+/* In-place forward FFT of the N complex values in Z. */
+static void
+fft(double* z, long n, const double* tw, const long* rev)
+{
+  long i, j, k, half, step;
+  double t, ur, ui, vr, vi, wr, wi;
+
+  for (i = 0; i < n; ++i) {
+    j = rev[i];
+    if (j > i) {
+      t = z[2*i];   z[2*i]   = z[2*j];   z[2*j]   = t;
+      t = z[2*i+1]; z[2*i+1] = z[2*j+1]; z[2*j+1] = t;
+    }
+  }
+  for (half = 1, step = n/2; half < n; half += half, step /= 2) {
+    for (i = 0; i < n; i += half + half) {
+      for (k = 0; k < half; ++k) {
+        wr = tw[2*k*step];
+        wi = tw[2*k*step+1];
+        j = i + k + half;
+        vr = z[2*j]*wr - z[2*j+1]*wi;
+        vi = z[2*j]*wi + z[2*j+1]*wr;
+        ur = z[2*(i+k)];
+        ui = z[2*(i+k)+1];
+        z[2*(i+k)]   = ur + vr;
+        z[2*(i+k)+1] = ui + vi;
+        z[2*j]   = ur - vr;
+        z[2*j+1] = ui - vi;
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* SPECKLE POWER SPECTRUM */
+
+/* The speckle stage accumulates the power spectrum of a sub-frame.  The 2-D
+   real-to-complex FFT is computed in two passes distributed among the worker
+   threads: (1) rows are transformed by pairs, two real rows being packed in
+   a single complex FFT, only the non-redundant half of the spectrum is kept;
+   (2) columns are transformed by blocks, a block of columns being first
+   copied into a contiguous workspace (for cache efficiency) and the squared
+   modulus of the result being directly added to the power spectrum. */
+
+#define SPECKLE_BLOCK 8 /* Number of columns per block. */
+
+typedef struct _speckle speckle_t;
+struct _speckle {
+  stage_t base;
+  long width, height;   /* Dimensions of the sub-frame (powers of 2). */
+  long nfreqs;          /* Number of frequencies along rows (WIDTH/2+1). */
+  long xorg, yorg;      /* Origin of the sub-frame (0-based, -1 if
+                           centered). */
+  long x0, y0;          /* Actual origin of the sub-frame. */
+  int apodize;          /* Apply a Hann window? */
+  double* wx;           /* Apodization along rows. */
+  double* wy;           /* Apodization along columns. */
+  double* twx;          /* Twiddle factors for rows. */
+  double* twy;          /* Twiddle factors for columns. */
+  long* revx;           /* Bit reversal for rows. */
+  long* revy;           /* Bit reversal for columns. */
+  double* spec;         /* Half spectrum after row FFTs (complex
+                           NFREQS-by-HEIGHT). */
+  double* psd;          /* Accumulated power spectrum (NFREQS-by-HEIGHT). */
+  double* work;         /* Per-thread workspaces. */
+  long worksize;        /* Number of doubles per thread. */
+  workers_t* workers;
+
+  /* Frame being processed. */
+  const unsigned char* frame;
+  long stride;
+  int encoding;
+};
+
+static void
+speckle_reset(stage_t* stage)
+{
+  speckle_t* spk = (speckle_t*)stage;
+  memset(spk->psd, 0, spk->nfreqs*spk->height*sizeof(double));
+}
+
+static void
+speckle_setup(stage_t* stage, const camera_t* cam)
+{
+  speckle_t* spk = (speckle_t*)stage;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for speckle processing");
+  }
+  spk->x0 = (spk->xorg >= 0 ? spk->xorg
+             : (cam->frame_width - spk->width)/2);
+  spk->y0 = (spk->yorg >= 0 ? spk->yorg
+             : (cam->frame_height - spk->height)/2);
+  if (spk->x0 < 0 || spk->x0 + spk->width > cam->frame_width ||
+      spk->y0 < 0 || spk->y0 + spk->height > cam->frame_height) {
+    y_error("speckle window outside the frame");
+  }
+}
+
+static void
+speckle_rows(void* ctx, long task, int thread)
+{
+  speckle_t* spk = (speckle_t*)ctx;
+  double* z = spk->work + thread*spk->worksize;
+  float* a = (float*)(z + 2*spk->width);
+  float* b = a + spk->width;
+  double* sa;
+  double* sb;
+  double zr, zi, nr, ni;
+  long x, k, y, n = spk->width;
+
+  /* Decode and pack two rows (the number of rows is even). */
+  y = 2*task;
+  decode_span(spk->encoding, spk->frame + (spk->y0 + y)*spk->stride,
+              spk->x0, n, a);
+  decode_span(spk->encoding, spk->frame + (spk->y0 + y + 1)*spk->stride,
+              spk->x0, n, b);
+  for (x = 0; x < n; ++x) {
+    z[2*x]   = a[x]*spk->wx[x]*spk->wy[y];
+    z[2*x+1] = b[x]*spk->wx[x]*spk->wy[y+1];
+  }
+  fft(z, n, spk->twx, spk->revx);
+
+  /* Unpack the spectra of the two real rows. */
+  sa = spk->spec + 2*y*spk->nfreqs;
+  sb = sa + 2*spk->nfreqs;
+  for (k = 0; k < spk->nfreqs; ++k) {
+    zr = z[2*k];
+    zi = z[2*k+1];
+    nr = z[2*((n - k) % n)];
+    ni = z[2*((n - k) % n)+1];
+    sa[2*k]   = 0.5*(zr + nr);
+    sa[2*k+1] = 0.5*(zi - ni);
+    sb[2*k]   = 0.5*(zi + ni);
+    sb[2*k+1] = 0.5*(nr - zr);
+  }
+}
+
+static void
+speckle_columns(void* ctx, long task, int thread)
+{
+  speckle_t* spk = (speckle_t*)ctx;
+  double* col;
+  const double* src;
+  double* psd;
+  long c, nc, k0, y, h = spk->height;
+
+  k0 = task*SPECKLE_BLOCK;
+  nc = spk->nfreqs - k0;
+  if (nc > SPECKLE_BLOCK) nc = SPECKLE_BLOCK;
+
+  /* Copy the block of columns into the workspace. */
+  for (y = 0; y < h; ++y) {
+    src = spk->spec + 2*(y*spk->nfreqs + k0);
+    for (c = 0; c < nc; ++c) {
+      col = spk->work + thread*spk->worksize + 2*c*h;
+      col[2*y]   = src[2*c];
+      col[2*y+1] = src[2*c+1];
+    }
+  }
+
+  /* Transform the columns and integrate the power spectrum. */
+  for (c = 0; c < nc; ++c) {
+    col = spk->work + thread*spk->worksize + 2*c*h;
+    fft(col, h, spk->twy, spk->revy);
+    psd = spk->psd + k0 + c;
+    for (y = 0; y < h; ++y) {
+      psd[y*spk->nfreqs] += col[2*y]*col[2*y] + col[2*y+1]*col[2*y+1];
+    }
+  }
+}
+
+static int
+speckle_process(stage_t* stage, const camera_t* cam,
+                const unsigned char* frame)
+{
+  speckle_t* spk = (speckle_t*)stage;
+  spk->frame = frame;
+  spk->stride = cam->row_stride;
+  spk->encoding = cam->encoding;
+  run_workers(spk->workers, spk->height/2, speckle_rows, spk);
+  run_workers(spk->workers, (spk->nfreqs + SPECKLE_BLOCK - 1)/SPECKLE_BLOCK,
+              speckle_columns, spk);
+  spk->frame = NULL;
+  return TRUE;
+}
+
+static void
+speckle_eval(stage_t* stage, int argc)
+{
+  speckle_t* spk = (speckle_t*)stage;
+  double* dst;
+  double q;
+  long dims[3], k, n;
+
+  dims[0] = 2;
+  dims[1] = spk->nfreqs;
+  dims[2] = spk->height;
+  dst = ypush_d(dims);
+  n = spk->nfreqs*spk->height;
+  q = (stage->frames > 0 ? 1.0/stage->frames : 0.0);
+  for (k = 0; k < n; ++k) {
+    dst[k] = q*spk->psd[k];
+  }
+}
+
+static int
+speckle_extract(stage_t* stage, const char* name)
+{
+  speckle_t* spk = (speckle_t*)stage;
+  long dims[3];
+  if (strcmp(name, "sum") == 0) {
+    dims[0] = 2;
+    dims[1] = spk->nfreqs;
+    dims[2] = spk->height;
+    memcpy(ypush_d(dims), spk->psd, dims[1]*dims[2]*sizeof(double));
+  } else if (strcmp(name, "origin") == 0) {
+    long* dst;
+    dims[0] = 1;
+    dims[1] = 2;
+    dst = ypush_l(dims);
+    dst[0] = spk->x0 + 1;
+    dst[1] = spk->y0 + 1;
+  } else if (strcmp(name, "nthreads") == 0) {
+    push_long(spk->workers != NULL ? spk->workers->nthreads : 1);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+speckle_free(stage_t* stage)
+{
+  speckle_t* spk = (speckle_t*)stage;
+  free_workers(spk->workers);
+  if (spk->wx != NULL) p_free(spk->wx);
+  if (spk->work != NULL) p_free(spk->work);
+}
+
+static stage_class_t speckle_class = {
+  "Andor speckle power spectrum accumulator",
+  speckle_setup,
+  speckle_process,
+  speckle_reset,
+  speckle_eval,
+  speckle_extract,
+  speckle_free
+};
+
+void
+Y__andor_speckle(int argc)
+{
+  speckle_t* spk;
+  const long* org;
+  long width, height, nfreqs, ntot, k, size, xorg, yorg;
+  int apodize, nthreads;
+  double* ptr;
+
+  if (argc != 5) y_error("expecting exactly 5 arguments");
+  width = get_long(4);
+  height = get_long(3);
+  if (width < 2 || height < 2 ||
+      ! is_power_of_two(width) || ! is_power_of_two(height)) {
+    y_error("dimensions of speckle window must be powers of 2");
+  }
+  xorg = yorg = -1;
+  if (! yarg_nil(2)) {
+    org = ygeta_l(2, &ntot, NULL);
+    if (ntot != 2 || org[0] < 1 || org[1] < 1) {
+      y_error("origin must be [X0,Y0] (1-based)");
+    }
+    xorg = org[0] - 1;
+    yorg = org[1] - 1;
+  }
+  apodize = get_boolean(1);
+  nthreads = get_int(0);
+
+  spk = (speckle_t*)push_stage(&speckle_class, sizeof(speckle_t));
+  nfreqs = width/2 + 1;
+  spk->width = width;
+  spk->height = height;
+  spk->nfreqs = nfreqs;
+  spk->xorg = xorg;
+  spk->yorg = yorg;
+  spk->apodize = apodize;
+
+  /* Allocate all the constant tables and the spectra at once. */
+  size = width + height + width + height + 3*nfreqs*height;
+  ptr = (double*)p_malloc(size*sizeof(double) + (width + height)*sizeof(long));
+  spk->wx = ptr;
+  spk->wy = spk->wx + width;
+  spk->twx = spk->wy + height;
+  spk->twy = spk->twx + width;
+  spk->spec = spk->twy + height;
+  spk->psd = spk->spec + 2*nfreqs*height;
+  spk->revx = (long*)(spk->psd + nfreqs*height);
+  spk->revy = spk->revx + width;
+  for (k = 0; k < width; ++k) {
+    spk->wx[k] = (apodize ? 0.5 - 0.5*cos(2.0*M_PI*(k + 0.5)/width) : 1.0);
+  }
+  for (k = 0; k < height; ++k) {
+    spk->wy[k] = (apodize ? 0.5 - 0.5*cos(2.0*M_PI*(k + 0.5)/height) : 1.0);
+  }
+  fft_setup(width, spk->twx, spk->revx);
+  fft_setup(height, spk->twy, spk->revy);
+  speckle_reset(&spk->base);
+
+  /* Per-thread workspaces: one complex row plus two decoded rows for the
+     first pass, a block of complex columns for the second pass. */
+  spk->workers = new_workers(nthreads);
+  if (spk->workers == NULL) y_error("insufficient memory");
+  spk->worksize = 2*width + width;
+  if (spk->worksize < 2*SPECKLE_BLOCK*height) {
+    spk->worksize = 2*SPECKLE_BLOCK*height;
+  }
+  spk->work = (double*)p_malloc(spk->workers->nthreads*spk->worksize*
+                                sizeof(double));
+}
+
+/*---------------------------------------------------------------------------*/
+/* BAD PIXEL CORRECTION */
+
+/* The bad pixels of a camera are replaced, in the extracted images, by the
+   median or the mean of their valid (i.e. not bad) neighbors.  The list of
+   neighbors of each bad pixel is computed once for the geometry of the
+   frames when acquisition starts (or when the orientation changes).  Table
+   FIX stores BAD_STRIDE values per bad pixel: the index of the pixel, the
+   number of valid neighbors and their offsets relative to the bad pixel.
+   Indices and offsets are those of the extracted (oriented) images. */
+
+#define BAD_STRIDE 10
+
+static void
+setup_bad_pixels(camera_t* cam)
+{
+  unsigned char* mask;
+  long* fix;
+  long width, height, k, x, y, dx, dy, n, nfix, origin, xstep, ystep;
+
+  nfix = 0;
+  width = cam->frame_width;
+  height = cam->frame_height;
+  frame_orientation(cam, &origin, &xstep, &ystep);
+  if (cam->nbad > 0 && width > 0 && height > 0) {
+    /* Build a temporary mask of the bad pixels in the frame. */
+    mask = (unsigned char*)p_malloc(width*height);
+    memset(mask, 0, width*height);
+    for (k = 0; k < cam->nbad; ++k) {
+      x = cam->bad_xy[2*k];
+      y = cam->bad_xy[2*k+1];
+      if (x < width && y < height) {
+        mask[y*width + x] = 1;
+      }
+    }
+    fix = cam->fix;
+    cam->fix = NULL;
+    if (fix != NULL) p_free(fix);
+    fix = (long*)p_malloc(BAD_STRIDE*cam->nbad*sizeof(long));
+    for (y = 0; y < height; ++y) {
+      for (x = 0; x < width; ++x) {
+        if (mask[y*width + x] == 0) {
+          continue;
+        }
+        n = 0;
+        for (dy = -1; dy <= 1; ++dy) {
+          if (y + dy < 0 || y + dy >= height) continue;
+          for (dx = -1; dx <= 1; ++dx) {
+            if (x + dx < 0 || x + dx >= width) continue;
+            if (mask[(y + dy)*width + x + dx] == 0) {
+              fix[BAD_STRIDE*nfix + 2 + n] = dy*ystep + dx*xstep;
+              ++n;
+            }
+          }
+        }
+        if (n > 0) {
+          fix[BAD_STRIDE*nfix] = origin + y*ystep + x*xstep;
+          fix[BAD_STRIDE*nfix + 1] = n;
+          ++nfix;
+        }
+      }
+    }
+    p_free(mask);
+    cam->fix = fix;
+  }
+  cam->nfix = nfix;
+}
+
+#define FUNCTION(NAME, TYPE, SUM_TYPE, ROUND)                   \
+static void                                                     \
+NAME(const camera_t* cam, TYPE* img)                            \
+{                                                               \
+  const long* fix;                                              \
+  const long* off;                                              \
+  TYPE val[8], t;                                               \
+  SUM_TYPE sum;                                                 \
+  long i, j, k, n;                                              \
+                                                                \
+  for (k = 0; k < cam->nfix; ++k) {                             \
+    fix = cam->fix + BAD_STRIDE*k;                              \
+    n = fix[1];                                                 \
+    off = fix + 2;                                              \
+    if (cam->bad_median) {                                      \
+      /* Insertion sort of the (at most 8) neighbors. */        \
+      for (i = 0; i < n; ++i) {                                 \
+        t = img[fix[0] + off[i]];                               \
+        for (j = i; j > 0 && val[j-1] > t; --j) {               \
+          val[j] = val[j-1];                                    \
+        }                                                       \
+        val[j] = t;                                             \
+      }                                                         \
+      if ((n & 1) != 0) {                                       \
+        img[fix[0]] = val[n/2];                                 \
+      } else {                                                  \
+        sum = (SUM_TYPE)val[n/2-1] + (SUM_TYPE)val[n/2];        \
+        img[fix[0]] = (TYPE)(sum/(SUM_TYPE)2);                  \
+      }                                                         \
+    } else {                                                    \
+      sum = 0;                                                  \
+      for (i = 0; i < n; ++i) {                                 \
+        sum += img[fix[0] + off[i]];                            \
+      }                                                         \
+      img[fix[0]] = (TYPE)((sum + ROUND(n))/(SUM_TYPE)n);       \
+    }                                                           \
+  }                                                             \
+}
+#define INTEGER_ROUND(n) ((n)/2)
+#define FLOAT_ROUND(n)   0
+FUNCTION(correct_bad_pixels_c, unsigned char,  unsigned long, INTEGER_ROUND)
+FUNCTION(correct_bad_pixels_s, unsigned short, unsigned long, INTEGER_ROUND)
+FUNCTION(correct_bad_pixels_i, unsigned int,   unsigned long, INTEGER_ROUND)
+FUNCTION(correct_bad_pixels_l, long,           long,          INTEGER_ROUND)
+FUNCTION(correct_bad_pixels_f, float,          double,        FLOAT_ROUND)
+FUNCTION(correct_bad_pixels_d, double,         double,        FLOAT_ROUND)
+#undef INTEGER_ROUND
+#undef FLOAT_ROUND
+#undef FUNCTION
+
+/* Correct the bad pixels in the image IMG of NTOT elements of type TYPE and
+   dimensions DIMS (which is left unchanged if it does not have the
+   dimensions of the frames). */
+static void
+correct_image(const camera_t* cam, void* img, long ntot,
+              const long dims[], int type)
+{
+  long npix, k;
+
+  if (cam->nfix <= 0) {
+    return;
+  }
+  if (dims[0] < 2 || dims[0] > 3 || dims[1]*dims[2] !=
+      cam->frame_width*cam->frame_height ||
+      dims[1] != ((cam->orientation & ORIENT_TRANSPOSE) != 0 ?
+                  cam->frame_height : cam->frame_width)) {
+    return;
+  }
+
+  /* Correct each plane of a color cube. */
+  npix = dims[1]*dims[2];
+  for (k = 0; k < ntot; k += npix) {
+    switch (type) {
+    case Y_CHAR:
+      correct_bad_pixels_c(cam, (unsigned char*)img + k);
+      break;
+    case Y_SHORT:
+      correct_bad_pixels_s(cam, (unsigned short*)img + k);
+      break;
+    case Y_INT:
+      correct_bad_pixels_i(cam, (unsigned int*)img + k);
+      break;
+    case Y_LONG:
+      correct_bad_pixels_l(cam, (long*)img + k);
+      break;
+    case Y_FLOAT:
+      correct_bad_pixels_f(cam, (float*)img + k);
+      break;
+    case Y_DOUBLE:
+      correct_bad_pixels_d(cam, (double*)img + k);
+      break;
+    }
+  }
+}
+
+/* Correct the bad pixels in the image on top of the stack. */
+static void
+correct_bad_pixels(const camera_t* cam)
+{
+  void* img;
+  long ntot, dims[Y_DIMSIZE];
+  int type;
+
+  if (cam->nfix <= 0) {
+    return;
+  }
+  img = ygeta_any(0, &ntot, dims, &type);
+  correct_image(cam, img, ntot, dims, type);
+}
+
+void
+Y__andor_set_bad_pixels(int argc)
+{
+  camera_t* cam;
+  const long* x;
+  const long* y;
+  long* xy;
+  long k, n, ny;
+  int median;
+
+  if (argc != 4) y_error("expecting exactly 4 arguments");
+  cam = get_camera(3);
+  if (yarg_nil(2) && yarg_nil(1)) {
+    x = y = NULL;
+    n = 0;
+  } else {
+    x = ygeta_l(2, &n, NULL);
+    y = ygeta_l(1, &ny, NULL);
+    if (ny != n) y_error("X and Y must have the same number of elements");
+    for (k = 0; k < n; ++k) {
+      if (x[k] < 1 || y[k] < 1) y_error("invalid bad pixel coordinates");
+    }
+  }
+  median = get_boolean(0);
+
+  /* Replace the list of bad pixels. */
+  xy = cam->bad_xy;
+  cam->bad_xy = NULL;
+  cam->nbad = 0;
+  if (xy != NULL) p_free(xy);
+  if (n > 0) {
+    xy = (long*)p_malloc(2*n*sizeof(long));
+    for (k = 0; k < n; ++k) {
+      xy[2*k] = x[k] - 1;
+      xy[2*k+1] = y[k] - 1;
+    }
+    cam->bad_xy = xy;
+    cam->nbad = n;
+  }
+  cam->bad_median = median;
+  setup_bad_pixels(cam);
+  push_nil();
+}
+
+/*---------------------------------------------------------------------------*/
+/* AUTOMATIC EXPOSURE */
+
+/* The auto-exposure stage measures, in every frame, the level of a given
+   percentile of the pixel values (by means of a histogram of AUTOEXP_BINS
+   bins) and corrects the exposure time so that this level matches a target
+   value.  The correction is applied in the logarithm of the exposure time and
+   damped: t' = t*(target/level)^(1 - damping).  To avoid runaway corrections
+   when the level is nearly zero, the ratio t'/t is restricted to
+   [1/AUTOEXP_MAX_RATIO, AUTOEXP_MAX_RATIO].  As the frames already in the
+   queue were acquired with the former exposure time, a number of frames can
+   be skipped after each change. */
+
+#define AUTOEXP_BITS      12
+#define AUTOEXP_BINS      (1 << AUTOEXP_BITS)
+#define AUTOEXP_MAX_RATIO 10.0
+
+typedef struct _auto_exposure auto_exposure_t;
+struct _auto_exposure {
+  stage_t base;
+  double target;      /* Target level. */
+  double percentile;  /* Fraction of pixels below the level. */
+  double damping;     /* Damping factor in [0,1). */
+  double tolerance;   /* Minimum relative change of the exposure time. */
+  long delay;         /* Number of frames to skip after a change. */
+  long skip;          /* Number of frames remaining to skip. */
+  double exposure;    /* Current exposure time (cached). */
+  double tmin, tmax;  /* Limits of the exposure time. */
+  double level;       /* Last measured level. */
+  long updates;       /* Number of changes of the exposure time. */
+  long errors;        /* Number of failed changes. */
+  int status;         /* Status of last change. */
+  int shift;          /* Shift to convert pixel values into bin index. */
+  unsigned long hist[AUTOEXP_BINS];
+  float* row;         /* Decoded row. */
+  long width;         /* Width of decoded row. */
+};
+
+static void
+auto_exposure_reset(stage_t* stage)
+{
+  auto_exposure_t* aex = (auto_exposure_t*)stage;
+  aex->skip = 0;
+  aex->level = 0.0;
+  aex->updates = 0;
+  aex->errors = 0;
+  aex->status = AT_SUCCESS;
+}
+
+static void
+auto_exposure_setup(stage_t* stage, const camera_t* cam)
+{
+  auto_exposure_t* aex = (auto_exposure_t*)stage;
+  float* row;
+  int code, bits;
+
+  switch (cam->encoding) {
+  case ENCODING_Mono8:        bits =  8; break;
+  case ENCODING_Mono12:
+  case ENCODING_Mono12Packed: bits = 12; break;
+  case ENCODING_Mono16:       bits = 16; break;
+  case ENCODING_Mono32:       bits = 32; break;
+  default:
+    y_error("unsupported pixel encoding for auto-exposure");
+    return;
+  }
+  aex->shift = (bits > AUTOEXP_BITS ? bits - AUTOEXP_BITS : 0);
+
+  /* Query the limits and the current value of the exposure time once. */
+  code = AT_GetFloatMin(cam->handle, L"ExposureTime", &aex->tmin);
+  if (code != AT_SUCCESS) throw("AT_GetFloatMin \"ExposureTime\"", code);
+  code = AT_GetFloatMax(cam->handle, L"ExposureTime", &aex->tmax);
+  if (code != AT_SUCCESS) throw("AT_GetFloatMax \"ExposureTime\"", code);
+  code = AT_GetFloat(cam->handle, L"ExposureTime", &aex->exposure);
+  if (code != AT_SUCCESS) throw("AT_GetFloat \"ExposureTime\"", code);
+
+  if (aex->width != cam->frame_width) {
+    row = aex->row;
+    aex->row = NULL;
+    aex->width = 0;
+    if (row != NULL) p_free(row);
+    aex->row = (float*)p_malloc(cam->frame_width*sizeof(float));
+    aex->width = cam->frame_width;
+  }
+  aex->skip = 0;
+}
+
+static int
+auto_exposure_process(stage_t* stage, const camera_t* cam,
+                      const unsigned char* frame)
+{
+  auto_exposure_t* aex = (auto_exposure_t*)stage;
+  unsigned long* hist = aex->hist;
+  const float* row = aex->row;
+  unsigned long sum, rank, bin;
+  double level, ratio, t;
+  long x, y, k, width = cam->frame_width;
+  int code, shift = aex->shift;
+
+  if (aex->skip > 0) {
+    --aex->skip;
+    return TRUE;
+  }
+
+  /* Histogram of the pixel values. */
+  memset(hist, 0, sizeof(aex->hist));
+  for (y = 0; y < cam->frame_height; ++y) {
+    decode_span(cam->encoding, frame + y*cam->row_stride, 0, width,
+                aex->row);
+    for (x = 0; x < width; ++x) {
+      /* Large 32-bit values may be rounded up to 2^32 by the decoding. */
+      bin = ((unsigned long)row[x]) >> shift;
+      ++hist[bin < AUTOEXP_BINS ? bin : AUTOEXP_BINS - 1];
+    }
+  }
+
+  /* Level of the percentile (at the center of the bin). */
+  rank = (unsigned long)(aex->percentile*(width*cam->frame_height - 1));
+  for (k = 0, sum = 0; k < AUTOEXP_BINS - 1; ++k) {
+    sum += hist[k];
+    if (sum > rank) break;
+  }
+  level = ((double)k + 0.5)*(double)(1UL << shift);
+  aex->level = level;
+
+  /* Damped correction of the exposure time. */
+  ratio = pow(aex->target/level, 1.0 - aex->damping);
+  if (ratio > AUTOEXP_MAX_RATIO) ratio = AUTOEXP_MAX_RATIO;
+  if (ratio < 1.0/AUTOEXP_MAX_RATIO) ratio = 1.0/AUTOEXP_MAX_RATIO;
+  t = aex->exposure*ratio;
+  if (t < aex->tmin) t = aex->tmin;
+  if (t > aex->tmax) t = aex->tmax;
+  if (fabs(t - aex->exposure) <= aex->tolerance*aex->exposure) {
+    return TRUE;
+  }
+  code = AT_SetFloat(cam->handle, L"ExposureTime", t);
+  aex->status = code;
+  if (code != AT_SUCCESS) {
+    ++aex->errors;
+    return TRUE;
+  }
+  /* The camera may round the exposure time. */
+  if (AT_GetFloat(cam->handle, L"ExposureTime",
+                  &aex->exposure) != AT_SUCCESS) {
+    aex->exposure = t;
+  }
+  ((camera_t*)cam)->exposure = aex->exposure; /* update cached value */
+  ++aex->updates;
+  aex->skip = aex->delay;
+  return TRUE;
+}
+
+static void
+auto_exposure_eval(stage_t* stage, int argc)
+{
+  push_double(((auto_exposure_t*)stage)->exposure);
+}
+
+static int
+auto_exposure_extract(stage_t* stage, const char* name)
+{
+  auto_exposure_t* aex = (auto_exposure_t*)stage;
+  if (strcmp(name, "exposure") == 0) {
+    push_double(aex->exposure);
+  } else if (strcmp(name, "level") == 0) {
+    push_double(aex->level);
+  } else if (strcmp(name, "target") == 0) {
+    push_double(aex->target);
+  } else if (strcmp(name, "min") == 0) {
+    push_double(aex->tmin);
+  } else if (strcmp(name, "max") == 0) {
+    push_double(aex->tmax);
+  } else if (strcmp(name, "updates") == 0) {
+    push_long(aex->updates);
+  } else if (strcmp(name, "errors") == 0) {
+    push_long(aex->errors);
+  } else if (strcmp(name, "status") == 0) {
+    push_int(aex->status);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+auto_exposure_free(stage_t* stage)
+{
+  auto_exposure_t* aex = (auto_exposure_t*)stage;
+  if (aex->row != NULL) p_free(aex->row);
+}
+
+static stage_class_t auto_exposure_class = {
+  "Andor auto-exposure controller",
+  auto_exposure_setup,
+  auto_exposure_process,
+  auto_exposure_reset,
+  auto_exposure_eval,
+  auto_exposure_extract,
+  auto_exposure_free
+};
+
+void
+Y__andor_auto_exposure(int argc)
+{
+  auto_exposure_t* aex;
+  double target, percentile, damping, tolerance;
+  long delay;
+
+  if (argc != 5) y_error("expecting exactly 5 arguments");
+  target = get_double(4);
+  percentile = get_double(3);
+  damping = get_double(2);
+  tolerance = get_double(1);
+  delay = get_long(0);
+  if (target <= 0.0) y_error("target level must be strictly positive");
+  if (percentile < 0.0 || percentile > 1.0) {
+    y_error("percentile must be in [0,1]");
+  }
+  if (damping < 0.0 || damping >= 1.0) y_error("damping must be in [0,1)");
+  if (tolerance < 0.0) y_error("tolerance must be nonnegative");
+  if (delay < 0) y_error("delay must be nonnegative");
+
+  aex = (auto_exposure_t*)push_stage(&auto_exposure_class,
+                                     sizeof(auto_exposure_t));
+  aex->target = target;
+  aex->percentile = percentile;
+  aex->damping = damping;
+  aex->tolerance = tolerance;
+  aex->delay = delay;
+  auto_exposure_reset(&aex->base);
+}
+
+/*---------------------------------------------------------------------------*/
+/* LIVE PREVIEW */
+
+/* The preview stage produces, at most every INTERVAL seconds, a small 8-bit
+   image for display: the frame is reduced by averaging blocks of
+   FACTOR-by-FACTOR pixels (incomplete blocks at the right and bottom edges
+   are dropped) and the result is linearly stretched between two percentiles
+   of its values.  Frames received in-between are ignored at the cost of
+   reading the clock. */
+
+typedef struct _preview preview_t;
+struct _preview {
+  stage_t base;
+  long width, height;       /* Requested maximum dimensions. */
+  long factor;              /* Reduction factor. */
+  long pw, ph;              /* Dimensions of the preview. */
+  double interval;          /* Minimum time between previews (seconds). */
+  double last;              /* Time of last preview. */
+  double lo, hi;            /* Percentiles for the stretch. */
+  double vmin, vmax;        /* Values mapped to 0 and 255. */
+  long count;               /* Number of previews produced. */
+  float* row;               /* Decoded row of the frame. */
+  float* sum;               /* Reduced image. */
+  float* tmp;               /* Sorted values. */
+  unsigned char* img;       /* Preview image. */
+};
+
+static double
+monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1E-9*(double)ts.tv_nsec;
+}
+
+static int
+compare_floats(const void* a, const void* b)
+{
+  float x = *(const float*)a;
+  float y = *(const float*)b;
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static void
+preview_reset(stage_t* stage)
+{
+  preview_t* pvw = (preview_t*)stage;
+  pvw->last = -HUGE_VAL;
+  pvw->count = 0;
+}
+
+static void
+preview_setup(stage_t* stage, const camera_t* cam)
+{
+  preview_t* pvw = (preview_t*)stage;
+  void* ptr;
+  long factor, fx, fy, pw, ph;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for preview");
+  }
+  fx = (cam->frame_width + pvw->width - 1)/pvw->width;
+  fy = (cam->frame_height + pvw->height - 1)/pvw->height;
+  factor = (fx > fy ? fx : fy);
+  if (factor < 1) factor = 1;
+  pw = cam->frame_width/factor;
+  ph = cam->frame_height/factor;
+
+  /* Allocate all buffers at once (the preview image is kept if its size
+     does not change). */
+  if (pvw->row == NULL || pw != pvw->pw || ph != pvw->ph ||
+      factor != pvw->factor) {
+    ptr = pvw->row;
+    pvw->row = NULL;
+    pvw->pw = 0;
+    pvw->ph = 0;
+    pvw->count = 0;
+    if (ptr != NULL) p_free(ptr);
+    ptr = p_malloc((cam->frame_width + 2*pw*ph)*sizeof(float) + pw*ph);
+    pvw->row = (float*)ptr;
+    pvw->sum = pvw->row + cam->frame_width;
+    pvw->tmp = pvw->sum + pw*ph;
+    pvw->img = (unsigned char*)(pvw->tmp + pw*ph);
+    memset(pvw->img, 0, pw*ph);
+    pvw->pw = pw;
+    pvw->ph = ph;
+    pvw->factor = factor;
+  }
+  pvw->last = -HUGE_VAL;
+}
+
+static int
+preview_process(stage_t* stage, const camera_t* cam,
+                const unsigned char* frame)
+{
+  preview_t* pvw = (preview_t*)stage;
+  const long factor = pvw->factor, pw = pvw->pw, ph = pvw->ph;
+  float* row = pvw->row;
+  float* sum;
+  double now, q, v;
+  long k, u, x, y, n;
+
+  now = monotonic_time();
+  if (now - pvw->last < pvw->interval || pw <= 0 || ph <= 0) {
+    return TRUE;
+  }
+  pvw->last = now;
+
+  /* Block averaging. */
+  memset(pvw->sum, 0, pw*ph*sizeof(float));
+  for (y = 0; y < ph*factor; ++y) {
+    decode_span(cam->encoding, frame + y*cam->row_stride, 0, pw*factor,
+                row);
+    sum = pvw->sum + (y/factor)*pw;
+    for (u = 0, x = 0; u < pw; ++u) {
+      float s = 0.0f;
+      for (k = 0; k < factor; ++k, ++x) {
+        s += row[x];
+      }
+      sum[u] += s;
+    }
+  }
+
+  /* Percentiles of the reduced image. */
+  n = pw*ph;
+  memcpy(pvw->tmp, pvw->sum, n*sizeof(float));
+  qsort(pvw->tmp, n, sizeof(float), compare_floats);
+  pvw->vmin = pvw->tmp[(long)(pvw->lo*(n - 1))];
+  pvw->vmax = pvw->tmp[(long)(pvw->hi*(n - 1))];
+
+  /* Quantization. */
+  q = (pvw->vmax > pvw->vmin ? 255.0/(pvw->vmax - pvw->vmin) : 0.0);
+  for (x = 0; x < n; ++x) {
+    v = q*(pvw->sum[x] - pvw->vmin);
+    pvw->img[x] = (v <= 0.0 ? 0 : (v >= 255.0 ? 255 :
+                                   (unsigned char)(v + 0.5)));
+  }
+  /* Values are sums of FACTOR^2 pixels. */
+  pvw->vmin /= factor*factor;
+  pvw->vmax /= factor*factor;
+  ++pvw->count;
+  return TRUE;
+}
+
+static void
+preview_eval(stage_t* stage, int argc)
+{
+  preview_t* pvw = (preview_t*)stage;
+  long dims[3];
+  if (pvw->count <= 0) {
+    push_nil();
+    return;
+  }
+  dims[0] = 2;
+  dims[1] = pvw->pw;
+  dims[2] = pvw->ph;
+  memcpy(ypush_c(dims), pvw->img, pvw->pw*pvw->ph);
+}
+
+static int
+preview_extract(stage_t* stage, const char* name)
+{
+  preview_t* pvw = (preview_t*)stage;
+  if (strcmp(name, "count") == 0) {
+    push_long(pvw->count);
+  } else if (strcmp(name, "factor") == 0) {
+    push_long(pvw->factor);
+  } else if (strcmp(name, "cmin") == 0) {
+    push_double(pvw->vmin);
+  } else if (strcmp(name, "cmax") == 0) {
+    push_double(pvw->vmax);
+  } else if (strcmp(name, "interval") == 0) {
+    push_double(pvw->interval);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+preview_free(stage_t* stage)
+{
+  preview_t* pvw = (preview_t*)stage;
+  if (pvw->row != NULL) p_free(pvw->row);
+}
+
+static stage_class_t preview_class = {
+  "Andor live preview",
+  preview_setup,
+  preview_process,
+  preview_reset,
+  preview_eval,
+  preview_extract,
+  preview_free
+};
+
+void
+Y__andor_preview(int argc)
+{
+  preview_t* pvw;
+  double interval, lo, hi;
+  long width, height;
+
+  if (argc != 5) y_error("expecting exactly 5 arguments");
+  width = get_long(4);
+  height = get_long(3);
+  interval = get_double(2);
+  lo = get_double(1);
+  hi = get_double(0);
+  if (width < 1 || height < 1) y_error("invalid preview dimensions");
+  if (! (0.0 <= lo && lo < hi && hi <= 1.0)) {
+    y_error("invalid percentiles for the preview");
+  }
+  pvw = (preview_t*)push_stage(&preview_class, sizeof(preview_t));
+  pvw->width = width;
+  pvw->height = height;
+  pvw->interval = interval;
+  pvw->lo = lo;
+  pvw->hi = hi;
+  preview_reset(&pvw->base);
+}
+
+/*---------------------------------------------------------------------------*/
+/* UP-THE-RAMP FITTING */
+
+/* The ramp stage fits, for every pixel, a straight line y = a + b*t to the
+   values of the frames of a ramp.  The frames are assumed to be regularly
+   spaced in time, t = k*dt for the k-th frame (k = 0, 1, ...) since the last
+   reset.  Only the per-pixel sums of y, t*y and y^2 are accumulated (the
+   sums of t and t^2 are the same for all pixels), so the memory needed does
+   not depend on the length of the ramp.  Rows of the frame are updated by
+   blocks of RAMP_CHUNK rows distributed among the worker threads. */
+
+#define RAMP_CHUNK 16
+
+typedef struct _ramp ramp_t;
+struct _ramp {
+  stage_t base;
+  double dt;          /* Time step between frames. */
+  double t;           /* Time of the frame being processed. */
+  double st, stt;     /* Sums of t and t^2. */
+  double* sy;         /* Per-pixel sums of y. */
+  double* sty;        /* Per-pixel sums of t*y. */
+  double* syy;        /* Per-pixel sums of y^2. */
+  long width, height; /* Dimensions of the frames. */
+  float* rows;        /* Per-thread decoded rows. */
+  workers_t* workers;
+
+  /* Frame being processed. */
+  const unsigned char* frame;
+  long stride;
+  int encoding;
+};
+
+static void
+ramp_reset(stage_t* stage)
+{
+  ramp_t* rmp = (ramp_t*)stage;
+  rmp->st = 0.0;
+  rmp->stt = 0.0;
+  if (rmp->sy != NULL) {
+    memset(rmp->sy, 0, 3*rmp->width*rmp->height*sizeof(double));
+  }
+}
+
+static void
+ramp_setup(stage_t* stage, const camera_t* cam)
+{
+  ramp_t* rmp = (ramp_t*)stage;
+  void* ptr;
+
+  if (! is_monochrome(cam->encoding)) {
+    y_error("unsupported pixel encoding for ramp fitting");
+  }
+  if (rmp->sy != NULL && rmp->width == cam->frame_width &&
+      rmp->height == cam->frame_height) {
+    /* Keep on accumulating the current ramp. */
+    return;
+  }
+  ptr = rmp->sy;
+  rmp->sy = NULL;
+  rmp->width = 0;
+  rmp->height = 0;
+  if (ptr != NULL) p_free(ptr);
+  ptr = rmp->rows;
+  rmp->rows = NULL;
+  if (ptr != NULL) p_free(ptr);
+  rmp->sy = (double*)p_malloc(3*cam->frame_width*cam->frame_height*
+                              sizeof(double));
+  rmp->sty = rmp->sy + cam->frame_width*cam->frame_height;
+  rmp->syy = rmp->sty + cam->frame_width*cam->frame_height;
+  rmp->rows = (float*)p_malloc(rmp->workers->nthreads*cam->frame_width*
+                               sizeof(float));
+  rmp->width = cam->frame_width;
+  rmp->height = cam->frame_height;
+  rmp->base.frames = 0;
+  ramp_reset(stage);
+}
+
+static void
+ramp_task(void* ctx, long task, int thread)
+{
+  ramp_t* rmp = (ramp_t*)ctx;
+  float* row = rmp->rows + thread*rmp->width;
+  double* sy;
+  double* sty;
+  double* syy;
+  double y, t = rmp->t;
+  long x, j, jmax, width = rmp->width;
+
+  j = task*RAMP_CHUNK;
+  jmax = j + RAMP_CHUNK;
+  if (jmax > rmp->height) jmax = rmp->height;
+  for (; j < jmax; ++j) {
+    decode_span(rmp->encoding, rmp->frame + j*rmp->stride, 0, width, row);
+    sy  = rmp->sy  + j*width;
+    sty = rmp->sty + j*width;
+    syy = rmp->syy + j*width;
+    for (x = 0; x < width; ++x) {
+      y = row[x];
+      sy[x]  += y;
+      sty[x] += t*y;
+      syy[x] += y*y;
+    }
+  }
+}
+
+static int
+ramp_process(stage_t* stage, const camera_t* cam,
+             const unsigned char* frame)
+{
+  ramp_t* rmp = (ramp_t*)stage;
+
+  /* The frame counter is incremented after processing. */
+  rmp->t = rmp->dt*stage->frames;
+  rmp->st += rmp->t;
+  rmp->stt += rmp->t*rmp->t;
+  rmp->frame = frame;
+  rmp->stride = cam->row_stride;
+  rmp->encoding = cam->encoding;
+  run_workers(rmp->workers, (rmp->height + RAMP_CHUNK - 1)/RAMP_CHUNK,
+              ramp_task, rmp);
+  rmp->frame = NULL;
+  return TRUE;
+}
+
+/* Push the fitted slope (SEL = 0), intercept (SEL = 1), rms residuals
+   (SEL = 2) or all of them (SEL = -1). */
+static void
+ramp_push(ramp_t* rmp, int sel)
+{
+  double* dst;
+  double n, stt, sty, syy, a, b, r;
+  long dims[4], k, npix;
+
+  if (rmp->sy == NULL) {
+    push_nil();
+    return;
+  }
+  npix = rmp->width*rmp->height;
+  dims[0] = (sel < 0 ? 3 : 2);
+  dims[1] = rmp->width;
+  dims[2] = rmp->height;
+  dims[3] = 3;
+  dst = ypush_d(dims);
+  n = (double)rmp->base.frames;
+  stt = rmp->stt - (n > 0 ? rmp->st*rmp->st/n : 0.0);
+  for (k = 0; k < npix; ++k) {
+    if (n < 2) {
+      /* Slope is undefined. */
+      b = 0.0;
+      a = (n > 0 ? rmp->sy[k]/n : 0.0);
+      r = 0.0;
+    } else {
+      sty = rmp->sty[k] - rmp->st*rmp->sy[k]/n;
+      syy = rmp->syy[k] - rmp->sy[k]*rmp->sy[k]/n;
+      b = sty/stt;
+      a = (rmp->sy[k] - b*rmp->st)/n;
+      r = syy - b*sty;
+      r = (r > 0.0 ? sqrt(r/n) : 0.0);
+    }
+    if (sel < 0) {
+      dst[k] = b;
+      dst[k + npix] = a;
+      dst[k + 2*npix] = r;
+    } else {
+      dst[k] = (sel == 0 ? b : (sel == 1 ? a : r));
+    }
+  }
+}
+
+static void
+ramp_eval(stage_t* stage, int argc)
+{
+  ramp_push((ramp_t*)stage, -1);
+}
+
+static int
+ramp_extract(stage_t* stage, const char* name)
+{
+  ramp_t* rmp = (ramp_t*)stage;
+  if (strcmp(name, "slope") == 0) {
+    ramp_push(rmp, 0);
+  } else if (strcmp(name, "intercept") == 0) {
+    ramp_push(rmp, 1);
+  } else if (strcmp(name, "residual") == 0) {
+    ramp_push(rmp, 2);
+  } else if (strcmp(name, "dt") == 0) {
+    push_double(rmp->dt);
+  } else if (strcmp(name, "nthreads") == 0) {
+    push_long(rmp->workers != NULL ? rmp->workers->nthreads : 1);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+ramp_free(stage_t* stage)
+{
+  ramp_t* rmp = (ramp_t*)stage;
+  free_workers(rmp->workers);
+  if (rmp->sy != NULL) p_free(rmp->sy);
+  if (rmp->rows != NULL) p_free(rmp->rows);
+}
+
+static stage_class_t ramp_class = {
+  "Andor up-the-ramp fitting",
+  ramp_setup,
+  ramp_process,
+  ramp_reset,
+  ramp_eval,
+  ramp_extract,
+  ramp_free
+};
+
+void
+Y__andor_ramp(int argc)
+{
+  ramp_t* rmp;
+  double dt;
+  int nthreads;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  dt = get_double(1);
+  nthreads = get_int(0);
+  if (dt <= 0.0) y_error("time step must be strictly positive");
+  rmp = (ramp_t*)push_stage(&ramp_class, sizeof(ramp_t));
+  rmp->dt = dt;
+  rmp->workers = new_workers(nthreads);
+  if (rmp->workers == NULL) y_error("insufficient memory");
+}
+
+/*---------------------------------------------------------------------------*/
+/* CHANGE DETECTION */
+
+/* The change detector compares each frame with a reference frame, computing
+   the sum of absolute differences (SAD) of the pixel values and the number
+   of pixels which differ by more than a threshold.  A frame has changed if
+   this number is at least COUNT; the reference is the last frame which has
+   changed (the first frame always has), so slow drifts are eventually
+   detected and nothing is copied while the scene is idle.  In suppress
+   mode, the frames which have not changed are not delivered (see
+   stage_class_t).  The reference is a copy of the raw pixels without the
+   padding of the rows, compared in a single pass with the raw frame by
+   integer loops simple enough to be vectorized by the compiler.  Rows are
+   processed by blocks of CHANGE_CHUNK rows distributed among the worker
+   threads, each block having its own partial results. */
+
+#define CHANGE_CHUNK 16
+
+typedef struct _change_detector change_detector_t;
+struct _change_detector {
+  stage_t base;
+  long threshold;       /* Threshold for the absolute differences. */
+  long count;           /* Minimum number of changed pixels. */
+  int suppress;         /* Suppress frames which have not changed? */
+  int valid;            /* Reference frame is valid? */
+  int encoding;         /* Pixel encoding of the frames. */
+  long width, height;   /* Dimensions of the frames. */
+  long row_size;        /* Number of bytes of the pixels of a row. */
+  unsigned char* ref;   /* Reference frame (HEIGHT rows of ROW_SIZE
+                           bytes). */
+  unsigned long* part;  /* Partial SAD and number of changed pixels, 2 per
+                           block of rows. */
+  double sad;           /* SAD of the last frame. */
+  long changed;         /* Number of changed pixels in the last frame. */
+  long changes;         /* Number of frames which have changed. */
+  long suppressed;      /* Number of suppressed frames. */
+  workers_t* workers;
+
+  /* Frame being processed. */
+  const unsigned char* frame;
+  long stride;
+};
+
+#define CHANGE_DIFF(a, b)                               \
+  do {                                                  \
+    long d_ = (long)(a) - (long)(b);                    \
+    d_ = (d_ < 0 ? -d_ : d_);                           \
+    sad += d_;                                          \
+    n += (d_ > thr);                                    \
+  } while (0)
+
+#define FUNCTION(NAME, TYPE)                                            \
+static void                                                             \
+NAME(const unsigned char* src, const unsigned char* ref, long width,    \
+     long thr, unsigned long* sad_ptr, unsigned long* n_ptr)            \
+{                                                                       \
+  const TYPE* a = (const TYPE*)src;                                     \
+  const TYPE* b = (const TYPE*)ref;                                     \
+  unsigned long sad = 0, n = 0;                                         \
+  long x;                                                               \
+  for (x = 0; x < width; ++x) {                                         \
+    CHANGE_DIFF(a[x], b[x]);                                            \
+  }                                                                     \
+  *sad_ptr += sad;                                                      \
+  *n_ptr += n;                                                          \
+}
+FUNCTION(compare_row_8,  uint8_t)
+FUNCTION(compare_row_16, uint16_t)
+FUNCTION(compare_row_32, uint32_t)
+#undef FUNCTION
+
+static void
+compare_row_12p(const unsigned char* src, const unsigned char* ref,
+                long width, long thr, unsigned long* sad_ptr,
+                unsigned long* n_ptr)
+{
+  unsigned long sad = 0, n = 0;
+  long x;
+  for (x = 0; x + 1 < width; x += 2, src += 3, ref += 3) {
+    CHANGE_DIFF(EXTRACTLOWPACKED(src), EXTRACTLOWPACKED(ref));
+    CHANGE_DIFF(EXTRACTHIGHPACKED(src), EXTRACTHIGHPACKED(ref));
+  }
+  if (x < width) {
+    CHANGE_DIFF(EXTRACTLOWPACKED(src), EXTRACTLOWPACKED(ref));
+  }
+  *sad_ptr += sad;
+  *n_ptr += n;
+}
+
+#undef CHANGE_DIFF
+
+static void
+change_detector_task(void* ctx, long task, int thread)
+{
+  change_detector_t* det = (change_detector_t*)ctx;
+  const unsigned char* src;
+  const unsigned char* ref;
+  unsigned long* part = det->part + 2*task;
+  long j, jmax;
+
+  part[0] = 0;
+  part[1] = 0;
+  j = task*CHANGE_CHUNK;
+  jmax = j + CHANGE_CHUNK;
+  if (jmax > det->height) jmax = det->height;
+  for (; j < jmax; ++j) {
+    src = det->frame + j*det->stride;
+    ref = det->ref + j*det->row_size;
+    switch (det->encoding) {
+    case ENCODING_Mono8:
+      compare_row_8(src, ref, det->width, det->threshold,
+                    &part[0], &part[1]);
+      break;
+    case ENCODING_Mono12:
+    case ENCODING_Mono16:
+      compare_row_16(src, ref, det->width, det->threshold,
+                     &part[0], &part[1]);
+      break;
+    case ENCODING_Mono32:
+      compare_row_32(src, ref, det->width, det->threshold,
+                     &part[0], &part[1]);
+      break;
+    case ENCODING_Mono12Packed:
+      compare_row_12p(src, ref, det->width, det->threshold,
+                      &part[0], &part[1]);
+      break;
+    }
+  }
+}
+
+static void
+change_detector_reset(stage_t* stage)
+{
+  change_detector_t* det = (change_detector_t*)stage;
+  det->valid = FALSE;
+  det->sad = 0.0;
+  det->changed = 0;
+  det->changes = 0;
+  det->suppressed = 0;
+}
+
+static void
+change_detector_setup(stage_t* stage, const camera_t* cam)
+{
+  change_detector_t* det = (change_detector_t*)stage;
+  void* ptr;
+  long row_size, nblocks;
+
+  switch (cam->encoding) {
+  case ENCODING_Mono8:
+    row_size = cam->frame_width;
+    break;
+  case ENCODING_Mono12:
+  case ENCODING_Mono16:
+    row_size = 2*cam->frame_width;
+    break;
+  case ENCODING_Mono32:
+    row_size = 4*cam->frame_width;
+    break;
+  case ENCODING_Mono12Packed:
+    row_size = (3*cam->frame_width + 1)/2;
+    break;
+  default:
+    y_error("unsupported pixel encoding for change detection");
+    return;
+  }
+
+  /* The reference of a previous acquisition cannot be trusted. */
+  det->valid = FALSE;
+  if (det->ref == NULL || row_size != det->row_size ||
+      cam->frame_height != det->height) {
+    ptr = det->ref;
+    det->ref = NULL;
+    det->row_size = 0;
+    det->height = 0;
+    if (ptr != NULL) p_free(ptr);
+    nblocks = (cam->frame_height + CHANGE_CHUNK - 1)/CHANGE_CHUNK;
+    ptr = p_malloc(ROUND_UP(row_size*cam->frame_height, 8) +
+                   2*nblocks*sizeof(unsigned long));
+    det->ref = (unsigned char*)ptr;
+    det->part = (unsigned long*)(det->ref +
+                                 ROUND_UP(row_size*cam->frame_height, 8));
+    det->row_size = row_size;
+    det->height = cam->frame_height;
+  }
+  det->width = cam->frame_width;
+  det->encoding = cam->encoding;
+}
+
+static int
+change_detector_process(stage_t* stage, const camera_t* cam,
+                        const unsigned char* frame)
+{
+  change_detector_t* det = (change_detector_t*)stage;
+  unsigned long sad, n;
+  long j, nblocks;
+
+  if (det->valid) {
+    nblocks = (det->height + CHANGE_CHUNK - 1)/CHANGE_CHUNK;
+    det->frame = frame;
+    det->stride = cam->row_stride;
+    run_workers(det->workers, nblocks, change_detector_task, det);
+    det->frame = NULL;
+    sad = 0;
+    n = 0;
+    for (j = 0; j < nblocks; ++j) {
+      sad += det->part[2*j];
+      n += det->part[2*j+1];
+    }
+    det->sad = (double)sad;
+    det->changed = (long)n;
+    if (det->changed < det->count) {
+      if (det->suppress) {
+        ++det->suppressed;
+        return FALSE;
+      }
+      return TRUE;
+    }
+  } else {
+    det->sad = 0.0;
+    det->changed = 0;
+  }
+
+  /* The frame has changed, it becomes the new reference. */
+  for (j = 0; j < det->height; ++j) {
+    memcpy(det->ref + j*det->row_size, frame + j*cam->row_stride,
+           det->row_size);
+  }
+  det->valid = TRUE;
+  ++det->changes;
+  return TRUE;
+}
+
+static void
+change_detector_eval(stage_t* stage, int argc)
+{
+  change_detector_t* det = (change_detector_t*)stage;
+  long dims[2];
+  double* dst;
+  dims[0] = 1;
+  dims[1] = 2;
+  dst = ypush_d(dims);
+  dst[0] = det->sad;
+  dst[1] = det->changed;
+}
+
+static int
+change_detector_extract(stage_t* stage, const char* name)
+{
+  change_detector_t* det = (change_detector_t*)stage;
+  if (strcmp(name, "sad") == 0) {
+    push_double(det->sad);
+  } else if (strcmp(name, "changed") == 0) {
+    push_long(det->changed);
+  } else if (strcmp(name, "changes") == 0) {
+    push_long(det->changes);
+  } else if (strcmp(name, "suppressed") == 0) {
+    push_long(det->suppressed);
+  } else if (strcmp(name, "threshold") == 0) {
+    push_long(det->threshold);
+  } else if (strcmp(name, "count") == 0) {
+    push_long(det->count);
+  } else if (strcmp(name, "suppress") == 0) {
+    push_int(det->suppress);
+  } else if (strcmp(name, "nthreads") == 0) {
+    push_long(det->workers != NULL ? det->workers->nthreads : 1);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+change_detector_free(stage_t* stage)
+{
+  change_detector_t* det = (change_detector_t*)stage;
+  free_workers(det->workers);
+  if (det->ref != NULL) p_free(det->ref);
+}
+
+static stage_class_t change_detector_class = {
+  "Andor change detector",
+  change_detector_setup,
+  change_detector_process,
+  change_detector_reset,
+  change_detector_eval,
+  change_detector_extract,
+  change_detector_free
+};
+
+void
+Y__andor_change_detector(int argc)
+{
+  change_detector_t* det;
+  long threshold, count;
+  int suppress, nthreads;
+
+  if (argc != 4) y_error("expecting exactly 4 arguments");
+  threshold = get_long(3);
+  count = get_long(2);
+  suppress = get_boolean(1);
+  nthreads = get_int(0);
+  if (threshold < 0) y_error("threshold must be nonnegative");
+  if (count < 1) y_error("number of changed pixels must be at least 1");
+  det = (change_detector_t*)push_stage(&change_detector_class,
+                                       sizeof(change_detector_t));
+  det->threshold = threshold;
+  det->count = count;
+  det->suppress = suppress;
+  det->workers = new_workers(nthreads);
+  if (det->workers == NULL) y_error("insufficient memory");
+}
+
+/*---------------------------------------------------------------------------*/
+/* RICE COMPRESSION */
+
+/* Rice coding of integers as in the FITS tiled image compression convention
+   (RICE_1 algorithm with blocks of RICE_BLOCK pixels, compatible with
+   CFITSIO).  Pixel values are given as unsigned integers of BBITS = 8 or 16
+   bits, the differences between successive pixels are computed modulo
+   2^BBITS, mapped to nonnegative values and coded by blocks with the number
+   of split bits chosen according to the mean value in the block. */
+
+#define RICE_BLOCK 32
+
+typedef struct _bit_writer bit_writer_t;
+struct _bit_writer {
+  unsigned char* ptr; /* Next byte to write. */
+  uint64_t acc;       /* Pending bits. */
+  int cnt;            /* Number of pending bits (less than 8 between
+                         calls). */
+};
+
+/* Append the N least significant bits (N <= 32) of VALUE. */
+static void
+put_bits(bit_writer_t* bw, unsigned long value, int n)
+{
+  bw->acc = (bw->acc << n) | (value & ((1UL << n) - 1UL));
+  bw->cnt += n;
+  while (bw->cnt >= 8) {
+    bw->cnt -= 8;
+    *bw->ptr++ = (unsigned char)(bw->acc >> bw->cnt);
+  }
+  bw->acc &= (1UL << bw->cnt) - 1UL;
+}
+
+/* Compress N pixel values of BBITS bits into DST and return the number of
+   bytes written.  At most (N*BBITS + NBLOCKS*FSBITS + BBITS + 7)/8 bytes
+   are written (with NBLOCKS the number of blocks and FSBITS <= 4). */
+static long
+rice_encode(const unsigned int* src, long n, int bbits, unsigned char* dst)
+{
+  unsigned int diff[RICE_BLOCK];
+  unsigned int mask, sign, last, v, top, psum;
+  double pixelsum, dpsum;
+  bit_writer_t bw;
+  long d, i, j, nb;
+  int fs, fsbits, fsmax;
+
+  if (bbits == 8) {
+    fsbits = 3;
+    fsmax = 6;
+  } else {
+    fsbits = 4;
+    fsmax = 14;
+  }
+  mask = (1U << bbits) - 1U;
+  sign = 1U << (bbits - 1);
+  bw.ptr = dst;
+  bw.acc = 0;
+  bw.cnt = 0;
+  if (n <= 0) {
+    return 0;
+  }
+
+  /* First pixel value is written verbatim. */
+  last = src[0] & mask;
+  put_bits(&bw, last, bbits);
+
+  for (i = 0; i < n; i += RICE_BLOCK) {
+    nb = (n - i < RICE_BLOCK ? n - i : RICE_BLOCK);
+    pixelsum = 0.0;
+    for (j = 0; j < nb; ++j) {
+      /* Difference modulo 2^BBITS, as a signed value, mapped to an
+         nonnegative value. */
+      v = src[i+j] & mask;
+      d = (long)((v - last) & mask);
+      if ((d & sign) != 0) d -= (long)mask + 1;
+      diff[j] = (unsigned int)(d < 0 ? ~(d << 1) : (d << 1)) & mask;
+      pixelsum += diff[j];
+      last = v;
+    }
+
+    /* Number of split bits. */
+    dpsum = (pixelsum - (nb/2) - 1)/nb;
+    if (dpsum < 0.0) dpsum = 0.0;
+    psum = ((unsigned int)dpsum) >> 1;
+    for (fs = 0; psum > 0; ++fs) {
+      psum >>= 1;
+    }
+
+    if (fs >= fsmax) {
+      /* High entropy block: differences are written verbatim. */
+      put_bits(&bw, fsmax + 1, fsbits);
+      for (j = 0; j < nb; ++j) {
+        put_bits(&bw, diff[j], bbits);
+      }
+    } else if (fs == 0 && pixelsum == 0.0) {
+      /* Low entropy block: all differences are zero. */
+      put_bits(&bw, 0, fsbits);
+    } else {
+      put_bits(&bw, fs + 1, fsbits);
+      for (j = 0; j < nb; ++j) {
+        /* Top bits in unary (zeros followed by a one), then the bottom FS
+           bits. */
+        top = diff[j] >> fs;
+        while (top >= 24) {
+          put_bits(&bw, 0, 24);
+          top -= 24;
+        }
+        put_bits(&bw, 1, top + 1);
+        if (fs > 0) {
+          put_bits(&bw, diff[j], fs);
+        }
+      }
+    }
+  }
+
+  /* Flush remaining bits. */
+  if (bw.cnt > 0) {
+    *bw.ptr++ = (unsigned char)(bw.acc << (8 - bw.cnt));
+  }
+  return bw.ptr - dst;
+}
+
+/*---------------------------------------------------------------------------*/
+/* FITS OUTPUT */
+
+/* Minimal support to write FITS headers.  A header is built in a buffer of
+   FITS_BLOCK bytes per block, cards are padded with spaces. */
+
+#define FITS_BLOCK 2880
+#define FITS_CARD    80
+
+static void
+fits_card(char* hdr, long* ncards, const char* fmt, ...)
+{
+  char card[FITS_CARD + 1];
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(card, sizeof(card), fmt, ap);
+  va_end(ap);
+  if (len > FITS_CARD) len = FITS_CARD;
+  memset(hdr + (*ncards)*FITS_CARD, ' ', FITS_CARD);
+  memcpy(hdr + (*ncards)*FITS_CARD, card, len);
+  ++*ncards;
+}
+
+#define FITS_LOGICAL(hdr, n, key, val, com) \
+  fits_card(hdr, n, "%-8s= %20s / %s", key, ((val) ? "T" : "F"), com)
+#define FITS_INTEGER(hdr, n, key, val, com) \
+  fits_card(hdr, n, "%-8s= %20ld / %s", key, (long)(val), com)
+#define FITS_STRING(hdr, n, key, val, com) \
+  fits_card(hdr, n, "%-8s= '%-8s' / %s", key, val, com)
+
+/* Terminate a header and return its size in bytes (a multiple of
+   FITS_BLOCK). */
+static long
+fits_end(char* hdr, long* ncards)
+{
+  long size;
+  fits_card(hdr, ncards, "END");
+  size = ROUND_UP((*ncards)*FITS_CARD, FITS_BLOCK);
+  memset(hdr + (*ncards)*FITS_CARD, ' ', size - (*ncards)*FITS_CARD);
+  return size;
+}
+
+static void
+put_int32_be(unsigned char* dst, unsigned long val)
+{
+  dst[0] = (unsigned char)(val >> 24);
+  dst[1] = (unsigned char)(val >> 16);
+  dst[2] = (unsigned char)(val >> 8);
+  dst[3] = (unsigned char)(val);
+}
+
+/*---------------------------------------------------------------------------*/
+/* LOSSLESS CODEC */
+
+/* A fast lossless codec for integer images of BITS = 8 or 16 bits per
+   pixel.  Each pixel is predicted by its left neighbor (by the pixel above
+   for the first pixel of a row, by zero for the first pixel of a tile), the
+   residuals modulo 2^BITS are mapped to nonnegative values (zig-zag
+   encoding) and packed by blocks of CODEC_BLOCK residuals.  A packed block
+   is made of one byte giving the number B of significant bits of the block
+   followed by B little-endian 32-bit words, the k-th word storing the k-th
+   bit of the 32 residuals (this layout only involves branchless loops of
+   fixed length which are easily vectorized by the compiler).
+
+   An encoded frame starts with a header of CODEC_HEADER bytes (all values
+   are little-endian):
+
+       offset  size  contents
+         0       4   magic "AZF1"
+         4       4   total size of the encoded frame in bytes
+         8       4   width
+        12       4   height
+        16       4   bits per pixel (8 or 16)
+        20       4   number of rows per tile
+        24       8   frame number (signed)
+
+   followed by the sizes of the tiles (4 bytes each) and the encoded tiles.
+   Tiles are independent, so they can be encoded or decoded in parallel. */
+
+#define CODEC_BLOCK   32
+#define CODEC_HEADER  32
+#define CODEC_MAGIC   "AZF1"
+
+/* Maximum size of an encoded tile of N pixels. */
+#define CODEC_TILE_CAP(n, bits) \
+  ((((n) + CODEC_BLOCK - 1)/CODEC_BLOCK)*(1 + 4*(bits)))
+
+static void
+put_uint32_le(unsigned char* dst, unsigned long val)
+{
+  dst[0] = (unsigned char)(val);
+  dst[1] = (unsigned char)(val >> 8);
+  dst[2] = (unsigned char)(val >> 16);
+  dst[3] = (unsigned char)(val >> 24);
+}
+
+static unsigned long
+get_uint32_le(const unsigned char* src)
+{
+  return ((unsigned long)src[0] | ((unsigned long)src[1] << 8) |
+          ((unsigned long)src[2] << 16) | ((unsigned long)src[3] << 24));
+}
+
+/* Map a difference modulo 2^BITS to a nonnegative value. */
+#define ZIGZAG(d, mask, half) \
+  ((((unsigned int)(ZIGZAG_SIGNED(d, mask, half) << 1)) ^ \
+    ((unsigned int)(ZIGZAG_SIGNED(d, mask, half) >> 31))) & (mask))
+#define ZIGZAG_SIGNED(d, mask, half) \
+  ((int)(((((unsigned int)(d)) & (mask)) ^ (half)) - (half)))
+#define UNZIGZAG(z) (((z) >> 1) ^ (0U - ((z) & 1U)))
+
+/* Encode, in-place, the WIDTH-by-HEIGHT pixel values of a tile into
+   zig-zag mapped residuals. */
+static void
+codec_residuals(unsigned int* v, long width, long height, int bits)
+{
+  const unsigned int mask = (1U << bits) - 1U, half = 1U << (bits - 1);
+  unsigned int* row;
+  long x, y;
+
+  /* Rows are processed from the last one and from right to left so that
+     the predictors have not yet been overwritten. */
+  for (y = height - 1; y >= 0; --y) {
+    row = v + y*width;
+    for (x = width - 1; x > 0; --x) {
+      row[x] = ZIGZAG(row[x] - row[x-1], mask, half);
+    }
+    row[0] = ZIGZAG(row[0] - (y > 0 ? row[-width] : 0U), mask, half);
+  }
+}
+
+/* Pack N residuals, return the number of bytes written in DST (at most
+   CODEC_TILE_CAP(N, BITS)). */
+static long
+codec_pack(const unsigned int* r, long n, unsigned char* dst)
+{
+  unsigned int blk[CODEC_BLOCK], any, word;
+  unsigned char* ptr = dst;
+  long i, j, nb;
+  int b, k;
+
+  for (i = 0; i < n; i += CODEC_BLOCK) {
+    nb = (n - i < CODEC_BLOCK ? n - i : CODEC_BLOCK);
+    any = 0;
+    for (j = 0; j < CODEC_BLOCK; ++j) {
+      blk[j] = (j < nb ? r[i+j] : 0U);
+      any |= blk[j];
+    }
+    for (b = 0; any != 0; ++b) {
+      any >>= 1;
+    }
+    *ptr++ = (unsigned char)b;
+    for (k = 0; k < b; ++k) {
+      word = 0;
+      for (j = 0; j < CODEC_BLOCK; ++j) {
+        word |= ((blk[j] >> k) & 1U) << j;
+      }
+      put_uint32_le(ptr, word);
+      ptr += 4;
+    }
+  }
+  return ptr - dst;
+}
+
+/* Unpack N residuals and undo the prediction to restore the WIDTH-by-HEIGHT
+   pixel values of a tile, return the number of bytes consumed or -1 if SIZE
+   bytes are not enough. */
+static long
+codec_unpack(const unsigned char* src, long size, unsigned int* v,
+             long width, long height, int bits)
+{
+  const unsigned int mask = (1U << bits) - 1U;
+  const unsigned char* ptr = src;
+  unsigned int blk[CODEC_BLOCK], word, z;
+  long i, j, nb, n = width*height;
+  int b, k;
+
+  for (i = 0; i < n; i += CODEC_BLOCK) {
+    if (ptr >= src + size) return -1;
+    b = *ptr++;
+    if (b > bits || ptr + 4*b > src + size) return -1;
+    for (j = 0; j < CODEC_BLOCK; ++j) {
+      blk[j] = 0;
+    }
+    for (k = 0; k < b; ++k) {
+      word = (unsigned int)get_uint32_le(ptr);
+      ptr += 4;
+      for (j = 0; j < CODEC_BLOCK; ++j) {
+        blk[j] |= ((word >> j) & 1U) << k;
+      }
+    }
+    nb = (n - i < CODEC_BLOCK ? n - i : CODEC_BLOCK);
+    for (j = 0; j < nb; ++j) {
+      v[i+j] = blk[j];
+    }
+  }
+  for (i = 0; i < n; i += width) {
+    z = v[i];
+    v[i] = ((i > 0 ? v[i-width] : 0U) + UNZIGZAG(z)) & mask;
+    for (j = 1; j < width; ++j) {
+      z = v[i+j];
+      v[i+j] = (v[i+j-1] + UNZIGZAG(z)) & mask;
+    }
+  }
+  return ptr - src;
+}
+
+/* Write the header of an encoded frame. */
+static void
+codec_header(unsigned char* dst, long size, long width, long height,
+             int bits, long tile_rows, long number)
+{
+  memcpy(dst, CODEC_MAGIC, 4);
+  put_uint32_le(dst + 4, size);
+  put_uint32_le(dst + 8, width);
+  put_uint32_le(dst + 12, height);
+  put_uint32_le(dst + 16, bits);
+  put_uint32_le(dst + 20, tile_rows);
+  put_uint32_le(dst + 24, (unsigned long)number);
+  put_uint32_le(dst + 28, (unsigned long)(number < 0 ? -1L : 0L));
+}
+
+/* Parse the header of an encoded frame, return the size of the frame or -1
+   if invalid. */
+static long
+codec_parse(const unsigned char* src, long size, long* width, long* height,
+            int* bits, long* tile_rows)
+{
+  long total, ntiles;
+  if (size < CODEC_HEADER || memcmp(src, CODEC_MAGIC, 4) != 0) return -1;
+  total = get_uint32_le(src + 4);
+  *width = get_uint32_le(src + 8);
+  *height = get_uint32_le(src + 12);
+  *bits = get_uint32_le(src + 16);
+  *tile_rows = get_uint32_le(src + 20);
+  if (total > size || *width < 1 || *height < 1 || *tile_rows < 1 ||
+      (*bits != 8 && *bits != 16)) return -1;
+  ntiles = (*height + *tile_rows - 1)/(*tile_rows);
+  if (CODEC_HEADER + 4*ntiles > total) return -1;
+  return total;
+}
+
+/* Decode a frame previously parsed by codec_parse, the pixel values are
+   stored in DST with TYPE = Y_CHAR or Y_SHORT.  Return FALSE if the frame is
+   corrupted. */
+static int
+codec_decode(const unsigned char* src, long total, void* dst, int type,
+             unsigned int* work)
+{
+  const unsigned char* tile;
+  long width, height, tile_rows, ntiles, len, y0, n, k, i;
+  int bits;
+
+  codec_parse(src, total, &width, &height, &bits, &tile_rows);
+  ntiles = (height + tile_rows - 1)/tile_rows;
+  tile = src + CODEC_HEADER + 4*ntiles;
+  for (k = 0; k < ntiles; ++k) {
+    len = get_uint32_le(src + CODEC_HEADER + 4*k);
+    y0 = k*tile_rows;
+    n = (y0 + tile_rows <= height ? tile_rows : height - y0);
+    if (tile + len > src + total ||
+        codec_unpack(tile, len, work, width, n, bits) < 0) {
+      return FALSE;
+    }
+    n *= width;
+    if (type == Y_CHAR) {
+      unsigned char* d = (unsigned char*)dst + y0*width;
+      for (i = 0; i < n; ++i) d[i] = (unsigned char)work[i];
+    } else {
+      unsigned short* d = (unsigned short*)dst + y0*width;
+      for (i = 0; i < n; ++i) d[i] = (unsigned short)work[i];
+    }
+    tile += len;
+  }
+  return TRUE;
+}
+
+void
+Y_andor_decode(int argc)
+{
+  const unsigned char* buf;
+  unsigned char* dst;
+  unsigned int* work;
+  long size, ntot, offset, total, nframes, k;
+  long width, height, tile_rows, w, h, t, dims[4];
+  int bits, b, type;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  buf = (const unsigned char*)ygeta_c(0, &ntot, NULL);
+  size = ntot;
+
+  /* Check the frames and their dimensions. */
+  nframes = 0;
+  width = height = tile_rows = 0;
+  bits = 0;
+  for (offset = 0; offset < size; offset += total) {
+    total = codec_parse(buf + offset, size - offset, &w, &h, &b, &t);
+    if (total < 0) y_error("invalid or truncated encoded frame");
+    if (nframes == 0) {
+      width = w;
+      height = h;
+      bits = b;
+      tile_rows = t;
+    } else if (w != width || h != height || b != bits) {
+      y_error("encoded frames have different formats");
+    }
+    if (t > tile_rows) tile_rows = t;
+    ++nframes;
+  }
+  if (nframes == 0) {
+    push_nil();
+    return;
+  }
+
+  /* Decode the frames. */
+  dims[0] = (nframes > 1 ? 3 : 2);
+  dims[1] = width;
+  dims[2] = height;
+  dims[3] = nframes;
+  type = (bits == 8 ? Y_CHAR : Y_SHORT);
+  work = (unsigned int*)ypush_scratch(width*tile_rows*sizeof(int), NULL);
+  dst = (type == Y_CHAR ? (unsigned char*)ypush_c(dims)
+         : (unsigned char*)ypush_s(dims));
+  for (offset = 0, k = 0; k < nframes; ++k, offset += total) {
+    total = get_uint32_le(buf + offset + 4);
+    if (! codec_decode(buf + offset, total, dst + k*width*height*(bits/8),
+                       type, work)) {
+      y_error("corrupted encoded frame");
+    }
+  }
+}
+
+void
+Y__andor_encode(int argc)
+{
+  unsigned char* dst;
+  unsigned int* work;
+  void* img;
+  long ntot, dims[Y_DIMSIZE], width, height, tile_rows, ntiles, size;
+  long k, y0, n, i, len;
+  int type, bits;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  img = ygeta_any(1, &ntot, dims, &type);
+  tile_rows = get_long(0);
+  if (type == Y_CHAR) {
+    bits = 8;
+  } else if (type == Y_SHORT) {
+    bits = 16;
+  } else {
+    y_error("expecting an array of chars or shorts");
+    return;
+  }
+  if (dims[0] != 2) y_error("expecting a 2-D array");
+  if (tile_rows < 1) y_error("invalid number of rows per tile");
+  width = dims[1];
+  height = dims[2];
+  if (tile_rows > height) tile_rows = height;
+  ntiles = (height + tile_rows - 1)/tile_rows;
+
+  /* Encode in a scratch buffer of the maximum size. */
+  work = (unsigned int*)ypush_scratch(width*tile_rows*sizeof(int), NULL);
+  size = CODEC_HEADER + 4*ntiles + ntiles*CODEC_TILE_CAP(width*tile_rows,
+                                                         bits);
+  dst = (unsigned char*)ypush_scratch(size, NULL);
+  size = CODEC_HEADER + 4*ntiles;
+  for (k = 0; k < ntiles; ++k) {
+    y0 = k*tile_rows;
+    n = width*(y0 + tile_rows <= height ? tile_rows : height - y0);
+    if (bits == 8) {
+      const unsigned char* src = (const unsigned char*)img + y0*width;
+      for (i = 0; i < n; ++i) work[i] = src[i];
+    } else {
+      const unsigned short* src = (const unsigned short*)img + y0*width;
+      for (i = 0; i < n; ++i) work[i] = src[i];
+    }
+    codec_residuals(work, width, n/width, bits);
+    len = codec_pack(work, n, dst + size);
+    put_uint32_le(dst + CODEC_HEADER + 4*k, len);
+    size += len;
+  }
+  codec_header(dst, size, width, height, bits, tile_rows, 0);
+  dims[0] = 1;
+  dims[1] = size;
+  memcpy(ypush_c(dims), dst, size);
+}
+
+/*---------------------------------------------------------------------------*/
+/* CONTAINER FILES */
+
+/* A container file stores a long sequence of frames with an index for
+   random access.  All values are little-endian.  The file starts with a
+   header of CONTAINER_HEADER bytes:
+
+       offset  size  contents
+         0       8   magic "ANDORCF1"
+         8       4   version (1)
+        12       4   size of the header
+        16       4   number of frames per chunk
+        20       4   alignment of chunks
+
+   the rest of the header is zero-filled.  Frames are stored by chunks of a
+   fixed number of frames, each chunk starting at a multiple of
+   CONTAINER_ALIGN bytes so that it can be mapped or read independently.  A
+   frame is stored either as raw pixel values (8 or 16-bit unsigned
+   integers) or as a frame encoded by the delta codec (see "LOSSLESS
+   CODEC").  The frames are followed by the index, a table of entries of
+   CONTAINER_ENTRY bytes, one per frame:
+
+       offset  size  contents
+         0       8   frame number (signed)
+         8       8   arrival time (IEEE double, seconds since the Epoch)
+        16       8   offset of the frame data in the file
+        24       8   size of the frame data in bytes
+        32       4   width
+        36       4   height
+        40       2   bits per pixel (8 or 16)
+        42       2   format (0 for raw pixels, 2 for the delta codec)
+        44       2   stripe (index of the file storing the frame)
+        46       2   reserved
+
+   and the file ends with a trailer of CONTAINER_TRAILER bytes:
+
+       offset  size  contents
+         0       8   magic "ANDORIDX"
+         8       8   offset of the index
+        16       8   number of entries in the index
+        24       4   size of an entry
+        28       4   reserved
+
+   Reading a given frame thus only requires to read the trailer and one
+   entry of the index.  A container may be striped over several files, the
+   frames being stored in the file given by the stripe of their entry.  Each
+   file has a valid header and an index of its own frames, the index of the
+   first file lists the frames of all files. */
+
+#define CONTAINER_HEADER   64
+#define CONTAINER_ENTRY    48
+#define CONTAINER_TRAILER  32
+#define CONTAINER_ALIGN  4096
+#define CONTAINER_MAGIC  "ANDORCF1"
+#define CONTAINER_IMAGIC "ANDORIDX"
+
+#define CONTAINER_RAW   0
+#define CONTAINER_DELTA 2
+
+static void
+put_uint64_le(unsigned char* dst, uint64_t val)
+{
+  put_uint32_le(dst, (unsigned long)(val & 0xFFFFFFFFUL));
+  put_uint32_le(dst + 4, (unsigned long)(val >> 32));
+}
+
+static uint64_t
+get_uint64_le(const unsigned char* src)
+{
+  return ((uint64_t)get_uint32_le(src) |
+          ((uint64_t)get_uint32_le(src + 4) << 32));
+}
+
+static void
+put_double_le(unsigned char* dst, double val)
+{
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  put_uint64_le(dst, bits);
+}
+
+static double
+get_double_le(const unsigned char* src)
+{
+  uint64_t bits = get_uint64_le(src);
+  double val;
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+static double
+wall_clock_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (double)ts.tv_sec + 1E-9*(double)ts.tv_nsec;
+}
+
+static void
+container_header(char* dst, long chunk)
+{
+  unsigned char* hdr = (unsigned char*)dst;
+  memset(hdr, 0, CONTAINER_HEADER);
+  memcpy(hdr, CONTAINER_MAGIC, 8);
+  put_uint32_le(hdr + 8, 1);
+  put_uint32_le(hdr + 12, CONTAINER_HEADER);
+  put_uint32_le(hdr + 16, chunk);
+  put_uint32_le(hdr + 20, CONTAINER_ALIGN);
+}
+
+/* Reader of container files, the files are mapped in memory. */
+typedef struct _container_file container_file_t;
+struct _container_file {
+  void* addr;                 /* Address of mapped file. */
+  size_t size;                /* Size of mapped file. */
+};
+
+typedef struct _container container_t;
+struct _container {
+  container_file_t* files;    /* Mapped files (one per stripe). */
+  long nfiles;                /* Number of files. */
+  const unsigned char* index; /* First entry of the index. */
+  long count;                 /* Number of entries. */
+  long chunk;                 /* Number of frames per chunk. */
+};
+
+static void
+free_container(void* ptr)
+{
+  container_t* cnt = (container_t*)ptr;
+  long k;
+  if (cnt->files != NULL) {
+    for (k = 0; k < cnt->nfiles; ++k) {
+      if (cnt->files[k].addr != NULL) {
+        munmap(cnt->files[k].addr, cnt->files[k].size);
+      }
+    }
+    p_free(cnt->files);
+  }
+}
+
+static void
+print_container(void* ptr)
+{
+  char buffer[64];
+  container_t* cnt = (container_t*)ptr;
+  y_print("Andor container file", 0);
+  if (cnt->nfiles > 1) {
+    sprintf(buffer, " (%ld frames in %ld files)", cnt->count, cnt->nfiles);
+  } else {
+    sprintf(buffer, " (%ld frames)", cnt->count);
+  }
+  y_print(buffer, 1);
+}
+
+static void eval_container(void* ptr, int argc);
+static void extract_container(void* ptr, char* name);
+
+static y_userobj_t container_type = {
+  "Andor container file",
+  free_container, print_container, eval_container, extract_container, NULL
+};
+
+/* Push frames FIRST to LAST (0-based, inclusive) on the stack. */
+static void
+container_push_frames(container_t* cnt, long first, long last)
+{
+  const container_file_t* file;
+  const unsigned char* entry;
+  const unsigned char* src;
+  unsigned char* dst;
+  unsigned int* work;
+  long width, height, w, h, tile_rows, t, dims[4], k, i, npix, stripe;
+  uint64_t offset, size;
+  int bits, b, format, type;
+
+  /* Check the frames. */
+  width = height = 0;
+  bits = 0;
+  tile_rows = 1;
+  for (k = first; k <= last; ++k) {
+    entry = cnt->index + k*CONTAINER_ENTRY;
+    offset = get_uint64_le(entry + 16);
+    size = get_uint64_le(entry + 24);
+    w = get_uint32_le(entry + 32);
+    h = get_uint32_le(entry + 36);
+    b = entry[40] | (entry[41] << 8);
+    format = entry[42] | (entry[43] << 8);
+    stripe = entry[44] | (entry[45] << 8);
+    if (stripe >= cnt->nfiles) {
+      y_error("frame stored in a missing file of the container");
+    }
+    file = &cnt->files[stripe];
+    if (offset > file->size || size > file->size - offset ||
+        (b != 8 && b != 16) || w < 1 || h < 1) {
+      y_error("corrupted container index");
+    }
+    if (k == first) {
+      width = w;
+      height = h;
+      bits = b;
+    } else if (w != width || h != height || b != bits) {
+      y_error("frames have different formats");
+    }
+    src = (const unsigned char*)file->addr + offset;
+    if (format == CONTAINER_DELTA) {
+      if (codec_parse(src, size, &w, &h, &b, &t) != size ||
+          w != width || h != height || b != bits) {
+        y_error("corrupted encoded frame");
+      }
+      if (t > tile_rows) tile_rows = t;
+    } else if (format != CONTAINER_RAW ||
+               size != (uint64_t)(width*height*(bits/8))) {
+      y_error("unknown frame format");
+    }
+  }
+
+  /* Extract the frames. */
+  dims[0] = (last > first ? 3 : 2);
+  dims[1] = width;
+  dims[2] = height;
+  dims[3] = last - first + 1;
+  type = (bits == 8 ? Y_CHAR : Y_SHORT);
+  if (tile_rows > height) tile_rows = height;
+  work = (unsigned int*)ypush_scratch(width*tile_rows*sizeof(int), NULL);
+  dst = (type == Y_CHAR ? (unsigned char*)ypush_c(dims)
+         : (unsigned char*)ypush_s(dims));
+  npix = width*height;
+  for (k = first; k <= last; ++k, dst += npix*(bits/8)) {
+    entry = cnt->index + k*CONTAINER_ENTRY;
+    offset = get_uint64_le(entry + 16);
+    size = get_uint64_le(entry + 24);
+    stripe = entry[44] | (entry[45] << 8);
+    src = (const unsigned char*)cnt->files[stripe].addr + offset;
+    if ((entry[42] | (entry[43] << 8)) == CONTAINER_DELTA) {
+      if (! codec_decode(src, size, dst, type, work)) {
+        y_error("corrupted encoded frame");
+      }
+    } else if (bits == 8) {
+      memcpy(dst, src, npix);
+    } else {
+      unsigned short* d = (unsigned short*)dst;
+      for (i = 0; i < npix; ++i) {
+        d[i] = (unsigned short)(src[2*i] | (src[2*i+1] << 8));
+      }
+    }
+  }
+}
+
+static void
+eval_container(void* ptr, int argc)
+{
+  container_t* cnt = (container_t*)ptr;
+  long first, last;
+
+  if (argc < 1 || argc > 2) y_error("expecting 1 or 2 frame indices");
+  first = get_long(argc - 1);
+  last = (argc == 2 ? get_long(0) : first);
+  if (first < 1 || last > cnt->count || first > last) {
+    y_error("out of range frame index");
+  }
+  container_push_frames(cnt, first - 1, last - 1);
+}
+
+static void
+extract_container(void* ptr, char* name)
+{
+  container_t* cnt = (container_t*)ptr;
+  long dims[2], k;
+  int field;
+
+  if (strcmp(name, "count") == 0) {
+    push_long(cnt->count);
+    return;
+  } else if (strcmp(name, "chunk") == 0) {
+    push_long(cnt->chunk);
+    return;
+  } else if (strcmp(name, "stripes") == 0) {
+    field = 44;
+  } else if (strcmp(name, "numbers") == 0) {
+    field = 0;
+  } else if (strcmp(name, "times") == 0) {
+    field = 8;
+  } else if (strcmp(name, "offsets") == 0) {
+    field = 16;
+  } else if (strcmp(name, "sizes") == 0) {
+    field = 24;
+  } else {
+    y_error("illegal member");
+    return;
+  }
+  if (cnt->count <= 0) {
+    push_nil();
+    return;
+  }
+  dims[0] = 1;
+  dims[1] = cnt->count;
+  if (field == 8) {
+    double* dst = ypush_d(dims);
+    for (k = 0; k < cnt->count; ++k) {
+      dst[k] = get_double_le(cnt->index + k*CONTAINER_ENTRY + field);
+    }
+  } else if (field == 44) {
+    long* dst = ypush_l(dims);
+    const unsigned char* entry = cnt->index + field;
+    for (k = 0; k < cnt->count; ++k, entry += CONTAINER_ENTRY) {
+      dst[k] = entry[0] | (entry[1] << 8);
+    }
+  } else {
+    long* dst = ypush_l(dims);
+    for (k = 0; k < cnt->count; ++k) {
+      dst[k] = (long)get_uint64_le(cnt->index + k*CONTAINER_ENTRY + field);
+    }
+  }
+}
+
+/* Map a container file, return its trailer. */
+static const unsigned char*
+container_map(container_file_t* file, const char* path)
+{
+  const unsigned char* base;
+  const unsigned char* trailer;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) y_error("cannot open container file");
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < CONTAINER_HEADER + CONTAINER_TRAILER) {
+    close(fd);
+    y_error("not a container file");
+  }
+  file->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file->addr == MAP_FAILED) {
+    file->addr = NULL;
+    y_error("cannot map container file");
+  }
+  file->size = st.st_size;
+
+  /* Check the header and the trailer. */
+  base = (const unsigned char*)file->addr;
+  trailer = base + file->size - CONTAINER_TRAILER;
+  if (memcmp(base, CONTAINER_MAGIC, 8) != 0) {
+    y_error("not a container file");
+  }
+  if (memcmp(trailer, CONTAINER_IMAGIC, 8) != 0) {
+    y_error("container file has no index (not properly closed?)");
+  }
+  return trailer;
+}
+
+void
+Y_andor_open_container(int argc)
+{
+  container_t* cnt;
+  const unsigned char* base;
+  const unsigned char* trailer;
+  char** paths;
+  uint64_t offset, count;
+  long npaths, k;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  paths = ygeta_q(0, &npaths, NULL);
+  for (k = 0; k < npaths; ++k) {
+    if (paths[k] == NULL) y_error("invalid file name");
+  }
+  cnt = (container_t*)ypush_obj(&container_type, sizeof(container_t));
+  cnt->files = (container_file_t*)p_malloc(npaths*sizeof(container_file_t));
+  memset(cnt->files, 0, npaths*sizeof(container_file_t));
+  cnt->nfiles = npaths;
+  trailer = NULL;
+  for (k = npaths - 1; k >= 0; --k) {
+    trailer = container_map(&cnt->files[k], paths[k]);
+  }
+
+  /* Use the index of the first file. */
+  base = (const unsigned char*)cnt->files[0].addr;
+  offset = get_uint64_le(trailer + 8);
+  count = get_uint64_le(trailer + 16);
+  if (get_uint32_le(trailer + 24) != CONTAINER_ENTRY ||
+      offset > cnt->files[0].size - CONTAINER_TRAILER ||
+      count > ((cnt->files[0].size - CONTAINER_TRAILER - offset)
+               /CONTAINER_ENTRY)) {
+    y_error("corrupted container index");
+  }
+  cnt->index = base + offset;
+  cnt->count = count;
+  cnt->chunk = get_uint32_le(base + 16);
+}
+
+/*---------------------------------------------------------------------------*/
+/* FRAME METADATA */
+
+/* When feature "MetadataEnable" is set, the camera appends metadata blocks
+   to the image data.  Each block is made of its data followed by a 4-byte
+   identifier (CID) and by the 4-byte length of the identifier and of the
+   data, so the blocks are parsed backwards from the end of the frame buffer
+   until the block of the image data (CID 0) is found.  Only the timestamp
+   (CID 1, a 64-bit count of clock ticks) is used.  Other per-frame values
+   (exposure time, temperature) are not queried for every frame but cached:
+   the exposure time is read when the acquisition starts and after each
+   feature is set by this plugin or by the automatic exposure stage. */
+
+#define METADATA_CID_FRAME 0
+#define METADATA_CID_TICKS 1
+
+/* Get the value of a floating-point feature, NaN if it cannot be read. */
+static double
+get_float_or_nan(AT_H handle, const AT_WC* feature)
+{
+  double value;
+  return (AT_GetFloat(handle, feature, &value) == AT_SUCCESS ? value : NAN);
+}
+
+static void
+setup_metadata(camera_t* cam)
+{
+  AT_BOOL enabled, timestamp;
+  AT_64 frequency;
+
+  cam->timestamps =
+    (AT_GetBool(cam->handle, L"MetadataEnable", &enabled) == AT_SUCCESS &&
+     enabled &&
+     AT_GetBool(cam->handle, L"MetadataTimestamp", &timestamp) == AT_SUCCESS &&
+     timestamp);
+  cam->frequency = (AT_GetInt(cam->handle, L"TimestampClockFrequency",
+                              &frequency) == AT_SUCCESS ?
+                    (double)frequency : 0.0);
+  cam->exposure = get_float_or_nan(cam->handle, L"ExposureTime");
+}
+
+/* Refresh the cached feature values of the camera at position IARG on the
+   stack after a feature has been set (setting a feature may change
+   others). */
+static void
+refresh_cached_features(int iarg)
+{
+  camera_t* cam;
+  if (! yarg_nil(iarg) && ! is_remote_camera(iarg)) {
+    cam = get_camera(iarg);
+    cam->exposure = get_float_or_nan(cam->handle, L"ExposureTime");
+  }
+}
+
+/* Get the timestamp of a frame from its metadata, return FALSE if there is
+   none. */
+static int
+get_frame_ticks(const camera_t* cam, const unsigned char* frame,
+                uint64_t* ticks)
+{
+  const unsigned char* end;
+  unsigned long cid, len;
+
+  if (! cam->timestamps) {
+    return FALSE;
+  }
+  end = frame + cam->frame_size;
+  while (end - frame >= 8) {
+    len = get_uint32_le(end - 4);
+    cid = get_uint32_le(end - 8);
+    if (cid == METADATA_CID_FRAME || len < 4 || len > (end - frame) - 4) {
+      break;
+    }
+    end -= len + 4;
+    if (cid == METADATA_CID_TICKS && len >= 12) {
+      *ticks = get_uint64_le(end);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+/* RECORDER */
+
+/* The recorder stage saves the frames into a FITS file, one image extension
+   per frame.  Frames are copied into a ring of slots by the processing
+   stage and written by a dedicated thread, so that disk latency does not
+   slow down acquisition (frames are dropped if the ring is full).  With
+   compression, each frame is stored according to the FITS tiled image
+   convention as a binary table of Rice compressed tiles of TILE_ROWS rows;
+   the tiles are compressed in parallel by a team of worker threads.  With
+   the delta codec (see "LOSSLESS CODEC" above), the file is not a FITS file
+   but the concatenation of the encoded frames.
+
+   The recorder can also write an indexed container (see "CONTAINER FILES"
+   above) where the frames are stored (uncompressed or with the delta codec)
+   by chunks of a fixed number of frames, followed by an index which is
+   rewritten each time the recorder is flushed and when it is closed.
+   Containers may be striped over several files (presumably on different
+   disks): the frames are distributed round-robin among the files, each file
+   having its own writer thread, ring of slots and team of workers.  Each
+   file has an index of its own frames, the index of the first file is the
+   unified index of all frames (the stripe of each frame is stored in the
+   entry).
+
+   Optionally, a sidecar table of per-frame metadata is written alongside
+   each file (with suffix ".meta").  The records are filled by the
+   processing stage from the frame metadata and the cached feature values
+   (see "FRAME METADATA" above) and written by the writer thread after the
+   frame data.  The sidecar file starts with a header of RECORDER_META_HEADER
+   bytes (all values are little-endian):
+
+       offset  size  contents
+         0       8   magic "ANDORMD1"
+         8       4   version (1)
+        12       4   size of a record
+        16       8   frequency of the timestamp clock (IEEE double, Hz, 0 if
+                     unknown)
+        24       8   reserved
+
+   followed by one record of RECORDER_RECORD bytes per written frame:
+
+       offset  size  contents
+         0       8   frame number
+         8       8   sequence number (index of the frame in the recording)
+        16       8   arrival time (IEEE double, seconds since the Epoch)
+        24       8   timestamp in clock ticks (0 if unknown)
+        32       8   exposure time (IEEE double, seconds, NaN if unknown)
+        40       8   sensor temperature (IEEE double, Celsius, NaN if unknown)
+        48       8   number of frames dropped by the recorder so far
+        56       4   stripe (index of the file storing the frame)
+        60       4   flags (bit 0 set if the timestamp is valid)
+
+   The sensor temperature is queried at most every RECORDER_TEMPERATURE_DELAY
+   seconds. */
+
+#define RECORDER_NONE  0 /* No compression. */
+#define RECORDER_RICE  1 /* FITS tile compression with Rice algorithm. */
+#define RECORDER_DELTA 2 /* Delta codec. */
+
+#define RECORDER_HEADER_SIZE (2*FITS_BLOCK)
+#define RECORDER_META_MAGIC "ANDORMD1"
+#define RECORDER_META_HEADER 32
+#define RECORDER_RECORD 64
+#define RECORDER_TEMPERATURE_DELAY 1.0
+#define WRITE_ERROR (errno != 0 ? errno : EIO)
+
+typedef struct _recorder recorder_t;
+typedef struct _writer writer_t;
+
+/* A writer manages one output file. */
+struct _writer {
+  recorder_t* rec;      /* Owner. */
+  long stripe;          /* Index of the file. */
+  FILE* file;
+  FILE* meta;           /* Sidecar metadata file (may be NULL). */
+  int64_t offset;       /* Current file offset (for containers). */
+
+  /* Index of the frames in this file (for containers). */
+  unsigned char* index; /* Serialized entries. */
+  int64_t* index_seq;   /* Sequence numbers of the entries. */
+  long index_size;      /* Number of entries in the index. */
+  long index_cap;       /* Maximum number of entries in the index. */
+
+  /* Ring of frames waiting to be written (protected by the mutex). */
+  unsigned char* slots; /* Frame data. */
+  long* numbers;        /* Frame numbers. */
+  double* times;        /* Frame arrival times. */
+  int64_t* seqs;        /* Sequence numbers of the frames. */
+  unsigned char* records; /* Metadata records of the frames. */
+  long head;            /* Index of next slot to fill. */
+  long count;           /* Number of pending frames. */
+  int busy;             /* Writer thread is writing a frame? */
+  int quit;             /* Writer thread must quit? */
+  int error;            /* Error code (errno) of writer thread. */
+  long written;         /* Number of frames written. */
+  double raw_bytes;     /* Amount of raw data written. */
+  double file_bytes;    /* Amount of data written in the file (without
+                           headers). */
+  int initialized;      /* Mutex and conditions initialized? */
+  int running;          /* Writer thread started? */
+  pthread_mutex_t mutex;
+  pthread_cond_t ready; /* Signaled when a frame is queued. */
+  pthread_cond_t space; /* Signaled when a frame has been written. */
+  pthread_t thread;
+
+  /* Resources of the writer thread. */
+  workers_t* workers;
+  void* buffer;         /* Allocated memory for all the following. */
+  float* rows;          /* Per-thread decoded rows. */
+  unsigned int* values; /* Per-thread tile values. */
+  unsigned char* data;  /* Output data (binary table or raw image). */
+  unsigned char* zbuf;  /* Compressed tiles. */
+  long* zlen;           /* Sizes of compressed tiles. */
+  const unsigned char* frame; /* Frame being written. */
+  char header[RECORDER_HEADER_SIZE];
+};
+
+struct _recorder {
+  stage_t base;
+  int compress;         /* Compression method (RECORDER_...). */
+  int bitpix;           /* FITS bits per pixel (8 or 16). */
+  long tile_rows;       /* Requested number of rows per tile. */
+  long tile_height;     /* Actual number of rows per tile. */
+  long ntiles;          /* Number of tiles per frame. */
+  long tile_cap;        /* Maximum size of a compressed tile. */
+  long chunk;           /* Number of frames per chunk in a container, 0 if
+                           not a container. */
+  int metadata;         /* Write sidecar metadata files? */
+  double temperature;   /* Last sensor temperature. */
+  double temperature_time; /* Time of last temperature query. */
+
+  /* Geometry of the recorded frames. */
+  long width, height, stride, frame_size;
+  int encoding;
+
+  long nslots;          /* Number of slots per writer. */
+  long slot_size;       /* Size of a slot. */
+  long nwriters;        /* Number of writers (stripes). */
+  writer_t* writers;    /* Writers. */
+  int64_t seq;          /* Sequence number of next frame. */
+  long dropped;         /* Number of frames dropped. */
+};
+
+/* Wait until all pending frames have been written. */
+static void
+writer_drain(writer_t* w)
+{
+  if (w->running) {
+    pthread_mutex_lock(&w->mutex);
+    while (w->count > 0 || w->busy) {
+      pthread_cond_wait(&w->space, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+  }
+}
+
+static void
+recorder_drain(recorder_t* rec)
+{
+  long k;
+  for (k = 0; k < rec->nwriters; ++k) {
+    writer_drain(&rec->writers[k]);
+  }
+}
+
+static void
+recorder_meta_header(char* dst, double frequency)
+{
+  unsigned char* hdr = (unsigned char*)dst;
+  memset(hdr, 0, RECORDER_META_HEADER);
+  memcpy(hdr, RECORDER_META_MAGIC, 8);
+  put_uint32_le(hdr + 8, 1);
+  put_uint32_le(hdr + 12, RECORDER_RECORD);
+  put_double_le(hdr + 16, frequency);
+}
+
+/* Fill the metadata record of the frame in slot K of writer W. */
+static void
+recorder_record(recorder_t* rec, writer_t* w, long k, const camera_t* cam,
+                const unsigned char* frame)
+{
+  unsigned char* record = w->records + k*RECORDER_RECORD;
+  uint64_t ticks;
+  double now;
+  int valid;
+
+  now = monotonic_time();
+  if (now >= rec->temperature_time + RECORDER_TEMPERATURE_DELAY) {
+    rec->temperature = get_float_or_nan(cam->handle, L"SensorTemperature");
+    rec->temperature_time = now;
+  }
+  valid = get_frame_ticks(cam, frame, &ticks);
+  put_uint64_le(record, (uint64_t)w->numbers[k]);
+  put_uint64_le(record + 8, (uint64_t)w->seqs[k]);
+  put_double_le(record + 16, w->times[k]);
+  put_uint64_le(record + 24, (valid ? ticks : 0));
+  put_double_le(record + 32, cam->exposure);
+  put_double_le(record + 40, rec->temperature);
+  put_uint64_le(record + 48, (uint64_t)rec->dropped);
+  put_uint32_le(record + 56, w->stripe);
+  put_uint32_le(record + 60, (valid ? 1 : 0));
+}
+
+/* Append an entry to the index of a container (the size of the frame data
+   is set by container_set_size). */
+static int
+container_add_entry(writer_t* w, long number, double time, int64_t seq)
+{
+  const recorder_t* rec = w->rec;
+  unsigned char* entry;
+  void* ptr;
+  long cap;
+
+  if (w->index_size >= w->index_cap) {
+    cap = (w->index_cap > 0 ? 2*w->index_cap : 1024);
+    ptr = realloc(w->index, cap*CONTAINER_ENTRY);
+    if (ptr == NULL) {
+      return ENOMEM;
+    }
+    w->index = (unsigned char*)ptr;
+    ptr = realloc(w->index_seq, cap*sizeof(int64_t));
+    if (ptr == NULL) {
+      return ENOMEM;
+    }
+    w->index_seq = (int64_t*)ptr;
+    w->index_cap = cap;
+  }
+  entry = w->index + w->index_size*CONTAINER_ENTRY;
+  memset(entry, 0, CONTAINER_ENTRY);
+  put_uint64_le(entry, (uint64_t)number);
+  put_double_le(entry + 8, time);
+  put_uint64_le(entry + 16, (uint64_t)w->offset);
+  put_uint32_le(entry + 32, rec->width);
+  put_uint32_le(entry + 36, rec->height);
+  entry[40] = (unsigned char)rec->bitpix;
+  entry[42] = (rec->compress == RECORDER_DELTA ?
+               CONTAINER_DELTA : CONTAINER_RAW);
+  entry[44] = (unsigned char)(w->stripe);
+  entry[45] = (unsigned char)(w->stripe >> 8);
+  w->index_seq[w->index_size] = seq;
+  return 0;
+}
+
+/* Set the size of the last frame of a container and advance the file
+   offset. */
+static void
+container_set_size(writer_t* w, long size)
+{
+  if (w->rec->chunk > 0) {
+    put_uint64_le(w->index + (w->index_size*CONTAINER_ENTRY + 24),
+                  (uint64_t)size);
+    ++w->index_size;
+    w->offset += size;
+  }
+}
+
+/* Write the COUNT entries of INDEX and the trailer of a container at the
+   current offset, then move back so that they get overwritten by the next
+   frames.  Return 0 on success or an error code. */
+static int
+container_write_index(writer_t* w, const unsigned char* index, long count)
+{
+  unsigned char trailer[CONTAINER_TRAILER];
+
+  memset(trailer, 0, CONTAINER_TRAILER);
+  memcpy(trailer, CONTAINER_IMAGIC, 8);
+  put_uint64_le(trailer + 8, (uint64_t)w->offset);
+  put_uint64_le(trailer + 16, (uint64_t)count);
+  put_uint32_le(trailer + 24, CONTAINER_ENTRY);
+  if ((count > 0 &&
+       fwrite(index, CONTAINER_ENTRY, count, w->file) != count) ||
+      fwrite(trailer, 1, CONTAINER_TRAILER, w->file) != CONTAINER_TRAILER ||
+      fflush(w->file) != 0 ||
+      fseeko(w->file, (off_t)w->offset, SEEK_SET) != 0) {
+    return WRITE_ERROR;
+  }
+  return 0;
+}
+
+/* Write the indices of all the files of a container, the writers must be
+   idle.  The index of the first file is the unified index of all files,
+   obtained by merging the indices of the writers in the order of the
+   sequence numbers.  Return 0 on success or an error code. */
+static int
+recorder_write_indices(recorder_t* rec)
+{
+  writer_t* w;
+  unsigned char* index;
+  long* next;
+  long k, n, total, best;
+  int code;
+
+  for (k = 1; k < rec->nwriters; ++k) {
+    w = &rec->writers[k];
+    if (w->error == 0) {
+      w->error = container_write_index(w, w->index, w->index_size);
+    }
+    if (w->error != 0) return w->error;
+  }
+  w = &rec->writers[0];
+  if (rec->nwriters == 1) {
+    return container_write_index(w, w->index, w->index_size);
+  }
+  for (k = 0, total = 0; k < rec->nwriters; ++k) {
+    total += rec->writers[k].index_size;
+  }
+  index = (unsigned char*)malloc(total*CONTAINER_ENTRY + 1);
+  next = (long*)malloc(rec->nwriters*sizeof(long));
+  if (index == NULL || next == NULL) {
+    if (index != NULL) free(index);
+    if (next != NULL) free(next);
+    return ENOMEM;
+  }
+  memset(next, 0, rec->nwriters*sizeof(long));
+  for (n = 0; n < total; ++n) {
+    best = -1;
+    for (k = 0; k < rec->nwriters; ++k) {
+      if (next[k] < rec->writers[k].index_size &&
+          (best < 0 || (rec->writers[k].index_seq[next[k]] <
+                        rec->writers[best].index_seq[next[best]]))) {
+        best = k;
+      }
+    }
+    memcpy(index + n*CONTAINER_ENTRY,
+           rec->writers[best].index + next[best]*CONTAINER_ENTRY,
+           CONTAINER_ENTRY);
+    ++next[best];
+  }
+  code = container_write_index(w, index, total);
+  free(next);
+  free(index);
+  return code;
+}
+
+static void
+recorder_tile(void* ctx, long tile, int thread)
+{
+  writer_t* w = (writer_t*)ctx;
+  const recorder_t* rec = w->rec;
+  const long width = rec->width;
+  float* row = w->rows + thread*width;
+  unsigned int* values = w->values + thread*rec->tile_height*width;
+  unsigned int* val = values;
+  unsigned char* dst;
+  unsigned int v;
+  long x, y, y0, y1;
+
+  y0 = tile*rec->tile_height;
+  y1 = y0 + rec->tile_height;
+  if (y1 > rec->height) y1 = rec->height;
+  dst = w->data + y0*width*(rec->bitpix/8);
+  for (y = y0; y < y1; ++y) {
+    decode_span(rec->encoding, w->frame + y*rec->stride, 0, width, row);
+    if (rec->compress != RECORDER_NONE) {
+      /* For FITS, unsigned 16-bit values are stored as signed ones with
+         BZERO = 32768. */
+      v = (rec->bitpix == 16 && rec->compress == RECORDER_RICE ?
+           0x8000U : 0U);
+      for (x = 0; x < width; ++x) {
+        *val++ = ((unsigned int)row[x]) ^ v;
+      }
+    } else if (rec->bitpix == 8) {
+      for (x = 0; x < width; ++x) {
+        *dst++ = (unsigned char)row[x];
+      }
+    } else if (rec->chunk > 0) {
+      /* Containers store little-endian unsigned values. */
+      for (x = 0; x < width; ++x) {
+        v = (unsigned int)row[x];
+        dst[0] = (unsigned char)(v);
+        dst[1] = (unsigned char)(v >> 8);
+        dst += 2;
+      }
+    } else {
+      for (x = 0; x < width; ++x) {
+        v = ((unsigned int)row[x]) ^ 0x8000U;
+        dst[0] = (unsigned char)(v >> 8);
+        dst[1] = (unsigned char)(v);
+        dst += 2;
+      }
+    }
+  }
+  if (rec->compress == RECORDER_RICE) {
+    w->zlen[tile] = rice_encode(values, (y1 - y0)*width, rec->bitpix,
+                                w->zbuf + tile*rec->tile_cap);
+  } else if (rec->compress == RECORDER_DELTA) {
+    codec_residuals(values, width, y1 - y0, rec->bitpix);
+    w->zlen[tile] = codec_pack(values, (y1 - y0)*width,
+                               w->zbuf + tile*rec->tile_cap);
+  }
+}
+
+/* Write a frame in the file, return 0 on success or an error code. */
+static int
+recorder_write(writer_t* w, const unsigned char* frame, long number,
+               double time, int64_t seq)
+{
+  static const unsigned char zeros[CONTAINER_ALIGN];
+  const recorder_t* rec = w->rec;
+  char* hdr = w->header;
+  long ncards, size, raw, heap, maxlen, pad, k;
+  int code;
+
+  w->frame = frame;
+  run_workers(w->workers, rec->ntiles, recorder_tile, w);
+  w->frame = NULL;
+
+  raw = rec->width*rec->height*(rec->bitpix/8);
+  if (rec->chunk > 0) {
+    /* Start chunks at aligned offsets. */
+    if (w->index_size % rec->chunk == 0) {
+      pad = ROUND_UP(w->offset, CONTAINER_ALIGN) - w->offset;
+      if (pad > 0 && fwrite(zeros, 1, pad, w->file) != pad) {
+        return WRITE_ERROR;
+      }
+      w->offset += pad;
+    }
+    code = container_add_entry(w, number, time, seq);
+    if (code != 0) {
+      return code;
+    }
+  }
+  if (rec->compress == RECORDER_DELTA) {
+    size = CODEC_HEADER + 4*rec->ntiles;
+    for (k = 0; k < rec->ntiles; ++k) {
+      put_uint32_le(w->data + CODEC_HEADER + 4*k, w->zlen[k]);
+      size += w->zlen[k];
+    }
+    codec_header(w->data, size, rec->width, rec->height, rec->bitpix,
+                 rec->tile_height, number);
+    if (fwrite(w->data, 1, CODEC_HEADER + 4*rec->ntiles, w->file)
+        != CODEC_HEADER + 4*rec->ntiles) {
+      return WRITE_ERROR;
+    }
+    for (k = 0; k < rec->ntiles; ++k) {
+      if (fwrite(w->zbuf + k*rec->tile_cap, 1, w->zlen[k], w->file)
+          != w->zlen[k]) {
+        return WRITE_ERROR;
+      }
+    }
+    container_set_size(w, size);
+    w->raw_bytes += raw;
+    w->file_bytes += size;
+    return 0;
+  }
+  if (rec->chunk > 0) {
+    /* Uncompressed frame in a container. */
+    if (fwrite(w->data, 1, raw, w->file) != raw) {
+      return WRITE_ERROR;
+    }
+    container_set_size(w, raw);
+    w->raw_bytes += raw;
+    w->file_bytes += raw;
+    return 0;
+  }
+  ncards = 0;
+  if (rec->compress == RECORDER_RICE) {
+    heap = 0;
+    maxlen = 0;
+    for (k = 0; k < rec->ntiles; ++k) {
+      if (w->zlen[k] > maxlen) maxlen = w->zlen[k];
+      heap += w->zlen[k];
+    }
+    FITS_STRING(hdr, &ncards, "XTENSION", "BINTABLE", "binary table extension");
+    FITS_INTEGER(hdr, &ncards, "BITPIX", 8, "8-bit bytes");
+    FITS_INTEGER(hdr, &ncards, "NAXIS", 2, "2-dimensional binary table");
+    FITS_INTEGER(hdr, &ncards, "NAXIS1", 8, "width of table in bytes");
+    FITS_INTEGER(hdr, &ncards, "NAXIS2", rec->ntiles, "number of rows");
+    FITS_INTEGER(hdr, &ncards, "PCOUNT", heap, "size of heap");
+    FITS_INTEGER(hdr, &ncards, "GCOUNT", 1, "one data group");
+    FITS_INTEGER(hdr, &ncards, "TFIELDS", 1, "number of fields");
+    FITS_STRING(hdr, &ncards, "TTYPE1", "COMPRESSED_DATA",
+                "compressed tiles");
+    fits_card(hdr, &ncards, "%-8s= '1PB(%ld)' / %s", "TFORM1", maxlen,
+              "variable length array");
+    FITS_LOGICAL(hdr, &ncards, "ZIMAGE", TRUE, "tile compressed image");
+    FITS_INTEGER(hdr, &ncards, "ZBITPIX", rec->bitpix, "bits per pixel");
+    FITS_INTEGER(hdr, &ncards, "ZNAXIS", 2, "number of axes");
+    FITS_INTEGER(hdr, &ncards, "ZNAXIS1", rec->width, "length of axis 1");
+    FITS_INTEGER(hdr, &ncards, "ZNAXIS2", rec->height, "length of axis 2");
+    FITS_INTEGER(hdr, &ncards, "ZTILE1", rec->width, "size of tiles");
+    FITS_INTEGER(hdr, &ncards, "ZTILE2", rec->tile_height, "size of tiles");
+    FITS_STRING(hdr, &ncards, "ZCMPTYPE", "RICE_1", "compression algorithm");
+    FITS_STRING(hdr, &ncards, "ZNAME1", "BLOCKSIZE", "compression block size");
+    FITS_INTEGER(hdr, &ncards, "ZVAL1", RICE_BLOCK, "pixels per block");
+    FITS_STRING(hdr, &ncards, "ZNAME2", "BYTEPIX", "bytes per pixel");
+    FITS_INTEGER(hdr, &ncards, "ZVAL2", rec->bitpix/8, "bytes per pixel");
+    size = 8*rec->ntiles + heap;
+  } else {
+    FITS_STRING(hdr, &ncards, "XTENSION", "IMAGE", "image extension");
+    FITS_INTEGER(hdr, &ncards, "BITPIX", rec->bitpix, "bits per pixel");
+    FITS_INTEGER(hdr, &ncards, "NAXIS", 2, "number of axes");
+    FITS_INTEGER(hdr, &ncards, "NAXIS1", rec->width, "length of axis 1");
+    FITS_INTEGER(hdr, &ncards, "NAXIS2", rec->height, "length of axis 2");
+    FITS_INTEGER(hdr, &ncards, "PCOUNT", 0, "no extra parameters");
+    FITS_INTEGER(hdr, &ncards, "GCOUNT", 1, "one data group");
+    size = raw;
+  }
+  if (rec->bitpix == 16) {
+    FITS_INTEGER(hdr, &ncards, "BZERO", 32768, "offset for unsigned values");
+    FITS_INTEGER(hdr, &ncards, "BSCALE", 1, "default scaling factor");
+  }
+  FITS_INTEGER(hdr, &ncards, "FRAMENUM", number, "frame number");
+  k = fits_end(hdr, &ncards);
+  if (fwrite(hdr, 1, k, w->file) != k) {
+    return WRITE_ERROR;
+  }
+
+  if (rec->compress == RECORDER_RICE) {
+    /* Table of descriptors followed by the heap (the raw image data are not
+       used with compression). */
+    for (k = 0, heap = 0; k < rec->ntiles; ++k) {
+      put_int32_be(w->data + 8*k, w->zlen[k]);
+      put_int32_be(w->data + 8*k + 4, heap);
+      heap += w->zlen[k];
+    }
+    if (fwrite(w->data, 8, rec->ntiles, w->file) != rec->ntiles) {
+      return WRITE_ERROR;
+    }
+    for (k = 0; k < rec->ntiles; ++k) {
+      if (fwrite(w->zbuf + k*rec->tile_cap, 1, w->zlen[k], w->file)
+          != w->zlen[k]) {
+        return WRITE_ERROR;
+      }
+    }
+  } else if (fwrite(w->data, 1, raw, w->file) != raw) {
+    return WRITE_ERROR;
+  }
+  pad = ROUND_UP(size, FITS_BLOCK) - size;
+  if (pad > 0 && fwrite(zeros, 1, pad, w->file) != pad) {
+    return WRITE_ERROR;
+  }
+  w->raw_bytes += raw;
+  w->file_bytes += size;
+  return 0;
+}
+
+static void*
+recorder_thread(void* arg)
+{
+  writer_t* w = (writer_t*)arg;
+  const recorder_t* rec = w->rec;
+  int64_t seq;
+  double time;
+  long k, number;
+  int code;
+
+  pthread_mutex_lock(&w->mutex);
+  for (;;) {
+    while (w->count == 0 && ! w->quit) {
+      pthread_cond_wait(&w->ready, &w->mutex);
+    }
+    if (w->count == 0) {
+      break;
+    }
+    k = (w->head + rec->nslots - w->count) % rec->nslots;
+    number = w->numbers[k];
+    time = w->times[k];
+    seq = w->seqs[k];
+    w->busy = TRUE;
+    pthread_mutex_unlock(&w->mutex);
+    code = (w->error == 0 ?
+            recorder_write(w, w->slots + k*rec->slot_size,
+                           number, time, seq) : 0);
+    if (code == 0 && w->error == 0 && w->meta != NULL &&
+        fwrite(w->records + k*RECORDER_RECORD, 1, RECORDER_RECORD, w->meta)
+        != RECORDER_RECORD) {
+      code = WRITE_ERROR;
+    }
+    pthread_mutex_lock(&w->mutex);
+    if (code != 0) {
+      w->error = code;
+    } else if (w->error == 0) {
+      ++w->written;
+    }
+    w->busy = FALSE;
+    --w->count;
+    pthread_cond_broadcast(&w->space);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+static void
+recorder_setup(stage_t* stage, const camera_t* cam)
+{
+  recorder_t* rec = (recorder_t*)stage;
+  writer_t* w;
+  long nthreads, width, tile_rows, ntiles, tile_cap, k;
+  int bitpix;
+  void* ptr;
+
+  switch (cam->encoding) {
+  case ENCODING_Mono8:
+    bitpix = 8;
+    break;
+  case ENCODING_Mono12:
+  case ENCODING_Mono12Packed:
+  case ENCODING_Mono16:
+    bitpix = 16;
+    break;
+  default:
+    y_error("unsupported pixel encoding for recording");
+    return;
+  }
+
+  /* Wait for the frames of a previous acquisition to be written. */
+  recorder_drain(rec);
+  if (rec->metadata) {
+    /* Store the frequency of the timestamp clock in the sidecar files. */
+    for (k = 0; k < rec->nwriters; ++k) {
+      w = &rec->writers[k];
+      recorder_meta_header(w->header, cam->frequency);
+      if (w->error == 0 &&
+          (fseeko(w->meta, 0, SEEK_SET) != 0 ||
+           fwrite(w->header, 1, RECORDER_META_HEADER, w->meta)
+           != RECORDER_META_HEADER ||
+           fseeko(w->meta, 0, SEEK_END) != 0)) {
+        w->error = WRITE_ERROR;
+      }
+    }
+    rec->temperature = get_float_or_nan(cam->handle, L"SensorTemperature");
+    rec->temperature_time = monotonic_time();
+  }
+  if (rec->writers[0].buffer != NULL && rec->bitpix == bitpix &&
+      rec->frame_size == cam->frame_size &&
+      rec->width == cam->frame_width && rec->height == cam->frame_height) {
+    rec->stride = cam->row_stride;
+    rec->encoding = cam->encoding;
+    return;
+  }
+
+  /* Free previous resources. */
+  rec->width = 0;
+  rec->height = 0;
+  for (k = 0; k < rec->nwriters; ++k) {
+    w = &rec->writers[k];
+    ptr = w->buffer;
+    w->buffer = NULL;
+    if (ptr != NULL) p_free(ptr);
+  }
+
+  /* Allocate all resources of each writer at once. */
+  rec->bitpix = bitpix;
+  width = cam->frame_width;
+  tile_rows = (rec->tile_rows < cam->frame_height ?
+               rec->tile_rows : cam->frame_height);
+  ntiles = (cam->frame_height + tile_rows - 1)/tile_rows;
+  if (rec->compress == RECORDER_DELTA) {
+    tile_cap = CODEC_TILE_CAP(tile_rows*width, rec->bitpix);
+  } else {
+    tile_cap = (tile_rows*width*rec->bitpix
+                + ((tile_rows*width + RICE_BLOCK - 1)/RICE_BLOCK)*4
+                + rec->bitpix + 7)/8;
+  }
+  tile_cap = ROUND_UP(tile_cap, 8);
+  rec->slot_size = ROUND_UP(cam->frame_size, FRAME_ALIGN);
+  for (k = 0; k < rec->nwriters; ++k) {
+    w = &rec->writers[k];
+    nthreads = w->workers->nthreads;
+    ptr = p_malloc(rec->nslots*rec->slot_size
+                   + rec->nslots*sizeof(long)
+                   + rec->nslots*sizeof(double)
+                   + rec->nslots*sizeof(int64_t)
+                   + rec->nslots*RECORDER_RECORD
+                   + ntiles*sizeof(long)
+                   + nthreads*width*sizeof(float)
+                   + nthreads*tile_rows*width*sizeof(int)
+                   + width*cam->frame_height*(rec->bitpix/8)
+                   + CODEC_HEADER + 8*ntiles
+                   + (rec->compress != RECORDER_NONE ? ntiles*tile_cap : 0));
+    w->buffer = ptr;
+    w->slots = (unsigned char*)ptr;
+    w->numbers = (long*)(w->slots + rec->nslots*rec->slot_size);
+    w->times = (double*)(w->numbers + rec->nslots);
+    w->seqs = (int64_t*)(w->times + rec->nslots);
+    w->records = (unsigned char*)(w->seqs + rec->nslots);
+    w->zlen = (long*)(w->records + rec->nslots*RECORDER_RECORD);
+    w->rows = (float*)(w->zlen + ntiles);
+    w->values = (unsigned int*)(w->rows + nthreads*width);
+    w->data = (unsigned char*)(w->values + nthreads*tile_rows*width);
+    w->zbuf = w->data + width*cam->frame_height*(rec->bitpix/8)
+      + CODEC_HEADER + 8*ntiles;
+    w->head = 0;
+    w->count = 0;
+  }
+  rec->tile_height = tile_rows;
+  rec->ntiles = ntiles;
+  rec->tile_cap = tile_cap;
+  rec->width = width;
+  rec->height = cam->frame_height;
+  rec->stride = cam->row_stride;
+  rec->frame_size = cam->frame_size;
+  rec->encoding = cam->encoding;
+}
+
+static int
+recorder_process(stage_t* stage, const camera_t* cam,
+                 const unsigned char* frame)
+{
+  recorder_t* rec = (recorder_t*)stage;
+  writer_t* w;
+  int64_t seq;
+  long k;
+
+  /* Frames are distributed round-robin among the writers. */
+  seq = rec->seq++;
+  w = &rec->writers[seq % rec->nwriters];
+  pthread_mutex_lock(&w->mutex);
+  if (w->count >= rec->nslots || w->error != 0) {
+    ++rec->dropped;
+    pthread_mutex_unlock(&w->mutex);
+    return TRUE;
+  }
+  k = w->head;
+  pthread_mutex_unlock(&w->mutex);
+
+  /* The slot is not used by the writer thread. */
+  memcpy(w->slots + k*rec->slot_size, frame, rec->frame_size);
+  w->numbers[k] = stage->frames + 1;
+  w->times[k] = wall_clock_time();
+  w->seqs[k] = seq;
+  if (rec->metadata) {
+    recorder_record(rec, w, k, cam, frame);
+  }
+
+  pthread_mutex_lock(&w->mutex);
+  w->head = (k + 1) % rec->nslots;
+  ++w->count;
+  pthread_cond_signal(&w->ready);
+  pthread_mutex_unlock(&w->mutex);
+  return TRUE;
+}
+
+/* Get the first error of the writers. */
+static int
+recorder_error(const recorder_t* rec)
+{
+  long k;
+  for (k = 0; k < rec->nwriters; ++k) {
+    if (rec->writers[k].error != 0) {
+      return rec->writers[k].error;
+    }
+  }
+  return 0;
+}
+
+static void
+recorder_eval(stage_t* stage, int argc)
+{
+  recorder_t* rec = (recorder_t*)stage;
+  writer_t* w;
+  long k, written;
+  int code;
+
+  recorder_drain(rec);
+  if (rec->chunk > 0 && recorder_error(rec) == 0) {
+    code = recorder_write_indices(rec);
+    if (code != 0) rec->writers[0].error = code;
+  }
+  for (k = 0, written = 0; k < rec->nwriters; ++k) {
+    w = &rec->writers[k];
+    if (w->error == 0 && (fflush(w->file) != 0 ||
+                          (w->meta != NULL && fflush(w->meta) != 0))) {
+      w->error = WRITE_ERROR;
+    }
+    written += w->written;
+  }
+  code = recorder_error(rec);
+  if (code != 0) {
+    y_error(strerror(code));
+  }
+  push_long(written);
+}
+
+static int
+recorder_extract(stage_t* stage, const char* name)
+{
+  recorder_t* rec = (recorder_t*)stage;
+  double raw, size;
+  long k, n;
+
+  if (strcmp(name, "written") == 0) {
+    for (k = 0, n = 0; k < rec->nwriters; ++k) {
+      n += rec->writers[k].written;
+    }
+    push_long(n);
+  } else if (strcmp(name, "dropped") == 0) {
+    push_long(rec->dropped);
+  } else if (strcmp(name, "pending") == 0) {
+    for (k = 0, n = 0; k < rec->nwriters; ++k) {
+      n += rec->writers[k].count;
+    }
+    push_long(n);
+  } else if (strcmp(name, "error") == 0) {
+    push_int(recorder_error(rec));
+  } else if (strcmp(name, "ratio") == 0) {
+    for (k = 0, raw = 0.0, size = 0.0; k < rec->nwriters; ++k) {
+      raw += rec->writers[k].raw_bytes;
+      size += rec->writers[k].file_bytes;
+    }
+    push_double(size > 0.0 ? raw/size : 0.0);
+  } else if (strcmp(name, "stripes") == 0) {
+    push_long(rec->nwriters);
+  } else if (strcmp(name, "nthreads") == 0) {
+    push_long(rec->writers[0].workers != NULL ?
+              rec->writers[0].workers->nthreads : 1);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+recorder_free(stage_t* stage)
+{
+  recorder_t* rec = (recorder_t*)stage;
+  writer_t* w;
+  long k;
+
+  if (rec->writers == NULL) {
+    return;
+  }
+  for (k = 0; k < rec->nwriters; ++k) {
+    w = &rec->writers[k];
+    if (w->running) {
+      pthread_mutex_lock(&w->mutex);
+      w->quit = TRUE;
+      pthread_cond_signal(&w->ready);
+      pthread_mutex_unlock(&w->mutex);
+      pthread_join(w->thread, NULL);
+      w->running = FALSE;
+    }
+  }
+  for (k = 0; k < rec->nwriters; ++k) {
+    if (rec->writers[k].file == NULL) break;
+  }
+  if (rec->chunk > 0 && k == rec->nwriters && recorder_error(rec) == 0) {
+    (void)recorder_write_indices(rec);
+  }
+  for (k = 0; k < rec->nwriters; ++k) {
+    w = &rec->writers[k];
+    if (w->initialized) {
+      pthread_cond_destroy(&w->space);
+      pthread_cond_destroy(&w->ready);
+      pthread_mutex_destroy(&w->mutex);
+    }
+    free_workers(w->workers);
+    if (w->file != NULL) fclose(w->file);
+    if (w->meta != NULL) fclose(w->meta);
+    if (w->index != NULL) free(w->index);
+    if (w->index_seq != NULL) free(w->index_seq);
+    if (w->buffer != NULL) p_free(w->buffer);
+  }
+  p_free(rec->writers);
+}
+
+static stage_class_t recorder_class = {
+  "Andor frame recorder",
+  recorder_setup,
+  recorder_process,
+  NULL,
+  recorder_eval,
+  recorder_extract,
+  recorder_free
+};
+
+void
+Y__andor_recorder(int argc)
+{
+  recorder_t* rec;
+  writer_t* w;
+  char** paths;
+  char* hdr;
+  char* name;
+  long ncards, size, tile_rows, nslots, chunk, npaths, k;
+  int compress, nthreads, metadata;
+
+  if (argc != 7) y_error("expecting exactly 7 arguments");
+  paths = ygeta_q(6, &npaths, NULL);
+  compress = get_int(5);
+  tile_rows = get_long(4);
+  nslots = get_long(3);
+  nthreads = get_int(2);
+  chunk = get_long(1);
+  metadata = get_boolean(0);
+  for (k = 0; k < npaths; ++k) {
+    if (paths[k] == NULL || paths[k][0] == '\0') {
+      y_error("invalid file name");
+    }
+  }
+  if (tile_rows < 1) y_error("invalid number of rows per tile");
+  if (nslots < 1) y_error("invalid number of slots");
+  if (compress < RECORDER_NONE || compress > RECORDER_DELTA) {
+    y_error("invalid compression method");
+  }
+  if (chunk < 0) y_error("invalid number of frames per chunk");
+  if (chunk > 0 && compress == RECORDER_RICE) {
+    y_error("Rice compression is only available for FITS files");
+  }
+  if (npaths > 1 && chunk == 0) {
+    y_error("only containers can be striped over several files");
+  }
+  if (npaths > 65535) y_error("too many files");
+
+  rec = (recorder_t*)push_stage(&recorder_class, sizeof(recorder_t));
+  rec->compress = compress;
+  rec->tile_rows = tile_rows;
+  rec->nslots = nslots;
+  rec->chunk = chunk;
+  rec->metadata = metadata;
+  rec->writers = (writer_t*)p_malloc(npaths*sizeof(writer_t));
+  memset(rec->writers, 0, npaths*sizeof(writer_t));
+  rec->nwriters = npaths;
+  for (k = 0; k < npaths; ++k) {
+    w = &rec->writers[k];
+    w->rec = rec;
+    w->stripe = k;
+    w->file = fopen(paths[k], "wb");
+    if (w->file == NULL) {
+      y_error("cannot create file");
+    }
+    if (metadata) {
+      name = p_malloc(strlen(paths[k]) + 6);
+      strcpy(name, paths[k]);
+      strcat(name, ".meta");
+      w->meta = fopen(name, "wb");
+      p_free(name);
+      if (w->meta == NULL) {
+        y_error("cannot create metadata file");
+      }
+      recorder_meta_header(w->header, 0.0);
+      if (fwrite(w->header, 1, RECORDER_META_HEADER, w->meta)
+          != RECORDER_META_HEADER) {
+        y_error("cannot write metadata file");
+      }
+    }
+
+    /* Write the primary header. */
+    hdr = w->header;
+    if (chunk > 0) {
+      container_header(hdr, chunk);
+      if (fwrite(hdr, 1, CONTAINER_HEADER, w->file) != CONTAINER_HEADER) {
+        y_error("cannot write file");
+      }
+      w->offset = CONTAINER_HEADER;
+    } else if (compress != RECORDER_DELTA) {
+      ncards = 0;
+      FITS_LOGICAL(hdr, &ncards, "SIMPLE", TRUE, "file conforms to FITS");
+      FITS_INTEGER(hdr, &ncards, "BITPIX", 8, "no data");
+      FITS_INTEGER(hdr, &ncards, "NAXIS", 0, "no data");
+      FITS_LOGICAL(hdr, &ncards, "EXTEND", TRUE, "frames are in extensions");
+      size = fits_end(hdr, &ncards);
+      if (fwrite(hdr, 1, size, w->file) != size) {
+        y_error("cannot write file");
+      }
+    }
+
+    w->workers = new_workers(nthreads);
+    if (w->workers == NULL) y_error("insufficient memory");
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    pthread_cond_init(&w->space, NULL);
+    w->initialized = TRUE;
+    if (pthread_create(&w->thread, NULL, recorder_thread, w) != 0) {
+      y_error("cannot start writer thread");
+    }
+    w->running = TRUE;
+  }
+}
+
+/* Reader of the sidecar metadata files written by the recorder. */
+typedef struct _metadata_table metadata_table_t;
+struct _metadata_table {
+  unsigned char* data;  /* Records. */
+  long count;           /* Number of records. */
+  double frequency;     /* Frequency of the timestamp clock. */
+};
+
+static void
+free_metadata_table(void* ptr)
+{
+  metadata_table_t* tab = (metadata_table_t*)ptr;
+  if (tab->data != NULL) p_free(tab->data);
+}
+
+static void
+print_metadata_table(void* ptr)
+{
+  char buffer[64];
+  metadata_table_t* tab = (metadata_table_t*)ptr;
+  y_print("Andor metadata table", 0);
+  sprintf(buffer, " (%ld frames)", tab->count);
+  y_print(buffer, 1);
+}
+
+static void eval_metadata_table(void* ptr, int argc);
+static void extract_metadata_table(void* ptr, char* name);
+
+static y_userobj_t metadata_table_type = {
+  "Andor metadata table",
+  free_metadata_table, print_metadata_table, eval_metadata_table,
+  extract_metadata_table, NULL
+};
+
+/* Names of the columns of a metadata table with the offset and the type
+   ('l' for integers, 'd' for doubles) of the values in the records. */
+static struct {
+  const char* name;
+  int offset;
+  int type;
+} metadata_columns[] = {
+  {"numbers",       0, 'l'},
+  {"sequences",     8, 'l'},
+  {"times",        16, 'd'},
+  {"ticks",        24, 'l'},
+  {"exposures",    32, 'd'},
+  {"temperatures", 40, 'd'},
+  {"dropped",      48, 'l'},
+  {"stripes",      56, 'i'},
+  {"flags",        60, 'i'},
+  {NULL, 0, 0}
+};
+
+/* Get the value of column J of record K as a double. */
+static double
+metadata_value(const metadata_table_t* tab, long k, int j)
+{
+  const unsigned char* src = (tab->data + k*RECORDER_RECORD
+                              + metadata_columns[j].offset);
+  switch (metadata_columns[j].type) {
+  case 'd':
+    return get_double_le(src);
+  case 'i':
+    return (double)get_uint32_le(src);
+  default:
+    return (double)get_uint64_le(src);
+  }
+}
+
+static void
+eval_metadata_table(void* ptr, int argc)
+{
+  metadata_table_t* tab = (metadata_table_t*)ptr;
+  double* dst;
+  long dims[3], k;
+  int j, ncols;
+
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  if (tab->count <= 0) {
+    push_nil();
+    return;
+  }
+  for (ncols = 0; metadata_columns[ncols].name != NULL; ++ncols)
+    ;
+  dims[0] = 2;
+  dims[1] = ncols;
+  dims[2] = tab->count;
+  dst = ypush_d(dims);
+  for (k = 0; k < tab->count; ++k) {
+    for (j = 0; j < ncols; ++j) {
+      *dst++ = metadata_value(tab, k, j);
+    }
+  }
+}
+
+static void
+extract_metadata_table(void* ptr, char* name)
+{
+  metadata_table_t* tab = (metadata_table_t*)ptr;
+  const unsigned char* src;
+  long dims[2], k;
+  int j;
+
+  if (strcmp(name, "count") == 0) {
+    push_long(tab->count);
+    return;
+  } else if (strcmp(name, "frequency") == 0) {
+    push_double(tab->frequency);
+    return;
+  }
+  for (j = 0; metadata_columns[j].name != NULL; ++j) {
+    if (strcmp(name, metadata_columns[j].name) == 0) break;
+  }
+  if (metadata_columns[j].name == NULL) {
+    y_error("illegal member");
+    return;
+  }
+  if (tab->count <= 0) {
+    push_nil();
+    return;
+  }
+  dims[0] = 1;
+  dims[1] = tab->count;
+  src = tab->data + metadata_columns[j].offset;
+  if (metadata_columns[j].type == 'd') {
+    double* dst = ypush_d(dims);
+    for (k = 0; k < tab->count; ++k, src += RECORDER_RECORD) {
+      dst[k] = get_double_le(src);
+    }
+  } else if (metadata_columns[j].type == 'i') {
+    long* dst = ypush_l(dims);
+    for (k = 0; k < tab->count; ++k, src += RECORDER_RECORD) {
+      dst[k] = (long)get_uint32_le(src);
+    }
+  } else {
+    long* dst = ypush_l(dims);
+    for (k = 0; k < tab->count; ++k, src += RECORDER_RECORD) {
+      dst[k] = (long)get_uint64_le(src);
+    }
+  }
+}
+
+void
+Y_andor_open_metadata(int argc)
+{
+  metadata_table_t* tab;
+  unsigned char hdr[RECORDER_META_HEADER];
+  const char* path;
+  FILE* file;
+  long size;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  path = ygets_q(0);
+  tab = (metadata_table_t*)ypush_obj(&metadata_table_type,
+                                     sizeof(metadata_table_t));
+  file = fopen(path, "rb");
+  if (file == NULL) y_error("cannot open metadata file");
+  size = (fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1);
+  if (size < RECORDER_META_HEADER ||
+      fseek(file, 0, SEEK_SET) != 0 ||
+      fread(hdr, 1, RECORDER_META_HEADER, file) != RECORDER_META_HEADER ||
+      memcmp(hdr, RECORDER_META_MAGIC, 8) != 0 ||
+      get_uint32_le(hdr + 12) != RECORDER_RECORD) {
+    fclose(file);
+    y_error("not a metadata file");
+  }
+  tab->frequency = get_double_le(hdr + 16);
+  tab->count = (size - RECORDER_META_HEADER)/RECORDER_RECORD;
+  tab->data = p_malloc(tab->count*RECORDER_RECORD + 1);
+  if (fread(tab->data, RECORDER_RECORD, tab->count, file) != tab->count) {
+    fclose(file);
+    y_error("cannot read metadata file");
+  }
+  fclose(file);
+}
+
+/*---------------------------------------------------------------------------*/
+/* RING FILE */
+
+/* The ring file stage copies the raw frames, as they are delivered, into a
+   file of fixed size mapped in memory.  The file holds the last NSLOTS
+   frames, so that the most recent data survive if the process dies: the
+   pages of the mapping belong to the page cache and are written to disk by
+   the system even though the process is killed.  The file starts with a
+   header of RING_HEADER bytes (all values are little-endian):
+
+       offset  size  contents
+         0       8   magic "ANDORRF1"
+         8       4   version (1)
+        12       4   size of the header
+        16       4   number of slots
+        20       4   size of the slot header
+        24       8   size of a slot (slot header included)
+        32       4   width
+        36       4   height
+        40       8   row stride in bytes
+        48       8   frame size in bytes
+        56       8   index of the next slot to write (cursor)
+        64       8   sequence number of the last written frame
+        72      32   pixel encoding (NUL terminated)
+
+   and is followed by the slots, each made of a header of RING_SLOT_HEADER
+   bytes and of the raw frame data:
+
+       offset  size  contents
+         0       8   sequence number (0 if the slot is empty or being written)
+         8       8   frame number
+        16       8   arrival time (IEEE double, seconds since the Epoch)
+        24       8   size of the frame data
+
+   The sequence number of a slot is cleared before its data are overwritten
+   and set once the copy is complete, so a frame being written when the
+   process dies is simply ignored by the reader. */
+
+#define RING_HEADER      4096
+#define RING_SLOT_HEADER 64
+#define RING_MAGIC       "ANDORRF1"
+
+/* Prevent the compiler and the processor from reordering the stores to the
+   mapped file across this point. */
+#define RING_BARRIER() __sync_synchronize()
+
+typedef struct _ring_file ring_file_t;
+struct _ring_file {
+  stage_t base;
+  int fd;               /* File descriptor. */
+  unsigned char* addr;  /* Address of mapped file. */
+  size_t size;          /* Size of mapped file. */
+  long nslots;          /* Number of slots. */
+  long slot_size;       /* Size of a slot. */
+  long frame_size;      /* Size of the frame data. */
+  long cursor;          /* Index of next slot to write. */
+  uint64_t seq;         /* Sequence number of last written frame. */
+  long width, height, stride;
+  int encoding;
+};
+
+/* Fill the header of a ring file. */
+static void
+ring_file_header(unsigned char* hdr, long nslots, long slot_size,
+                 const camera_t* cam)
+{
+  memset(hdr, 0, RING_HEADER);
+  memcpy(hdr, RING_MAGIC, 8);
+  put_uint32_le(hdr + 8, 1);
+  put_uint32_le(hdr + 12, RING_HEADER);
+  put_uint32_le(hdr + 16, nslots);
+  put_uint32_le(hdr + 20, RING_SLOT_HEADER);
+  put_uint64_le(hdr + 24, (uint64_t)slot_size);
+  put_uint32_le(hdr + 32, cam->frame_width);
+  put_uint32_le(hdr + 36, cam->frame_height);
+  put_uint64_le(hdr + 40, (uint64_t)cam->row_stride);
+  put_uint64_le(hdr + 48, (uint64_t)cam->frame_size);
+  strncpy((char*)hdr + 72, pixel_encoding_table[cam->encoding].name, 31);
+}
+
+static void
+ring_file_setup(stage_t* stage, const camera_t* cam)
+{
+  ring_file_t* rf = (ring_file_t*)stage;
+  unsigned char hdr[RING_HEADER];
+  long slot_size, k;
+  size_t size;
+  void* addr;
+
+  if (cam->encoding < 0) {
+    y_error("unknown pixel encoding");
+  }
+  slot_size = ROUND_UP(RING_SLOT_HEADER + cam->frame_size, FRAME_ALIGN);
+  ring_file_header(hdr, rf->nslots, slot_size, cam);
+  if (rf->addr != NULL) {
+    if (memcmp(rf->addr, hdr, 56) == 0 && memcmp(rf->addr + 72, hdr + 72,
+                                                  RING_HEADER - 72) == 0) {
+      /* Same format, keep on filling the ring. */
+      return;
+    }
+    munmap(rf->addr, rf->size);
+    rf->addr = NULL;
+  }
+
+  /* Size the file and allocate its blocks now so that copying the frames
+     does not have to. */
+  size = RING_HEADER + rf->nslots*slot_size;
+  if (ftruncate(rf->fd, (off_t)size) != 0) {
+    y_error("cannot resize ring file");
+  }
+  (void)posix_fallocate(rf->fd, 0, (off_t)size);
+  addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, rf->fd, 0);
+  if (addr == MAP_FAILED) {
+    y_error("cannot map ring file");
+  }
+  rf->addr = (unsigned char*)addr;
+  rf->size = size;
+  rf->slot_size = slot_size;
+  rf->frame_size = cam->frame_size;
+  rf->width = cam->frame_width;
+  rf->height = cam->frame_height;
+  rf->stride = cam->row_stride;
+  rf->encoding = cam->encoding;
+
+  if (memcmp(rf->addr, hdr, 56) == 0 &&
+      memcmp(rf->addr + 72, hdr + 72, RING_HEADER - 72) == 0) {
+    /* The file already holds a ring with the same format (for instance
+       after a crash), resume after its last frame. */
+    rf->cursor = (long)(get_uint64_le(rf->addr + 56) % rf->nslots);
+    rf->seq = get_uint64_le(rf->addr + 64);
+    for (k = 0; k < rf->nslots; ++k) {
+      uint64_t seq = get_uint64_le(rf->addr + RING_HEADER + k*slot_size);
+      if (seq > rf->seq) {
+        rf->seq = seq;
+        rf->cursor = (k + 1) % rf->nslots;
+      }
+    }
+  } else {
+    for (k = 0; k < rf->nslots; ++k) {
+      memset(rf->addr + RING_HEADER + k*slot_size, 0, RING_SLOT_HEADER);
+    }
+    rf->cursor = 0;
+    rf->seq = 0;
+    RING_BARRIER();
+    memcpy(rf->addr, hdr, RING_HEADER);
+  }
+}
+
+static int
+ring_file_process(stage_t* stage, const camera_t* cam,
+                  const unsigned char* frame)
+{
+  ring_file_t* rf = (ring_file_t*)stage;
+  unsigned char* slot = rf->addr + RING_HEADER + rf->cursor*rf->slot_size;
+
+  put_uint64_le(slot, 0);
+  RING_BARRIER();
+  memcpy(slot + RING_SLOT_HEADER, frame, rf->frame_size);
+  put_uint64_le(slot + 8, (uint64_t)(stage->frames + 1));
+  put_double_le(slot + 16, wall_clock_time());
+  put_uint64_le(slot + 24, (uint64_t)rf->frame_size);
+  RING_BARRIER();
+  put_uint64_le(slot, ++rf->seq);
+  RING_BARRIER();
+  rf->cursor = (rf->cursor + 1) % rf->nslots;
+  put_uint64_le(rf->addr + 56, (uint64_t)rf->cursor);
+  put_uint64_le(rf->addr + 64, rf->seq);
+  return TRUE;
+}
+
+static void
+ring_file_eval(stage_t* stage, int argc)
+{
+  ring_file_t* rf = (ring_file_t*)stage;
+  if (rf->addr != NULL && msync(rf->addr, rf->size, MS_SYNC) != 0) {
+    y_error(strerror(errno));
+  }
+  push_long((long)rf->seq);
+}
+
+static int
+ring_file_extract(stage_t* stage, const char* name)
+{
+  ring_file_t* rf = (ring_file_t*)stage;
+  if (strcmp(name, "nslots") == 0) {
+    push_long(rf->nslots);
+  } else if (strcmp(name, "sequence") == 0) {
+    push_long((long)rf->seq);
+  } else if (strcmp(name, "cursor") == 0) {
+    push_long(rf->cursor);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+ring_file_free(stage_t* stage)
+{
+  ring_file_t* rf = (ring_file_t*)stage;
+  if (rf->addr != NULL) {
+    munmap(rf->addr, rf->size);
+  }
+  if (rf->fd >= 0) {
+    close(rf->fd);
+  }
+}
+
+static stage_class_t ring_file_class = {
+  "Andor ring file",
+  ring_file_setup,
+  ring_file_process,
+  NULL,
+  ring_file_eval,
+  ring_file_extract,
+  ring_file_free
+};
+
+void
+Y__andor_ring_file(int argc)
+{
+  ring_file_t* rf;
+  const char* path;
+  long nslots;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  path = ygets_q(1);
+  nslots = get_long(0);
+  if (path == NULL || path[0] == '\0') y_error("invalid file name");
+  if (nslots < 1) y_error("invalid number of frames");
+  rf = (ring_file_t*)push_stage(&ring_file_class, sizeof(ring_file_t));
+  rf->nslots = nslots;
+  rf->fd = open(path, O_RDWR|O_CREAT, 0644);
+  if (rf->fd < 0) {
+    y_error("cannot open ring file");
+  }
+}
+
+/* Reader of ring files, the file is mapped in memory so that the ring can
+   be read while it is being filled. */
+typedef struct _ring_reader ring_reader_t;
+struct _ring_reader {
+  void* addr;           /* Address of mapped file. */
+  size_t size;          /* Size of mapped file. */
+  uint64_t* seqs;       /* Sequence numbers of the valid slots. */
+  long* slots;          /* Indices of the valid slots by increasing sequence
+                           numbers. */
+  long count;           /* Number of valid slots. */
+  long slot_size;       /* Size of a slot. */
+  camera_t cam;         /* Geometry of the frames (for the extractors). */
+};
+
+static void
+free_ring_reader(void* ptr)
+{
+  ring_reader_t* rr = (ring_reader_t*)ptr;
+  if (rr->addr != NULL) munmap(rr->addr, rr->size);
+  if (rr->seqs != NULL) p_free(rr->seqs);
+}
+
+static void
+print_ring_reader(void* ptr)
+{
+  char buffer[64];
+  ring_reader_t* rr = (ring_reader_t*)ptr;
+  y_print("Andor ring file reader", 0);
+  sprintf(buffer, " (%ld frames)", rr->count);
+  y_print(buffer, 1);
+}
+
+static void eval_ring_reader(void* ptr, int argc);
+static void extract_ring_reader(void* ptr, char* name);
+
+static y_userobj_t ring_reader_type = {
+  "Andor ring file reader",
+  free_ring_reader, print_ring_reader, eval_ring_reader, extract_ring_reader,
+  NULL
+};
+
+static const unsigned char*
+ring_reader_slot(const ring_reader_t* rr, long k)
+{
+  return (const unsigned char*)rr->addr + RING_HEADER + k*rr->slot_size;
+}
+
+static void
+eval_ring_reader(void* ptr, int argc)
+{
+  ring_reader_t* rr = (ring_reader_t*)ptr;
+  const unsigned char* slot;
+  long i;
+
+  if (argc != 1) y_error("expecting exactly 1 frame index");
+  i = get_long(0);
+  if (i < 1 || i > rr->count) y_error("out of range frame index");
+  slot = ring_reader_slot(rr, rr->slots[i - 1]);
+  rr->cam.extract(&rr->cam, slot + RING_SLOT_HEADER);
+  RING_BARRIER();
+  if (get_uint64_le(slot) != rr->seqs[i - 1]) {
+    y_error("frame has been overwritten");
+  }
+}
+
+static void
+extract_ring_reader(void* ptr, char* name)
+{
+  ring_reader_t* rr = (ring_reader_t*)ptr;
+  long dims[2], k;
+  int field;
+
+  if (strcmp(name, "count") == 0) {
+    push_long(rr->count);
+    return;
+  } else if (strcmp(name, "encoding") == 0) {
+    push_string(pixel_encoding_table[rr->cam.encoding].name);
+    return;
+  } else if (strcmp(name, "sequences") == 0) {
+    field = 0;
+  } else if (strcmp(name, "numbers") == 0) {
+    field = 8;
+  } else if (strcmp(name, "times") == 0) {
+    field = 16;
+  } else {
+    y_error("illegal member");
+    return;
+  }
+  if (rr->count <= 0) {
+    push_nil();
+    return;
+  }
+  dims[0] = 1;
+  dims[1] = rr->count;
+  if (field == 16) {
+    double* dst = ypush_d(dims);
+    for (k = 0; k < rr->count; ++k) {
+      dst[k] = get_double_le(ring_reader_slot(rr, rr->slots[k]) + field);
+    }
+  } else {
+    long* dst = ypush_l(dims);
+    for (k = 0; k < rr->count; ++k) {
+      dst[k] = (long)get_uint64_le(ring_reader_slot(rr, rr->slots[k])
+                                   + field);
+    }
+  }
+}
+
+void
+Y_andor_open_ring_file(int argc)
+{
+  ring_reader_t* rr;
+  const unsigned char* hdr;
+  const unsigned char* slot;
+  const char* path;
+  struct stat st;
+  uint64_t seq, frame_size;
+  long nslots, i, j, k, n;
+  char name[32];
+  int fd;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  path = ygets_q(0);
+  rr = (ring_reader_t*)ypush_obj(&ring_reader_type, sizeof(ring_reader_t));
+  fd = open(path, O_RDONLY);
+  if (fd < 0) y_error("cannot open ring file");
+  if (fstat(fd, &st) != 0 || st.st_size < RING_HEADER) {
+    close(fd);
+    y_error("not a ring file");
+  }
+  rr->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (rr->addr == MAP_FAILED) {
+    rr->addr = NULL;
+    y_error("cannot map ring file");
+  }
+  rr->size = st.st_size;
+
+  /* Check the header. */
+  hdr = (const unsigned char*)rr->addr;
+  if (memcmp(hdr, RING_MAGIC, 8) != 0) {
+    y_error("not a ring file");
+  }
+  nslots = get_uint32_le(hdr + 16);
+  rr->slot_size = (long)get_uint64_le(hdr + 24);
+  frame_size = get_uint64_le(hdr + 48);
+  if (get_uint32_le(hdr + 12) != RING_HEADER ||
+      get_uint32_le(hdr + 20) != RING_SLOT_HEADER ||
+      rr->slot_size < RING_SLOT_HEADER + frame_size ||
+      nslots > (rr->size - RING_HEADER)/rr->slot_size) {
+    y_error("corrupted ring file");
+  }
+  memcpy(name, hdr + 72, 31);
+  name[31] = '\0';
+  rr->cam.encoding = -1;
+  rr->cam.output_type = -1;
+  for (k = 0; k < number_of_pixel_encodings; ++k) {
+    if (strcmp(name, pixel_encoding_table[k].name) == 0) {
+      rr->cam.encoding = k;
+      break;
+    }
+  }
+  if (rr->cam.encoding < 0) y_error("unknown pixel encoding");
+  rr->cam.extract = pixel_encoding_table[rr->cam.encoding].extract;
+  rr->cam.frame_width = get_uint32_le(hdr + 32);
+  rr->cam.frame_height = get_uint32_le(hdr + 36);
+  rr->cam.row_stride = (long)get_uint64_le(hdr + 40);
+  rr->cam.frame_size = (long)frame_size;
+
+  /* Collect the valid slots and sort them by increasing sequence numbers
+     (insertion sort, the slots are mostly in order after the cursor). */
+  rr->seqs = (uint64_t*)p_malloc(nslots*(sizeof(long) + sizeof(uint64_t))
+                                 + 1);
+  rr->slots = (long*)(rr->seqs + nslots);
+  k = (long)(get_uint64_le(hdr + 56) % (nslots > 0 ? nslots : 1));
+  for (n = 0, i = 0; i < nslots; ++i, k = (k + 1) % nslots) {
+    slot = ring_reader_slot(rr, k);
+    seq = get_uint64_le(slot);
+    if (seq == 0 || get_uint64_le(slot + 24) != frame_size) continue;
+    for (j = n; j > 0 && rr->seqs[j - 1] > seq; --j) {
+      rr->slots[j] = rr->slots[j - 1];
+      rr->seqs[j] = rr->seqs[j - 1];
+    }
+    rr->slots[j] = k;
+    rr->seqs[j] = seq;
+    ++n;
+  }
+  rr->count = n;
+}
+
+/*---------------------------------------------------------------------------*/
+/* FRAME SERVER */
+
+/* The frame server is a processing stage which distributes the frames of a
+   camera to other processes on the same host.  Clients connect to a Unix
+   domain socket (of type SOCK_SEQPACKET so that messages are not split) and
+   subscribe with a decimation factor, a region of interest and a binning
+   factor.  Each subscriber is given (as a file descriptor passed with the
+   reply) a shared memory area where the server publishes the region of
+   interest of the selected frames, binned and converted to single
+   precision.  The area starts with a header of FS_HEADER bytes:
+
+       offset  size  contents
+         0       8   magic "ANDORFS1"
+         8       4   width of the images
+        12       4   height of the images
+        16       4   number of slots
+        20       4   size of the slot header
+        24       8   size of a slot (slot header included)
+        32       8   sequence number of the last published image (0 if none)
+
+   followed by the slots, each made of a header of FS_SLOT_HEADER bytes and
+   of the image (width*height floats in native byte order):
+
+       offset  size  contents
+         0       8   lock (odd while the slot is being written)
+         8       8   sequence number of the image
+        16       8   frame number
+        24       8   arrival time (IEEE double, seconds since the Epoch)
+
+   Image number S (S = 1, 2, ...) is stored in slot (S - 1) modulo the
+   number of slots.  The lock of a slot is a sequence lock: readers copy the
+   image and check that the lock has not changed (and is even), so the
+   server never waits for the clients.  After publishing an image, the
+   server sends a short "NEWF" message to the client without blocking (the
+   message is dropped if the socket buffer is full); clients use these
+   messages to sleep until a new image is available.
+
+   The subscriptions are managed by a thread of the server which accepts the
+   connections, replies to the requests and detects the disconnected
+   clients.  The fan-out is done by the thread feeding the stage (the caller
+   of andor_wait_image or andor_process) which only shares with the server
+   thread a short list of active subscribers protected by a mutex. */
+
+#define FS_MAGIC        "ANDORFS1"
+#define FS_HEADER       64
+#define FS_SLOT_HEADER  64
+#define FS_MAX_CLIENTS  16
+#define FS_MAX_MESSAGE  1024
+#define FS_TIMEOUT      5000 /* milliseconds */
+
+/* Prevent the compiler and the processor from reordering the accesses to
+   the shared memory across this point. */
+#define FS_BARRIER() __sync_synchronize()
+
+/* The words of the shared memory used for synchronization (seqlocks and
+   sequence numbers) are aligned native 64-bit integers which are read and
+   written atomically, so that other processes never see torn values. */
+#define FS_LOAD(ptr) __atomic_load_n((const uint64_t*)(ptr), __ATOMIC_ACQUIRE)
+#define FS_STORE(ptr, val) \
+  __atomic_store_n((uint64_t*)(ptr), (uint64_t)(val), __ATOMIC_RELEASE)
+
+/* Maximum number of attempts to read a slot which is being written before
+   waiting for the next notification. */
+#define FS_MAX_RETRIES  1000
+
+/* Send a message made of the 4-character TAG and SIZE bytes of DATA,
+   optionally with the file descriptor PASSFD (if nonnegative).  Return 0 on
+   success, -1 on failure. */
+static int
+fs_send(int fd, const char* tag, const void* data, size_t size, int passfd,
+        int flags)
+{
+  unsigned char buf[FS_MAX_MESSAGE];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  struct iovec iov;
+
+  if (size > FS_MAX_MESSAGE - 8) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  memcpy(buf, tag, 4);
+  put_uint32_le(buf + 4, size);
+  if (size > 0) memcpy(buf + 8, data, size);
+  iov.iov_base = buf;
+  iov.iov_len = 8 + size;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (passfd >= 0) {
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+  }
+  if (sendmsg(fd, &msg, flags | MSG_NOSIGNAL) != (ssize_t)(8 + size)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Receive a message in BUF (of FS_MAX_MESSAGE bytes, the payload starts at
+   BUF + 8 and is followed by a final null), storing any passed file
+   descriptor in PASSFD (-1 if none).  Return the size of the payload, -1 on
+   error and -2 if the connection has been closed. */
+static long
+fs_recv(int fd, unsigned char* buf, int* passfd, int flags)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  struct iovec iov;
+  ssize_t n;
+  unsigned long size;
+
+  if (passfd != NULL) *passfd = -1;
+  iov.iov_base = buf;
+  iov.iov_len = FS_MAX_MESSAGE - 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  n = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+  if (n == 0) {
+    return -2;
+  }
+  if (n < 0) {
+    return -1;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int rfd;
+      memcpy(&rfd, CMSG_DATA(cmsg), sizeof(int));
+      if (passfd != NULL && *passfd < 0) {
+        *passfd = rfd;
+      } else {
+        close(rfd);
+      }
+    }
+  }
+  size = (n >= 8 ? get_uint32_le(buf + 4) : 0);
+  if (n < 8 || size != (unsigned long)(n - 8)) {
+    if (passfd != NULL && *passfd >= 0) {
+      close(*passfd);
+      *passfd = -1;
+    }
+    errno = EPROTO;
+    return -1;
+  }
+  buf[n] = '\0';
+  return (long)size;
+}
+
+/* Create an anonymous shared memory area of SIZE bytes, return its file
+   descriptor or -1 on error. */
+static int
+fs_create_shm(size_t size)
+{
+  static unsigned long counter = 0;
+  char name[64];
+  int fd, k;
+
+  for (k = 0; k < 100; ++k) {
+    sprintf(name, "/yandor-%ld-%lu", (long)getpid(), ++counter);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+      shm_unlink(name);
+      if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return -1;
+      }
+      return fd;
+    }
+    if (errno != EEXIST) {
+      break;
+    }
+  }
+  return -1;
+}
+
+typedef struct _fs_client fs_client_t;
+struct _fs_client {
+  int fd;               /* Connected socket. */
+  int active;           /* Client has subscribed? */
+  int raw;              /* Client is a remote camera reading the shared
+                           frame buffers (see "CAMERA BROKER" below)? */
+  long decimation;      /* Publish one frame every DECIMATION frames. */
+  long x0, y0;          /* First column and row of the region of interest
+                           (0-based). */
+  long width, height;   /* Dimensions of the published images. */
+  long bin;             /* Binning factor. */
+  long nslots;          /* Number of slots. */
+  long slot_size;       /* Size of a slot. */
+  unsigned char* addr;  /* Address of shared memory. */
+  size_t size;          /* Size of shared memory. */
+  uint64_t seq;         /* Sequence number of last published image. */
+  long received;        /* Number of frames received since subscription. */
+};
+
+typedef struct _frame_server frame_server_t;
+struct _frame_server {
+  stage_t base;
+  char* path;           /* Path of the socket. */
+  int listen_fd;        /* Listening socket. */
+  int wake[2];          /* Pipe to wake up the server thread. */
+  int started;          /* Server thread has been started? */
+  pthread_t thread;     /* Server thread. */
+  pthread_mutex_t mutex;/* Lock for the members below. */
+  int ready;            /* Frame geometry is known? */
+  long width, height;   /* Dimensions of the frames. */
+  long stride;          /* Row stride of the frames. */
+  int encoding;         /* Pixel encoding of the frames. */
+  int nactive;          /* Number of active subscribers. */
+  fs_client_t* active[FS_MAX_CLIENTS];
+  long published;       /* Number of published images. */
+
+  /* Owned by the server thread. */
+  int nclients;
+  fs_client_t* clients[FS_MAX_CLIENTS];
+
+  /* Owned by the thread feeding the stage. */
+  float* row;           /* Decoded row. */
+  long row_size;        /* Number of elements in ROW. */
+
+  /* Camera broker (see "CAMERA BROKER" below). */
+  int broker;           /* Server is a camera broker? */
+  camera_t* camera;     /* Camera of the broker, NULL if none. */
+  void* camera_use;     /* Reference on the camera of the broker. */
+  AT_H handle;          /* Handle of the camera for remote feature access. */
+  const unsigned char* shared; /* Shared frame buffers of the camera. */
+  int shared_fd;        /* Duplicate of the file descriptor of the shared
+                           frame buffers (protected by the lock), -1 if
+                           none. */
+};
+
+static void br_serve_call(frame_server_t* srv, fs_client_t* cl,
+                          const unsigned char* req, long size);
+static void br_share_frames(frame_server_t* srv, fs_client_t* cl);
+
+static void
+fs_close_client(fs_client_t* cl)
+{
+  if (cl->addr != NULL) munmap(cl->addr, cl->size);
+  if (cl->fd >= 0) close(cl->fd);
+  free(cl);
+}
+
+/* Remove the K-th client (called by the server thread). */
+static void
+fs_remove_client(frame_server_t* srv, int k)
+{
+  fs_client_t* cl = srv->clients[k];
+  int j;
+
+  pthread_mutex_lock(&srv->mutex);
+  for (j = 0; j < srv->nactive; ++j) {
+    if (srv->active[j] == cl) {
+      srv->active[j] = srv->active[--srv->nactive];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&srv->mutex);
+  srv->clients[k] = srv->clients[--srv->nclients];
+  fs_close_client(cl);
+}
+
+static void
+fs_reply_error(int fd, const char* mesg)
+{
+  fs_send(fd, "FAIL", mesg, strlen(mesg), -1, MSG_DONTWAIT);
+}
+
+/* Process a subscription request (called by the server thread). */
+static void
+fs_subscribe(frame_server_t* srv, fs_client_t* cl, const unsigned char* req,
+             long size)
+{
+  unsigned char reply[12];
+  unsigned char* hdr;
+  long decimation, x0, y0, w, h, bin, nslots, width, height;
+  int fd, ready, encoding;
+
+  if (cl->active) {
+    fs_reply_error(cl->fd, "already subscribed");
+    return;
+  }
+  if (size != 28) {
+    fs_reply_error(cl->fd, "bad subscription request");
+    return;
+  }
+  decimation = (long)get_uint32_le(req);
+  x0 = (long)get_uint32_le(req + 4);
+  y0 = (long)get_uint32_le(req + 8);
+  w = (long)get_uint32_le(req + 12);
+  h = (long)get_uint32_le(req + 16);
+  bin = (long)get_uint32_le(req + 20);
+  nslots = (long)get_uint32_le(req + 24);
+  pthread_mutex_lock(&srv->mutex);
+  ready = srv->ready;
+  width = srv->width;
+  height = srv->height;
+  encoding = srv->encoding;
+  pthread_mutex_unlock(&srv->mutex);
+  if (! ready) {
+    fs_reply_error(cl->fd, "acquisition has not been started");
+    return;
+  }
+  if (! is_monochrome(encoding)) {
+    fs_reply_error(cl->fd, "unsupported pixel encoding");
+    return;
+  }
+  if (w == 0) w = width - x0;
+  if (h == 0) h = height - y0;
+  if (decimation < 1 || bin < 1 || nslots < 1 || nslots > 1024 ||
+      x0 < 0 || y0 < 0 || w < bin || h < bin ||
+      x0 + w > width || y0 + h > height) {
+    fs_reply_error(cl->fd, "invalid subscription parameters");
+    return;
+  }
+  cl->decimation = decimation;
+  cl->x0 = x0;
+  cl->y0 = y0;
+  cl->width = w/bin;
+  cl->height = h/bin;
+  cl->bin = bin;
+  cl->nslots = nslots;
+  cl->slot_size = ROUND_UP(FS_SLOT_HEADER +
+                           cl->width*cl->height*sizeof(float), 64);
+  cl->size = FS_HEADER + nslots*cl->slot_size;
+  fd = fs_create_shm(cl->size);
+  if (fd < 0) {
+    fs_reply_error(cl->fd, "cannot create shared memory");
+    return;
+  }
+  cl->addr = (unsigned char*)mmap(NULL, cl->size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+  if (cl->addr == MAP_FAILED) {
+    cl->addr = NULL;
+    close(fd);
+    fs_reply_error(cl->fd, "cannot map shared memory");
+    return;
+  }
+  hdr = cl->addr;
+  memcpy(hdr, FS_MAGIC, 8);
+  put_uint32_le(hdr + 8, cl->width);
+  put_uint32_le(hdr + 12, cl->height);
+  put_uint32_le(hdr + 16, nslots);
+  put_uint32_le(hdr + 20, FS_SLOT_HEADER);
+  put_uint64_le(hdr + 24, cl->slot_size);
+  FS_STORE(hdr + 32, 0);
+  put_uint32_le(reply, cl->width);
+  put_uint32_le(reply + 4, cl->height);
+  put_uint32_le(reply + 8, nslots);
+
+  /* The subscriber is activated before replying, so that it is counted as
+     soon as the client knows it has subscribed.  A client which cannot be
+     replied to will be removed when its disconnection is detected. */
+  cl->active = TRUE;
+  pthread_mutex_lock(&srv->mutex);
+  srv->active[srv->nactive++] = cl;
+  pthread_mutex_unlock(&srv->mutex);
+  fs_send(cl->fd, "OKAY", reply, 12, fd, 0);
+  close(fd);
+}
+
+/* Process a request of a client (called by the server thread), return
+   FALSE if the client must be removed. */
+static int
+fs_serve_request(frame_server_t* srv, fs_client_t* cl)
+{
+  unsigned char buf[FS_MAX_MESSAGE];
+  long size;
+  int fd;
+
+  size = fs_recv(cl->fd, buf, &fd, MSG_DONTWAIT);
+  if (fd >= 0) close(fd);
+  if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return TRUE;
+  }
+  if (size < 0) {
+    return FALSE;
+  }
+  if (memcmp(buf, "SUBS", 4) == 0) {
+    fs_subscribe(srv, cl, buf + 8, size);
+  } else if (memcmp(buf, "CALL", 4) == 0) {
+    br_serve_call(srv, cl, buf + 8, size);
+  } else if (memcmp(buf, "RAWF", 4) == 0) {
+    br_share_frames(srv, cl);
+  } else {
+    fs_reply_error(cl->fd, "unknown request");
+  }
+  return TRUE;
+}
+
+static void*
+fs_thread(void* arg)
+{
+  frame_server_t* srv = (frame_server_t*)arg;
+  struct pollfd fds[FS_MAX_CLIENTS + 2];
+  fs_client_t* cl;
+  int k, n, fd;
+
+  for (;;) {
+    fds[0].fd = srv->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = srv->listen_fd;
+    fds[1].events = POLLIN;
+    for (k = 0; k < srv->nclients; ++k) {
+      fds[k + 2].fd = srv->clients[k]->fd;
+      fds[k + 2].events = POLLIN;
+    }
+    n = srv->nclients + 2;
+    if (poll(fds, n, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[0].revents != 0) {
+      /* Server is shutting down. */
+      break;
+    }
+
+    /* Serve the clients in reverse order as they may be removed. */
+    for (k = n - 3; k >= 0; --k) {
+      if (fds[k + 2].revents == 0) continue;
+      if ((fds[k + 2].revents & POLLIN) == 0 ||
+          ! fs_serve_request(srv, srv->clients[k])) {
+        fs_remove_client(srv, k);
+      }
+    }
+
+    /* Accept a new connection. */
+    if ((fds[1].revents & POLLIN) != 0) {
+      fd = accept(srv->listen_fd, NULL, NULL);
+      if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        cl = NULL;
+        if (srv->nclients < FS_MAX_CLIENTS) {
+          cl = (fs_client_t*)malloc(sizeof(fs_client_t));
+        }
+        if (cl == NULL) {
+          fs_reply_error(fd, "too many clients");
+          close(fd);
+        } else {
+          memset(cl, 0, sizeof(fs_client_t));
+          cl->fd = fd;
+          srv->clients[srv->nclients++] = cl;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Publish a frame for client CL (called with the lock held). */
+static void
+fs_publish(frame_server_t* srv, fs_client_t* cl, const stage_t* stage,
+           const unsigned char* frame)
+{
+  unsigned char* slot;
+  float* dst;
+  float* row = srv->row;
+  const long bin = cl->bin, w = cl->width;
+  long i, k, u, v;
+  uint64_t lock;
+  float s, q;
+
+  ++cl->seq;
+  slot = cl->addr + FS_HEADER + ((cl->seq - 1) % cl->nslots)*cl->slot_size;
+  lock = FS_LOAD(slot);
+  FS_STORE(slot, lock + 1);
+  FS_BARRIER();
+  dst = (float*)(slot + FS_SLOT_HEADER);
+  q = 1.0f/(float)(bin*bin);
+  for (v = 0; v < cl->height; ++v, dst += w) {
+    for (k = 0; k < bin; ++k) {
+      decode_span(srv->encoding,
+                  frame + (cl->y0 + v*bin + k)*srv->stride,
+                  cl->x0, w*bin, row);
+      if (bin == 1) {
+        memcpy(dst, row, w*sizeof(float));
+        continue;
+      }
+      for (u = 0; u < w; ++u) {
+        s = 0.0f;
+        for (i = 0; i < bin; ++i) {
+          s += row[u*bin + i];
+        }
+        dst[u] = (k == 0 ? s : dst[u] + s);
+      }
+    }
+    if (bin > 1) {
+      for (u = 0; u < w; ++u) {
+        dst[u] *= q;
+      }
+    }
+  }
+  FS_STORE(slot + 8, cl->seq);
+  put_uint64_le(slot + 16, (uint64_t)(stage->frames + 1));
+  put_double_le(slot + 24, wall_clock_time());
+  FS_BARRIER();
+  FS_STORE(slot, lock + 2);
+  FS_BARRIER();
+  FS_STORE(cl->addr + 32, cl->seq);
+  fs_send(cl->fd, "NEWF", NULL, 0, -1, MSG_DONTWAIT);
+}
+
+static void
+frame_server_setup(stage_t* stage, const camera_t* cam)
+{
+  frame_server_t* srv = (frame_server_t*)stage;
+  float* row;
+
+  if (! is_monochrome(cam->encoding) && ! srv->broker) {
+    y_error("unsupported pixel encoding for frame server");
+  }
+  if (srv->row == NULL || srv->row_size < cam->frame_width) {
+    row = srv->row;
+    srv->row = NULL;
+    srv->row_size = 0;
+    if (row != NULL) p_free(row);
+    srv->row = (float*)p_malloc(cam->frame_width*sizeof(float));
+    srv->row_size = cam->frame_width;
+  }
+  pthread_mutex_lock(&srv->mutex);
+  srv->width = cam->frame_width;
+  srv->height = cam->frame_height;
+  srv->stride = cam->row_stride;
+  srv->encoding = cam->encoding;
+  srv->ready = TRUE;
+  pthread_mutex_unlock(&srv->mutex);
+}
+
+static int
+frame_server_process(stage_t* stage, const camera_t* cam,
+                     const unsigned char* frame)
+{
+  frame_server_t* srv = (frame_server_t*)stage;
+  fs_client_t* cl;
+  int k;
+
+  pthread_mutex_lock(&srv->mutex);
+  for (k = 0; k < srv->nactive; ++k) {
+    cl = srv->active[k];
+    if (cl->raw) {
+      /* Remote cameras are notified by publish_frame. */
+      continue;
+    }
+    if ((cl->received++) % cl->decimation != 0 ||
+        ! is_monochrome(srv->encoding) ||
+        cl->x0 + cl->width*cl->bin > srv->width ||
+        cl->y0 + cl->height*cl->bin > srv->height) {
+      continue;
+    }
+    fs_publish(srv, cl, stage, frame);
+    ++srv->published;
+  }
+  pthread_mutex_unlock(&srv->mutex);
+  return TRUE;
+}
+
+static void
+frame_server_eval(stage_t* stage, int argc)
+{
+  frame_server_t* srv = (frame_server_t*)stage;
+  long n;
+  pthread_mutex_lock(&srv->mutex);
+  n = srv->nactive;
+  pthread_mutex_unlock(&srv->mutex);
+  push_long(n);
+}
+
+static int
+frame_server_extract(stage_t* stage, const char* name)
+{
+  frame_server_t* srv = (frame_server_t*)stage;
+  if (strcmp(name, "path") == 0) {
+    push_string(srv->path);
+  } else if (strcmp(name, "clients") == 0) {
+    frame_server_eval(stage, 0);
+  } else if (strcmp(name, "published") == 0) {
+    push_long(srv->published);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+frame_server_free(stage_t* stage)
+{
+  frame_server_t* srv = (frame_server_t*)stage;
+  char c = 0;
+
+  if (srv->started) {
+    if (write(srv->wake[1], &c, 1) != 1) {
+      /* Cannot happen, the pipe is empty. */
+    }
+    pthread_join(srv->thread, NULL);
+    srv->started = FALSE;
+    pthread_mutex_destroy(&srv->mutex);
+  }
+  if (srv->camera != NULL) {
+    /* The frame buffers of the camera are no longer shared from the next
+       start of the acquisition. */
+    void* use = srv->camera_use;
+    srv->camera->broker = NULL;
+    srv->camera = NULL;
+    srv->camera_use = NULL;
+    ydrop_use(use);
+  }
+  while (srv->nclients > 0) {
+    fs_close_client(srv->clients[--srv->nclients]);
+  }
+  if (srv->listen_fd >= 0) {
+    close(srv->listen_fd);
+    if (srv->path != NULL) unlink(srv->path);
+  }
+  if (srv->wake[0] >= 0) close(srv->wake[0]);
+  if (srv->wake[1] >= 0) close(srv->wake[1]);
+  if (srv->shared_fd >= 0) close(srv->shared_fd);
+  if (srv->path != NULL) p_free(srv->path);
+  if (srv->row != NULL) p_free(srv->row);
+}
+
+static stage_class_t frame_server_class = {
+  "Andor frame server",
+  frame_server_setup,
+  frame_server_process,
+  NULL,
+  frame_server_eval,
+  frame_server_extract,
+  frame_server_free
+};
+
+/* Create a listening Unix socket at PATH, return its file descriptor or -1
+   on error.  An existing socket at PATH is replaced. */
+static int
+fs_listen(const char* path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fd, FS_MAX_CLIENTS) != 0) {
+    int code = errno;
+    close(fd);
+    errno = code;
+    return -1;
+  }
+  return fd;
+}
+
+void
+Y__andor_frame_server(int argc)
+{
+  frame_server_t* srv;
+  camera_t* cam;
+  const char* path;
+
+  if (argc != 2) y_error("expecting exactly 2 arguments");
+  path = get_string(1);
+  cam = (yarg_nil(0) ? NULL : get_camera(0));
+  if (path == NULL || path[0] == '\0') y_error("invalid socket path");
+  if (cam != NULL && cam->broker != NULL) {
+    y_error("camera already has a broker");
+  }
+  srv = (frame_server_t*)push_stage(&frame_server_class,
+                                    sizeof(frame_server_t));
+  srv->listen_fd = -1;
+  srv->wake[0] = -1;
+  srv->wake[1] = -1;
+  srv->shared_fd = -1;
+  srv->path = p_strcpy(path);
+  if (pipe(srv->wake) != 0) {
+    srv->wake[0] = -1;
+    srv->wake[1] = -1;
+    y_error(strerror(errno));
+  }
+  srv->listen_fd = fs_listen(path);
+  if (srv->listen_fd < 0) {
+    y_error(strerror(errno));
+  }
+  if (cam != NULL) {
+    srv->broker = TRUE;
+    srv->handle = cam->handle;
+    srv->camera = cam;
+    srv->camera_use = yget_use(1);
+  }
+  pthread_mutex_init(&srv->mutex, NULL);
+  if (pthread_create(&srv->thread, NULL, fs_thread, srv) != 0) {
+    pthread_mutex_destroy(&srv->mutex);
+    y_error("cannot start server thread");
+  }
+  srv->started = TRUE;
+  if (cam != NULL) {
+    /* The frame buffers of the camera are shared from the next start of
+       the acquisition. */
+    cam->broker = srv;
+  }
+}
+
+/* Client of a frame server. */
+typedef struct _frame_client frame_client_t;
+struct _frame_client {
+  int fd;               /* Connected socket. */
+  unsigned char* addr;  /* Address of shared memory. */
+  size_t size;          /* Size of shared memory. */
+  long width, height;   /* Dimensions of the images. */
+  long nslots;          /* Number of slots. */
+  long slot_size;       /* Size of a slot. */
+  uint64_t seq;         /* Sequence number of last received image. */
+  long count;           /* Number of received images. */
+  long missed;          /* Number of missed images. */
+  long number;          /* Frame number of last received image. */
+  double time;          /* Arrival time of last received image. */
+};
+
+static void
+free_frame_client(void* ptr)
+{
+  frame_client_t* fc = (frame_client_t*)ptr;
+  if (fc->addr != NULL) munmap(fc->addr, fc->size);
+  if (fc->fd >= 0) close(fc->fd);
+}
+
+static void
+print_frame_client(void* ptr)
+{
+  char buffer[96];
+  frame_client_t* fc = (frame_client_t*)ptr;
+  y_print("Andor frame client", 0);
+  sprintf(buffer, " (%ldx%ld images, %ld received)",
+          fc->width, fc->height, fc->count);
+  y_print(buffer, 1);
+}
+
+static void eval_frame_client(void* ptr, int argc);
+static void extract_frame_client(void* ptr, char* name);
+
+static y_userobj_t frame_client_type = {
+  "Andor frame client",
+  free_frame_client, print_frame_client, eval_frame_client,
+  extract_frame_client, NULL
+};
+
+/* Copy the last published image into DST, return its sequence number (0 if
+   none or if the slot is still being written after FS_MAX_RETRIES
+   attempts, for instance because the server died while writing it). */
+static uint64_t
+fc_read_latest(frame_client_t* fc, float* dst)
+{
+  const unsigned char* slot;
+  uint64_t seq, lock;
+  int k;
+
+  for (k = 0; k < FS_MAX_RETRIES; ++k) {
+    seq = FS_LOAD(fc->addr + 32);
+    if (seq == 0) {
+      return 0;
+    }
+    slot = fc->addr + FS_HEADER + ((seq - 1) % fc->nslots)*fc->slot_size;
+    lock = FS_LOAD(slot);
+    if ((lock & 1) != 0) {
+      continue;
+    }
+    seq = FS_LOAD(slot + 8);
+    fc->number = (long)get_uint64_le(slot + 16);
+    fc->time = get_double_le(slot + 24);
+    memcpy(dst, slot + FS_SLOT_HEADER, fc->width*fc->height*sizeof(float));
+    FS_BARRIER();
+    if (FS_LOAD(slot) == lock) {
+      return seq;
+    }
+  }
+  return 0;
+}
+
+static void
+eval_frame_client(void* ptr, int argc)
+{
+  frame_client_t* fc = (frame_client_t*)ptr;
+  unsigned char buf[FS_MAX_MESSAGE];
+  struct pollfd pfd;
+  double deadline, remaining;
+  float* dst;
+  long dims[3], size;
+  uint64_t seq;
+  int timeout, forever;
+
+  if (argc > 1) y_error("expecting at most 1 argument");
+  timeout = ((argc == 1 && ! yarg_nil(0)) ? get_int(0) : -1);
+  forever = (timeout < 0);
+  deadline = (forever ? 0.0 : monotonic_time() + 1E-3*timeout);
+
+  /* Wait for an image newer than the last one and read it. */
+  dims[0] = 2;
+  dims[1] = fc->width;
+  dims[2] = fc->height;
+  dst = NULL;
+  for (;;) {
+    if (FS_LOAD(fc->addr + 32) > fc->seq) {
+      if (dst == NULL) {
+        dst = ypush_f(dims);
+      }
+      seq = fc_read_latest(fc, dst);
+      if (seq != 0) {
+        break;
+      }
+      /* The slot is being written, wait for the next notification. */
+    }
+    if (! forever) {
+      remaining = deadline - monotonic_time();
+      if (remaining <= 0.0) {
+        if (dst != NULL) {
+          yarg_drop(1);
+        }
+        push_nil();
+        return;
+      }
+      timeout = (int)(1E3*remaining) + 1;
+    }
+    pfd.fd = fc->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, (forever ? -1 : timeout)) < 0 && errno != EINTR) {
+      y_error(strerror(errno));
+    }
+    if ((pfd.revents & (POLLIN | POLLHUP)) != 0) {
+      /* Drain the notifications. */
+      do {
+        size = fs_recv(fc->fd, buf, NULL, MSG_DONTWAIT);
+        if (size == -2) {
+          y_error("frame server has closed the connection");
+        }
+      } while (size >= 0);
+    }
+  }
+  if (fc->seq > 0 && seq > fc->seq + 1) {
+    fc->missed += (long)(seq - fc->seq - 1);
+  }
+  fc->seq = seq;
+  ++fc->count;
+}
+
+static void
+extract_frame_client(void* ptr, char* name)
+{
+  frame_client_t* fc = (frame_client_t*)ptr;
+  if (strcmp(name, "width") == 0) {
+    push_long(fc->width);
+  } else if (strcmp(name, "height") == 0) {
+    push_long(fc->height);
+  } else if (strcmp(name, "nslots") == 0) {
+    push_long(fc->nslots);
+  } else if (strcmp(name, "count") == 0) {
+    push_long(fc->count);
+  } else if (strcmp(name, "missed") == 0) {
+    push_long(fc->missed);
+  } else if (strcmp(name, "sequence") == 0) {
+    push_long((long)fc->seq);
+  } else if (strcmp(name, "number") == 0) {
+    push_long(fc->number);
+  } else if (strcmp(name, "time") == 0) {
+    push_double(fc->time);
+  } else {
+    y_error("illegal member");
+  }
+}
+
+/* Connect to the Unix socket at PATH, return the socket or -1 on error. */
+static int
+fs_connect(const char* path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    int code = errno;
+    close(fd);
+    errno = code;
+    return -1;
+  }
+  return fd;
+}
+
+/* Wait for the reply to a request, return the size of its payload.  Errors
+   reported by the server and notifications are handled. */
+static long
+fs_wait_reply(int fd, unsigned char* buf, int* passfd)
+{
+  struct pollfd pfd;
+  long size;
+  int code;
+
+  for (;;) {
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    code = poll(&pfd, 1, FS_TIMEOUT);
+    if (code < 0 && errno == EINTR) continue;
+    if (code < 0) y_error(strerror(errno));
+    if (code == 0) y_error("no reply from server");
+    size = fs_recv(fd, buf, passfd, 0);
+    if (size == -2) y_error("server has closed the connection");
+    if (size < 0) y_error(strerror(errno));
+    if (memcmp(buf, "NEWF", 4) == 0) continue;
+    if (memcmp(buf, "FAIL", 4) == 0) {
+      if (passfd != NULL && *passfd >= 0) close(*passfd);
+      y_error((char*)buf + 8);
+    }
+    return size;
+  }
+}
+
+void
+Y__andor_frame_client(int argc)
+{
+  frame_client_t* fc;
+  const char* path;
+  const unsigned char* hdr;
+  unsigned char buf[FS_MAX_MESSAGE];
+  unsigned char req[28];
+  long par[7];
+  struct stat st;
+  int k, fd;
+
+  if (argc != 8) y_error("expecting exactly 8 arguments");
+  path = get_string(7);
+  for (k = 0; k < 7; ++k) {
+    par[k] = get_long(6 - k);
+    if (par[k] < 0 || par[k] > 0x7FFFFFFFL) {
+      y_error("invalid subscription parameter");
+    }
+  }
+  if (path == NULL) y_error("invalid socket path");
+
+  /* First, push object to avoid leaks. */
+  fc = (frame_client_t*)ypush_obj(&frame_client_type,
+                                  sizeof(frame_client_t));
+  fc->fd = fs_connect(path);
+  if (fc->fd < 0) {
+    y_error(strerror(errno));
+  }
+  for (k = 0; k < 7; ++k) {
+    put_uint32_le(req + 4*k, (unsigned long)par[k]);
+  }
+  if (fs_send(fc->fd, "SUBS", req, sizeof(req), -1, 0) != 0) {
+    y_error(strerror(errno));
+  }
+  if (fs_wait_reply(fc->fd, buf, &fd) != 12 || fd < 0) {
+    if (fd >= 0) close(fd);
+    y_error("bad reply from server");
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < FS_HEADER) {
+    close(fd);
+    y_error("bad shared memory");
+  }
+  fc->addr = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                                  fd, 0);
+  close(fd);
+  if (fc->addr == MAP_FAILED) {
+    fc->addr = NULL;
+    y_error("cannot map shared memory");
+  }
+  fc->size = st.st_size;
+  hdr = fc->addr;
+  fc->width = (long)get_uint32_le(hdr + 8);
+  fc->height = (long)get_uint32_le(hdr + 12);
+  fc->nslots = (long)get_uint32_le(hdr + 16);
+  fc->slot_size = (long)get_uint64_le(hdr + 24);
+  if (memcmp(hdr, FS_MAGIC, 8) != 0 || fc->nslots < 1 ||
+      get_uint32_le(hdr + 20) != FS_SLOT_HEADER ||
+      fc->slot_size < FS_SLOT_HEADER +
+      (long)(fc->width*fc->height*sizeof(float)) ||
+      fc->nslots > (long)((fc->size - FS_HEADER)/fc->slot_size)) {
+    y_error("corrupted shared memory");
+  }
+  /* Only images published from now on are delivered. */
+  fc->seq = FS_LOAD(hdr + 32);
+}
+
+/*---------------------------------------------------------------------------*/
+/* CAMERA BROKER */
+
+/* A frame server created with a camera (see andor_frame_server) is a broker
+   which lets other processes share the camera: these processes connect
+   "remote cameras" (see andor_connect) to the server socket and use them
+   with the same functions as a local camera to access the features of the
+   camera and to wait for images.
+
+   Remote cameras have pseudo-handles (see FORWARD above): the calls to the
+   SDK are sent to the server in a "CALL" request and executed by the server
+   thread with the handle of the camera, the reply yields the SDK status and
+   the result.  The acquisition is only controlled by the broker.
+
+   The frames are delivered without any copy: the frame buffers of the
+   camera are allocated in shared memory which is mapped by the remote
+   cameras (its file descriptor is passed in reply of a "RAWF" request).  To
+   let remote cameras read the frames while the acquisition goes on, the
+   camera holds back the last delivered buffers from the queue (half the
+   queue length at most): the buffer of frame S is re-queued after frame
+   S + HOLD has been delivered.  The shared memory starts with a header:
+
+     offset  size  contents
+        0       8  magic string "ANDORBR1"
+        8       4  state (1 while the buffers are used by the camera, 0 once
+                   released)
+       12       4  number of held buffers (HOLD)
+       16       8  generation (incremented before and after every change of
+                   the frame format, odd while changing)
+       24       8  sequence number of the last delivered frame
+       32       4  frame width
+       36       4  frame height
+       40       4  queue length
+       44       4  (unused)
+       48       8  row stride
+       56       8  frame size
+       64      32  name of the pixel encoding (null terminated)
+      128    2048  ring of the last BR_RING delivered frames, each entry has
+                   the sequence number (written last), the offset of the
+                   frame in the shared memory and its arrival time
+
+   The frame buffers follow the header.  Readers extract the frame and then
+   check that the generation has not changed and that the frame is still
+   held, that is its sequence number S verifies LAST - S < HOLD.  The server
+   notifies the remote cameras of each new frame with a "NEWF" message. */
+
+#define BR_MAGIC       "ANDORBR1"
+#define BR_HEADER      4096 /* multiple of FRAME_ALIGN */
+#define BR_RING        64
+#define BR_RING_OFFSET 128
+#define BR_ENTRY       32
+#define BR_MAX_STRING  480
+
+/* Number of features written by the brokers on behalf of remote cameras,
+   the cached feature values of a shared camera are refreshed when this
+   counter changes. */
+static volatile unsigned int broker_writes = 0;
+
+static void
+alloc_frame_buffers(camera_t* cam, long size)
+{
+  unsigned char* addr;
+  long total;
+  int fd;
+
+  if (cam->broker == NULL) {
+    cam->buffer = p_malloc(size);
+    cam->buffer_size = size;
+    return;
+  }
+  total = BR_HEADER + size;
+  fd = fs_create_shm(total);
+  if (fd < 0) {
+    y_error("cannot create shared memory for the frame buffers");
+  }
+  addr = (unsigned char*)mmap(NULL, total, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    close(fd);
+    y_error("cannot map shared memory for the frame buffers");
+  }
+  memcpy(addr, BR_MAGIC, 8);
+  cam->shared = addr;
+  cam->shared_fd = fd;
+  cam->shared_size = total;
+  cam->buffer = addr + BR_HEADER;
+  cam->buffer_size = size;
+}
+
+static void
+free_frame_buffers(camera_t* cam)
+{
+  void* ptr = cam->buffer;
+  unsigned char* shared = cam->shared;
+  long size = cam->shared_size;
+  int fd = cam->shared_fd;
+
+  /* Free *after* updating members (in case of interrupts). */
+  cam->buffer = NULL;
+  cam->buffer_size = 0;
+  cam->shared = NULL;
+  cam->shared_size = 0;
+  cam->shared_fd = -1;
+  cam->nheld = 0;
+  if (shared != NULL) {
+    /* Tell the remote cameras that the buffers are no longer used. */
+    put_uint32_le(shared + 8, 0);
+    munmap(shared, size);
+    close(fd);
+  } else if (ptr != NULL) {
+    p_free(ptr);
+  }
+}
+
+/* Describe the format of the shared frames and choose the number of held
+   buffers (called before queuing the buffers). */
+static void
+setup_shared_frames(camera_t* cam)
+{
+  unsigned char* hdr = cam->shared;
+  frame_server_t* srv;
+  uint64_t generation;
+  const char* name;
+
+  cam->nheld = 0;
+  cam->first_held = 0;
+  if (hdr == NULL) {
+    cam->hold = 0;
+    return;
+  }
+  if (cam->queue_length < 2) {
+    y_error("queue length must be at least 2 to share the frames");
+  }
+  cam->hold = (cam->queue_length/2 < BR_MAX_HOLD ? cam->queue_length/2
+               : BR_MAX_HOLD);
+  name = (cam->encoding >= 0 ? pixel_encoding_table[cam->encoding].name
+          : "");
+  generation = FS_LOAD(hdr + 16);
+  FS_STORE(hdr + 16, generation + 1);
+  FS_BARRIER();
+  put_uint32_le(hdr + 8, 1);
+  put_uint32_le(hdr + 12, cam->hold);
+  put_uint32_le(hdr + 32, cam->frame_width);
+  put_uint32_le(hdr + 36, cam->frame_height);
+  put_uint32_le(hdr + 40, cam->queue_length);
+  put_uint64_le(hdr + 48, cam->row_stride);
+  put_uint64_le(hdr + 56, cam->frame_size);
+  memset(hdr + 64, 0, 32);
+  strncpy((char*)hdr + 64, name, 31);
+  FS_STORE(hdr + 16, generation + 2);
+
+  /* Let the broker serve the (new) shared memory. */
+  srv = cam->broker;
+  pthread_mutex_lock(&srv->mutex);
+  if (srv->shared_fd >= 0) close(srv->shared_fd);
+  srv->shared = cam->shared;
+  srv->shared_fd = fcntl(cam->shared_fd, F_DUPFD_CLOEXEC, 0);
+  pthread_mutex_unlock(&srv->mutex);
+}
+
+/* Publish a delivered frame for the remote cameras (called before the
+   frame is fed to the stages). */
+static void
+publish_frame(camera_t* cam, const unsigned char* frame)
+{
+  frame_server_t* srv;
+  unsigned char* entry;
+  uint64_t seq;
+  int k;
+
+  if (cam->writes != broker_writes) {
+    /* Some features have been set by a remote camera. */
+    cam->writes = broker_writes;
+    cam->exposure = get_float_or_nan(cam->handle, L"ExposureTime");
+  }
+  if (cam->shared == NULL) {
+    return;
+  }
+  seq = ++cam->sequence;
+  entry = cam->shared + BR_RING_OFFSET + ((seq - 1) % BR_RING)*BR_ENTRY;
+  FS_STORE(entry, 0);
+  FS_BARRIER();
+  put_uint64_le(entry + 8, (uint64_t)(frame - cam->shared));
+  put_double_le(entry + 16, wall_clock_time());
+  FS_STORE(entry, seq);
+  FS_STORE(cam->shared + 24, seq);
+
+  /* Notify the remote cameras. */
+  srv = cam->broker;
+  pthread_mutex_lock(&srv->mutex);
+  for (k = 0; k < srv->nactive; ++k) {
+    if (srv->active[k]->raw) {
+      fs_send(srv->active[k]->fd, "NEWF", NULL, 0, -1, MSG_DONTWAIT);
+    }
+  }
+  pthread_mutex_unlock(&srv->mutex);
+}
+
+/* Give back a delivered buffer to the SDK, the last delivered buffers are
+   held back if the frames are shared. */
+static int
+requeue_buffer(camera_t* cam, AT_U8* frame_ptr, int frame_size)
+{
+  if (cam->hold > 0) {
+    cam->held[(cam->first_held + cam->nheld) % BR_MAX_HOLD] = frame_ptr;
+    if (++cam->nheld <= cam->hold) {
+      return AT_SUCCESS;
+    }
+    frame_ptr = cam->held[cam->first_held];
+    cam->first_held = (cam->first_held + 1) % BR_MAX_HOLD;
+    --cam->nheld;
+  }
+  return AT_QueueBuffer(cam->handle, frame_ptr, frame_size);
+}
+
+/* Append the wide string WCS as a null terminated string of bytes at offset
+   N of BUF (of SIZE bytes), return the offset after the string or -1 if it
+   does not fit.  Characters which cannot be converted are replaced by
+   '?'. */
+static long
+br_put_string(unsigned char* buf, long n, long size, const AT_WC* wcs)
+{
+  int c;
+  for (; *wcs != L'\0'; ++wcs) {
+    if (n >= size - 1) {
+      return -1;
+    }
+    c = wctob(*wcs);
+    buf[n++] = (c != EOF ? c : '?');
+  }
+  buf[n++] = '\0';
+  return n;
+}
+
+/* Get a null terminated string of bytes at offset N of BUF (of SIZE bytes)
+   as a wide string of at most MAXLEN characters, return the offset after
+   the string or -1 if it is not null terminated or too long. */
+static long
+br_get_string(const unsigned char* buf, long n, long size, AT_WC* wcs,
+              long maxlen)
+{
+  long k;
+  for (k = 0; n < size; ++k, ++n) {
+    if (k > maxlen) {
+      return -1;
+    }
+    if (buf[n] == '\0') {
+      wcs[k] = L'\0';
+      return n + 1;
+    }
+    wcs[k] = btowc(buf[n]);
+  }
+  return -1;
+}
+
+/* Execute a forwarded call (called by the server thread).  The request is
+   the identifier of the function, an integer argument (4 bytes), a 64-bit
+   integer argument, a floating-point argument, the name of the feature and
+   a string argument for the setters of strings.  The reply is the status,
+   an integer result (4 bytes), a 64-bit integer result, a floating-point
+   result and a string result. */
+static void
+br_serve_call(frame_server_t* srv, fs_client_t* cl, const unsigned char* req,
+              long size)
+{
+  AT_WC feature[BR_MAX_STRING+1];
+  AT_WC sval[BR_MAX_STRING+1];
+  AT_WC wres[BR_MAX_STRING+1];
+  unsigned char reply[FS_MAX_MESSAGE - 8];
+  const AT_H handle = srv->handle;
+  int func, ival, ires, length, code;
+  AT_64 lval, lres;
+  double dval, dres;
+  long n;
+
+  if (! srv->broker) {
+    fs_reply_error(cl->fd, "not a camera broker");
+    return;
+  }
+  func = (size >= 24 ? (int)get_uint32_le(req) : -1);
+  n = (func >= 0 && func < BR_NFUNCS ?
+       br_get_string(req, 24, size, feature, BR_MAX_STRING) : -1);
+  if (n > 0 && (func == BR_AT_SetString || func == BR_AT_SetEnumString)) {
+    n = br_get_string(req, n, size, sval, BR_MAX_STRING);
+  }
+  if (n < 0) {
+    fs_reply_error(cl->fd, "bad request");
+    return;
+  }
+  ival = (int)(int32_t)get_uint32_le(req + 4);
+  lval = (AT_64)get_uint64_le(req + 8);
+  dval = get_double_le(req + 16);
+  ires = 0;
+  lres = 0;
+  dres = 0.0;
+  wres[0] = L'\0';
+  length = 0;
+  if (func == BR_AT_GetString || func == BR_AT_GetEnumStringByIndex) {
+    length = (int)(func == BR_AT_GetString ? ival : lval);
+    if (length < 1 || length > BR_MAX_STRING + 1) {
+      length = BR_MAX_STRING + 1;
+    }
+  }
+  switch (func) {
+#define CASE(CFUNC, ARGS) case BR_##CFUNC: code = CFUNC ARGS; break
+    CASE(AT_GetBool,                 (handle, feature, &ires));
+    CASE(AT_IsImplemented,           (handle, feature, &ires));
+    CASE(AT_IsReadOnly,              (handle, feature, &ires));
+    CASE(AT_IsReadable,              (handle, feature, &ires));
+    CASE(AT_IsWritable,              (handle, feature, &ires));
+    CASE(AT_IsEnumIndexAvailable,    (handle, feature, ival, &ires));
+    CASE(AT_IsEnumIndexImplemented,  (handle, feature, ival, &ires));
+    CASE(AT_GetEnumIndex,            (handle, feature, &ires));
+    CASE(AT_GetEnumCount,            (handle, feature, &ires));
+    CASE(AT_GetStringMaxLength,      (handle, feature, &ires));
+    CASE(AT_GetInt,                  (handle, feature, &lres));
+    CASE(AT_GetIntMin,               (handle, feature, &lres));
+    CASE(AT_GetIntMax,               (handle, feature, &lres));
+    CASE(AT_GetFloat,                (handle, feature, &dres));
+    CASE(AT_GetFloatMin,             (handle, feature, &dres));
+    CASE(AT_GetFloatMax,             (handle, feature, &dres));
+    CASE(AT_GetString,               (handle, feature, wres, length));
+    CASE(AT_GetEnumStringByIndex,    (handle, feature, ival, wres, length));
+    CASE(AT_SetInt,                  (handle, feature, lval));
+    CASE(AT_SetFloat,                (handle, feature, dval));
+    CASE(AT_SetBool,                 (handle, feature, ival));
+    CASE(AT_SetEnumIndex,            (handle, feature, ival));
+    CASE(AT_SetString,               (handle, feature, sval));
+    CASE(AT_SetEnumString,           (handle, feature, sval));
+#undef CASE
+  case BR_AT_Command:
+    if (wcsncmp(feature, L"Acquisition", 11) == 0 &&
+        (wcscmp(feature + 11, L"Start") == 0 ||
+         wcscmp(feature + 11, L" Start") == 0 ||
+         wcscmp(feature + 11, L"Stop") == 0 ||
+         wcscmp(feature + 11, L" Stop") == 0)) {
+      fs_reply_error(cl->fd, "acquisition is controlled by the broker");
+      return;
+    }
+    code = AT_Command(handle, feature);
+    break;
+  default:
+    code = AT_ERR_NOTIMPLEMENTED;
+  }
+  if (code == AT_SUCCESS && func >= BR_AT_SetInt) {
+    __sync_fetch_and_add(&broker_writes, 1);
+  }
+  if (length > 0) {
+    wres[length - 1] = L'\0';
+  }
+  put_uint32_le(reply, (uint32_t)code);
+  put_uint32_le(reply + 4, (uint32_t)ires);
+  put_uint64_le(reply + 8, (uint64_t)lres);
+  put_double_le(reply + 16, dres);
+  n = br_put_string(reply, 24, sizeof(reply), wres);
+  if (n < 0) {
+    reply[24] = '\0';
+    n = 25;
+  }
+  fs_send(cl->fd, "OKAY", reply, n, -1, 0);
+}
+
+/* Reply to a request for the shared frame buffers (called by the server
+   thread).  The reply has no file descriptor if the frames are not yet
+   shared, the client is notified of the new frames anyway. */
+static void
+br_share_frames(frame_server_t* srv, fs_client_t* cl)
+{
+  int fd;
+
+  if (! srv->broker) {
+    fs_reply_error(cl->fd, "not a camera broker");
+    return;
+  }
+  if (cl->active && ! cl->raw) {
+    fs_reply_error(cl->fd, "already subscribed");
+    return;
+  }
+  pthread_mutex_lock(&srv->mutex);
+  fd = (srv->shared_fd >= 0 ? fcntl(srv->shared_fd, F_DUPFD_CLOEXEC, 0)
+        : -1);
+  if (! cl->active) {
+    cl->active = TRUE;
+    cl->raw = TRUE;
+    srv->active[srv->nactive++] = cl;
+  }
+  pthread_mutex_unlock(&srv->mutex);
+  fs_send(cl->fd, "OKAY", NULL, 0, fd, 0);
+  if (fd >= 0) close(fd);
+}
+
+/* Remote camera. */
+typedef struct _remote_camera remote_camera_t;
+struct _remote_camera {
+  int fd;               /* Connected socket. */
+  int slot;             /* Index in the table of remote cameras, -1 if
+                           none. */
+  unsigned char* addr;  /* Address of the shared frame buffers, NULL if
+                           not yet mapped. */
+  size_t size;          /* Size of the shared memory. */
+  uint64_t seq;         /* Sequence number of last received frame. */
+  long count;           /* Number of received frames. */
+  long missed;          /* Number of missed frames. */
+  double time;          /* Arrival time of last received frame. */
+  camera_t cam;         /* Format of the frames for the extraction. */
+};
+
+/* Remote cameras indexed by their pseudo-handles. */
+static remote_camera_t* remote_cameras[BR_MAX_REMOTE];
+
+static void
+free_remote_camera(void* ptr)
+{
+  remote_camera_t* rc = (remote_camera_t*)ptr;
+  if (rc->slot >= 0) remote_cameras[rc->slot] = NULL;
+  if (rc->addr != NULL) munmap(rc->addr, rc->size);
+  if (rc->fd >= 0) close(rc->fd);
+}
+
+static void
+print_remote_camera(void* ptr)
+{
+  char buffer[64];
+  remote_camera_t* rc = (remote_camera_t*)ptr;
+  y_print("Andor remote camera", 0);
+  sprintf(buffer, " (%ld frames received)", rc->count);
+  y_print(buffer, 1);
+}
+
+static void
+eval_remote_camera(void* ptr, int argc)
+{
+  push_nil();
+}
+
+static void extract_remote_camera(void* ptr, char* name);
+
+static y_userobj_t remote_camera_type = {
+  "Andor remote camera",
+  free_remote_camera, print_remote_camera, eval_remote_camera,
+  extract_remote_camera, NULL
+};
+
+static void
+extract_remote_camera(void* ptr, char* name)
+{
+  remote_camera_t* rc = (remote_camera_t*)ptr;
+  if (strcmp(name, "count") == 0) {
+    push_long(rc->count);
+  } else if (strcmp(name, "missed") == 0) {
+    push_long(rc->missed);
+  } else if (strcmp(name, "sequence") == 0) {
+    push_long((long)rc->seq);
+  } else if (strcmp(name, "time") == 0) {
+    push_double(rc->time);
+  } else if (strcmp(name, "frame_width") == 0) {
+    push_long(rc->cam.frame_width);
+  } else if (strcmp(name, "frame_height") == 0) {
+    push_long(rc->cam.frame_height);
+  } else {
+    y_error("illegal member");
+  }
+}
+
+static int
+is_remote_camera(int iarg)
+{
+  return (yget_obj(iarg, NULL) == remote_camera_type.type_name);
+}
+
+static AT_H
+get_remote_handle(int iarg)
+{
+  remote_camera_t* rc;
+  rc = (remote_camera_t*)yget_obj(iarg, &remote_camera_type);
+  return BR_FIRST_HANDLE - rc->slot;
+}
+
+static int
+remote_call(AT_H handle, int func, const AT_WC* feature,
+            int ival, AT_64 lval, double dval, const AT_WC* sval,
+            void* result, int length)
+{
+  unsigned char req[FS_MAX_MESSAGE - 8];
+  unsigned char buf[FS_MAX_MESSAGE];
+  remote_camera_t* rc;
+  long n, size;
+  int code;
+
+  rc = remote_cameras[BR_FIRST_HANDLE - handle];
+  if (rc == NULL) {
+    return AT_ERR_INVALIDHANDLE;
+  }
+  if (feature == NULL) y_error("invalid NULL string");
+  if (func == BR_AT_GetString) {
+    ival = length;
+  } else if (func == BR_AT_GetEnumStringByIndex) {
+    lval = length;
+  }
+  put_uint32_le(req, func);
+  put_uint32_le(req + 4, (uint32_t)ival);
+  put_uint64_le(req + 8, (uint64_t)lval);
+  put_double_le(req + 16, dval);
+  n = br_put_string(req, 24, sizeof(req), feature);
+  if (n > 0 && sval != NULL) {
+    n = br_put_string(req, n, sizeof(req), sval);
+  }
+  if (n < 0) y_error("string too long for a remote camera");
+  if (fs_send(rc->fd, "CALL", req, n, -1, 0) != 0) {
+    y_error(strerror(errno));
+  }
+  size = fs_wait_reply(rc->fd, buf, NULL);
+  if (size < 25) y_error("bad reply from broker");
+  code = (int)(int32_t)get_uint32_le(buf + 8);
+  if (code == AT_SUCCESS && result != NULL) {
+    if (func <= BR_AT_GetStringMaxLength) {
+      *(int*)result = (int)(int32_t)get_uint32_le(buf + 12);
+    } else if (func <= BR_AT_GetIntMax) {
+      *(AT_64*)result = (AT_64)get_uint64_le(buf + 16);
+    } else if (func <= BR_AT_GetFloatMax) {
+      *(double*)result = get_double_le(buf + 24);
+    } else if (length > 0 &&
+               br_get_string(buf, 32, 8 + size, (AT_WC*)result,
+                             length - 1) < 0) {
+      ((AT_WC*)result)[0] = L'\0';
+    }
+  }
+  return code;
+}
+
+/* Request the shared frame buffers of the broker and map them if they are
+   available.  If RECENT is true, only the frames delivered from now on are
+   received; otherwise the last delivered frame can be received (the frame
+   buffers are shared after the remote camera has been connected). */
+static void
+map_remote_frames(remote_camera_t* rc, int recent)
+{
+  uint64_t last;
+  unsigned char buf[FS_MAX_MESSAGE];
+  unsigned char* addr;
+  struct stat st;
+  int fd;
+
+  if (rc->addr != NULL) {
+    munmap(rc->addr, rc->size);
+    rc->addr = NULL;
+  }
+  if (fs_send(rc->fd, "RAWF", NULL, 0, -1, 0) != 0) {
+    y_error(strerror(errno));
+  }
+  fs_wait_reply(rc->fd, buf, &fd);
+  if (fd < 0) {
+    return;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < BR_HEADER) {
+    close(fd);
+    y_error("bad shared memory");
+  }
+  addr = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    y_error("cannot map shared memory");
+  }
+  if (memcmp(addr, BR_MAGIC, 8) != 0) {
+    munmap(addr, st.st_size);
+    y_error("corrupted shared memory");
+  }
+  rc->addr = addr;
+  rc->size = st.st_size;
+  last = FS_LOAD(addr + 24);
+  if (recent || last < rc->seq) {
+    rc->seq = last;
+  }
+}
+
+/* Extract the last frame delivered to the broker, return FALSE if there is
+   no new frame or if it has been overwritten meanwhile (nothing is left on
+   the stack). */
+static int
+extract_remote_frame(remote_camera_t* rc)
+{
+  const unsigned char* hdr = rc->addr;
+  const unsigned char* entry;
+  camera_t* cam = &rc->cam;
+  uint64_t generation, last, seq, offset;
+  long hold;
+  double time;
+  char name[32];
+  int k;
+
+  generation = FS_LOAD(hdr + 16);
+  last = FS_LOAD(hdr + 24);
+  if ((generation & 1) != 0 || last <= rc->seq) {
+    return FALSE;
+  }
+  entry = hdr + BR_RING_OFFSET + ((last - 1) % BR_RING)*BR_ENTRY;
+  seq = FS_LOAD(entry);
+  offset = get_uint64_le(entry + 8);
+  time = get_double_le(entry + 16);
+  hold = get_uint32_le(hdr + 12);
+  cam->frame_width = get_uint32_le(hdr + 32);
+  cam->frame_height = get_uint32_le(hdr + 36);
+  cam->row_stride = (long)get_uint64_le(hdr + 48);
+  cam->frame_size = (long)get_uint64_le(hdr + 56);
+  memcpy(name, hdr + 64, 31);
+  name[31] = '\0';
+  if (seq != last) {
+    /* The entry is being written. */
+    return FALSE;
+  }
+  FS_BARRIER();
+  if (FS_LOAD(hdr + 16) != generation) {
+    /* The frame format has changed meanwhile, the fields may be torn. */
+    return FALSE;
+  }
+  if (offset < BR_HEADER || offset + cam->frame_size > rc->size ||
+      cam->row_stride*cam->frame_height > cam->frame_size) {
+    y_error("corrupted shared memory");
+  }
+  cam->encoding = -1;
+  cam->extract = extract_Raw;
+  for (k = 0; k < number_of_pixel_encodings; ++k) {
+    if (strcmp(name, pixel_encoding_table[k].name) == 0) {
+      cam->encoding = k;
+      cam->extract = pixel_encoding_table[k].extract;
+      break;
+    }
+  }
+  cam->extract(cam, hdr + offset);
+
+  /* Check that the frame has not been overwritten while being extracted. */
+  FS_BARRIER();
+  if (FS_LOAD(hdr + 16) != generation ||
+      FS_LOAD(entry) != seq ||
+      FS_LOAD(hdr + 24) - seq >= (uint64_t)hold) {
+    yarg_drop(1);
+    return FALSE;
+  }
+  if (rc->count > 0 && seq > rc->seq + 1) {
+    rc->missed += (long)(seq - rc->seq - 1);
+  }
+  rc->seq = seq;
+  rc->time = time;
+  ++rc->count;
+  return TRUE;
+}
+
+static void
+wait_remote_image(int iarg, int timeout)
+{
+  remote_camera_t* rc;
+  unsigned char buf[FS_MAX_MESSAGE];
+  struct pollfd pfd;
+  double deadline, remaining;
+  long size;
+  int forever, retries;
+
+  rc = (remote_camera_t*)yget_obj(iarg, &remote_camera_type);
+  forever = (timeout < 0);
+  deadline = (forever ? 0.0 : monotonic_time() + 1E-3*timeout);
+  retries = 0;
+  for (;;) {
+    if (rc->addr == NULL || get_uint32_le(rc->addr + 8) == 0) {
+      /* The frame buffers are not (or no longer) mapped. */
+      map_remote_frames(rc, FALSE);
+    }
+    if (rc->addr != NULL && extract_remote_frame(rc)) {
+      return;
+    }
+    if (rc->addr != NULL && FS_LOAD(rc->addr + 24) > rc->seq &&
+        ++retries < FS_MAX_RETRIES) {
+      /* The frame has been overwritten, try the next one (a limited number
+         of times in case the broker died while writing it). */
+      continue;
+    }
+    retries = 0;
+
+    /* Wait for a notification. */
+    if (! forever) {
+      remaining = deadline - monotonic_time();
+      if (remaining <= 0.0) {
+        push_nil();
+        return;
+      }
+      timeout = (int)(1E3*remaining) + 1;
+    }
+    pfd.fd = rc->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, (forever ? -1 : timeout)) < 0 && errno != EINTR) {
+      y_error(strerror(errno));
+    }
+    if ((pfd.revents & (POLLIN | POLLHUP)) != 0) {
+      /* Drain the notifications. */
+      do {
+        size = fs_recv(rc->fd, buf, NULL, MSG_DONTWAIT);
+        if (size == -2) {
+          y_error("broker has closed the connection");
+        }
+      } while (size >= 0);
+    }
+  }
+}
+
+void
+Y_andor_connect(int argc)
+{
+  remote_camera_t* rc;
+  const char* path;
+  int k;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  path = get_string(0);
+  if (path == NULL) y_error("invalid socket path");
+  for (k = 0; k < BR_MAX_REMOTE; ++k) {
+    if (remote_cameras[k] == NULL) break;
+  }
+  if (k >= BR_MAX_REMOTE) y_error("too many remote cameras");
+
+  /* First, push object to avoid leaks. */
+  rc = (remote_camera_t*)ypush_obj(&remote_camera_type,
+                                   sizeof(remote_camera_t));
+  rc->slot = -1;
+  rc->cam.encoding = -1;
+  rc->cam.output_type = -1;
+  rc->cam.shared_fd = -1;
+  rc->cam.trigger_mode = -1;
+  rc->fd = fs_connect(path);
+  if (rc->fd < 0) {
+    y_error(strerror(errno));
+  }
+
+  /* Subscribe to the frames (this also checks that the server is a
+   broker). */
+  map_remote_frames(rc, TRUE);
+  rc->slot = k;
+  remote_cameras[k] = rc;
+}
+
+/*---------------------------------------------------------------------------*/
+/* ACQUISITION SEQUENCER */
+
+/* The sequencer executes a list of steps, each step sets some features of
+   the camera and acquires a given number of frames (see capture_frames).
+   The frame buffers of the camera are reused from one step to the next and
+   a feature is not written if it has been set to the same value by a
+   previous step of the same run. */
+
+/* Setting of a feature by a step of a sequence. */
+typedef struct _sequencer_setting sequencer_setting_t;
+struct _sequencer_setting {
+  wchar_t* name;        /* Name of the feature. */
+  wchar_t* text;        /* Value of a string (or enumerated) feature. */
+  long ival;            /* Value of an integer (or boolean) feature. */
+  double dval;          /* Value of a floating-point feature. */
+  long feature;         /* Index of the feature (among distinct names). */
+  int type;             /* 'i' for integer, 'd' for floating-point and 's'
+                           for string values. */
+};
+
+/* Step of a sequence. */
+typedef struct _sequencer_step sequencer_step_t;
+struct _sequencer_step {
+  long count;           /* Number of frames to acquire. */
+  long first;           /* Index of first setting. */
+  long nsettings;       /* Number of settings. */
+  void* result;         /* Use of the acquired frames or NULL. */
+};
+
+typedef struct _sequencer sequencer_t;
+struct _sequencer {
+  sequencer_setting_t* settings;
+  sequencer_step_t* steps;
+  long* current;        /* Index of the setting last written for each
+                           feature during a run, -1 if none. */
+  long nsettings, maxsettings;
+  long nsteps, maxsteps;
+  long nfeatures;       /* Number of distinct features. */
+  long writes;          /* Number of features written by the last run. */
+  long skipped;         /* Number of settings skipped by the last run. */
+  int keep;             /* Keep the acquired frames? */
+};
+
+static void
+drop_sequencer_results(sequencer_t* seq)
+{
+  void* use;
+  long k;
+  for (k = 0; k < seq->nsteps; ++k) {
+    use = seq->steps[k].result;
+    if (use != NULL) {
+      seq->steps[k].result = NULL;
+      ydrop_use(use);
+    }
+  }
+}
+
+static void
+free_sequencer(void* ptr)
+{
+  sequencer_t* seq = (sequencer_t*)ptr;
+  long k;
+  if (seq->steps != NULL) {
+    drop_sequencer_results(seq);
+    free(seq->steps);
+  }
+  if (seq->settings != NULL) {
+    for (k = 0; k < seq->nsettings; ++k) {
+      if (seq->settings[k].name != NULL) free(seq->settings[k].name);
+      if (seq->settings[k].text != NULL) free(seq->settings[k].text);
+    }
+    free(seq->settings);
+  }
+  if (seq->current != NULL) free(seq->current);
+}
+
+static void
+print_sequencer(void* ptr)
+{
+  char buffer[64];
+  sequencer_t* seq = (sequencer_t*)ptr;
+  long k, count = 0;
+  for (k = 0; k < seq->nsteps; ++k) {
+    count += seq->steps[k].count;
+  }
+  y_print("Andor sequencer", 0);
+  sprintf(buffer, " (%ld steps, %ld frames)", seq->nsteps, count);
+  y_print(buffer, 1);
+}
+
+/* SEQ(K) yields the frames acquired by the K-th step of the last run. */
+static void
+eval_sequencer(void* ptr, int argc)
+{
+  sequencer_t* seq = (sequencer_t*)ptr;
+  long k;
+
+  if (argc != 1) y_error("expecting exactly 1 argument");
+  k = get_long(0);
+  if (k <= 0) k += seq->nsteps;
+  if (k < 1 || k > seq->nsteps) y_error("out of range step index");
+  if (seq->steps[k - 1].result == NULL) {
+    push_nil();
+  } else {
+    ypush_use(seq->steps[k - 1].result);
+  }
+}
+
+static void
+extract_sequencer(void* ptr, char* name)
+{
+  sequencer_t* seq = (sequencer_t*)ptr;
+  long k, count;
+  if (strcmp(name, "steps") == 0) {
+    push_long(seq->nsteps);
+  } else if (strcmp(name, "frames") == 0) {
+    for (count = 0, k = 0; k < seq->nsteps; ++k) {
+      count += seq->steps[k].count;
+    }
+    push_long(count);
+  } else if (strcmp(name, "writes") == 0) {
+    push_long(seq->writes);
+  } else if (strcmp(name, "skipped") == 0) {
+    push_long(seq->skipped);
+  } else if (strcmp(name, "keep") == 0) {
+    push_int(seq->keep);
+  } else {
+    y_error("illegal member");
+  }
+}
+
+static y_userobj_t sequencer_type = {
+  "Andor sequencer",
+  free_sequencer, print_sequencer, eval_sequencer, extract_sequencer, NULL
+};
+
+/* Make a copy of a wide string with malloc(), return NULL on failure. */
+static wchar_t*
+copy_wide(const wchar_t* wcs)
+{
+  size_t size = (wcslen(wcs) + 1)*sizeof(wchar_t);
+  wchar_t* copy = (wchar_t*)malloc(size);
+  if (copy != NULL) memcpy(copy, wcs, size);
+  return copy;
+}
+
+/* Set a feature of the camera according to SET. */
+static int
+apply_setting(AT_H handle, const sequencer_setting_t* set)
+{
+  int code;
+
+  switch (set->type) {
+  case 's':
+    code = AT_SetEnumString(handle, set->name, set->text);
+    if (code == AT_ERR_NOTIMPLEMENTED) {
+      code = AT_SetString(handle, set->name, set->text);
+    }
+    return code;
+  case 'd':
+    return AT_SetFloat(handle, set->name, set->dval);
+  default:
+    /* An integer may be the value of a boolean or of a floating-point
+       feature. */
+    code = AT_SetInt(handle, set->name, set->ival);
+    if (code == AT_ERR_NOTIMPLEMENTED) {
+      code = AT_SetBool(handle, set->name, (set->ival != 0));
+    }
+    if (code == AT_ERR_NOTIMPLEMENTED) {
+      code = AT_SetFloat(handle, set->name, (double)set->ival);
+    }
+    return code;
+  }
+}
+
+static int
+same_setting(const sequencer_setting_t* a, const sequencer_setting_t* b)
+{
+  if (a->type != b->type) return FALSE;
+  switch (a->type) {
+  case 's': return (wcscmp(a->text, b->text) == 0);
+  case 'd': return (a->dval == b->dval);
+  default:  return (a->ival == b->ival);
+  }
+}
+
+void
+Y_andor_sequencer(int argc)
+{
+  sequencer_t* seq;
+  int keep;
+
+  if (argc > 1) y_error("expecting at most 1 argument");
+  keep = (argc == 1 && yarg_true(0));
+  seq = (sequencer_t*)ypush_obj(&sequencer_type, sizeof(sequencer_t));
+  seq->keep = keep;
+}
+
+void
+Y_andor_add_step(int argc)
+{
+  sequencer_t* seq;
+  sequencer_setting_t* set;
+  const char* str;
+  void* ptr;
+  long count, n, j, k, nfeatures;
+  int iarg, type;
+
+  if (argc < 2 || argc % 2 != 0) {
+    y_error("expecting SEQ, COUNT and pairs of feature names and values");
+  }
+  seq = (sequencer_t*)yget_obj(argc - 1, &sequencer_type);
+  count = get_long(argc - 2);
+  if (count < 1) y_error("invalid number of frames");
+  n = (argc - 2)/2;
+
+  /* Check the settings before changing anything. */
+  for (k = 0; k < n; ++k) {
+    iarg = argc - 3 - 2*k;
+    str = get_string(iarg);
+    if (str == NULL || str[0] == '\0') y_error("invalid feature name");
+    (void)get_wide_string(iarg, FALSE); /* check the characters */
+    if (yarg_rank(iarg - 1) != 0) y_error("feature values must be scalars");
+    type = yarg_typeid(iarg - 1);
+    if (type > Y_DOUBLE && type != Y_STRING) {
+      y_error("feature values must be integers, reals or strings");
+    }
+    if (type == Y_STRING && get_wide_string(iarg - 1, FALSE) == NULL) {
+      y_error("invalid NULL string value");
+    }
+  }
+
+  /* Make room for the new step and its settings. */
+  if (seq->nsteps >= seq->maxsteps) {
+    long size = (seq->maxsteps > 0 ? 2*seq->maxsteps : 16);
+    ptr = realloc(seq->steps, size*sizeof(sequencer_step_t));
+    if (ptr == NULL) y_error("insufficient memory");
+    seq->steps = (sequencer_step_t*)ptr;
+    seq->maxsteps = size;
+  }
+  if (seq->nsettings + n > seq->maxsettings) {
+    long size = (seq->maxsettings > 0 ? 2*seq->maxsettings : 32);
+    if (size < seq->nsettings + n) size = seq->nsettings + n;
+    ptr = realloc(seq->settings, size*sizeof(sequencer_setting_t));
+    if (ptr == NULL) y_error("insufficient memory");
+    seq->settings = (sequencer_setting_t*)ptr;
+    ptr = realloc(seq->current, size*sizeof(long));
+    if (ptr == NULL) y_error("insufficient memory");
+    seq->current = (long*)ptr;
+    seq->maxsettings = size;
+  }
+
+  /* Build the settings after the stored ones, they are only committed
+     (with the step) once complete.  The strings are copied first so that a
+     failure leaves the sequencer unchanged. */
+  set = seq->settings + seq->nsettings;
+  memset(set, 0, n*sizeof(sequencer_setting_t));
+  for (k = 0; k < n; ++k) {
+    iarg = argc - 3 - 2*k;
+    set[k].name = copy_wide(get_wide_string(iarg, FALSE));
+    if (set[k].name == NULL) break;
+    if (yarg_typeid(iarg - 1) == Y_STRING) {
+      set[k].text = copy_wide(get_wide_string(iarg - 1, FALSE));
+      if (set[k].text == NULL) break;
+    }
+  }
+  if (k < n) {
+    for (k = 0; k < n; ++k) {
+      if (set[k].name != NULL) free(set[k].name);
+      if (set[k].text != NULL) free(set[k].text);
+    }
+    y_error("insufficient memory");
+  }
+  nfeatures = seq->nfeatures;
+  for (k = 0; k < n; ++k) {
+    iarg = argc - 3 - 2*k;
+    type = yarg_typeid(iarg - 1);
+    if (type == Y_STRING) {
+      set[k].type = 's';
+    } else if (type == Y_FLOAT || type == Y_DOUBLE) {
+      set[k].type = 'd';
+      set[k].dval = get_double(iarg - 1);
+    } else {
+      set[k].type = 'i';
+      set[k].ival = get_long(iarg - 1);
+    }
+    for (j = 0; j < seq->nsettings + k; ++j) {
+      if (wcscmp(seq->settings[j].name, set[k].name) == 0) break;
+    }
+    set[k].feature = (j < seq->nsettings + k ? seq->settings[j].feature :
+                      nfeatures++);
+  }
+  seq->nsettings += n;
+  seq->nfeatures = nfeatures;
+  seq->steps[seq->nsteps].count = count;
+  seq->steps[seq->nsteps].first = seq->nsettings - n;
+  seq->steps[seq->nsteps].nsettings = n;
+  seq->steps[seq->nsteps].result = NULL;
+  ++seq->nsteps;
+  push_nil();
+}
+
+void
+Y_andor_run_sequence(int argc)
+{
+  sequencer_t* seq;
+  sequencer_step_t* step;
+  sequencer_setting_t* set;
+  camera_t* cam;
+  char descr[128];
+  long j, k, prev;
+  int code, timeout;
+
+  if (argc != 3) y_error("expecting exactly 3 arguments");
+  seq = (sequencer_t*)yget_obj(2, &sequencer_type);
+  cam = get_camera(1);
+  timeout = get_int(0);
+  if (cam->acquiring) y_error("camera is acquiring");
+  drop_sequencer_results(seq);
+  for (j = 0; j < seq->nfeatures; ++j) {
+    seq->current[j] = -1;
+  }
+  seq->writes = 0;
+  seq->skipped = 0;
+  for (k = 0; k < seq->nsteps; ++k) {
+    step = &seq->steps[k];
+    for (j = step->first; j < step->first + step->nsettings; ++j) {
+      set = &seq->settings[j];
+      prev = seq->current[set->feature];
+      if (prev >= 0 && same_setting(&seq->settings[prev], set)) {
+        ++seq->skipped;
+        continue;
+      }
+      code = apply_setting(cam->handle, set);
+      if (code != AT_SUCCESS) {
+        sprintf(descr, "setting \"%.64s\" at step %ld",
+                to_char(set->name, FALSE), k + 1);
+        throw(descr, code);
+      }
+      seq->current[set->feature] = j;
+      ++seq->writes;
+    }
+    capture_frames(cam, step->count, timeout, seq->keep);
+    if (seq->keep) {
+      step->result = yget_use(0);
+      yarg_drop(1);
+    }
+  }
+  push_nil();
+}
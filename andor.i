@@ -71,7 +71,11 @@ local andor_intro;
      The functions andor_get_single and andor_get_sequence are drivers which
      can be used to simply get a single image or a sequence of images.
 
-   SEE ALSO andor_equiv, andor_open.
+     Processing stages (for instance, andor_centroider) can be attached to a
+     camera to process the raw frames directly in the frame buffers, without
+     decoding the full images in Yorick arrays (see andor_attach).
+
+   SEE ALSO andor_equiv, andor_open, andor_attach.
 */
 
 local andor_equiv;
@@ -201,9 +205,141 @@ extern andor_wait_image;
       available image.  If TIMEOUT is strictly less than zero, the function
       will wait until a frame is ready.  If TIMEOUT is zero, the function will
       return immediately.  If no frame is ready after the delay, an empty
-      result is returned.
+      result is returned.  CAM can also be a remote camera (see
+      andor_connect), the frames are then native arrays read directly in
+      the frame buffers of the broker.
+
+   SEE ALSO: andor_connect.
+ */
+
+extern andor_arm;
+extern andor_trigger;
+/* DOCUMENT andor_arm, cam;
+         or andor_trigger, cam;
+
+     The subroutine andor_arm prepares camera CAM for a software triggered
+     acquisition: the pixel format is queried and the method to extract the
+     frames is selected, the queue of frame buffers is allocated (if
+     needed), pre-faulted and queued, the trigger mode is set to "Software"
+     and the acquisition is started.  No frames are acquired until
+     andor_trigger is called, which only sends the "SoftwareTrigger"
+     command to the camera and thus has a short and steady latency.  Each
+     call to andor_trigger acquires one frame to be retrieved by
+     andor_wait_image.  The length of the queue must be set before arming
+     the camera and the acquisition is stopped by andor_stop_acquisition as
+     usual.  The trigger mode in use before arming the camera is restored
+     when the acquisition is stopped.
+
+   SEE ALSO: andor_start_acquisition, andor_wait_image,
+             andor_set_queue_length.
+ */
+
+extern andor_set_color_mode;
+/* DOCUMENT andor_set_color_mode, cam, mode;
+
+     Set how the frames of camera CAM with the RGB8Packed pixel encoding are
+     extracted by andor_wait_image.  MODE is one of:
+       "planar"    - (the default) a WIDTH-by-HEIGHT-by-3 array of chars with
+                     the red, green and blue planes;
+       "luminance" - a WIDTH-by-HEIGHT array of chars with the luminance
+                     (0.299*R + 0.587*G + 0.114*B);
+       "raw"       - the interleaved bytes as delivered by the camera.
+     The current mode is given by CAM.color_mode.
+
+   SEE ALSO: andor_wait_image, andor_set_output_type.
+ */
+
+extern _andor_set_output_type;
+func andor_set_output_type(cam, type)
+/* DOCUMENT andor_set_output_type, cam, type;
+
+     Set the type of the frames of camera CAM extracted by andor_wait_image.
+     TYPE is one of char, short, int, long, float or double (or the name of
+     one of these types).  If TYPE is nil or "native", the frames have the
+     smallest type able to store the pixel values (char for Mono8 and
+     RGB8Packed, short for Mono12, Mono12Packed and Mono16, int for Mono32).
+     The conversion is done while the pixels are extracted, which is faster
+     than converting the result.  Pixel encodings which are extracted as raw
+     data always yield arrays of chars.  The current setting is given by
+     CAM.output_type.
+
+   SEE ALSO: andor_wait_image, andor_set_color_mode.
+ */
+{
+  if (! is_void(type) && ! is_string(type)) type = nameof(type);
+  _andor_set_output_type, cam, type;
+}
+
+extern andor_set_orientation;
+/* DOCUMENT andor_set_orientation, cam, orient;
+
+     Set the orientation of the frames of camera CAM extracted by
+     andor_wait_image.  ORIENT is one of:
+       "none"          - (the default) the frames as delivered by the camera;
+       "flipx"         - the first axis is reversed;
+       "flipy"         - the second axis is reversed;
+       "rotate90"      - rotation by 90 degrees counterclockwise (as
+                         displayed by pli);
+       "rotate180"     - rotation by 180 degrees;
+       "rotate270"     - rotation by 270 degrees counterclockwise;
+       "transpose"     - the axes are exchanged;
+       "antitranspose" - the axes are exchanged and both are reversed.
+     The frames are transformed while the pixels are extracted, by small
+     tiles so that it costs about the same as the plain extraction.  The
+     coordinates of the bad pixels (see andor_set_bad_pixels) remain those
+     of the sensor.  Frames extracted as raw data and processing stages are
+     not affected.  The current orientation is given by CAM.orientation.
+
+   SEE ALSO: andor_wait_image, andor_set_output_type.
+ */
 
-   SEE ALSO:
+extern andor_attach;
+extern andor_detach;
+extern andor_process;
+extern andor_reset;
+/* DOCUMENT andor_attach, cam, stage;
+         or andor_detach, cam, stage;
+         or n = andor_process(cam, timeout, count);
+         or andor_reset, stage;
+
+     Processing stages are objects which process the raw frames acquired by a
+     camera directly in the queue of frame buffers, before the buffers are
+     re-queued.  The subroutine andor_attach attaches processing stage STAGE
+     to camera CAM.  A stage can only be attached to a single camera at a
+     time, but several stages can be attached to the same camera, they are
+     applied in the order of attachment.  The subroutine andor_detach detaches
+     STAGE from camera CAM; if STAGE is nil, all stages are detached.
+
+     The attached stages are fed with every frame returned by andor_wait_image
+     and by andor_process.  The function andor_process waits for at most
+     COUNT frames and only feeds them to the attached stages without
+     extracting the images.  It returns the number of processed frames which
+     may be less than COUNT if no frame is delivered after TIMEOUT
+     milliseconds (TIMEOUT < 0 to wait forever).
+
+     A stage may suppress the delivery of a frame (see
+     andor_change_detector): the frame is then not fed to the stages attached
+     after it and andor_wait_image skips it and waits for the next frame
+     (within the same TIMEOUT).  Suppressed frames are counted by
+     andor_process.
+
+     A stage STAGE used as a function, that is STAGE(), yields its current
+     result.  Its member STAGE.frames is the number of processed frames.  The
+     subroutine andor_reset resets the results accumulated by STAGE.
+
+     For instance, with a Shack-Hartmann wavefront sensor:
+
+         wfs = andor_centroider(x, y, 8, 8);
+         andor_attach, cam, wfs;
+         andor_start_acquisition, cam;
+         for (k = 1; k <= 1000; ++k) {
+           andor_process, cam, -1, 1;
+           slopes = wfs();
+           ...
+         }
+         andor_stop_acquisition, cam;
+
+   SEE ALSO: andor_intro, andor_centroider, andor_wait_image.
  */
 
 extern andor_command;
@@ -420,6 +556,807 @@ func andor_get_sequence(cam, cnt, timeout=)
   return ptr;
 }
 
+extern andor_capture;
+/* DOCUMENT cube = andor_capture(cam, cnt, timeout);
+
+     Acquire exactly CNT frames with camera CAM and return them as a
+     WIDTH-by-HEIGHT-by-CNT array.  The camera is set in the "Fixed" cycle
+     mode with "FrameCount" equal to CNT, so no surplus frames are acquired
+     and the acquisition ends by itself.  TIMEOUT is the maximum number of
+     milliseconds to wait for each frame (forever if strictly negative); an
+     error is raised if a frame is not acquired in time.  The camera must
+     not be acquiring.
+
+     The result is allocated before starting the acquisition.  When the
+     frames can be returned as delivered by the camera (Mono8, Mono12,
+     Mono16 or Mono32 encoding, no row padding, no metadata, default output
+     type, no orientation nor bad pixels and no frame server), the frame
+     buffers are directly queued in the result and no frames are copied.
+     Otherwise the queue of frame buffers of the camera is used (see
+     andor_set_queue_length) and each frame is extracted, as by
+     andor_wait_image, directly in its slice of the result.  In any case,
+     the attached processing stages are fed with every frame but cannot
+     suppress any: the result always has CNT frames, even if a stage (for
+     instance a change detector, see andor_change_detector) would have
+     suppressed some of them.
+
+     The cycle mode of the camera is left as "Fixed" until the next
+     acquisition is started by andor_start_acquisition.
+
+   SEE ALSO: andor_get_sequence, andor_wait_image, andor_attach.
+ */
+
+extern andor_sequencer;
+extern andor_add_step;
+extern andor_run_sequence;
+/* DOCUMENT seq = andor_sequencer(keep);
+         or andor_add_step, seq, cnt, name1, val1, name2, val2, ...;
+         or andor_run_sequence, seq, cam, timeout;
+         or cube = seq(k);
+
+     The function andor_sequencer creates a new acquisition sequencer, that
+     is a list of steps to be executed back-to-back by andor_run_sequence.
+     If KEEP is true, the frames acquired by each step are kept in the
+     sequencer; otherwise, they are only fed to the processing stages
+     attached to the camera (see andor_attach).
+
+     The subroutine andor_add_step appends a step to sequencer SEQ.  The step
+     sets the features NAME1, NAME2, ... of the camera to the values VAL1,
+     VAL2, ... (in that order) and then acquires exactly CNT frames.  A
+     string value is set with andor_set_enum_string (or with
+     andor_set_string for a string feature), a real value with
+     andor_set_float and an integer value with andor_set_int (or with
+     andor_set_bool or andor_set_float if the feature is a boolean or a
+     floating-point one).
+
+     The subroutine andor_run_sequence executes all the steps of sequencer
+     SEQ with camera CAM.  Each step is acquired as by andor_capture with
+     TIMEOUT the maximum number of milliseconds to wait for each frame and
+     the frame buffers of the camera are reused from one step to the next.
+     Within a run, a feature is not written again if it has already been
+     set to the same value by a previous step, so, when setting a feature
+     may change another one (for instance, the binning and the size of the
+     area of interest), both should be specified by the steps where any of
+     them changes.  The camera must not be acquiring.
+
+     When the frames are kept, SEQ(K) yields the frames acquired by the
+     K-th step of the last run (K less or equal zero counts from the last
+     step).  Other members are:
+
+       seq.steps   - the number of steps;
+       seq.frames  - the total number of frames acquired by a run;
+       seq.writes  - the number of features written by the last run;
+       seq.skipped - the number of unchanged settings skipped by the last
+                     run;
+       seq.keep    - whether the frames are kept.
+
+     For instance:
+
+       seq = andor_sequencer(1);
+       andor_add_step, seq, 10, "ExposureTime", 0.01, "AOIWidth", 512;
+       andor_add_step, seq, 50, "ExposureTime", 0.1;
+       andor_set_queue_length, cam, 8;
+       andor_run_sequence, seq, cam, 1000;
+       short_exposures = seq(1);
+
+   SEE ALSO: andor_capture, andor_attach, andor_set_queue_length.
+ */
+
+extern _andor_centroider;
+func andor_centroider(x, y, w, h, method=, threshold=, weights=, nthreads=)
+/* DOCUMENT wfs = andor_centroider(x, y, w, h);
+
+     Create a processing stage which computes the centroids of the
+     sub-images of a Shack-Hartmann wavefront sensor directly from the raw
+     frames (Mono8, Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings
+     are supported).  X and Y are the 1-based coordinates of the first pixel
+     of the sub-apertures, W and H are the widths and heights of the
+     sub-apertures (scalars or vectors of same length as X and Y).
+
+     Once attached to a camera (see andor_attach), WFS() yields a 2-by-N
+     array of slopes, with N the number of sub-apertures, which are the
+     centroids relative to the center of the sub-apertures in pixel units.
+     WFS.flux gives the total (weighted) intensity in each sub-aperture for
+     the last frame.  The slopes of a sub-aperture with no flux are zero.
+
+     Keyword METHOD specifies the centroiding method: "cog" (the default) for
+     the center of gravity, "tcog" for the thresholded center of gravity (the
+     value of keyword THRESHOLD is subtracted and negative values are
+     discarded) and "wcog" for the weighted center of gravity (keyword
+     WEIGHTS is a W-by-H array of weights, all sub-apertures must have the
+     same size).
+
+     Sub-apertures are processed in parallel by NTHREADS threads (by default
+     as many as there are processors).
+
+   SEE ALSO: andor_attach, andor_process.
+ */
+{
+  if (is_void(method)) method = "cog";
+  if (is_void(threshold)) threshold = 0.0;
+  if (is_void(nthreads)) nthreads = 0;
+  return _andor_centroider(x, y, w, h, method, threshold, weights, nthreads);
+}
+
+extern _andor_event_extractor;
+func andor_event_extractor(threshold, maxcount=)
+/* DOCUMENT ev = andor_event_extractor(threshold);
+
+     Create a processing stage which extracts the pixels above a given
+     threshold in the raw frames (Mono8, Mono12, Mono12Packed, Mono16 and
+     Mono32 pixel encodings are supported), for instance to perform photon
+     counting.  THRESHOLD is either a scalar or a WIDTH-by-HEIGHT array of
+     per-pixel thresholds.  A pixel is selected if its value is strictly
+     greater than its threshold.
+
+     Once attached to a camera (see andor_attach), EV() yields a 4-by-N array
+     of long integers with the (X,Y,VALUE,FRAME) quadruplets of the N events
+     extracted so far, where X and Y are the 1-based pixel coordinates and
+     FRAME is the 1-based number of the processed frame; the result is empty
+     if there are no events.  The list keeps growing until andor_reset is
+     called.  EV.count is the number of events in the list.
+
+     Keyword MAXCOUNT can be used to limit the number of events in the list,
+     the subsequent events are only counted in EV.lost.
+
+   SEE ALSO: andor_attach, andor_process, andor_reset.
+ */
+{
+  return _andor_event_extractor(threshold, (is_void(maxcount) ? 0 : maxcount));
+}
+
+extern _andor_lucky_selector;
+func andor_lucky_selector(k, metric=)
+/* DOCUMENT sel = andor_lucky_selector(k);
+
+     Create a processing stage which retains the K sharpest frames for lucky
+     imaging.  The sharpness of each frame is computed on the fly from the raw
+     frame (Mono8, Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings
+     are supported) and only the K best raw frames are kept, so memory is
+     bounded whatever the number of processed frames.
+
+     Keyword METRIC specifies the sharpness metric: "peak" (the default) for
+     the ratio of the peak intensity to the total intensity (a proxy for the
+     Strehl ratio) or "gradient" for the energy of the finite differences
+     divided by the squared total intensity.
+
+     Once attached to a camera (see andor_attach), SEL() yields a
+     WIDTH-by-HEIGHT-by-N array of floats with the N <= K retained frames
+     sorted by decreasing sharpness.  SEL.metrics and SEL.numbers give the
+     sharpness and the 1-based numbers of the retained frames (in the same
+     order).  Use andor_reset to start a new selection.
+
+   SEE ALSO: andor_attach, andor_process, andor_reset.
+ */
+{
+  return _andor_lucky_selector(k, (is_void(metric) ? "peak" : metric));
+}
+
+extern _andor_shift_and_add;
+func andor_shift_and_add(method=, shift=, oversampling=, window=)
+/* DOCUMENT saa = andor_shift_and_add();
+
+     Create a processing stage which registers and stacks the frames on the
+     fly (Mono8, Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings are
+     supported).  The position of the brightest feature is measured in a
+     reference window of each frame and the frame is shifted so that this
+     feature stays at the position it had in the first frame before being
+     added into an oversampled accumulator.
+
+     Keyword METHOD specifies how to estimate the position: "peak" (the
+     default) for the brightest pixel, "centroid" for the center of
+     gravity.  Keyword WINDOW = [XMIN,XMAX,YMIN,YMAX] specifies the
+     reference window (1-based inclusive bounds), by default the full frame.
+     Keyword OVERSAMPLING specifies the integer oversampling factor of the
+     accumulator (1 by default).  Keyword SHIFT specifies how the frames are
+     shifted: "integer" (the default) to shift by the nearest integer number
+     of pixels of the oversampled grid, or "bilinear" to split fractional
+     shifts between neighboring pixels with bilinear weights.
+
+     Once attached to a camera (see andor_attach), SAA() yields the
+     registered stack, that is the accumulated sum divided by the
+     accumulated weights, as an array of doubles with dimensions
+     OVERSAMPLING times those of the frames.  SAA.sum and SAA.weights are
+     the accumulated sum and weights, SAA.shift is the shift [DX,DY] (in
+     frame pixels) applied to the last frame.  Use andor_reset to start a new
+     stack (the next frame becomes the new reference).
+
+   SEE ALSO: andor_attach, andor_process, andor_reset,
+             andor_lucky_selector.
+ */
+{
+  if (is_void(method)) method = "peak";
+  if (is_void(shift)) shift = "integer";
+  if (is_void(oversampling)) oversampling = 1;
+  return _andor_shift_and_add(method, shift, oversampling, window);
+}
+
+extern _andor_stacker;
+func andor_stacker(n, method=, nsigma=, niter=)
+/* DOCUMENT stk = andor_stacker(n);
+
+     Create a processing stage which keeps the N last raw frames (Mono8,
+     Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings are supported)
+     and combines them on demand with a robust estimator, for instance to get
+     rid of hot pixels and cosmic rays without storing cubes of images.
+
+     Keyword METHOD specifies the combination: "median" (the default) for
+     the per-pixel median, "sigma" for the per-pixel sigma-clipped mean.  For
+     the latter, keywords NSIGMA (3 by default) and NITER (3 by default) are
+     the clipping threshold in units of the standard deviation and the
+     number of clipping iterations.  The first iteration clips around the
+     median with a standard deviation estimated from the median absolute
+     deviation, the next ones clip around the mean of the values kept so
+     far.  With NITER = 0, the result is the median.
+
+     Once attached to a camera (see andor_attach), STK() yields the
+     combination (as an array of floats) of the STK.count <= N last
+     processed frames.  Use andor_reset to empty the window.
+
+   SEE ALSO: andor_attach, andor_process, andor_reset.
+ */
+{
+  if (is_void(method)) method = "median";
+  if (is_void(nsigma)) nsigma = 3.0;
+  if (is_void(niter)) niter = 3;
+  return _andor_stacker(n, method, nsigma, niter);
+}
+
+extern _andor_speckle;
+func andor_speckle(width, height, origin=, apodize=, nthreads=)
+/* DOCUMENT spk = andor_speckle(width, height);
+
+     Create a processing stage which accumulates the power spectrum of a
+     WIDTH-by-HEIGHT window of the frames for speckle interferometry (Mono8,
+     Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings are supported).
+     WIDTH and HEIGHT must be powers of 2.  The 2-D FFT is computed
+     internally by a team of NTHREADS threads (by default as many as there
+     are processors).
+
+     Keyword ORIGIN = [X0,Y0] specifies the 1-based coordinates of the first
+     pixel of the window, by default the window is centered in the frames.
+     If keyword APODIZE is true, a separable Hann window is applied to the
+     data before the Fourier transform.
+
+     Once attached to a camera (see andor_attach), SPK() yields the mean
+     power spectrum as an array of doubles of dimensions (WIDTH/2+1)-by-HEIGHT
+     (the other half of the spectrum is given by the Hermitian symmetry) with
+     the same frequency layout as the fft function.  SPK.sum is the sum of
+     the power spectra of the SPK.frames processed frames.
+
+   SEE ALSO: andor_attach, andor_process, andor_reset, fft.
+ */
+{
+  if (is_void(nthreads)) nthreads = 0;
+  return _andor_speckle(width, height, origin, (apodize ? 1n : 0n), nthreads);
+}
+
+extern _andor_set_bad_pixels;
+func andor_set_bad_pixels(cam, x, y, method=)
+/* DOCUMENT andor_set_bad_pixels, cam, x, y;
+         or andor_set_bad_pixels, cam;
+
+     Set the map of bad (hot or dead) pixels of camera CAM.  X and Y are the
+     1-based coordinates of the bad pixels relative to the frames (i.e. to the
+     area of interest).  Without X and Y, the map is cleared.  The map can be
+     retrieved as a 2-by-N array of coordinates by CAM.bad_pixels.
+
+     The bad pixels are corrected in the images returned by andor_wait_image
+     by replacing their values by the median (the default, or if keyword
+     METHOD is "median") or the mean (if METHOD is "mean") of their neighbors
+     (the 8 nearest pixels) which are not themselves bad.  The list of
+     neighbors is computed when the acquisition starts, so the correction has
+     a negligible cost.  Bad pixels without valid neighbors and pixels outside
+     the frames are left unchanged.  The processing stages (see andor_attach)
+     are fed with the raw uncorrected frames.
+
+   SEE ALSO: andor_wait_image, andor_attach.
+ */
+{
+  if (is_void(method) || method == "median") {
+    median = 1n;
+  } else if (method == "mean") {
+    median = 0n;
+  } else {
+    error, "METHOD must be \"median\" or \"mean\"";
+  }
+  _andor_set_bad_pixels, cam, x, y, median;
+}
+
+extern _andor_auto_exposure;
+func andor_auto_exposure(target, percentile=, damping=, tolerance=, delay=)
+/* DOCUMENT aex = andor_auto_exposure(target);
+
+     Create a processing stage which automatically adjusts the exposure time
+     of the camera it is attached to (see andor_attach) so that a given
+     percentile of the pixel values matches the level TARGET (in ADU).  The
+     level is measured in every frame from a histogram of the raw pixel
+     values (Mono8, Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings
+     are supported) and the "ExposureTime" feature is directly set by the
+     stage, so the exposure converges in a few frames without any
+     interpreted code.
+
+     Keywords:
+       PERCENTILE = fraction of pixels below the measured level (default
+                    0.99).
+       DAMPING    = damping factor in [0,1) (default 0.3): the exposure time
+                    is multiplied by (TARGET/LEVEL)^(1 - DAMPING), by at most
+                    a factor of 10 per frame.  The exposure time is clamped to
+                    the limits given by the camera when acquisition starts.
+       TOLERANCE  = minimum relative change of the exposure time (default
+                    0.02) to avoid setting it too often.
+       DELAY      = number of frames to skip after a change (default 1), to
+                    account for the frames acquired before the change took
+                    effect.
+
+     AEX() yields the current exposure time.  Other members are:
+       AEX.level   = level measured in the last processed frame;
+       AEX.target  = target level;
+       AEX.min     = minimum exposure time;
+       AEX.max     = maximum exposure time;
+       AEX.updates = number of changes of the exposure time;
+       AEX.errors  = number of failures to change the exposure time;
+       AEX.status  = status code of the last attempt.
+
+     The current exposure time is read when the acquisition starts, so it
+     should not be changed by other means while the stage is attached.
+
+   SEE ALSO: andor_attach, andor_set_float.
+ */
+{
+  if (is_void(percentile)) percentile = 0.99;
+  if (is_void(damping)) damping = 0.3;
+  if (is_void(tolerance)) tolerance = 0.02;
+  if (is_void(delay)) delay = 1;
+  return _andor_auto_exposure(target, percentile, damping, tolerance, delay);
+}
+
+extern _andor_preview;
+func andor_preview(width, height, interval=, stretch=)
+/* DOCUMENT pvw = andor_preview(width, height);
+
+     Create a processing stage which produces a small contrast-stretched
+     8-bit image of the frames for live display.  The frames are reduced by
+     averaging square blocks of pixels, the smallest integer reduction factor
+     is chosen so that the preview is at most WIDTH-by-HEIGHT pixels.  The
+     result is linearly stretched between two percentiles of its values,
+     given by keyword STRETCH (default [0.01,0.99]), and quantized to 8 bits.
+     Mono8, Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings are
+     supported.
+
+     The preview is computed at most every INTERVAL seconds (default 0.1),
+     whatever the acquisition rate, other frames are ignored at a negligible
+     cost.  PVW() yields the last preview as an array of chars (nil if none
+     has been computed), PVW.count is the number of previews computed so
+     far, PVW.factor is the reduction factor and PVW.cmin and PVW.cmax are the
+     pixel values mapped to 0 and 255.  For instance:
+
+         pvw = andor_preview(256, 256);
+         andor_attach, cam, pvw;
+         andor_start_acquisition, cam;
+         last = 0;
+         for (;;) {
+           andor_process, cam, -1, 10;
+           if (pvw.count > last) {
+             last = pvw.count;
+             fma;
+             pli, pvw();
+           }
+         }
+
+   SEE ALSO: andor_attach, andor_process, pli.
+ */
+{
+  if (is_void(interval)) interval = 0.1;
+  if (is_void(stretch)) stretch = [0.01, 0.99];
+  return _andor_preview(width, height, interval, stretch(1), stretch(2));
+}
+
+extern _andor_ramp;
+func andor_ramp(dt, nthreads=)
+/* DOCUMENT rmp = andor_ramp();
+         or rmp = andor_ramp(dt);
+
+     Create a processing stage which fits, for every pixel, a straight line
+     to the values of the successive frames of a ramp (e.g. non-destructive
+     reads).  The k-th frame since the last reset (see andor_reset) is
+     assumed to have been taken at time (k - 1)*DT, by default DT = 1 and the
+     slope is in ADU per frame.  Only per-pixel sums are updated as frames
+     arrive (by NTHREADS threads, by default as many as there are
+     processors), so the memory required does not depend on the length of
+     the ramp.  Mono8, Mono12, Mono12Packed, Mono16 and Mono32 pixel
+     encodings are supported.
+
+     RMP() yields a WIDTH-by-HEIGHT-by-3 array of doubles with the slope,
+     the intercept (value at the time of the first frame) and the rms of the
+     residuals of the fit.  These can also be retrieved separately as
+     RMP.slope, RMP.intercept and RMP.residual.  RMP.frames is the number of
+     frames of the current ramp.  The sums are kept if the acquisition is
+     restarted with the same frame dimensions, call andor_reset to start a
+     new ramp.
+
+   SEE ALSO: andor_attach, andor_reset, andor_process.
+ */
+{
+  if (is_void(dt)) dt = 1.0;
+  if (is_void(nthreads)) nthreads = 0;
+  return _andor_ramp(dt, nthreads);
+}
+
+extern _andor_change_detector;
+func andor_change_detector(threshold, count, suppress=, nthreads=)
+/* DOCUMENT det = andor_change_detector();
+         or det = andor_change_detector(threshold, count);
+
+     Create a processing stage which detects changes in the frames.  Each
+     frame is compared, pixel by pixel, to a reference frame: the last frame
+     which has changed (the first frame always has).  A frame has changed if
+     at least COUNT pixels (by default 1) differ from the reference by more
+     than THRESHOLD (by default 0) in absolute value.  Comparisons are done
+     directly on the raw pixels, by NTHREADS threads (by default as many as
+     there are processors).  Mono8, Mono12, Mono12Packed, Mono16 and Mono32
+     pixel encodings are supported.
+
+     If keyword SUPPRESS is true, the frames which have not changed are not
+     delivered: they are neither fed to the stages attached after DET nor
+     returned by andor_wait_image.  Attach DET first to avoid any other
+     processing of these frames.
+
+     DET() yields [SAD, N] for the last frame, where SAD is the sum of the
+     absolute differences with the reference and N the number of changed
+     pixels (both are zero for the first frame).  These are also given by
+     DET.sad and DET.changed.  DET.changes is the number of frames which have
+     changed and DET.suppressed the number of suppressed frames.  The
+     reference is discarded when acquisition is started and by andor_reset.
+
+   SEE ALSO: andor_attach, andor_reset, andor_process, andor_wait_image.
+ */
+{
+  if (is_void(threshold)) threshold = 0;
+  if (is_void(count)) count = 1;
+  if (is_void(nthreads)) nthreads = 0;
+  return _andor_change_detector(threshold, count, (suppress ? 1n : 0n),
+                                nthreads);
+}
+
+extern _andor_recorder;
+func andor_recorder(filename, compress=, tile=, nslots=, nthreads=,
+                    container=, chunk=, metadata=)
+/* DOCUMENT rec = andor_recorder(filename);
+
+     Create a processing stage which records the frames in the FITS file
+     FILENAME (which is overwritten if it exists).  Each frame is saved as an
+     image extension with keyword FRAMENUM set to the frame number.  Mono8,
+     Mono12, Mono12Packed and Mono16 pixel encodings are supported, 12 and
+     16-bit pixels are saved as unsigned 16-bit integers (BITPIX = 16 and
+     BZERO = 32768).
+
+     If keyword COMPRESS is true or "rice", the frames are losslessly
+     compressed with the Rice algorithm according to the FITS tiled image
+     convention (as done by fpack, such files can be read by CFITSIO or
+     uncompressed with funpack).  If COMPRESS is "delta", the frames are
+     compressed with the faster codec of andor_encode and the file is not a
+     FITS file but the concatenation of the encoded frames (the frame number
+     is stored in the header of each encoded frame), it can be read back
+     with andor_decode.  The tiles are made of TILE rows (default 1 for
+     "rice" and 16 for "delta") and are compressed in parallel by NTHREADS
+     threads (by default as many as there are processors).
+
+     If keyword CONTAINER is true, the file is an indexed container where the
+     frames are stored (uncompressed or, with COMPRESS="delta", encoded) by
+     chunks of CHUNK frames (default 64) aligned on 4 KiB boundaries, and
+     followed by an index of the frames (number, arrival time, offset, size
+     and format).  The index is written each time the recorder is flushed
+     and when it is closed.  Containers are read by andor_open_container
+     which gives random access to any frame without reading the rest of the
+     file.  To add up the bandwidth of several disks, a container may be
+     striped over several files: FILENAME is then an array of names (one per
+     disk) and the frames are distributed round-robin among the files, each
+     file having its own writer thread, ring of buffers and NTHREADS
+     compression threads.  The first file holds the index of all frames.
+
+     If keyword METADATA is true, a table of per-frame metadata is written
+     alongside each file in a file with the same name and suffix ".meta".
+     Each record gives the frame number, the index of the frame in the
+     recording, its arrival time, its timestamp (in ticks of the camera
+     clock, requires the "MetadataEnable" and "MetadataTimestamp" features to
+     be set), the exposure time, the sensor temperature and the number of
+     frames dropped so far.  To not slow down the acquisition, the exposure
+     time is a cached value and the temperature is queried at most once per
+     second.  Such tables are read by andor_open_metadata.
+
+     Frames are copied into a ring of NSLOTS buffers (default 8, per file) and
+     written by a separate thread, frames are dropped if the writer cannot keep
+     up.  REC() waits for all pending frames to be written, flushes the file
+     (and writes the index of a container) and yields the number of frames
+     written so far.  The file is closed when the stage is destroyed.  Other
+     members are:
+       REC.written  = number of frames written;
+       REC.dropped  = number of frames dropped;
+       REC.pending  = number of frames waiting to be written;
+       REC.ratio    = compression ratio;
+       REC.stripes  = number of files;
+       REC.error    = error code (errno) of the writer, no more frames are
+                      written after an error.
+
+   SEE ALSO: andor_attach, andor_process, andor_decode,
+             andor_open_container, andor_open_metadata.
+ */
+{
+  if (is_void(compress)) {
+    method = 0n;
+  } else if (structof(compress) == string) {
+    if (compress == "rice") {
+      method = 1n;
+    } else if (compress == "delta") {
+      method = 2n;
+    } else {
+      error, "COMPRESS must be \"rice\" or \"delta\"";
+    }
+  } else {
+    method = (compress ? 1n : 0n);
+  }
+  if (is_void(tile)) tile = (method == 2n ? 16 : 1);
+  if (is_void(nslots)) nslots = 8;
+  if (is_void(nthreads)) nthreads = 0;
+  if (container) {
+    if (method == 1n) error, "Rice compression is only available for FITS";
+    if (is_void(chunk)) chunk = 64;
+    if (chunk < 1) error, "invalid number of frames per chunk";
+  } else {
+    if (numberof(filename) > 1) error, "only containers can be striped";
+    chunk = 0;
+  }
+  return _andor_recorder(filename, method, tile, nslots, nthreads, chunk,
+                         (metadata ? 1n : 0n));
+}
+
+extern andor_open_container;
+/* DOCUMENT cnt = andor_open_container(filename);
+
+     Open the container file FILENAME written by a recorder (see
+     andor_recorder).  For a container striped over several files, FILENAME
+     is the array of the file names in the same order as given to the
+     recorder.  The files are mapped in memory, so frames are read on
+     demand: CNT(i) yields the i-th frame and CNT(i,j) yields the frames i
+     to j as a 3-D array (1-based indices) without reading the rest of the
+     file.  The members of CNT are:
+       CNT.count   = number of frames;
+       CNT.numbers = frame numbers;
+       CNT.times   = arrival times of the frames (seconds since the Epoch);
+       CNT.offsets = offsets of the frames in the file;
+       CNT.sizes   = sizes of the stored frames in bytes;
+       CNT.stripes = indices (0-based) of the files storing the frames;
+       CNT.chunk   = number of frames per chunk.
+
+   SEE ALSO: andor_recorder, andor_decode.
+ */
+
+extern andor_open_metadata;
+/* DOCUMENT tab = andor_open_metadata(filename);
+
+     Read the table of per-frame metadata FILENAME written by a recorder
+     (see andor_recorder).  The members of TAB are:
+       TAB.count        = number of frames;
+       TAB.numbers      = frame numbers;
+       TAB.sequences    = indices (0-based) of the frames in the recording;
+       TAB.times        = arrival times of the frames (seconds since the
+                          Epoch);
+       TAB.ticks        = timestamps of the frames in clock ticks;
+       TAB.frequency    = frequency of the timestamp clock (Hz);
+       TAB.exposures    = exposure times (s);
+       TAB.temperatures = sensor temperatures (Celsius);
+       TAB.dropped      = number of frames dropped by the recorder so far;
+       TAB.stripes      = indices (0-based) of the files storing the frames;
+       TAB.flags        = flags (bit 0 set if the timestamp is valid).
+     Unknown exposure times and temperatures are NaN.  TAB() yields all the
+     columns as a 9-by-COUNT array of doubles (in the above order).
+
+   SEE ALSO: andor_recorder.
+ */
+
+extern andor_decode;
+extern _andor_encode;
+func andor_encode(img, tile=)
+/* DOCUMENT buf = andor_encode(img);
+         or img = andor_decode(buf);
+
+     The function andor_encode losslessly compresses the 2-D array of chars
+     or shorts (considered as unsigned values) IMG into an array of chars
+     BUF.  Each pixel is predicted by its neighbor on the left, the residuals
+     are zig-zag encoded and packed by blocks of 32 with the smallest number
+     of bits.  This codec is much faster than general purpose compressors
+     and yields good compression ratios on noisy sensor data.  The image is
+     split in tiles of TILE rows (default 16) which are independently
+     encoded.
+
+     The function andor_decode decodes the frames encoded in the array of
+     chars BUF (for instance, the contents of a file written by a recorder
+     with COMPRESS="delta") and yields a 2-D array or, if there are several
+     frames, a 3-D array of chars or of shorts.  For instance:
+
+         f = open(filename, "rb");
+         buf = array(char, sizeof(f));
+         _read, f, 0, buf;
+         close, f;
+         frames = andor_decode(buf);
+
+   SEE ALSO: andor_recorder.
+ */
+{
+  return _andor_encode(img, (is_void(tile) ? 16 : tile));
+}
+
+extern _andor_ring_file;
+func andor_ring_file(filename, nframes)
+/* DOCUMENT rf = andor_ring_file(filename, nframes);
+
+     Create a processing stage which copies the raw frames, as they are
+     delivered, into the file FILENAME mapped in memory.  The file has a
+     fixed size and holds the last NFRAMES frames, the oldest ones being
+     overwritten.  Since the mapped pages belong to the system, the most
+     recent frames survive if Yorick crashes or is killed and can be
+     recovered with andor_open_ring_file without having been explicitly
+     saved.  If FILENAME already holds a ring file with the same format
+     (number of frames and frame geometry), the new frames are appended
+     after the existing ones.
+
+     RF() forces the file to be written to disk and yields the sequence
+     number of the last frame written.  Other members are:
+       RF.nslots   = number of frames in the ring;
+       RF.sequence = sequence number of the last frame written;
+       RF.cursor   = index (0-based) of the next slot to write.
+
+   SEE ALSO: andor_attach, andor_open_ring_file, andor_recorder.
+ */
+{
+  return _andor_ring_file(filename, nframes);
+}
+
+extern andor_open_ring_file;
+/* DOCUMENT rr = andor_open_ring_file(filename);
+
+     Open the ring file FILENAME written by a ring file stage (see
+     andor_ring_file), for instance after a crash.  RR(i) yields the i-th
+     frame (1-based index) in the order of acquisition, the frames are
+     extracted as by andor_wait_image.  The ring file may be read while it
+     is being filled, an error is raised if the requested frame has been
+     overwritten since the file was opened.  The members of RR are:
+       RR.count     = number of frames;
+       RR.sequences = sequence numbers of the frames;
+       RR.numbers   = frame numbers;
+       RR.times     = arrival times of the frames (seconds since the Epoch);
+       RR.encoding  = pixel encoding of the frames.
+
+   SEE ALSO: andor_ring_file.
+ */
+
+extern _andor_frame_server;
+func andor_frame_server(path, broker=)
+/* DOCUMENT srv = andor_frame_server(path);
+         or srv = andor_frame_server(path, broker=cam);
+
+     Create a processing stage which serves the frames of the camera it is
+     attached to to other processes of the same host.  The server listens on
+     the Unix socket PATH (an existing socket at PATH is replaced, the socket
+     is removed when SRV is destroyed).  Clients (see andor_frame_client)
+     subscribe with their own decimation factor, region of interest and
+     binning, and receive their images through shared memory: the attached
+     stage publishes the images without ever waiting for the clients.  Mono8,
+     Mono12, Mono12Packed, Mono16 and Mono32 pixel encodings are supported.
+     Clients can only subscribe once acquisition has been started.
+
+     SRV() and SRV.clients yield the number of subscribers, SRV.published
+     the number of published images and SRV.path the path of the socket.
+
+     With keyword BROKER set to the camera CAM, the server is also a camera
+     broker: other Yorick sessions connect remote cameras (see
+     andor_connect) to access the features of CAM and receive its frames
+     without any copy.  From the next start of the acquisition, the frame
+     buffers of CAM are allocated in shared memory and half of the queue
+     (at most 32 buffers) is held back to let the remote cameras read the
+     last frames, so the queue length must be at least 2.  The remote
+     cameras are notified of every new frame before it is fed to the
+     attached stages, so SRV only needs to be attached to CAM to also serve
+     the subscribers of andor_frame_client.  SRV keeps a reference on CAM
+     (detach SRV from CAM for both to be destroyed); when SRV is destroyed,
+     the frame buffers of CAM are no longer shared from the next start of
+     the acquisition.  See andor_broker for a ready-made broker.
+
+   SEE ALSO: andor_attach, andor_frame_client, andor_connect, andor_broker.
+ */
+{
+  return _andor_frame_server(path, broker);
+}
+
+extern _andor_frame_client;
+func andor_frame_client(path, decimation=, roi=, bin=, nslots=)
+/* DOCUMENT fc = andor_frame_client(path);
+
+     Subscribe to the frame server listening on the Unix socket PATH (see
+     andor_frame_server).  Keyword DECIMATION (by default 1) is to receive
+     one frame every DECIMATION frames.  Keyword ROI = [X0, Y0, WIDTH,
+     HEIGHT] is to receive only the region of interest of WIDTH by HEIGHT
+     pixels starting at pixel (X0,Y0) (1-based coordinates in the frames);
+     by default the whole frames are received, WIDTH or HEIGHT can be 0 to
+     extend the region up to the edge of the frames.  Keyword BIN (by
+     default 1) is to average blocks of BIN-by-BIN pixels (incomplete blocks
+     are dropped), for instance to receive small previews.  Keyword NSLOTS
+     (by default 4) is the number of images kept by the server in shared
+     memory.
+
+     FC(timeout) yields the last image (as an array of floats) received
+     since the previous call, waiting at most TIMEOUT milliseconds for a new
+     one (forever if TIMEOUT is nil or negative); nil is returned if no new
+     image arrived in time.  Slow clients get the most recent image, the
+     skipped images are counted in FC.missed.  The other members of FC are:
+       FC.width, FC.height = dimensions of the images;
+       FC.count            = number of received images;
+       FC.sequence         = sequence number of the last image;
+       FC.number           = frame number of the last image;
+       FC.time             = arrival time of the last image (seconds since
+                             the Epoch);
+       FC.nslots           = number of slots in shared memory.
+
+   SEE ALSO: andor_frame_server.
+ */
+{
+  if (is_void(decimation)) decimation = 1;
+  if (is_void(roi)) roi = [1, 1, 0, 0];
+  if (numberof(roi) != 4 || roi(1) < 1 || roi(2) < 1) {
+    error, "ROI must be [X0, Y0, WIDTH, HEIGHT]";
+  }
+  if (is_void(bin)) bin = 1;
+  if (is_void(nslots)) nslots = 4;
+  return _andor_frame_client(path, decimation, roi(1) - 1, roi(2) - 1,
+                             roi(3), roi(4), bin, nslots);
+}
+
+extern andor_connect;
+/* DOCUMENT cam = andor_connect(path);
+
+     Connect a remote camera to the camera broker listening on the Unix
+     socket PATH (see andor_frame_server and andor_broker).  CAM can be used
+     as a local camera with the functions accessing the features
+     (andor_get_float, andor_set_float, andor_command, ...), the calls are
+     executed by the broker, and with andor_wait_image which extracts the
+     last frame delivered to the broker directly from its frame buffers.
+     Slow remote cameras get the most recent frame; the acquisition is only
+     controlled by the broker.  The members of CAM are:
+       CAM.count        = number of received frames;
+       CAM.missed       = number of missed frames;
+       CAM.sequence     = sequence number of the last frame;
+       CAM.time         = arrival time of the last frame (seconds since the
+                          Epoch);
+       CAM.frame_width  = width of the last frame;
+       CAM.frame_height = height of the last frame.
+
+   SEE ALSO: andor_frame_server, andor_broker, andor_wait_image.
+ */
+
+func andor_broker(cam, path, timeout=)
+/* DOCUMENT andor_broker, cam, path;
+
+     Run a camera broker for the camera CAM on the Unix socket PATH: a
+     frame server with CAM as broker is attached to CAM, the acquisition is
+     (re)started and the frames are processed until the broker is
+     interrupted.  The remote cameras receive all the frames, even those
+     suppressed by a stage attached to CAM.  The queue length of CAM must
+     have been set (at least 2).  Keyword TIMEOUT is the maximum time
+     in milliseconds to wait for each frame (by default 1000).  Other Yorick
+     sessions share the camera with andor_connect.
+
+   SEE ALSO: andor_frame_server, andor_connect, andor_process.
+ */
+{
+  if (is_void(timeout)) timeout = 1000;
+  srv = andor_frame_server(path, broker=cam);
+  if (cam.acquiring) andor_stop_acquisition, cam;
+  andor_attach, cam, srv;
+  andor_start_acquisition, cam;
+  for (;;) andor_process, cam, timeout, 1000;
+}
+
 local andor_list_enum_string;
 local andor_list_enum_implemented;
 local andor_list_enum_available
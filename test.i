@@ -32,3 +32,554 @@ write, format="cam.row_stride ----------> %d\n", cam.row_stride;
 i = andor_get_enum_index(cam, "PixelEncoding");
 s = andor_get_enum_string_by_index(cam, "PixelEncoding", i);
 write, format="PixelEncoding -----------> %s\n", s;
+
+// Self-checks: the results of the processing stages, of the recorders and
+// of the extraction options are compared with plain Yorick code applied to
+// frames acquired by the camera.
+func andor_check(cond, mesg)
+{
+  if (! allof(cond)) error, "check failed: " + mesg;
+  write, format="check passed: %s\n", mesg;
+}
+
+func andor_check_value(a)
+/* The pixel values A (as extracted from the frames) as unsigned longs. */
+{
+  s = structof(a);
+  if (s == short) return long(a) & 0xffff;
+  if (s == int) return long(a) & 0xffffffff;
+  return long(a);
+}
+
+func andor_check_capture(cam, cnt, s1, s2, s3)
+/* Capture CNT frames with camera CAM with the stages S1, S2 and S3 (which
+   may be nil) attached and return their pixel values. */
+{
+  if (! is_void(s1)) andor_attach, cam, s1;
+  if (! is_void(s2)) andor_attach, cam, s2;
+  if (! is_void(s3)) andor_attach, cam, s3;
+  cube = andor_capture(cam, cnt, 10000);
+  andor_detach, cam;
+  return andor_check_value(cube);
+}
+
+tmp = "andor-test";
+w = andor_get_width(cam);
+h = andor_get_height(cam);
+encoding = andor_get_enum_string(cam, "PixelEncoding");
+recordable = (encoding != "Mono32");
+
+// Centers of gravity of two sub-apertures:
+x0 = [1, 5];
+y0 = [2, 3];
+wfs = andor_centroider(x0, y0, 4, 4);
+v = andor_check_capture(cam, 1, wfs);
+slopes = wfs();
+flux = wfs.flux;
+for (k = 1; k <= 2; ++k) {
+  sub = double(v(x0(k):x0(k)+3, y0(k):y0(k)+3, 1));
+  s = sum(sub);
+  cog = (s > 0 ? [sum(sub*indgen(0:3))/s - 1.5,
+                  sum(sub*indgen(0:3)(-,))/s - 1.5] : [0.0, 0.0]);
+  andor_check, abs(slopes(,k) - cog) < 1e-6 && abs(flux(k) - s) <= 1e-6*s,
+    swrite(format="centroider sub-aperture %d", k);
+}
+wfs = [];
+
+// Events above the mean level:
+thr = floor(avg(v)) + 0.5;
+ev = andor_event_extractor(thr);
+v = andor_check_capture(cam, 2, ev);
+andor_check, ev.count == sum(v > thr), "event count";
+if (ev.count > 0) {
+  e = ev();
+  andor_check, v(e(1,) + w*(e(2,) - 1) + w*h*(e(4,) - 1)) == e(3,) &&
+    e(3,) > thr, "event positions and values";
+}
+ev = [];
+
+// Lucky imaging with the peak metric:
+sel = andor_lucky_selector(2);
+v = andor_check_capture(cam, 5, sel);
+m = v(max,max,)/double(v(sum,sum,));
+numbers = sel.numbers;
+metrics = sel.metrics;
+kept = array(0, 5);
+kept(numbers) = 1;
+andor_check, numberof(numbers) == 2 && metrics(1) >= metrics(2) &&
+  abs(metrics - m(numbers)) <= 1e-6*m(numbers), "lucky selector metrics";
+andor_check, min(metrics) >= max(m(where(! kept)))*(1 - 1e-6),
+  "lucky selector selection";
+frames = sel();
+andor_check, frames(,,1) == v(,,numbers(1)) &&
+  frames(,,2) == v(,,numbers(2)), "lucky selector frames";
+sel = [];
+
+// Shift-and-add of a single frame (the reference):
+saa = andor_shift_and_add();
+v = andor_check_capture(cam, 1, saa);
+andor_check, saa() == v(,,1) && saa.weights == 1, "shift-and-add reference";
+saa = [];
+
+// Median of the last frames:
+stk = andor_stacker(5, method="median");
+v = andor_check_capture(cam, 5, stk);
+andor_check, stk() == median(v, 3), "stacker median";
+stk = [];
+
+// Power spectrum of a centered window:
+spk = andor_speckle(8, 8);
+v = andor_check_capture(cam, 3, spk);
+x1 = (w - 8)/2 + 1;
+y1 = (h - 8)/2 + 1;
+p = 0.0;
+for (k = 1; k <= 3; ++k) {
+  p += abs(fft(double(v(x1:x1+7, y1:y1+7, k)), 1))^2;
+}
+p = p(1:5,)/3;
+andor_check, abs(spk() - p) <= 1e-9*max(p), "speckle power spectrum";
+spk = [];
+
+// Bad pixels replaced by the median of their valid neighbors (the ring
+// file keeps the raw frame):
+bad = [[3, 3], [4, 3], [1, 1]];
+andor_set_bad_pixels, cam, bad(1,), bad(2,);
+ring = andor_ring_file(tmp + ".ring", 2);
+v = andor_check_capture(cam, 1, ring)(,,1);
+ring = [];
+andor_set_bad_pixels, cam;
+r = andor_open_ring_file(tmp + ".ring");
+raw = andor_check_value(r(1));
+r = [];
+remove, tmp + ".ring";
+mask = array(0, w, h);
+mask(bad(1,) + w*(bad(2,) - 1)) = 1;
+andor_check, v(where(! mask)) == raw(where(! mask)), "good pixels unchanged";
+for (k = 1; k <= 3; ++k) {
+  x = bad(1,k);
+  y = bad(2,k);
+  nb = [];
+  for (j = max(y - 1, 1); j <= min(y + 1, h); ++j) {
+    for (i = max(x - 1, 1); i <= min(x + 1, w); ++i) {
+      if (! mask(i,j)) grow, nb, raw(i,j);
+    }
+  }
+  nb = nb(sort(nb));
+  andor_check, v(x,y) == nb((numberof(nb) + 1)/2),
+    swrite(format="bad pixel (%d,%d)", x, y);
+}
+
+// Level measured by the auto-exposure stage (at the center of a bin of the
+// histogram):
+t0 = andor_get_float(cam, "ExposureTime");
+aex = andor_auto_exposure(1000.0, percentile=0.5, delay=0);
+v = andor_check_capture(cam, 1, aex);
+bits = (encoding == "Mono8" ? 8 : (encoding == "Mono16" ? 16 :
+                                   (encoding == "Mono32" ? 32 : 12)));
+bin = 2.0^max(bits - 12, 0);
+s = v(*);
+s = s(sort(s));
+q = s(long(0.5*(numberof(s) - 1)) + 1);
+andor_check, (encoding == "Mono32" ||
+              aex.level == (min(floor(q/bin), 4095) + 0.5)*bin),
+  "auto-exposure level";
+andor_check, abs(andor_get_float(cam, "ExposureTime") - aex()) <= 1e-9*aex(),
+  "auto-exposure time";
+aex = [];
+andor_set_float, cam, "ExposureTime", t0;
+
+// Block averaged preview:
+pvw = andor_preview(16, 16, interval=0.0);
+v = andor_check_capture(cam, 1, pvw)(,,1);
+f = pvw.factor;
+pw = w/f;
+ph = h/f;
+s = array(double, pw, ph);
+for (j = 1; j <= f; ++j) {
+  for (i = 1; i <= f; ++i) {
+    s += v(i:pw*f:f, j:ph*f:f);
+  }
+}
+t = s(*);
+t = t(sort(t));
+lo = t(long(0.01*(pw*ph - 1)) + 1);
+hi = t(long(0.99*(pw*ph - 1)) + 1);
+andor_check, pvw.count == 1 && f == max((w + 15)/16, (h + 15)/16, 1),
+  "preview factor";
+andor_check, abs(pvw.cmin*f*f - lo) <= 1e-6*abs(lo) &&
+  abs(pvw.cmax*f*f - hi) <= 1e-6*abs(hi), "preview percentiles";
+q = (hi > lo ? 255.0/(hi - lo) : 0.0);
+andor_check, abs(long(pvw()) - long(min(max(q*(s - lo), 0.0), 255.0) + 0.5))
+  <= 1, "preview image";
+pvw = [];
+
+// Linear fit of a ramp of frames taken every 0.5 s:
+rmp = andor_ramp(0.5);
+v = double(andor_check_capture(cam, 4, rmp));
+t = 0.5*indgen(0:3) - 0.75;
+vm = v(,,avg);
+b = ((v - vm)*t(-,-,))(,,sum)/sum(t*t);
+a = vm - 0.75*b;
+andor_check, rmp.frames == 4 && abs(rmp.slope - b) <= 1e-6*(abs(b) + 1) &&
+  abs(rmp.intercept - a) <= 1e-6*(abs(a) + 1), "ramp fit";
+rmp = [];
+
+// Rice compressed FITS file, the first and last tiles (rows) of the frame
+// are decoded:
+func andor_check_bits(bits, &p, n)
+/* The N bits of BITS at index P as an integer, P is advanced. */
+{
+  v = 0;
+  for (k = 0; k < n; ++k) {
+    v = (v << 1) | bits(p);
+    ++p;
+  }
+  return v;
+}
+
+func andor_check_rice(buf, n, bbits)
+/* Decode N values of BBITS bits compressed by the RICE_1 algorithm in the
+   array of chars BUF. */
+{
+  nbits = 8*numberof(buf);
+  bits = array(long, nbits);
+  for (k = 1; k <= 8; ++k) bits(k:nbits:8) = (long(buf) >> (8 - k)) & 1;
+  ones = where(bits);
+  fsbits = (bbits == 8 ? 3 : 4);
+  fsmax = (bbits == 8 ? 6 : 14);
+  mask = (1 << bbits) - 1;
+  p = q = 1;
+  last = andor_check_bits(bits, p, bbits);
+  out = array(long, n);
+  for (i = 1; i <= n; i += 32) {
+    fs = andor_check_bits(bits, p, fsbits) - 1;
+    for (j = i; j <= min(i + 31, n); ++j) {
+      if (fs < 0) {
+        d = 0;
+      } else if (fs == fsmax) {
+        d = andor_check_bits(bits, p, bbits);
+      } else {
+        while (ones(q) < p) ++q;
+        d = (ones(q) - p) << fs;
+        p = ones(q) + 1;
+        d = d | andor_check_bits(bits, p, fs);
+      }
+      last = (last + ((d & 1) ? ~(d >> 1) : (d >> 1))) & mask;
+      out(j) = last;
+    }
+  }
+  return out;
+}
+
+func andor_check_header(buf, off)
+/* The cards of the FITS header at offset OFF (0-based) of BUF. */
+{
+  cards = [];
+  for (k = off; k + 80 <= numberof(buf); k += 80) {
+    grow, cards, strchar(grow(buf(k+1:k+80), '\0'))(1);
+    if (strpart(cards(0), 1:8) == "END     ") break;
+  }
+  return cards;
+}
+
+func andor_check_key(cards, key)
+/* The integer value of keyword KEY in the FITS header CARDS. */
+{
+  v = 0;
+  i = where(strpart(cards, 1:8) == swrite(format="%-8s", key));
+  sread, strpart(cards(i(1)), 11:80), v;
+  return v;
+}
+
+func andor_check_int32(buf, off)
+/* The big-endian 32-bit integer at offset OFF (0-based) of BUF. */
+{
+  b = long(buf(off+1:off+4));
+  return (b(1) << 24) | (b(2) << 16) | (b(3) << 8) | b(4);
+}
+
+if (recordable) {
+  rec = andor_recorder(tmp + ".fits", compress="rice");
+  v = andor_check_capture(cam, 1, rec);
+  andor_check, rec() == 1, "Rice recorder";
+  rec = [];
+  f = open(tmp + ".fits", "rb");
+  buf = array(char, sizeof(f));
+  _read, f, 0, buf;
+  close, f;
+  remove, tmp + ".fits";
+  off = 2880*((80*numberof(andor_check_header(buf, 0)) + 2879)/2880);
+  cards = andor_check_header(buf, off);
+  ntiles = andor_check_key(cards, "NAXIS2");
+  bitpix = andor_check_key(cards, "ZBITPIX");
+  off += 2880*((80*numberof(cards) + 2879)/2880);
+  andor_check, ntiles == h && andor_check_key(cards, "ZTILE1") == w,
+    "Rice tiles";
+  for (k = 1; k <= ntiles; k += max(ntiles - 1, 1)) {
+    len = andor_check_int32(buf, off + 8*(k - 1));
+    pos = off + 8*ntiles + andor_check_int32(buf, off + 8*(k - 1) + 4);
+    andor_check, andor_check_rice(buf(pos+1:pos+len), w, bitpix) ==
+      (bitpix == 16 ? v(,k,1) ~ 0x8000 : v(,k,1)),
+      swrite(format="Rice tile %d", k);
+  }
+}
+
+// Round trip through the delta codec (sizes not multiple of the blocks):
+for (tile = 1; tile <= 40; tile *= 3) {
+  img = short(random(37, 23)*65536.0 - 32768.0);
+  andor_check, andor_decode(andor_encode(img, tile=tile)) == img,
+    swrite(format="delta codec with shorts and %d-row tiles", tile);
+  img = char(random(37, 23)*256.0);
+  andor_check, andor_decode(andor_encode(img, tile=tile)) == img,
+    swrite(format="delta codec with chars and %d-row tiles", tile);
+}
+buf = grow(andor_encode(img), andor_encode(img(::-1,)));
+andor_check, andor_decode(buf) == [img, img(::-1,)],
+  "delta codec with concatenated frames";
+if (recordable) {
+  rec = andor_recorder(tmp + ".dlt", compress="delta");
+  v = andor_check_capture(cam, 3, rec);
+  andor_check, rec() == 3, "delta recorder";
+  rec = [];
+  f = open(tmp + ".dlt", "rb");
+  buf = array(char, sizeof(f));
+  _read, f, 0, buf;
+  close, f;
+  remove, tmp + ".dlt";
+  andor_check, andor_check_value(andor_decode(buf)) == v, "delta file";
+}
+
+// Container with chunks of 2 frames, uncompressed and encoded:
+if (recordable) {
+  for (k = 1; k <= 2; ++k) {
+    if (k == 1) {
+      rec = andor_recorder(tmp + ".cnt", container=1, chunk=2);
+    } else {
+      rec = andor_recorder(tmp + ".cnt", container=1, chunk=2,
+                           compress="delta");
+    }
+    v = andor_check_capture(cam, 5, rec);
+    andor_check, rec() == 5, "container recorder";
+    rec = [];
+    c = andor_open_container(tmp + ".cnt");
+    andor_check, c.count == 5 && c.chunk == 2 &&
+      c.offsets(1:5:2) % 4096 == 0, "container index";
+    andor_check, andor_check_value(c(1, 5)) == v &&
+      andor_check_value(c(4)) == v(,,4), "container frames";
+    c = [];
+    remove, tmp + ".cnt";
+  }
+}
+
+// Container striped over two files:
+if (recordable) {
+  names = tmp + [".st0", ".st1"];
+  rec = andor_recorder(names, container=1);
+  v = andor_check_capture(cam, 5, rec);
+  andor_check, rec() == 5 && rec.stripes == 2, "striped recorder";
+  rec = [];
+  c = andor_open_container(names);
+  andor_check, c.stripes == indgen(0:4) % 2, "striped container index";
+  andor_check, andor_check_value(c(1, 5)) == v, "striped container frames";
+  c = [];
+  remove, names(1);
+  remove, names(2);
+}
+
+// Ring file of 3 frames (the oldest ones are overwritten):
+ring = andor_ring_file(tmp + ".ring", 3);
+v = andor_check_capture(cam, 5, ring);
+andor_check, ring() == 5 && ring.cursor == 2, "ring file";
+ring = [];
+r = andor_open_ring_file(tmp + ".ring");
+andor_check, r.count == 3 && r.sequences == [3, 4, 5] &&
+  r.encoding == encoding, "ring file reader";
+for (i = 1; i <= 3; ++i) {
+  andor_check, andor_check_value(r(i)) == v(,,i + 2),
+    swrite(format="ring file frame %d", i);
+}
+r = [];
+remove, tmp + ".ring";
+
+// Metadata table written alongside a container:
+if (recordable) {
+  rec = andor_recorder(tmp + ".cnt", container=1, metadata=1);
+  v = andor_check_capture(cam, 4, rec);
+  rec = [];
+  c = andor_open_container(tmp + ".cnt");
+  t = andor_open_metadata(tmp + ".cnt.meta");
+  andor_check, t.count == 4 && t.numbers == c.numbers &&
+    t.sequences == indgen(0:3) && t.dropped == 0 && t.stripes == 0,
+    "metadata table";
+  andor_check, abs(t.times - c.times) < 1.0 && dimsof(t()) == [2, 9, 4],
+    "metadata columns";
+  c = t = [];
+  remove, tmp + ".cnt";
+  remove, tmp + ".cnt.meta";
+}
+
+// Luminance of color frames (if the camera has RGB8Packed frames, the ring
+// file yields the planar frames):
+if (anyof(andor_list_enum_string(cam, "PixelEncoding") == "RGB8Packed" &
+          andor_list_enum_available(cam, "PixelEncoding"))) {
+  andor_set_enum_string, cam, "PixelEncoding", "RGB8Packed";
+  andor_set_color_mode, cam, "luminance";
+  ring = andor_ring_file(tmp + ".ring", 1);
+  v = andor_check_capture(cam, 1, ring)(,,1);
+  ring = [];
+  andor_set_color_mode, cam, "planar";
+  andor_set_enum_string, cam, "PixelEncoding", encoding;
+  r = andor_open_ring_file(tmp + ".ring");
+  rgb = long(r(1));
+  r = [];
+  remove, tmp + ".ring";
+  andor_check, dimsof(rgb) == [3, w, h, 3] &&
+    v == ((77*rgb(,,1) + 150*rgb(,,2) + 29*rgb(,,3) + 128) >> 8),
+    "color luminance";
+} else {
+  write, format="%s\n", "no color frames to check";
+}
+
+// Conversion of the extracted frames to other types:
+for (k = 1; k <= 3; ++k) {
+  otype = ["float", "double", "long"](k);
+  andor_set_output_type, cam, otype;
+  ring = andor_ring_file(tmp + ".ring", 1);
+  andor_attach, cam, ring;
+  cube = andor_capture(cam, 1, 10000);
+  andor_detach, cam;
+  ring = [];
+  andor_set_output_type, cam;
+  r = andor_open_ring_file(tmp + ".ring");
+  andor_check, nameof(structof(cube)) == otype &&
+    cube(,,1) == andor_check_value(r(1)), "output type " + otype;
+  r = [];
+  remove, tmp + ".ring";
+}
+
+// Orientations (the stages, hence the ring file, see the raw frames):
+for (k = 1; k <= 7; ++k) {
+  orient = ["flipx", "flipy", "rotate180", "transpose", "rotate90",
+            "rotate270", "antitranspose"](k);
+  ring = andor_ring_file(tmp + ".ring", 1);
+  andor_set_orientation, cam, orient;
+  v = andor_check_capture(cam, 1, ring)(,,1);
+  ring = [];
+  andor_set_orientation, cam, "none";
+  r = andor_open_ring_file(tmp + ".ring");
+  img = andor_check_value(r(1));
+  r = [];
+  remove, tmp + ".ring";
+  if (orient == "flipx") {
+    img = img(::-1,);
+  } else if (orient == "flipy") {
+    img = img(,::-1);
+  } else if (orient == "rotate180") {
+    img = img(::-1,::-1);
+  } else if (orient == "transpose") {
+    img = transpose(img);
+  } else if (orient == "rotate90") {
+    img = transpose(img)(::-1,);
+  } else if (orient == "rotate270") {
+    img = transpose(img)(,::-1);
+  } else {
+    img = transpose(img)(::-1,::-1);
+  }
+  andor_check, dimsof(v) == dimsof(img) && v == img, "orientation " + orient;
+}
+
+// Change detection (the captured frames are all kept):
+thr = 2;
+cnt = w*h/2;
+det = andor_change_detector(thr, cnt, suppress=1);
+v = andor_check_capture(cam, 5, det);
+ref = v(,,1);
+changes = 1;
+for (k = 2; k <= 5; ++k) {
+  d = abs(v(,,k) - ref);
+  n = sum(d > thr);
+  sad = sum(d);
+  if (n >= cnt) {
+    ref = v(,,k);
+    ++changes;
+  }
+}
+andor_check, dimsof(v)(4) == 5 && det() == [sad, n] && det.changed == n,
+  "change detector counts";
+andor_check, det.changes == changes && det.suppressed == 5 - changes,
+  "change detector decisions";
+det = [];
+
+// Frame server with a full frame client and a binned region of interest:
+sock = tmp + ".sock";
+srv = andor_frame_server(sock);
+andor_attach, cam, srv;
+andor_start_acquisition, cam;
+fc1 = andor_frame_client(sock);
+fc2 = andor_frame_client(sock, roi=[2, 3, 8, 6], bin=2);
+img = andor_check_value(andor_wait_image(cam, 10000));
+a = fc1(10000);
+b = fc2(10000);
+andor_stop_acquisition, cam;
+andor_detach, cam;
+andor_check, srv() == 2 && srv.published == 2 && fc1.count == 1,
+  "frame server";
+fc1 = fc2 = srv = [];
+sub = double(img(2:9, 3:8));
+andor_check, a == img, "frame client";
+avg4 = 0.25*(sub(1::2,1::2) + sub(2::2,1::2) +
+             sub(1::2,2::2) + sub(2::2,2::2));
+andor_check, abs(b - avg4) <= 1e-6*avg4 + 1e-3, "binned frame client";
+
+// Camera broker and remote camera in the same session:
+sock = tmp + ".broker";
+srv = andor_frame_server(sock, broker=cam);
+andor_attach, cam, srv;
+andor_start_acquisition, cam;
+rc = andor_connect(sock);
+andor_check, andor_get_int(rc, "AOIWidth") == andor_get_int(cam, "AOIWidth"),
+  "remote features";
+img = andor_wait_image(cam, 10000);
+r = andor_wait_image(rc, 10000);
+andor_check, structof(r) == structof(img) && r == img && rc.count == 1,
+  "remote frame";
+andor_stop_acquisition, cam;
+andor_detach, cam;
+rc = srv = [];
+
+// Exact number of captured frames:
+ring = andor_ring_file(tmp + ".ring", 4);
+andor_attach, cam, ring;
+cube = andor_capture(cam, 3, 10000);
+andor_detach, cam;
+andor_check, dimsof(cube) == [3, w, h, 3] && ring.sequence == 3 &&
+  andor_get_enum_string(cam, "CycleMode") == "Fixed", "capture count";
+ring = [];
+remove, tmp + ".ring";
+
+// Software triggered acquisition:
+mode = andor_get_enum_string(cam, "TriggerMode");
+andor_arm, cam;
+andor_check, andor_get_enum_string(cam, "TriggerMode") == "Software",
+  "armed camera";
+andor_trigger, cam;
+img = andor_wait_image(cam, 10000);
+andor_stop_acquisition, cam;
+andor_check, dimsof(img) == [2, w, h], "triggered frame";
+andor_check, andor_get_enum_string(cam, "TriggerMode") == mode,
+  "trigger mode restored";
+
+// Sequence of 3 steps, the second one does not change the exposure time:
+t0 = andor_get_float(cam, "ExposureTime");
+t1 = (2*t0 <= andor_get_float_max(cam, "ExposureTime") ? 2*t0 : 0.5*t0);
+seq = andor_sequencer(1);
+andor_add_step, seq, 2, "ExposureTime", t0;
+andor_add_step, seq, 1, "ExposureTime", t0;
+andor_add_step, seq, 3, "ExposureTime", t1;
+andor_run_sequence, seq, cam, 10000;
+andor_check, seq.steps == 3 && seq.frames == 6, "sequence steps";
+andor_check, seq.writes == 2 && seq.skipped == 1, "sequence settings";
+andor_check, dimsof(seq(1)) == [3, w, h, 2] && dimsof(seq(0)) == [3, w, h, 3],
+  "sequence frames";
+seq = [];
+andor_set_float, cam, "ExposureTime", t0;